@@ -0,0 +1,123 @@
+// Load generator for the inference queue. Requests are submitted at a fixed
+// rate from one thread, and the latency from submit to completion is measured
+// for each request. The run is repeated without batching, and with batching.
+//
+// usage: inference_queue_benchmark [requests] [rate] [workers] [max_batch] [max_delay_us]
+// A rate of 0 submits the requests as fast as possible.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tom.h"
+
+#define INPUT_SIZE 784
+#define HIDDEN_SIZE 256
+#define OUTPUT_SIZE 10
+
+// The timing of one request.
+struct request_timing {
+    double submit, complete;
+};
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e6 + (double)t.tv_nsec * 1e-3;
+}
+
+static void on_complete(void *user_data, const double *output, int success) {
+    (void)output;
+    struct request_timing *timing = user_data;
+    timing->complete = success ? now() : -1.0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void run(struct model *m, double *inputs, int n_requests, double rate,
+                int n_workers, int max_batch, int max_delay) {
+    struct inference_queue q;
+    QUIT_ON_ERROR(inference_queue_init(&q, m, n_workers, max_batch, max_delay));
+
+    struct request_timing *timings = calloc(n_requests, sizeof(struct request_timing));
+    double start = now();
+    for (int i = 0; i < n_requests; i++) {
+        // Open loop: wait for the request's scheduled time, regardless of the
+        // completions.
+        if (rate > 0) {
+            double scheduled = start + i * 1e6 / rate;
+            while (now() < scheduled) {
+            }
+        }
+        timings[i].submit = now();
+        QUIT_ON_ERROR(inference_queue_submit(&q, &inputs[(i % 64) * INPUT_SIZE], on_complete, &timings[i]));
+    }
+
+    // Freeing the queue completes the pending requests.
+    inference_queue_free(&q);
+
+    double end = start;
+    double *latencies = malloc(n_requests * sizeof(double));
+    for (int i = 0; i < n_requests; i++) {
+        if (timings[i].complete < 0) {
+            printf("request %d failed\n", i);
+            exit(1);
+        }
+        latencies[i] = timings[i].complete - timings[i].submit;
+        if (timings[i].complete > end) {
+            end = timings[i].complete;
+        }
+    }
+    qsort(latencies, n_requests, sizeof(double), compare_doubles);
+
+    printf("max_batch %4d: %10.0f req/s, p50 %8.0f us, p99 %8.0f us, average batch %.1f\n",
+        max_batch, n_requests / ((end - start) * 1e-6),
+        latencies[n_requests / 2], latencies[(int)(n_requests * 0.99)],
+        (double)q.n_requests / (double)q.n_batches);
+
+    free(latencies);
+    free(timings);
+}
+
+int main(int argc, char *argv[]) {
+    int n_requests = argc > 1 ? atoi(argv[1]) : 20000;
+    double rate = argc > 2 ? atof(argv[2]) : 0.0;
+    int n_workers = argc > 3 ? atoi(argv[3]) : 2;
+    int max_batch = argc > 4 ? atoi(argv[4]) : 32;
+    int max_delay = argc > 5 ? atoi(argv[5]) : 1000;
+
+    // An inference only MLP, with random weights.
+    random_init();
+    struct model m;
+    QUIT_ON_ERROR(model_init(&m, 1));
+    model_set_memory_plan(&m, MEMORY_PLAN_INFERENCE);
+    struct layer *l1 = model_add_layer(&m, LAYER_DENSE, INPUT_SIZE, HIDDEN_SIZE);
+    model_add_layer(&m, LAYER_RELU, HIDDEN_SIZE, HIDDEN_SIZE);
+    struct layer *l2 = model_add_layer(&m, LAYER_DENSE, HIDDEN_SIZE, HIDDEN_SIZE);
+    model_add_layer(&m, LAYER_RELU, HIDDEN_SIZE, HIDDEN_SIZE);
+    struct layer *l3 = model_add_layer(&m, LAYER_DENSE, HIDDEN_SIZE, OUTPUT_SIZE);
+    model_add_layer(&m, LAYER_SOFTMAX, OUTPUT_SIZE, OUTPUT_SIZE);
+    QUIT_ON_ERROR(model_finalize(&m));
+    layer_dense_init_values(l1->obj, WI_GLOROT_NORMAL, BI_ZEROS);
+    layer_dense_init_values(l2->obj, WI_GLOROT_NORMAL, BI_ZEROS);
+    layer_dense_init_values(l3->obj, WI_GLOROT_NORMAL, BI_ZEROS);
+
+    double *inputs = malloc(64 * INPUT_SIZE * sizeof(double));
+    for (int i = 0; i < 64 * INPUT_SIZE; i++) {
+        inputs[i] = (double)rand() / RAND_MAX;
+    }
+
+    printf("%d requests, rate %s, %d workers, max delay %d us\n", n_requests,
+        rate > 0 ? argv[2] : "unlimited", n_workers, max_delay);
+    run(&m, inputs, n_requests, rate, n_workers, 1, max_delay);
+    run(&m, inputs, n_requests, rate, n_workers, max_batch, max_delay);
+
+    free(inputs);
+    model_free(&m);
+    return 0;
+}
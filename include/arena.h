@@ -0,0 +1,40 @@
+// arena.h
+// Aligned memory arenas.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "matrix.h"
+#include "declspec.h"
+
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// The alignment of the arena buffer and of each matrix inside it, in bytes.
+#define ARENA_ALIGNMENT 64
+
+// Round a size in doubles up to a multiple of the alignment.
+#define ARENA_ALIGN_SIZE(size) (((size) + (int)(ARENA_ALIGNMENT / sizeof(double)) - 1) / (int)(ARENA_ALIGNMENT / sizeof(double)) * (int)(ARENA_ALIGNMENT / sizeof(double)))
+
+// A contiguous, aligned buffer of doubles. Matrices are allocated from the 
+// arena as views, so the whole arena can be processed in a single pass. The
+// padding between the matrices is zero.
+struct arena {
+    // The raw allocation, and the aligned buffer inside it.
+    void *memory;
+    double *buffer;
+
+    // The capacity and the used size, in doubles.
+    int size, used;
+};
+
+// Initialize an arena with a capacity in doubles. The buffer is zeroed.
+extern TOM_API int arena_init(struct arena *obj, int size);
+
+// Allocate a matrix view from the arena. The view starts on an aligned 
+// offset.
+extern TOM_API int arena_alloc(struct arena *obj, struct matrix *matrix, int n_rows, int n_cols);
+
+// Free the arena. Any views into it become invalid.
+extern TOM_API void arena_free(struct arena *obj);
+
+#endif
@@ -8,7 +8,7 @@
 #include "declspec.h"
 #include "dense.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The batch normalization layer, with running mean and variance, along with 
 // affine transformation.
@@ -57,6 +57,11 @@ extern TOM_API void layer_normalization_forward(struct layer_normalization *obj)
 // Perform a forward pass on the layer, in prediction mode.
 extern TOM_API void layer_normalization_forward_predict(struct layer_normalization *obj);
 
+// Perform a forward pass on the layer with the batch mean and variance from 
+// the last training forward pass. The running mean and variance are not 
+// updated.
+extern TOM_API void layer_normalization_forward_replay(struct layer_normalization *obj);
+
 // Perform a backward pass on the layer.
 extern TOM_API void layer_normalization_backward(struct layer_normalization *obj);
 
@@ -7,7 +7,7 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The binary cross-entropy loss function. The forward pass is calculated as 
 // -(y * log(input) + (1-y) * log(1-input)). The backward pass is calculated 
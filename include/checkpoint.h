@@ -0,0 +1,92 @@
+// checkpoint.h
+// Training checkpoints.
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+#include "model.h"
+#include "random.h"
+#include "declspec.h"
+
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// A training checkpoint holds everything needed to resume training where it 
+// stopped: the parameters, the running statistics of batch normalization 
+// layers, the optimizer state and iterations, the RNG state, and the training
+// cursor. The layers and optimizers themselves are not stored, so a 
+// checkpoint is loaded into a model built the same way.
+#define CHECKPOINT_MAGIC "TOMCHKPT"
+#define CHECKPOINT_VERSION 1
+
+// The checkpoint file header. It is followed by the optimizer iteration of 
+// each layer, the shape of each matrix, and the values of the matrices.
+struct checkpoint_header {
+    // CHECKPOINT_MAGIC, without a terminator.
+    char magic[8];
+
+    // The format version, and MODEL_FILE_BYTE_ORDER as written.
+    uint32_t version, byte_order;
+
+    // Number of layers and matrices.
+    int32_t n_layers, n_matrices;
+
+    // The training cursor, and the iteration of the fused optimizer, or -1 
+    // if the model has none.
+    int32_t epoch, batch, fused_iter, reserved;
+
+    // The RNG state.
+    struct random_state random;
+
+    // The number of values in the matrices.
+    uint64_t n_values;
+
+    // The checksum of the data after the header, and of the header before 
+    // this field.
+    uint32_t data_checksum, header_checksum;
+};
+
+// The periodic checkpoints of a model. Every interval batches, model_train 
+// copies the training state into a snapshot, which a background thread 
+// writes to a temporary file and renames over the checkpoint, so training 
+// does not wait for the file, and the checkpoint is always complete.
+struct model_checkpoint {
+    // The checkpoint path, and the temporary path it is written to.
+    char *path, *temp_path;
+
+    // The number of batches between checkpoints, and since the last one.
+    int interval, n_batches;
+
+    // Number of checkpoints written, and the error of the last failed write,
+    // or NULL. Updated under the lock.
+    int n_written;
+    const char *error;
+
+    // The writer state: the snapshot, the lock, and the writer thread.
+    struct checkpoint_writer *writer;
+};
+
+// Write a training checkpoint of a model.
+extern TOM_API int model_save_checkpoint(struct model *obj, const char *path);
+
+// Load a training checkpoint into a finalized model with the same layers and
+// optimizers. model_train then resumes from the checkpoint's cursor.
+extern TOM_API int model_load_checkpoint(struct model *obj, const char *path);
+
+// Write a checkpoint every interval batches of model_train, in the 
+// background. A checkpoint which comes due while the previous one is still 
+// being written is taken once the writer is free. A NULL path or an interval
+// of 0 disables the checkpoints, after the pending one is written.
+extern TOM_API int model_set_checkpoint(struct model *obj, const char *path, int interval);
+
+// Wait for the pending checkpoint to be written. Returns 0 if a checkpoint 
+// failed to be written since the last wait, with the error in LAST_ERROR.
+extern TOM_API int model_wait_checkpoint(struct model *obj);
+
+// Count a batch of model_train, and snapshot the model if a checkpoint is 
+// due. Called by model_train once the batch is applied and the cursor points
+// to the next batch.
+extern TOM_API int model_checkpoint_batch(struct model *obj);
+
+#endif
@@ -4,24 +4,72 @@
 #ifndef CONV2D_H
 #define CONV2D_H
 
+#include <stdbool.h>
+
 #include "matrix.h"
 #include "dense.h"
+#include "padding2d.h"
+#include "layout2d.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// Conv kernel enum. The kernel is selected on initialization, based on the 
+// layer configuration, and again when the layout is set.
+enum conv2d_kernel {
+    // Generic kernel for the NCHW layout.
+    CONV2D_KERNEL_GENERIC,
+
+    // Pointwise kernel for the NCHW layout, for a filter size of 1, a stride 
+    // of 1 and no padding. Computed as a matrix product for each sample.
+    CONV2D_KERNEL_POINTWISE,
+
+    // Depthwise kernel for the NCHW layout, for layers with one channel per 
+    // group.
+    CONV2D_KERNEL_DEPTHWISE,
+
+    // Generic kernel for the NHWC layout.
+    CONV2D_KERNEL_NHWC,
+
+    // Depthwise kernel for the NHWC layout.
+    CONV2D_KERNEL_DEPTHWISE_NHWC
+};
 
 // The 2D conv layer. The dimensions of the input matrix are (n_samples, 
 // n_channels * input_height * input_width). The dimensions of the output 
 // matrix are (n_samples, n_filters * output_height * output_width). The 
-// output height is (input_height - filter_size)/stride + 1. The
-// output width is (input_width - filter_size)/stride + 1. The 
-// total number of filters is n_filters * n_channels.
+// output height is 
+// (input_height + padding_y * 2 - dilation * (filter_size - 1) - 1)/stride + 1,
+// and the output width is calculated the same way. The padding is applied 
+// implicitly by the kernels, so the padded input is never stored.
+// The channels and filters are split into groups, and each filter only reads
+// the group_channels channels of its own group, so the total number of filter
+// planes is n_filters * group_channels. A depthwise layer has one group per 
+// channel. The dilation is the spacing between the kernel values on the 
+// input.
 struct layer_conv2d {
     // The input and output dimensions.
     int n_channels, input_height, input_width, output_height, output_width;
 
     // The hyperparameter values for the conv layer.
-    int n_filters, filter_size, stride;
+    int n_filters, filter_size, stride, dilation, groups;
+
+    // The number of channels and filters in each group.
+    int group_channels, group_filters;
+
+    // The padding values. The padding is applied twice to each dimension, on
+    // both sides.
+    int padding_x, padding_y;
+    enum padding_type padding_type;
+
+    // Padding index caches. For each output row and kernel row, row_index 
+    // stores the corresponding input row, or -1 if the value is zero padding.
+    // Similarly, col_index stores the input column for each output column and
+    // kernel column. For each kernel column, col_start and col_end store the
+    // range of output columns which read from inside the input, so the
+    // kernels only need the index caches at the borders.
+    int *row_index, *col_index;
+    int *col_start, *col_end;
 
     // The input and output matrices.
     struct matrix *input, *output;
@@ -31,18 +79,84 @@ struct layer_conv2d {
 
     // Gradients on the outputs, inputs, weights, and biases, respectively.
     struct matrix *d_outputs, *d_inputs, d_weights, d_biases;
+
+    // The selected forward and backward kernel.
+    enum conv2d_kernel kernel;
+
+    // The activation layout. For the NHWC layout, the weights are packed into
+    // (filter_size * filter_size * group_channels, n_filters) on each 
+    // forward pass, so the kernels can vectorize across the filters. The 
+    // weight gradients are calculated in the packed layout and unpacked into
+    // d_weights. The packed matrices are only allocated for NHWC.
+    enum layout_2d layout;
+    struct matrix packed_weights, packed_d_weights;
+
+    // Whether the weights were packed once for inference, in which case the
+    // forward pass does not pack them.
+    bool prepacked;
 };
 
 // Calculate the output dimension.
 #define CALC_CONV2D_OUTPUT_DIM(dim, filter_size, stride) ((dim - filter_size) / stride + 1)
 
-// Initialize an empty layer object.
+// Calculate the output dimension with padding.
+#define CALC_CONV2D_PADDED_OUTPUT_DIM(dim, filter_size, stride, padding) ((dim + padding * 2 - filter_size) / stride + 1)
+
+// Calculate the output dimension with padding and dilation.
+#define CALC_CONV2D_DILATED_OUTPUT_DIM(dim, filter_size, stride, padding, dilation) ((dim + padding * 2 - dilation * (filter_size - 1) - 1) / stride + 1)
+
+// Initialize an empty layer object, without padding, groups or dilation.
 extern TOM_API int layer_conv2d_init(struct layer_conv2d *obj, int n_channels, 
                       int input_height, int input_width, int n_filters, 
                       int filter_size, int stride, struct matrix *input, 
                       struct matrix *output, struct matrix *d_outputs, 
                       struct matrix *d_inputs);
 
+// Initialize an empty layer object with implicit padding, without groups or 
+// dilation.
+extern TOM_API int layer_conv2d_init_padded(struct layer_conv2d *obj, int n_channels, 
+                             int input_height, int input_width, int n_filters, 
+                             int filter_size, int stride, int padding_x, 
+                             int padding_y, enum padding_type padding_type,
+                             struct matrix *input, struct matrix *output, 
+                             struct matrix *d_outputs, struct matrix *d_inputs);
+
+// Initialize an empty layer object with implicit padding, groups and 
+// dilation. The number of channels and filters must be divisible by the 
+// number of groups.
+extern TOM_API int layer_conv2d_init_grouped(struct layer_conv2d *obj, int n_channels, 
+                              int input_height, int input_width, int n_filters, 
+                              int filter_size, int stride, int dilation, int groups,
+                              int padding_x, int padding_y, 
+                              enum padding_type padding_type,
+                              struct matrix *input, struct matrix *output, 
+                              struct matrix *d_outputs, struct matrix *d_inputs);
+
+// Initialize an empty depthwise layer object. Each input channel is 
+// convolved with depth_multiplier filters of its own, so the layer has 
+// n_channels * depth_multiplier filters. This is a conv layer with one group
+// per channel and no dilation.
+extern TOM_API int layer_conv2d_init_depthwise(struct layer_conv2d *obj, int n_channels, 
+                                int input_height, int input_width, 
+                                int depth_multiplier, int filter_size, 
+                                int stride, int padding_x, int padding_y, 
+                                enum padding_type padding_type,
+                                struct matrix *input, struct matrix *output, 
+                                struct matrix *d_outputs, 
+                                struct matrix *d_inputs);
+
+// Set the padding type. Recalculates the padding index caches.
+extern TOM_API void layer_conv2d_set_padding_type(struct layer_conv2d *obj, enum padding_type padding_type);
+
+// Set the activation layout, and select the kernel again. Returns 1 if 
+// successful.
+extern TOM_API int layer_conv2d_set_layout(struct layer_conv2d *obj, enum layout_2d layout);
+
+// Pack the weights once for inference, so the forward pass does not repack 
+// them. The weights must not change afterwards, except through 
+// layer_conv2d_init_values. Returns 1 if successful.
+extern TOM_API int layer_conv2d_prepack(struct layer_conv2d *obj);
+
 // Initialize the weights and biases.
 extern TOM_API int layer_conv2d_init_values(struct layer_conv2d *obj, enum weight_initializer wi_type, enum bias_initializer bi_type);
 
@@ -7,7 +7,7 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The cross-entropy loss function. The forward pass is calculated as 
 // -log(sum(y * input)). The backward pass is calculated as (-y / d_output) / 
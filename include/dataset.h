@@ -7,10 +7,11 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // Shuffle a dataset. Shuffles assuming the dimensions of each matrix are
-// (n_samples, size).
+// (n_samples, size). Uses the RNG, so seed it with random_seed for a 
+// reproducible order.
 extern TOM_API int dataset_shuffle(struct matrix *X, struct matrix *Y);
 
 // Scale a dataset between [min, max].
@@ -1,5 +1,5 @@
 // declspec.h
-// DLL DECLSPEC definition.
+// DLL DECLSPEC and thread local storage definitions.
 
 #ifndef DECLSPEC_H
 #define DECLSPEC_H
@@ -14,4 +14,13 @@
 #define TOM_API __attribute__((visibility("default")))
 #endif
 
+// Thread local storage, so each thread has its own last error.
+#if defined(_MSC_VER)
+#define TOM_THREAD_LOCAL __declspec(thread)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define TOM_THREAD_LOCAL _Thread_local
+#else
+#define TOM_THREAD_LOCAL __thread
+#endif
+
 #endif
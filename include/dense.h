@@ -7,7 +7,14 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// Number of output columns in each chunk of the single sample forward pass.
+#define DENSE_GEMV_COLUMNS 64
+
+// The smallest number of weights for which the single sample forward pass
+// runs in parallel, if tom is built with OpenMP.
+#define DENSE_PARALLEL_SIZE 65536
 
 // The standard fully-connected dense layer. The layer stores the input and
 // output size, along with its weights, biases, and gradients. On a forward
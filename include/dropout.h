@@ -8,9 +8,10 @@
 #include "random.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
-// The dropout layer. 
+// The dropout layer. The backward pass only uses the mask, so the layer can
+// run in place.
 struct layer_dropout {
     // The input and output size.
     int input_size, output_size;
@@ -37,6 +38,10 @@ extern TOM_API int layer_dropout_init(struct layer_dropout *obj, int input_size,
 // Set the dropout layer's rate.
 extern TOM_API void layer_dropout_set_rate(struct layer_dropout *obj, double rate);
 
+// Reallocate the mask for the current number of rows of the input matrix.
+// Returns 1 if successful.
+extern TOM_API int layer_dropout_resize(struct layer_dropout *obj);
+
 // Free the matrices owned by the layer.
 extern TOM_API void layer_dropout_free(struct layer_dropout *obj);
 
@@ -46,6 +51,10 @@ extern TOM_API void layer_dropout_forward(struct layer_dropout *obj);
 // Perform a forward pass on the layer, without applying dropout.
 extern TOM_API void layer_dropout_forward_predict(struct layer_dropout *obj);
 
+// Perform a forward pass on the layer with the mask from the last forward 
+// pass.
+extern TOM_API void layer_dropout_forward_replay(struct layer_dropout *obj);
+
 // Perform a backward pass on the layer.
 extern TOM_API void layer_dropout_backward(struct layer_dropout *obj);
 
@@ -6,7 +6,7 @@
 
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // Print the last error to stdout.
 extern TOM_API void print_last_error(void);
@@ -0,0 +1,59 @@
+// fused_optimizer.h
+// Fused multi-tensor optimizer.
+
+#ifndef FUSED_OPTIMIZER_H
+#define FUSED_OPTIMIZER_H
+
+#include <stdbool.h>
+#include <stdarg.h>
+
+#include "matrix.h"
+#include "arena.h"
+#include "model.h"
+#include "declspec.h"
+
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// The minimum number of values for the update to run in parallel.
+#define FUSED_OPTIMIZER_PARALLEL_SIZE 65536
+
+// The fused optimizer. Updates every parameter of a model in a single pass 
+// over the parameter and gradient arenas, which have the same layout, 
+// instead of one update per layer. Supports the SGD (with momentum and 
+// Nesterov momentum), Adam and RMSProp algorithms, with the same parameters
+// and update rules as the per-layer optimizers.
+struct optimizer_fused {
+    // The optimizer type.
+    enum optimizer_type type;
+
+    // The optimizer parameters. Only the ones used by the type are set.
+    double learning_rate, momentum, decay, beta_1, beta_2, epsilon, rho;
+    bool nesterov;
+
+    // The current iteration.
+    int iter;
+
+    // The parameter and gradient arenas.
+    struct arena *params, *grads;
+
+    // The first and second moment buffers, with the same layout as the 
+    // parameter arena. Views into the optimizer state arena, only allocated
+    // if the algorithm uses them.
+    struct matrix m, c;
+};
+
+// Initialize an empty fused optimizer object. The moment buffers are 
+// allocated from the state arena. Takes the same variable args as 
+// model_init_optimizers.
+extern TOM_API int optimizer_fused_init(struct optimizer_fused *obj, enum optimizer_type type,
+                         struct arena *params, struct arena *grads, 
+                         struct arena *state, va_list ap);
+
+// Get the size of the state arena needed by the optimizer type, in doubles.
+// Returns -1 if the type is invalid.
+extern TOM_API int optimizer_fused_state_size(enum optimizer_type type, struct arena *params, va_list ap);
+
+// Update all the parameters, and advance the iteration.
+extern TOM_API void optimizer_fused_update(struct optimizer_fused *obj);
+
+#endif
@@ -0,0 +1,46 @@
+// globavgpool2d.h
+// 2D global average pooling layer.
+
+#ifndef GLOBAVGPOOL2D_H
+#define GLOBAVGPOOL2D_H
+
+#include "matrix.h"
+#include "layout2d.h"
+#include "declspec.h"
+
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// The 2D global average pooling layer. Reduces each channel to the average 
+// of its values. The dimensions of the input matrix are (n_samples, 
+// n_channels * input_height * input_width). The dimensions of the output 
+// matrix are (n_samples, n_channels), which is the same in both layouts.
+struct layer_globavgpool2d {
+    // The input dimensions.
+    int n_channels, input_height, input_width;
+
+    // The input and output matrices.
+    struct matrix *input, *output;
+
+    // The input activation layout.
+    enum layout_2d layout;
+
+    // Gradients on the outputs and inputs, respectively.
+    struct matrix *d_outputs, *d_inputs;
+};
+
+// Initialize an empty layer object.
+extern TOM_API int layer_globavgpool2d_init(struct layer_globavgpool2d *obj, int n_channels, 
+                             int input_height, int input_width, 
+                             struct matrix *input, struct matrix *output, 
+                             struct matrix *d_outputs, struct matrix *d_inputs);
+
+// Set the input activation layout.
+extern TOM_API void layer_globavgpool2d_set_layout(struct layer_globavgpool2d *obj, enum layout_2d layout);
+
+// Perform a forward pass on the layer.
+extern TOM_API void layer_globavgpool2d_forward(struct layer_globavgpool2d *obj);
+
+// Perform a backward pass on the layer.
+extern TOM_API void layer_globavgpool2d_backward(struct layer_globavgpool2d *obj);
+
+#endif
@@ -0,0 +1,64 @@
+// inference_queue.h
+// Dynamic micro-batching inference queue.
+
+#ifndef INFERENCE_QUEUE_H
+#define INFERENCE_QUEUE_H
+
+#include "model.h"
+#include "declspec.h"
+
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// Called on a worker thread when a request completes. The output holds the
+// model's output for the sample, and is only valid during the call. On
+// failure, success is 0, the output is NULL, and LAST_ERROR is set on the
+// worker thread.
+typedef void (*inference_callback)(void *user_data, const double *output, int success);
+
+// The platform specific state of the queue: the pending requests, the lock,
+// and the worker threads.
+struct inference_queue_state;
+
+// A queue of single sample inference requests. Worker threads coalesce the
+// pending requests into batches of up to max_batch_size samples, waiting at
+// most max_delay microseconds after the oldest request for the batch to fill,
+// run each batch through their own model context, and scatter the results
+// back to the callbacks.
+struct inference_queue {
+    // The shared model.
+    struct model *model;
+
+    // Number of worker threads, and the largest batch.
+    int n_workers, max_batch_size;
+
+    // The longest time a request waits for its batch to fill, in
+    // microseconds.
+    int max_delay;
+
+    // Number of values in each sample's input and output.
+    int input_size, output_size;
+
+    // Number of batches and requests processed, for measuring the average
+    // batch size. Updated under the queue's lock.
+    long n_batches, n_requests;
+
+    // The queue state.
+    struct inference_queue_state *state;
+};
+
+// Initialize an inference queue for a finalized model, and start the worker
+// threads. The model's parameters are shared by the workers, and must not
+// change while the queue is running.
+extern TOM_API int inference_queue_init(struct inference_queue *obj, struct model *model,
+                                        int n_workers, int max_batch_size, int max_delay);
+
+// Submit a sample for inference. The input of input_size values is copied,
+// and the callback is called with the output once its batch has run.
+extern TOM_API int inference_queue_submit(struct inference_queue *obj, const double *input,
+                                          inference_callback callback, void *user_data);
+
+// Stop the queue. The pending requests are completed, and the worker threads
+// are joined before the queue is freed.
+extern TOM_API void inference_queue_free(struct inference_queue *obj);
+
+#endif
@@ -0,0 +1,130 @@
+// layer_ops.h
+// Layer operations tables, and custom layer types.
+
+#ifndef LAYER_OPS_H
+#define LAYER_OPS_H
+
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "matrix.h"
+#include "model.h"
+#include "declspec.h"
+
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// The maximum number of layer types, including the built-in ones.
+#define LAYER_MAX_TYPES 64
+
+// The operations of a layer type. The layer functions in model.h dispatch
+// through the table of the layer's type, which is set on the layer when it
+// is initialized. Each built-in layer type has a table, and custom layer
+// types are added with layer_register_type. Only init and forward are
+// required; the other functions can be NULL, with the defaults described
+// for each one. Functions returning int return 1 if successful, and set
+// LAST_ERROR otherwise.
+struct layer_ops {
+    // The layer type name.
+    const char *name;
+
+    // Set if each output value only depends on the input value at the same
+    // position, and the input and output sizes are the same. Elementwise
+    // layers can run inside chains of NHWC layers, and in place. When 
+    // training, they only run in place if backward_skips_input is also set.
+    bool elementwise;
+
+    // Set if the layer reads its layout from the layer's layout field, and
+    // supports the NHWC layout. model_finalize inserts layout conversion 
+    // layers around other layers.
+    bool layout_2d;
+
+    // Set if the layer reads its input in the layout of the layer's layout 
+    // field, and its output is the same in both layouts, such as a 
+    // (n_channels, 1, 1) output. The layer ends a chain of NHWC layers 
+    // without a layout conversion layer.
+    bool layout_2d_reduces;
+
+    // Set if the backward pass does not read the layer's input or output,
+    // respectively, so the memory planner can overwrite them.
+    bool backward_skips_input, backward_skips_output;
+
+    // Initialize the layer object, and store it in the layer's obj field. The
+    // layer's input, output and gradient matrices are set. The dimensions and
+    // hyperparameters are read from the layer.
+    int (*init)(struct layer *obj);
+
+    // Perform a forward pass, for training or inference.
+    int (*forward)(struct layer *obj, bool training);
+
+    // Repeat the last training forward pass, with the same output. Defaults
+    // to a training forward pass.
+    int (*recompute)(struct layer *obj);
+
+    // Reallocate the per-sample state for the current number of rows of the
+    // layer's matrices. Defaults to nothing.
+    int (*resize)(struct layer *obj);
+
+    // Perform a backward pass. Required for training.
+    int (*backward)(struct layer *obj);
+
+    // Free the matrices owned by the layer object. The object itself is
+    // freed afterwards.
+    void (*free)(struct layer *obj);
+
+    // Get the trainable parameter matrices and their gradients, at most
+    // LAYER_MAX_PARAMS. The matrices must be allocated with matrix_init, as
+    // they are moved into the model's arenas on finalization. Defaults to
+    // none.
+    int (*get_params)(struct layer *obj, struct matrix **params, struct matrix **grads);
+
+    // Get the weight matrices for hot reloading, at most LAYER_MAX_WEIGHTS.
+    // Defaults to the parameters.
+    int (*get_weights)(struct layer *obj, struct matrix **weights);
+
+    // Initialize the layer's optimizer, storing it in the layer's opt.obj
+    // field, with the args of layer_init_optimizer. Layers with this function
+    // are trainable. Layers without it can still be trained with the fused
+    // optimizer.
+    int (*init_optimizer)(struct layer *obj, enum optimizer_type type, va_list ap);
+
+    // Perform an update on the layer's optimizer.
+    int (*update)(struct layer *obj);
+
+    // Get the matrices allocated by the layer's optimizer, at most
+    // LAYER_MAX_OPTIMIZER_STATE. Defaults to none.
+    int (*get_optimizer_state)(struct layer *obj, struct matrix **state);
+
+    // Free the matrices owned by the layer's optimizer. The optimizer itself
+    // is freed afterwards.
+    void (*free_optimizer)(struct layer *obj);
+
+    // Write and read the values of the layer which are not set when it is
+    // added to a model, such as its parameters, for serialize_model. Read
+    // after the model is finalized. Defaults to nothing.
+    int (*serialize)(struct layer *obj, FILE *fp);
+    int (*deserialize)(struct layer *obj, FILE *fp);
+
+    // Initialize a layer object sharing the parameters of an initialized
+    // layer, for the inference passes of a model context. The layer's input
+    // and output matrices are set, and its gradients have no buffers.
+    // Required for model contexts.
+    int (*init_shared)(struct layer *obj, const struct layer *shared);
+
+    // Free the state owned by a shared layer object. The object itself is
+    // freed afterwards. Defaults to nothing.
+    void (*free_shared)(struct layer *obj);
+};
+
+// Register a custom layer type, and set its type. Layers of the type are
+// added with model_add_layer. The table is not copied, and must stay valid
+// while the type is used. Types should be registered before any model uses
+// them, from one thread, and in the same order on each run for serialized
+// models.
+extern TOM_API int layer_register_type(const struct layer_ops *ops, enum layer_type *type);
+
+// Get the operations table of a layer type, or NULL if the type is not
+// registered.
+extern TOM_API const struct layer_ops* layer_get_ops(enum layer_type type);
+
+#endif
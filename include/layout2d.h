@@ -0,0 +1,54 @@
+// layout2d.h
+// 2D activation layout conversion layer.
+
+#ifndef LAYOUT2D_H
+#define LAYOUT2D_H
+
+#include "matrix.h"
+#include "declspec.h"
+
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// Activation layout enum for 2D layers. Each row of an activation matrix 
+// stores one sample.
+enum layout_2d {
+    // Channel-major layout. Each channel is a contiguous plane of 
+    // height * width values.
+    LAYOUT_NCHW,
+
+    // Channel-minor layout. Each pixel is a contiguous vector of n_channels
+    // values, so 2D kernels can vectorize across the channels.
+    LAYOUT_NHWC
+};
+
+// The 2D layout conversion layer. Converts the activations between the NCHW
+// and NHWC layouts. The dimensions of the input and output matrices are 
+// (n_samples, n_channels * height * width). The gradients are converted back
+// to the input layout in the backward pass.
+struct layer_layout2d {
+    // The dimensions.
+    int n_channels, height, width;
+
+    // The output layout. The input is in the other layout.
+    enum layout_2d output_layout;
+
+    // The input and output matrices.
+    struct matrix *input, *output;
+
+    // Gradients on the outputs and inputs, respectively.
+    struct matrix *d_outputs, *d_inputs;
+};
+
+// Initialize an empty layer object.
+extern TOM_API int layer_layout2d_init(struct layer_layout2d *obj, int n_channels,
+                        int height, int width, enum layout_2d output_layout,
+                        struct matrix *input, struct matrix *output,
+                        struct matrix *d_outputs, struct matrix *d_inputs);
+
+// Perform a forward pass on the layer.
+extern TOM_API void layer_layout2d_forward(struct layer_layout2d *obj);
+
+// Perform a backward pass on the layer.
+extern TOM_API void layer_layout2d_backward(struct layer_layout2d *obj);
+
+#endif
@@ -7,11 +7,12 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The Leaky Rectified Linear Unit (RELU) activation layer. The output is 
 // calculated as 1 * x if x > 0, or rate * x if x <= 0. The gradient is 
-// calculated as d_output if x > 0, or rate * d_output if x <= 0.
+// calculated as d_output if y > 0, or rate * d_output if y <= 0, so with a 
+// non-negative rate the layer can run in place.
 struct activation_leaky_relu {
     // The input and output size.
     int input_size, output_size;
@@ -7,7 +7,7 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The Mean Absolute Error (MAE) loss function. The output loss value is 
 // calculated as sum(abs(input - y)). The gradient on the inputs is 
@@ -4,22 +4,33 @@
 #ifndef MATRIX_H
 #define MATRIX_H
 
+#include <stdbool.h>
+
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // Matrix struct. We store the matrix data as a buffer of doubles, row by row.
 // The location of the item at (row, col) is (row * n_cols + col) * 
-// sizeof(double).
+// sizeof(double). A view borrows its buffer from another object, like an 
+// arena, so freeing the view does not free the buffer.
 struct matrix {
     int n_rows, n_cols, size;
     double *buffer;
+    bool view;
 };
 
 // Initialize an empty matrix object.
 extern TOM_API int matrix_init(struct matrix *obj, int n_rows, int n_cols);
 
-// Free a matrix buffer.
+// Initialize a matrix view of an existing buffer.
+extern TOM_API void matrix_init_view(struct matrix *obj, int n_rows, int n_cols, double *buffer);
+
+// Set the number of rows in use. The buffer must hold at least n_rows * 
+// n_cols values.
+extern TOM_API void matrix_set_rows(struct matrix *obj, int n_rows);
+
+// Free a matrix buffer. Views only drop their buffer.
 extern TOM_API void matrix_free(struct matrix *obj);
 
 #endif
\ No newline at end of file
@@ -5,9 +5,27 @@
 #define MAXPOOL2D_H
 
 #include "matrix.h"
+#include "layout2d.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// Max pooling kernel enum. The kernel is selected on initialization, based on
+// the pool size and stride, and again when the layout is set.
+enum maxpool2d_kernel {
+    // Generic kernel, for any pool size and stride.
+    MAXPOOL2D_KERNEL_GENERIC,
+
+    // Specialized kernel for a pool size of 2 and a stride of 2.
+    MAXPOOL2D_KERNEL_2X2_S2,
+
+    // Specialized kernel for a pool size of 3 and a stride of 2.
+    MAXPOOL2D_KERNEL_3X3_S2,
+
+    // Kernel for the NHWC layout, for any pool size and stride. Takes the 
+    // maximum over whole channel vectors.
+    MAXPOOL2D_KERNEL_NHWC
+};
 
 // The 2D max pooling layer. 
 struct layer_maxpool2d {
@@ -20,9 +38,21 @@ struct layer_maxpool2d {
     // The input and output matrices.
     struct matrix *input, *output;
 
+    // The activation layout.
+    enum layout_2d layout;
+
+    // The selected forward and backward kernel.
+    enum maxpool2d_kernel kernel;
+
     // Max pooling cache. For each input value, the value is 1.0 where the 
     // value is the maximum, while the value is 0.0 where the value is not.
+    // Only allocated for the generic kernel; the other kernels compare
+    // the inputs against the outputs in the backward pass instead.
     struct matrix cache;
+
+    // Row cache for the specialized kernels. Stores the vertical maximum of
+    // the input rows under the current output row.
+    struct matrix row_max;
     
     // Gradients on the outputs and inputs, respectively.
     struct matrix *d_outputs, *d_inputs;
@@ -38,6 +68,13 @@ extern TOM_API int layer_maxpool2d_init(struct layer_maxpool2d *obj, int n_chann
                          struct matrix *output, struct matrix *d_outputs, 
                          struct matrix *d_inputs);
 
+// Set the activation layout. Returns 1 if successful.
+extern TOM_API int layer_maxpool2d_set_layout(struct layer_maxpool2d *obj, enum layout_2d layout);
+
+// Reallocate the cache for the current number of rows of the input matrix.
+// Returns 1 if successful.
+extern TOM_API int layer_maxpool2d_resize(struct layer_maxpool2d *obj);
+
 // Free the cache owned by the layer.
 extern TOM_API void layer_maxpool2d_free(struct layer_maxpool2d *obj);
 
@@ -0,0 +1,57 @@
+// memory_plan.h
+// Liveness-based memory planning for activation buffers.
+
+#ifndef MEMORY_PLAN_H
+#define MEMORY_PLAN_H
+
+#include "declspec.h"
+
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
+
+// The last step of a tensor which is used until the model is freed.
+#define MEMORY_PLAN_FOREVER 0x7fffffff
+
+// Memory plan mode enum.
+enum memory_plan_mode {
+    // Every layer output and gradient has its own buffer.
+    MEMORY_PLAN_NONE,
+
+    // Buffers are shared between tensors which are not live at the same 
+    // time during training, which includes the forward pass.
+    MEMORY_PLAN_TRAINING,
+
+    // Buffers are shared between tensors which are not live at the same 
+    // time during the forward pass. The model cannot be trained, and no
+    // training state is allocated.
+    MEMORY_PLAN_INFERENCE
+};
+
+// A tensor to place in the memory plan.
+struct memory_plan_tensor {
+    // The size, in doubles.
+    int size;
+
+    // The offset of the tensor in the planned buffer, in doubles. Set by the
+    // planner.
+    int offset;
+};
+
+// A range of steps where a tensor is live, inclusive. A tensor may have 
+// several ranges, if its value is dead between them. Tensors without ranges
+// are never used.
+struct memory_plan_range {
+    // The index of the tensor.
+    int tensor;
+
+    // The first and last steps of the range.
+    int first_use, last_use;
+};
+
+// Assign an offset to each tensor, so that tensors which are live at the 
+// same time do not overlap. Every offset is aligned to ARENA_ALIGNMENT. 
+// Returns the size of the buffer needed by the plan, in doubles, or -1 if 
+// it failed.
+extern TOM_API int memory_plan_assign(struct memory_plan_tensor *tensors, int n_tensors,
+                                      const struct memory_plan_range *ranges, int n_ranges);
+
+#endif
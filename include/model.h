@@ -6,11 +6,16 @@
 
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #include "matrix.h"
 #include "declspec.h"
+#include "padding2d.h"
+#include "layout2d.h"
+#include "arena.h"
+#include "memory_plan.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 #define IS_CROSSENTROPY_SOFTMAX(obj) (obj->loss.type == LOSS_CROSSENTROPY && obj->last->type == LAYER_SOFTMAX)
 
@@ -71,9 +76,25 @@ enum layer_type {
 	LAYER_TANH,
     
     // Batch normalization layer.
-    LAYER_NORMALIZATION
+    LAYER_NORMALIZATION,
+
+    // 2D layout conversion layer.
+    LAYER_LAYOUT2D,
+
+    // Depthwise 2D conv layer.
+    LAYER_DEPTHWISE_CONV2D,
+
+    // 2D global average pooling layer.
+    LAYER_GLOBAVGPOOL2D,
+
+    // The first custom layer type. Custom layer types are numbered from it 
+    // in the order they are registered with layer_register_type.
+    LAYER_CUSTOM
 };
 
+// The operations of a layer type, in layer_ops.h.
+struct layer_ops;
+
 // The generic layer object. 
 struct layer {
     // Next and previous layers.
@@ -82,6 +103,9 @@ struct layer {
     // The layer type.
     enum layer_type type;
 
+    // The operations of the layer type. Set when the layer is initialized.
+    const struct layer_ops *ops;
+
     // The layer object.
     void *obj;
 
@@ -106,14 +130,38 @@ struct layer {
     // Optional parameters for conv and max pooling 2D layers.
     int filter_size, stride;
 
-    // Optional parameters for padding 2D layers.
+    // Optional parameters for padding 2D and (depthwise) conv 2D layers.
     int padding_x, padding_y;
+    enum padding_type padding_type;
+
+    // Optional parameters for (depthwise) conv 2D layers.
+    int dilation, groups;
+
+    // Set on (depthwise) conv 2D layers which absorbed a preceding padding 2D layer 
+    // during model finalization.
+    bool fused_padding;
+
+    // Set on elementwise layers whose output and output gradients share the 
+    // buffers of their input and input gradients. Set during model 
+    // finalization.
+    bool in_place;
+
+    // Set on layers whose output is kept as a checkpoint for the backward 
+    // pass, when gradient checkpointing is enabled. The other layers are 
+    // recomputed from the previous checkpoint. Set during model 
+    // finalization.
+    bool checkpoint;
+
+    // The activation layout for 2D layers, or the output layout for 2D 
+    // layout conversion layers. Set during model finalization.
+    enum layout_2d layout;
 };
 
 // Initialize a layer object. The layer should have its type, input size, and 
 // output size set. Requires the input matrix and the gradients from the
 // previous layer. Initializes the layer object itself, along with the output
-// matrix and output gradients.
+// matrix and output gradients. If the output and output gradient matrices 
+// are already set (by the memory planner), they are used instead.
 extern TOM_API int layer_init(struct layer* obj, int n_samples, struct matrix* inputs,
                struct matrix* d_prev);
 
@@ -125,6 +173,15 @@ extern TOM_API int layer_init_optimizer(struct layer* obj, enum optimizer_type t
 // Perform a forward pass on the layer.
 extern TOM_API int layer_forward(struct layer* obj, bool training);
 
+// Repeat the last training forward pass on the layer, for gradient 
+// checkpointing. Dropout masks and batch statistics are reused, so the 
+// output is the same.
+extern TOM_API int layer_recompute(struct layer* obj);
+
+// Reallocate the layer's per-sample state for the current number of rows of
+// its matrices.
+extern TOM_API int layer_resize(struct layer* obj);
+
 // Perform a backward pass on the layer.
 extern TOM_API int layer_backward(struct layer* obj);
 
@@ -135,6 +192,30 @@ extern TOM_API int layer_free(struct layer *obj);
 // Perform an update on the layer's optimizer.
 extern TOM_API int layer_update(struct layer* obj);
 
+// The maximum number of trainable parameter matrices in a layer.
+#define LAYER_MAX_PARAMS 2
+
+// The maximum number of optimizer state matrices in a layer.
+#define LAYER_MAX_OPTIMIZER_STATE 4
+
+// The maximum number of weight matrices in a layer.
+#define LAYER_MAX_WEIGHTS 4
+
+// Get the layer's trainable parameter matrices and their gradients. Returns 
+// the number of matrices, at most LAYER_MAX_PARAMS.
+extern TOM_API int layer_get_params(struct layer* obj, struct matrix **params, 
+                                    struct matrix **grads);
+
+// Get the matrices allocated by the layer's optimizer. Returns the number of
+// matrices, at most LAYER_MAX_OPTIMIZER_STATE.
+extern TOM_API int layer_get_optimizer_state(struct layer* obj, struct matrix **state);
+
+// Get the layer's weight matrices for hot reloading: its parameters, the 
+// running statistics of normalization layers, and the packed weights of NHWC
+// conv layers, which are NULL unless prepacked. Returns the number of 
+// matrices, at most LAYER_MAX_WEIGHTS.
+extern TOM_API int layer_get_weights(struct layer* obj, struct matrix **weights);
+
 // Loss type enum.
 enum loss_type {
     // Mean squared error.
@@ -147,7 +228,10 @@ enum loss_type {
     LOSS_CROSSENTROPY,
 
     // Binary cross-entropy loss.
-    LOSS_BINARY_CROSSENTROPY
+    LOSS_BINARY_CROSSENTROPY,
+
+    // No loss. The model can only be used for predictions.
+    LOSS_NONE
 };
 
 // The generic loss object.
@@ -182,6 +266,48 @@ extern TOM_API int loss_backward(struct loss* obj);
 // Free the loss object.
 extern TOM_API int loss_free(struct loss *obj);
 
+// The work done by a forward pass on the model.
+enum model_forward_mode {
+    // Layers in inference mode, without the loss. Used for predictions.
+    MODEL_FORWARD_INFERENCE,
+
+    // Layers in inference mode, with the loss value. Used to evaluate the
+    // loss.
+    MODEL_FORWARD_EVALUATE,
+
+    // Layers in training mode, ready for the backward pass, without the loss
+    // value.
+    MODEL_FORWARD_TRAINING,
+
+    // Layers in training mode, ready for the backward pass, with the loss 
+    // value.
+    MODEL_FORWARD_TRAINING_LOSS
+};
+
+// The fused optimizer object, defined in fused_optimizer.h.
+struct optimizer_fused;
+
+// The periodic training checkpoints, defined in checkpoint.h.
+struct model_checkpoint;
+
+// A published version of a model's weights, for hot reloading. A reader, the
+// model itself or an execution context, binds its layers to a version and 
+// keeps a reference to it until it binds to a newer one, so a version is 
+// freed once it is replaced and its last reader moves on.
+struct model_weights {
+    // The buffers of the weight matrices, in the order of layer_get_weights.
+    // Slots which are not bound are NULL.
+    double **buffers;
+    int n_buffers;
+
+    // The arena holding the buffers. Empty for the model's original weights.
+    struct arena arena;
+
+    // The number of references, including the model's reference while the
+    // version is published, and the version number, starting at 1.
+    int refs, version;
+};
+
 // The model object.
 struct model {
     // First and last layers.
@@ -193,24 +319,78 @@ struct model {
     // Number of samples.
     int n_samples;
 
+    // Number of samples in the current batch, at most n_samples. The layers
+    // and the loss only process this many rows.
+    int active_samples;
+
     // Loss object.
     struct loss loss;
 
-    // We store the input, output and y matrices.
+    // We store the input, output and y matrices. Models for inference only
+    // have no y matrix.
     struct matrix *input, *output, *y;
 
-    // Loss output.
+    // Loss output. Models for inference only have none.
     struct matrix *loss_output;
 
     // Store the last gradient.
     struct matrix *last_gradient;
+
+    // The activation layout to use inside chains of 2D layers.
+    enum layout_2d layout_2d;
+
+    // Arenas for the trainable parameters, their gradients and the optimizer
+    // state. The layer and optimizer matrices are views into the arenas, so
+    // whole-model operations can run as a single pass over each arena.
+    struct arena params, grads, optimizer_state;
+
+    // The (optional) fused optimizer. If set, it replaces the per-layer 
+    // optimizers in model updates.
+    struct optimizer_fused *fused_optimizer;
+
+    // The memory plan mode, and the arena holding the planned layer outputs
+    // and gradients.
+    enum memory_plan_mode memory_plan;
+    struct arena activations;
+
+    // The size of the layer outputs and gradients with and without the 
+    // memory plan, in doubles. Set when the model is finalized.
+    int planned_activation_size, unplanned_activation_size;
+
+    // The gradient checkpointing interval, in layers. Zero if disabled.
+    int checkpoint_interval;
+
+    // The published weights, the weights bound to the model's own layers, 
+    // and the model's original weights, for hot reloading. All are NULL 
+    // until weights are first published. The lock guards the published 
+    // weights and the references, and is only allocated for models planned 
+    // for inference.
+    struct model_weights *weights, *bound_weights, *original_weights;
+    void *weights_lock;
+
+    // The mapped model file holding the weights, if the model was loaded with
+    // map_model_file, and its size in bytes.
+    void *mapping;
+    size_t mapping_size;
+
+    // The training cursor: the epoch, and the batch within it, which 
+    // model_train starts from. Zero unless the model was loaded from a 
+    // training checkpoint, and reset when model_train returns, whether or 
+    // not it succeeded.
+    int epoch, batch;
+
+    // The periodic training checkpoints, if enabled with 
+    // model_set_checkpoint.
+    struct model_checkpoint *checkpoint;
 };
 
 // Initialize an empty model object.
 extern TOM_API int model_init(struct model *obj, int n_samples);
 
 // Free a model object. Free all the layers, optimizers, and matrices, along
-// with the loss.
+// with the loss. The model's execution contexts and inference queues must be
+// freed first, as freeing the model frees the published weights and the lock
+// they use.
 extern TOM_API int model_free(struct model *obj);
 
 // Add a layer without initializing it. Returns the layer if successful.
@@ -224,6 +404,33 @@ extern TOM_API struct layer* model_add_conv2d_layer(struct model* obj,
     int input_width, int n_filters,
     int filter_size, int stride);
 
+// Add a conv 2D layer with implicit padding without initializing it. Returns 
+// the layer if successful.
+extern TOM_API struct layer* model_add_conv2d_padded_layer(struct model* obj,
+    int input_channels, int input_height,
+    int input_width, int n_filters,
+    int filter_size, int stride, int padding_x,
+    int padding_y, enum padding_type padding_type);
+
+// Add a conv 2D layer with implicit padding, groups and dilation without 
+// initializing it. The number of input channels and filters must be 
+// divisible by the number of groups. Returns the layer if successful.
+extern TOM_API struct layer* model_add_conv2d_grouped_layer(struct model* obj,
+    int input_channels, int input_height,
+    int input_width, int n_filters,
+    int filter_size, int stride, int padding_x,
+    int padding_y, enum padding_type padding_type,
+    int groups, int dilation);
+
+// Add a depthwise conv 2D layer without initializing it. Each input channel
+// is convolved with depth_multiplier filters. Returns the layer if 
+// successful.
+extern TOM_API struct layer* model_add_depthwise_conv2d_layer(struct model* obj,
+    int input_channels, int input_height,
+    int input_width, int depth_multiplier,
+    int filter_size, int stride, int padding_x,
+    int padding_y, enum padding_type padding_type);
+
 // Add a max pooling 2D layer without initializing it. Returns the layer if 
 // successful.
 extern TOM_API struct layer* model_add_maxpool2d_layer(struct model* obj,
@@ -231,22 +438,83 @@ extern TOM_API struct layer* model_add_maxpool2d_layer(struct model* obj,
     int input_width, int pool_size,
     int stride);
 
+// Add a global average pooling 2D layer without initializing it. Each 
+// channel is reduced to its average, so the output size is input_channels.
+// Returns the layer if successful.
+extern TOM_API struct layer* model_add_globavgpool2d_layer(struct model* obj,
+    int input_channels, int input_height, int input_width);
+
 // Add a padding 2D layer without initializing it. Returns the layer if 
 // successful.
 extern TOM_API struct layer* model_add_padding2d_layer(struct model* obj,
     int input_channels, int input_height,
     int input_width, int padding_x, int padding_y);
 
+// Add a 2D layout conversion layer without initializing it. The conversion 
+// direction is set during model finalization. Returns the layer if 
+// successful.
+extern TOM_API struct layer* model_add_layout2d_layer(struct model* obj,
+    int channels, int height, int width);
+
+// Set the activation layout to use inside chains of 2D layers. Layout 
+// conversion layers are inserted at the chain boundaries when the model is 
+// finalized.
+extern TOM_API void model_set_layout_2d(struct model *obj, enum layout_2d layout);
+
+// Set the memory plan mode used to share buffers between the layer outputs
+// and gradients when the model is finalized. Defaults to 
+// MEMORY_PLAN_TRAINING.
+extern TOM_API void model_set_memory_plan(struct model *obj, enum memory_plan_mode mode);
+
+// Use automatic checkpoint placement, at intervals of about sqrt(n_layers).
+#define MODEL_CHECKPOINT_AUTO -1
+
+// Enable gradient checkpointing when the model is finalized, with a 
+// checkpoint every interval layers, or MODEL_CHECKPOINT_AUTO. Zero disables
+// it. Only used with MEMORY_PLAN_TRAINING.
+extern TOM_API void model_set_checkpointing(struct model *obj, int interval);
+
 // Set the layer's loss.
 extern TOM_API void model_set_loss(struct model *obj, enum loss_type type) ;
 
-// Finalize and initialize the model.
+// Finalize and initialize the model. Padding 2D layers which are merged into
+// the following conv 2D layer are removed from the model and freed, so
+// pointers to them are no longer valid.
 extern TOM_API int model_finalize(struct model *obj);
 
+// Pack the weights of the model's layers once for inference, into the 
+// layouts read by the forward kernels. Only models planned for inference can
+// be prepacked. Call again after changing the weights.
+extern TOM_API int model_prepack(struct model *obj);
+
+// Publish the weights of another finalized model with the same layers as the
+// model's new weights, for hot reloading. The weights are copied into a new
+// version, and prepacked if the model is. Later predictions with the model
+// and its execution contexts use the new weights, while predictions already
+// running finish with the old ones. Only models planned for inference can be
+// reloaded, and weights must be published from one thread at a time. The 
+// model owns the lock and the references to each version, so its contexts
+// must be freed before the model.
+extern TOM_API int model_publish_weights(struct model *obj, struct model *source);
+
 // Initialize optimizers on the model.
 extern TOM_API int model_init_optimizers(struct model *obj, enum optimizer_type type, ...);
 
-// Predict. Takes an input and output matrix with any number of samples.
+// Initialize a fused optimizer on the model, which updates all the 
+// parameters in a single pass. Takes the same variable args as 
+// model_init_optimizers.
+extern TOM_API int model_init_fused_optimizer(struct model *obj, enum optimizer_type type, ...);
+
+// Set the number of samples in the current batch, at most n_samples. The 
+// model must be finalized.
+extern TOM_API int model_set_active_samples(struct model *obj, int n_samples);
+
+// Change the batch size of a finalized model. The layer matrices are only
+// reallocated if the batch size grows past n_samples.
+extern TOM_API int model_set_batch_size(struct model *obj, int n_samples);
+
+// Predict. Takes an input and output matrix with any number of samples. Uses
+// the latest published weights, if any.
 extern TOM_API int model_predict(struct model* obj, struct matrix* X, struct matrix* Y);
 
 // Calculate model loss.
@@ -257,12 +525,64 @@ extern TOM_API int model_train(struct model* obj, struct matrix* X, struct matri
                 int epochs, bool debug);
 
 // Perform a forward pass on the model.
-extern TOM_API int model_forward(struct model *obj, bool training);
+extern TOM_API int model_forward(struct model *obj, enum model_forward_mode mode);
 
 // Perform a backward pass on the model.
 extern TOM_API int model_backward(struct model *obj);
 
-// Update each trainable layer in the model.
+// Update each trainable layer in the model, or all the parameters at once
+// with the fused optimizer.
 extern TOM_API int model_update(struct model* obj);
 
+// Calculate the L2 norm of all the parameter gradients in the model.
+extern TOM_API double model_gradient_norm(struct model* obj);
+
+// A per-thread execution context for a shared model, for inference only. The
+// context owns the layer outputs and the per-sample layer state, and shares
+// the parameters of the model, so several threads can predict with one copy 
+// of the weights.
+struct model_context {
+    // The shared model.
+    struct model *model;
+
+    // The layers of the context, in order. They share the parameters of the
+    // model's layers.
+    struct layer *layers;
+    int n_layers;
+
+    // Number of samples, and number of samples in the current batch.
+    int n_samples, active_samples;
+
+    // The input matrix, and its gradient, which has no buffer.
+    struct matrix input, d_input;
+
+    // The output matrix of the last layer.
+    struct matrix *output;
+
+    // The arena holding the layer outputs, planned for inference.
+    struct arena activations;
+
+    // The published model weights bound to the layers, if any.
+    struct model_weights *weights;
+};
+
+// Initialize an execution context for a finalized model, for inference with
+// up to n_samples samples per batch. The model's parameters are shared, and
+// must not change while the context is used, except by publishing new 
+// weights. Free the context before the model: a context keeps a reference to
+// the weights version it is bound to, which model_free releases along with
+// the lock guarding the references.
+extern TOM_API int model_context_init(struct model_context *obj, struct model *model, int n_samples);
+
+// Free the context's layers and activations. The shared model is not freed.
+extern TOM_API void model_context_free(struct model_context *obj);
+
+// Perform an inference forward pass on the context's input, with the latest
+// published weights.
+extern TOM_API int model_context_forward(struct model_context *obj);
+
+// Predict with the context. Takes an input and output matrix with any number
+// of samples.
+extern TOM_API int model_context_predict(struct model_context *obj, struct matrix *X, struct matrix *Y);
+
 #endif
@@ -7,7 +7,7 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The Mean Squared Error (MSE) loss function. The output loss value is 
 // calculated as sum((input - y) ** 2). The gradient on the inputs is 
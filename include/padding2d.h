@@ -7,9 +7,10 @@
 #include <stdbool.h>
 
 #include "matrix.h"
+#include "layout2d.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // Padding type enum.
 enum padding_type {
@@ -42,6 +43,10 @@ struct layer_padding2d {
     int *output_cache;
 
     bool has_caches;
+
+    // The activation layout. For the NHWC layout, whole channel vectors are 
+    // copied for each output pixel.
+    enum layout_2d layout;
     
     // Gradients on the outputs and inputs, respectively.
     struct matrix *d_outputs, *d_inputs;
@@ -63,6 +68,9 @@ extern TOM_API void layer_padding2d_free(struct layer_padding2d *obj);
 // Set the padding type.
 extern TOM_API void layer_padding2d_set_type(struct layer_padding2d *obj, enum padding_type type);
 
+// Set the activation layout.
+extern TOM_API void layer_padding2d_set_layout(struct layer_padding2d *obj, enum layout_2d layout);
+
 // Recalculate the caches.
 extern TOM_API int layer_padding2d_recalculate_caches(struct layer_padding2d *obj);
 
@@ -0,0 +1,45 @@
+// precision.h
+// Conversions between doubles and reduced precision values.
+
+#ifndef PRECISION_H
+#define PRECISION_H
+
+#include <stdint.h>
+
+#include "declspec.h"
+
+// Convert doubles to 32-bit floats.
+extern TOM_API void precision_to_float32(const double *src, float *dst, int n);
+
+// Convert 32-bit floats to doubles.
+extern TOM_API void precision_from_float32(const float *src, double *dst, int n);
+
+// Convert doubles to IEEE half precision values, rounding to nearest even. 
+// Values beyond the half precision range become infinities.
+extern TOM_API void precision_to_float16(const double *src, uint16_t *dst, int n);
+
+// Convert IEEE half precision values to doubles.
+extern TOM_API void precision_from_float16(const uint16_t *src, double *dst, int n);
+
+// Convert doubles to bfloat16 values, the upper half of a 32-bit float, 
+// rounding to nearest even.
+extern TOM_API void precision_to_bfloat16(const double *src, uint16_t *dst, int n);
+
+// Convert bfloat16 values to doubles.
+extern TOM_API void precision_from_bfloat16(const uint16_t *src, double *dst, int n);
+
+// Quantize doubles to 8-bit integers with a symmetric scale for each 
+// channel, so a value is its integer times its channel's scale. Value i 
+// belongs to channel (i / channel_block) % n_channels, and n must be a 
+// multiple of n_channels * channel_block. Dense weights have one channel per
+// column and a block of 1, and conv weights have one channel per filter and a
+// block of the filter's size.
+extern TOM_API void precision_to_int8(const double *src, int8_t *dst, float *scales, int n,
+                                      int n_channels, int channel_block);
+
+// Convert 8-bit integers with a scale for each channel to doubles. The 
+// channels are as in precision_to_int8.
+extern TOM_API void precision_from_int8(const int8_t *src, const float *scales, double *dst, int n,
+                                        int n_channels, int channel_block);
+
+#endif
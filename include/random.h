@@ -4,15 +4,35 @@
 #ifndef RANDOM_H
 #define RANDOM_H
 
+#include <stdint.h>
+
 #include "declspec.h"
 
-// Initialize the RNG.
+// The state of the random number generator, a splitmix64 generator, along 
+// with the spare value of the normal generator, which makes values in pairs.
+// Saved in training checkpoints, so a resumed run draws the same values.
+struct random_state {
+    uint64_t state;
+    double spare;
+    int32_t has_spare, reserved;
+};
+
+// Initialize the RNG from the current time.
 extern TOM_API void random_init(void);
 
+// Initialize the RNG from a seed, for reproducible runs.
+extern TOM_API void random_seed(uint64_t seed);
+
+// Get the state of the RNG.
+extern TOM_API void random_get_state(struct random_state *state);
+
+// Restore a state of the RNG.
+extern TOM_API void random_set_state(const struct random_state *state);
+
 // Generate a uniform random value from min to min+range.
 extern TOM_API double random_uniform(double min, double range);
 
 // Generate a normal random value.
 extern TOM_API double random_normal(double mu, double sigma);
 
-#endif
\ No newline at end of file
+#endif
@@ -7,11 +7,12 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The Rectified Linear Unit (RELU) activation layer. The output is calculated
 // as 1 * x if x > 0, or 0 if x <= 0. The gradient is calculated as d_output
-// if x > 0, or 0 if x <= 0.
+// if y > 0, or 0 if y <= 0, so the layer can run in place, with the output 
+// and input sharing a buffer.
 struct activation_relu {
     // The input and output size.
     int input_size, output_size;
@@ -5,6 +5,8 @@
 #define SERIALIZE_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #include "model.h"
 #include "matrix.h"
@@ -16,13 +18,22 @@ extern TOM_API int serialize_matrix(struct matrix* obj, FILE* fp);
 // Deserialize a matrix's data from a file.
 extern TOM_API int deserialize_matrix(struct matrix* obj, FILE* fp);
 
+// The stream format of serialize_model. Streams start with SERIALIZE_MAGIC 
+// and the version, followed by the number of layers. Streams without the 
+// magic word are read in the original format, which starts with the number 
+// of layers, and has no groups and dilation for conv 2D layers.
+#define SERIALIZE_MAGIC 0x534D4F54
+#define SERIALIZE_VERSION 1
+
 // Serialize a layer.
 extern TOM_API int serialize_layer(struct layer* obj, FILE* fp);
 
 // Serialize a layer's parameters.
 extern TOM_API int serialize_layer_params(struct layer* obj, FILE* fp);
 
-// Deserialize a layer and add it to a model.
+// Deserialize a layer written by serialize_layer and add it to a model. 
+// Layout conversion layers are skipped, as the model inserts its own for its
+// 2D layout when it is finalized.
 extern TOM_API int deserialize_layer(struct model* obj, FILE* fp);
 
 // Deserialize a layer's parameters.
@@ -36,4 +47,133 @@ extern TOM_API int serialize_model(struct model* obj, FILE* fp);
 // initializing and finalizing the model, and then loading layer parameters.
 extern TOM_API int deserialize_model(struct model* obj, FILE* fp);
 
+// Deserialize a model with the same layers into a shadow model, and publish 
+// its weights as the model's new weights for hot reloading. Predictions 
+// continue meanwhile, and later ones use the new weights.
+extern TOM_API int deserialize_model_weights(struct model* obj, FILE* fp);
+
+// Build the table for CRC-32 checksums.
+extern TOM_API void crc32_init(uint32_t table[256]);
+
+// Continue a CRC-32 checksum over data, with a table from crc32_init. Start 
+// with a checksum of zero.
+extern TOM_API uint32_t crc32_update(const uint32_t table[256], uint32_t crc, const void* data, size_t size);
+
+// The model file format. A model file starts with a header, followed by a 
+// table of layer records and a table of tensor records, and then the tensor
+// data. Every section and every tensor starts on an aligned offset, so the 
+// tensors of a mapped file can be used in place. Each tensor has a CRC-32
+// checksum, and so do the header and the tables. Values are stored in the
+// byte order of the machine which wrote the file, which is recorded.
+// Version 2 added reduced precision tensors.
+#define MODEL_FILE_MAGIC "TOMMODEL"
+#define MODEL_FILE_VERSION 2
+#define MODEL_FILE_BYTE_ORDER 0x01020304u
+#define MODEL_FILE_ALIGNMENT 64
+
+// Tensor data types, and the precisions a model file can be written with.
+enum model_file_type {
+    // 64-bit floats.
+    MODEL_FILE_FLOAT64,
+
+    // 32-bit floats.
+    MODEL_FILE_FLOAT32,
+
+    // IEEE half precision floats.
+    MODEL_FILE_FLOAT16,
+
+    // bfloat16 floats, with the exponent range of 32-bit floats.
+    MODEL_FILE_BFLOAT16,
+
+    // 8-bit integers, with a 32-bit float scale for each output channel. The
+    // scales are stored before the integers. Only the weights of dense and 
+    // conv layers are quantized, and the other tensors of a file written 
+    // with this precision are stored as 32-bit floats.
+    MODEL_FILE_INT8
+};
+
+// The model file header.
+struct model_file_header {
+    // MODEL_FILE_MAGIC, without a terminator.
+    char magic[8];
+
+    // The format version, and MODEL_FILE_BYTE_ORDER as written.
+    uint32_t version, byte_order;
+
+    // Number of layer and tensor records.
+    uint32_t n_layers, n_tensors;
+
+    // The loss type, and the precision the file was written with.
+    int32_t loss_type, type;
+
+    // Offsets of the layer table, the tensor table and the tensor data, and
+    // the file size, in bytes.
+    uint64_t layer_offset, tensor_offset, data_offset, file_size;
+
+    // The checksum of both tables, and of the header before this field.
+    uint32_t table_checksum, header_checksum;
+};
+
+// A layer record.
+struct model_file_layer {
+    // The layer type.
+    int32_t type;
+
+    // The layer dimensions and hyperparameters, as in struct layer. The 
+    // padding type is that of padding 2D and padded conv 2D layers.
+    int32_t input_size, output_size;
+    int32_t input_channels, input_height, input_width;
+    int32_t output_channels, output_height, output_width;
+    int32_t filter_size, stride;
+    int32_t padding_x, padding_y, padding_type;
+    int32_t dilation, groups;
+
+    // The layer's tensors in the tensor table.
+    int32_t first_tensor, n_tensors;
+
+    // The dropout or leaky RELU rate, or the batch normalization epsilon and
+    // momentum.
+    double values[2];
+};
+
+// A tensor record.
+struct model_file_tensor {
+    // The shape.
+    int32_t n_rows, n_cols;
+
+    // The data type, and the CRC-32 checksum of the data.
+    int32_t type;
+    uint32_t checksum;
+
+    // Offset and size of the data, in bytes.
+    uint64_t offset, size;
+
+    // For 8-bit integer tensors, the number of channels, and the number of 
+    // consecutive values in each channel, as in precision_to_int8. Zero for 
+    // other types.
+    int32_t n_channels, channel_block;
+};
+
+// Write a finalized model in the model file format, with its tensors stored 
+// in a precision. The layers are stored in order, and each layer's tensors 
+// are its parameters, followed by the running statistics of batch 
+// normalization layers.
+extern TOM_API int serialize_model_file(struct model* obj, FILE* fp, enum model_file_type type);
+
+// Read a model in the model file format, checking every checksum. The layers
+// are added to the model, which is finalized with its own batch size, memory
+// plan and 2D layout before the tensors are read into it, converted to 
+// doubles. The file's layout conversion layers are skipped, so a file written
+// with either layout loads into a model with either.
+extern TOM_API int deserialize_model_file(struct model* obj, FILE* fp);
+
+// Map a model file into memory and load the model with its tensors used in 
+// place, so processes mapping the same file share the weight pages. The 
+// model must be planned for inference, as the mapped weights are read only.
+// The tensor checksums are only checked if verify is set, since it reads 
+// every page. Only 64-bit float tensors can be used in place, and the others
+// are converted into the model's own weights. The mapping is released by 
+// model_free.
+extern TOM_API int map_model_file(struct model* obj, const char* path, bool verify);
+
 #endif
\ No newline at end of file
@@ -7,10 +7,11 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The sigmoid activation function. The forward pass is calculated as
 // 1 / (1 + e^(-x)). The backward pass is calculated as d_output * y * (1-y).
+// Only the output is used by the backward pass, so the layer can run in place.
 struct activation_sigmoid {
     // The input and output size.
     int input_size, output_size;
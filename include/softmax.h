@@ -7,7 +7,7 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The softmax activation function. The forward pass is calculated as
 // e^x/sum(e^x). The forward pass can be calculated in a numerically unstable
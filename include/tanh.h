@@ -7,11 +7,12 @@
 #include "matrix.h"
 #include "declspec.h"
 
-extern char *LAST_ERROR;
+extern TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // The hyperbolic tangent (tanh) activation function. The forward pass is 
 // calculated as (e^x - e^(-x))/(e^x + e^(-x)). The backward pass is calculated
-// as d_output * (1 - y^2).
+// as d_output * (1 - y^2). Only the output is used by the backward pass, so
+// the layer can run in place.
 struct activation_tanh {
     // The input and output size.
     int input_size, output_size;
@@ -14,6 +14,8 @@ extern "C" {
 #include "crossentropy.h"
 #include "dense.h"
 #include "matrix.h"
+#include "arena.h"
+#include "memory_plan.h"
 #include "mse.h"
 #include "mae.h"
 #include "random.h"
@@ -26,14 +28,21 @@ extern "C" {
 #include "conv2d.h"
 #include "maxpool2d.h"
 #include "padding2d.h"
+#include "globavgpool2d.h"
+#include "layout2d.h"
 #include "model.h"
+#include "layer_ops.h"
+#include "inference_queue.h"
+#include "checkpoint.h"
 #include "serialize.h"
+#include "precision.h"
 #include "version.h"
 #include "sgd.h"
 #include "rmsprop.h"
 #include "rmsprop_conv2d.h"
 #include "sgd_conv2d.h"
 #include "adam_conv2d.h"
+#include "fused_optimizer.h"
 
 #ifdef __cplusplus
 }
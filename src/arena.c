@@ -0,0 +1,48 @@
+// arena.c
+// Aligned memory arenas.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "matrix.h"
+
+// Initialize an arena with a capacity in doubles. The buffer is zeroed.
+int arena_init(struct arena *obj, int size) {
+    obj->size = ARENA_ALIGN_SIZE(size);
+    obj->used = 0;
+
+    // Over-allocate, and align the buffer inside the allocation.
+    obj->memory = malloc(obj->size * sizeof(double) + ARENA_ALIGNMENT);
+    if (obj->memory == NULL) {
+        obj->buffer = NULL;
+        LAST_ERROR = "Failed to allocate arena.";
+        return 0;
+    }
+    obj->buffer = (double *)(((uintptr_t)obj->memory + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1));
+    memset(obj->buffer, 0, obj->size * sizeof(double));
+    return 1;
+}
+
+// Allocate a matrix view from the arena. The view starts on an aligned 
+// offset.
+int arena_alloc(struct arena *obj, struct matrix *matrix, int n_rows, int n_cols) {
+    const int size = ARENA_ALIGN_SIZE(n_rows * n_cols);
+    if (obj->used + size > obj->size) {
+        LAST_ERROR = "Arena is full.";
+        return 0;
+    }
+    matrix_init_view(matrix, n_rows, n_cols, &obj->buffer[obj->used]);
+    obj->used += size;
+    return 1;
+}
+
+// Free the arena. Any views into it become invalid.
+void arena_free(struct arena *obj) {
+    free(obj->memory);
+    obj->memory = NULL;
+    obj->buffer = NULL;
+    obj->size = 0;
+    obj->used = 0;
+}
@@ -2,6 +2,7 @@
 // Batch normalization (Ioffe & Szegedy, 2015).
 
 #include <math.h>
+#include <stdlib.h>
 
 #include "batch_normalization.h"
 #include "matrix.h"
@@ -73,11 +74,17 @@ int layer_normalization_init(struct layer_normalization *obj, int input_size,
     if (!matrix_init(&obj->beta, 1, input_size)) {
         return 0;
     }
-    if (!matrix_init(&obj->d_gamma, 1, input_size)) {
-        return 0;
-    }
-    if (!matrix_init(&obj->d_beta, 1, input_size)) {
-        return 0;
+
+    // The gradients are not needed for inference only.
+    obj->d_gamma.buffer = NULL;
+    obj->d_beta.buffer = NULL;
+    if (d_outputs->buffer != NULL) {
+        if (!matrix_init(&obj->d_gamma, 1, input_size)) {
+            return 0;
+        }
+        if (!matrix_init(&obj->d_beta, 1, input_size)) {
+            return 0;
+        }
     }
 
     // Initialize the running mean and running variance.
@@ -222,6 +229,17 @@ void layer_normalization_forward_predict(struct layer_normalization *obj) {
     }
 }
 
+// Perform a forward pass on the layer with the batch mean and variance from 
+// the last training forward pass. The running mean and variance are not 
+// updated.
+void layer_normalization_forward_replay(struct layer_normalization *obj) {
+    for (int i = 0; i < obj->input_size; i++) {
+        for (int j = 0; j < obj->input->n_rows; j++) {
+            obj->output->buffer[j * obj->input_size + i] = obj->gamma.buffer[i] * (obj->input->buffer[j * obj->input_size + i] - obj->mean.buffer[i]) / sqrt(obj->variance.buffer[i] + obj->epsilon) + obj->beta.buffer[i];
+        }
+    }
+}
+
 // Perform a backward pass on the layer.
 void layer_normalization_backward(struct layer_normalization *obj) {
     // Calculate d_inputs, d_gamma, and d_beta.
@@ -0,0 +1,553 @@
+// checkpoint.c
+// Training checkpoints.
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "checkpoint.h"
+#include "model.h"
+#include "matrix.h"
+#include "random.h"
+#include "serialize.h"
+#include "fused_optimizer.h"
+#include "batch_normalization.h"
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION checkpoint_mutex;
+typedef CONDITION_VARIABLE checkpoint_cond;
+typedef HANDLE checkpoint_thread;
+#else
+typedef pthread_mutex_t checkpoint_mutex;
+typedef pthread_cond_t checkpoint_cond;
+typedef pthread_t checkpoint_thread;
+#endif
+
+// Round a size in bytes up to a multiple of a double.
+#define CHECKPOINT_ALIGN(size) (((size) + sizeof(double) - 1) / sizeof(double) * sizeof(double))
+
+// The writer state. The snapshot is only written by the training thread
+// while no write is pending, and only read by the writer thread while one
+// is.
+struct checkpoint_writer {
+    checkpoint_mutex mutex;
+    checkpoint_cond cond;
+
+    // The checkpoint image, its size and its capacity, in bytes.
+    unsigned char *snapshot;
+    size_t size, capacity;
+
+    // Set while the snapshot waits to be written or is being written, and
+    // when the writer should stop.
+    bool pending, stopping;
+
+    checkpoint_thread thread;
+    bool started;
+};
+
+static void checkpoint_lock(struct checkpoint_writer *writer) {
+#ifdef _WIN32
+    EnterCriticalSection(&writer->mutex);
+#else
+    pthread_mutex_lock(&writer->mutex);
+#endif
+}
+
+static void checkpoint_unlock(struct checkpoint_writer *writer) {
+#ifdef _WIN32
+    LeaveCriticalSection(&writer->mutex);
+#else
+    pthread_mutex_unlock(&writer->mutex);
+#endif
+}
+
+static void checkpoint_broadcast(struct checkpoint_writer *writer) {
+#ifdef _WIN32
+    WakeAllConditionVariable(&writer->cond);
+#else
+    pthread_cond_broadcast(&writer->cond);
+#endif
+}
+
+static void checkpoint_wait(struct checkpoint_writer *writer) {
+#ifdef _WIN32
+    SleepConditionVariableCS(&writer->cond, &writer->mutex, INFINITE);
+#else
+    pthread_cond_wait(&writer->cond, &writer->mutex);
+#endif
+}
+
+// The maximum number of matrices in a checkpoint of a model.
+static int checkpoint_max_matrices(struct model *obj) {
+    return obj->n_layers * (LAYER_MAX_PARAMS + 2 + LAYER_MAX_OPTIMIZER_STATE) + 2;
+}
+
+// Get the matrices stored in a checkpoint: the parameters and running
+// statistics of each layer, followed by the optimizer state. The per-layer
+// optimizer state is unused while a fused optimizer is set. Returns the
+// number of matrices.
+static int checkpoint_matrices(struct model *obj, struct matrix **matrices) {
+    int n = 0;
+    struct matrix *grads[LAYER_MAX_PARAMS];
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        n += layer_get_params(current, &matrices[n], grads);
+        if (current->type == LAYER_NORMALIZATION) {
+            matrices[n++] = &((struct layer_normalization *)current->obj)->running_mean;
+            matrices[n++] = &((struct layer_normalization *)current->obj)->running_variance;
+        }
+        if (obj->fused_optimizer == NULL) {
+            n += layer_get_optimizer_state(current, &matrices[n]);
+        }
+    }
+    if (obj->fused_optimizer != NULL) {
+        if (obj->fused_optimizer->m.buffer != NULL) {
+            matrices[n++] = &obj->fused_optimizer->m;
+        }
+        if (obj->fused_optimizer->c.buffer != NULL) {
+            matrices[n++] = &obj->fused_optimizer->c;
+        }
+    }
+    return n;
+}
+
+// Copy a model's training state into a checkpoint image. The buffer grows as
+// needed.
+static int checkpoint_capture(struct model *obj, unsigned char **buffer, size_t *capacity, size_t *size) {
+    struct matrix **matrices = malloc(checkpoint_max_matrices(obj) * sizeof(struct matrix *));
+    if (matrices == NULL) {
+        LAST_ERROR = "Failed to allocate checkpoint.";
+        return 0;
+    }
+    int n_matrices = checkpoint_matrices(obj, matrices);
+    uint64_t n_values = 0;
+    for (int i = 0; i < n_matrices; i++) {
+        n_values += matrices[i]->size;
+    }
+
+    // Lay out the image: the header, the iterations, the shapes and the
+    // values.
+    size_t values_offset = CHECKPOINT_ALIGN(sizeof(struct checkpoint_header) +
+        (obj->n_layers + 2 * n_matrices) * sizeof(int32_t));
+    *size = values_offset + n_values * sizeof(double);
+    if (*size > *capacity) {
+        unsigned char *grown = realloc(*buffer, *size);
+        if (grown == NULL) {
+            free(matrices);
+            LAST_ERROR = "Failed to allocate checkpoint.";
+            return 0;
+        }
+        *buffer = grown;
+        *capacity = *size;
+    }
+    memset(*buffer, 0, values_offset);
+
+    struct checkpoint_header *header = (struct checkpoint_header *)*buffer;
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->version = CHECKPOINT_VERSION;
+    header->byte_order = MODEL_FILE_BYTE_ORDER;
+    header->n_layers = obj->n_layers;
+    header->n_matrices = n_matrices;
+    header->epoch = obj->epoch;
+    header->batch = obj->batch;
+    header->fused_iter = obj->fused_optimizer != NULL ? obj->fused_optimizer->iter : -1;
+    random_get_state(&header->random);
+    header->n_values = n_values;
+
+    int32_t *iters = (int32_t *)(*buffer + sizeof(struct checkpoint_header));
+    int i = 0;
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        iters[i++] = current->opt.iter;
+    }
+    int32_t *shapes = &iters[obj->n_layers];
+    double *values = (double *)(*buffer + values_offset);
+    for (i = 0; i < n_matrices; i++) {
+        shapes[2 * i] = matrices[i]->n_rows;
+        shapes[2 * i + 1] = matrices[i]->n_cols;
+        memcpy(values, matrices[i]->buffer, matrices[i]->size * sizeof(double));
+        values += matrices[i]->size;
+    }
+    free(matrices);
+
+    // The checksums are computed here rather than by the writer, so the
+    // image is complete once captured.
+    uint32_t table[256];
+    crc32_init(table);
+    header->data_checksum = crc32_update(table, 0, *buffer + sizeof(struct checkpoint_header),
+                                         *size - sizeof(struct checkpoint_header));
+    header->header_checksum = crc32_update(table, 0, header, offsetof(struct checkpoint_header, header_checksum));
+    return 1;
+}
+
+// Write a checkpoint image to a temporary file, flush it to the disk, and
+// rename it over the checkpoint, so the checkpoint is replaced whole.
+static int checkpoint_write(const unsigned char *image, size_t size, const char *path, const char *temp_path) {
+    FILE *fp = fopen(temp_path, "wb");
+    if (fp == NULL) {
+        LAST_ERROR = "Failed to open checkpoint file.";
+        return 0;
+    }
+    int result = fwrite(image, 1, size, fp) == size && fflush(fp) == 0;
+#ifdef _WIN32
+    result = result && _commit(_fileno(fp)) == 0;
+#else
+    result = result && fsync(fileno(fp)) == 0;
+#endif
+    result = fclose(fp) == 0 && result;
+    if (!result) {
+        remove(temp_path);
+        LAST_ERROR = "Failed to write checkpoint file.";
+        return 0;
+    }
+
+#ifdef _WIN32
+    result = MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    result = rename(temp_path, path) == 0;
+#endif
+    if (!result) {
+        remove(temp_path);
+        LAST_ERROR = "Failed to replace checkpoint file.";
+        return 0;
+    }
+    return 1;
+}
+
+// Get the temporary path a checkpoint is written to.
+static char *checkpoint_temp_path(const char *path) {
+    char *temp_path = malloc(strlen(path) + 5);
+    if (temp_path == NULL) {
+        LAST_ERROR = "Failed to allocate checkpoint.";
+        return NULL;
+    }
+    strcpy(temp_path, path);
+    strcat(temp_path, ".tmp");
+    return temp_path;
+}
+
+// Write a training checkpoint of a model.
+int model_save_checkpoint(struct model *obj, const char *path) {
+    if (obj->input == NULL) {
+        LAST_ERROR = "Model not finalized.";
+        return 0;
+    }
+    char *temp_path = checkpoint_temp_path(path);
+    if (temp_path == NULL) {
+        return 0;
+    }
+    unsigned char *image = NULL;
+    size_t size = 0, capacity = 0;
+    int result = checkpoint_capture(obj, &image, &capacity, &size) &&
+                 checkpoint_write(image, size, path, temp_path);
+    free(image);
+    free(temp_path);
+    return result;
+}
+
+// Check a checkpoint image against a model, and restore it.
+static int checkpoint_restore(struct model *obj, const unsigned char *image, size_t size) {
+    const struct checkpoint_header *header = (const struct checkpoint_header *)image;
+    if (size < sizeof(struct checkpoint_header) || memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) {
+        LAST_ERROR = "Not a checkpoint file.";
+        return 0;
+    }
+    if (header->byte_order != MODEL_FILE_BYTE_ORDER) {
+        LAST_ERROR = "Checkpoint file has a different byte order.";
+        return 0;
+    }
+    if (header->version != CHECKPOINT_VERSION) {
+        LAST_ERROR = "Unsupported checkpoint file version.";
+        return 0;
+    }
+    uint32_t table[256];
+    crc32_init(table);
+    if (header->header_checksum != crc32_update(table, 0, header, offsetof(struct checkpoint_header, header_checksum))) {
+        LAST_ERROR = "Checkpoint file header is corrupt.";
+        return 0;
+    }
+    if (header->n_layers != obj->n_layers || header->n_matrices < 0 || header->n_matrices > checkpoint_max_matrices(obj)) {
+        LAST_ERROR = "Checkpoint does not match the model.";
+        return 0;
+    }
+    size_t values_offset = CHECKPOINT_ALIGN(sizeof(struct checkpoint_header) +
+        (header->n_layers + 2 * header->n_matrices) * sizeof(int32_t));
+    if (size != values_offset + header->n_values * sizeof(double)) {
+        LAST_ERROR = "Checkpoint file is truncated or corrupt.";
+        return 0;
+    }
+    if (header->data_checksum != crc32_update(table, 0, image + sizeof(struct checkpoint_header),
+                                              size - sizeof(struct checkpoint_header))) {
+        LAST_ERROR = "Checkpoint file is corrupt.";
+        return 0;
+    }
+    if ((header->fused_iter >= 0) != (obj->fused_optimizer != NULL)) {
+        LAST_ERROR = "Checkpoint optimizers do not match the model.";
+        return 0;
+    }
+
+    // Check every shape before changing the model.
+    struct matrix **matrices = malloc(checkpoint_max_matrices(obj) * sizeof(struct matrix *));
+    if (matrices == NULL) {
+        LAST_ERROR = "Failed to allocate checkpoint.";
+        return 0;
+    }
+    int n_matrices = checkpoint_matrices(obj, matrices);
+    const int32_t *iters = (const int32_t *)(image + sizeof(struct checkpoint_header));
+    const int32_t *shapes = &iters[header->n_layers];
+    int result = n_matrices == header->n_matrices;
+    for (int i = 0; result && i < n_matrices; i++) {
+        result = shapes[2 * i] == matrices[i]->n_rows && shapes[2 * i + 1] == matrices[i]->n_cols;
+    }
+    if (!result) {
+        free(matrices);
+        LAST_ERROR = "Checkpoint optimizers do not match the model.";
+        return 0;
+    }
+
+    // Restore the values, the iterations, the RNG and the cursor.
+    const double *values = (const double *)(image + values_offset);
+    for (int i = 0; i < n_matrices; i++) {
+        memcpy(matrices[i]->buffer, values, matrices[i]->size * sizeof(double));
+        values += matrices[i]->size;
+    }
+    free(matrices);
+
+    int i = 0;
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        current->opt.iter = iters[i++];
+    }
+    if (obj->fused_optimizer != NULL) {
+        obj->fused_optimizer->iter = header->fused_iter;
+    }
+    random_set_state(&header->random);
+    obj->epoch = header->epoch;
+    obj->batch = header->batch;
+    return 1;
+}
+
+// Load a training checkpoint into a finalized model with the same layers and
+// optimizers.
+int model_load_checkpoint(struct model *obj, const char *path) {
+    if (obj->input == NULL) {
+        LAST_ERROR = "Model not finalized.";
+        return 0;
+    }
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        LAST_ERROR = "Failed to open checkpoint file.";
+        return 0;
+    }
+
+    // Read the whole image, which is checked before the model changes.
+    long size = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        size = ftell(fp);
+    }
+    unsigned char *image = size >= 0 ? malloc(size > 0 ? (size_t)size : 1) : NULL;
+    int result = image != NULL && fseek(fp, 0, SEEK_SET) == 0 && fread(image, 1, (size_t)size, fp) == (size_t)size;
+    fclose(fp);
+    if (!result) {
+        free(image);
+        LAST_ERROR = "Failed to read checkpoint file.";
+        return 0;
+    }
+
+    result = checkpoint_restore(obj, image, (size_t)size);
+    free(image);
+    return result;
+}
+
+// The writer thread. Wait for a snapshot, and write it outside the lock.
+#ifdef _WIN32
+static DWORD WINAPI checkpoint_writer_main(LPVOID arg) {
+#else
+static void *checkpoint_writer_main(void *arg) {
+#endif
+    struct model_checkpoint *obj = arg;
+    struct checkpoint_writer *writer = obj->writer;
+
+    checkpoint_lock(writer);
+    while (true) {
+        while (!writer->pending && !writer->stopping) {
+            checkpoint_wait(writer);
+        }
+        if (!writer->pending) {
+            break;
+        }
+
+        checkpoint_unlock(writer);
+        int result = checkpoint_write(writer->snapshot, writer->size, obj->path, obj->temp_path);
+        checkpoint_lock(writer);
+
+        if (result) {
+            obj->n_written++;
+        } else {
+            obj->error = LAST_ERROR;
+        }
+        writer->pending = false;
+        checkpoint_broadcast(writer);
+    }
+    checkpoint_unlock(writer);
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// Stop the writer once the pending checkpoint is written, and free the
+// checkpoints. Returns 0 if a write failed since the last wait.
+static int model_checkpoint_free(struct model *obj) {
+    struct model_checkpoint *checkpoint = obj->checkpoint;
+    if (checkpoint == NULL) {
+        return 1;
+    }
+    struct checkpoint_writer *writer = checkpoint->writer;
+    int result = 1;
+    if (writer != NULL) {
+        if (writer->started) {
+            checkpoint_lock(writer);
+            writer->stopping = true;
+            checkpoint_broadcast(writer);
+            checkpoint_unlock(writer);
+#ifdef _WIN32
+            WaitForSingleObject(writer->thread, INFINITE);
+            CloseHandle(writer->thread);
+#else
+            pthread_join(writer->thread, NULL);
+#endif
+        }
+#ifdef _WIN32
+        DeleteCriticalSection(&writer->mutex);
+#else
+        pthread_mutex_destroy(&writer->mutex);
+        pthread_cond_destroy(&writer->cond);
+#endif
+        free(writer->snapshot);
+        free(writer);
+    }
+    if (checkpoint->error != NULL) {
+        LAST_ERROR = (char *)checkpoint->error;
+        result = 0;
+    }
+    free(checkpoint->path);
+    free(checkpoint->temp_path);
+    free(checkpoint);
+    obj->checkpoint = NULL;
+    return result;
+}
+
+// Write a checkpoint every interval batches of model_train, in the
+// background.
+int model_set_checkpoint(struct model *obj, const char *path, int interval) {
+    // Finish with the current checkpoints.
+    int result = model_checkpoint_free(obj);
+    if (path == NULL || interval == 0) {
+        return result;
+    }
+    if (interval < 0) {
+        LAST_ERROR = "Invalid checkpoint interval.";
+        return 0;
+    }
+
+    struct model_checkpoint *checkpoint = calloc(1, sizeof(struct model_checkpoint));
+    if (checkpoint == NULL) {
+        LAST_ERROR = "Failed to allocate checkpoint.";
+        return 0;
+    }
+    obj->checkpoint = checkpoint;
+    checkpoint->interval = interval;
+    checkpoint->path = malloc(strlen(path) + 1);
+    checkpoint->temp_path = checkpoint_temp_path(path);
+    checkpoint->writer = calloc(1, sizeof(struct checkpoint_writer));
+    if (checkpoint->path == NULL || checkpoint->temp_path == NULL || checkpoint->writer == NULL) {
+        model_checkpoint_free(obj);
+        LAST_ERROR = "Failed to allocate checkpoint.";
+        return 0;
+    }
+    strcpy(checkpoint->path, path);
+
+    struct checkpoint_writer *writer = checkpoint->writer;
+#ifdef _WIN32
+    InitializeCriticalSection(&writer->mutex);
+    InitializeConditionVariable(&writer->cond);
+    writer->thread = CreateThread(NULL, 0, checkpoint_writer_main, checkpoint, 0, NULL);
+    writer->started = writer->thread != NULL;
+#else
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    writer->started = pthread_create(&writer->thread, NULL, checkpoint_writer_main, checkpoint) == 0;
+#endif
+    if (!writer->started) {
+        model_checkpoint_free(obj);
+        LAST_ERROR = "Failed to start checkpoint writer.";
+        return 0;
+    }
+    return result;
+}
+
+// Wait for the pending checkpoint to be written.
+int model_wait_checkpoint(struct model *obj) {
+    struct model_checkpoint *checkpoint = obj->checkpoint;
+    if (checkpoint == NULL) {
+        return 1;
+    }
+    struct checkpoint_writer *writer = checkpoint->writer;
+    checkpoint_lock(writer);
+    while (writer->pending) {
+        checkpoint_wait(writer);
+    }
+    const char *error = checkpoint->error;
+    checkpoint->error = NULL;
+    checkpoint_unlock(writer);
+
+    if (error != NULL) {
+        LAST_ERROR = (char *)error;
+        return 0;
+    }
+    return 1;
+}
+
+// Count a batch of model_train, and snapshot the model if a checkpoint is
+// due.
+int model_checkpoint_batch(struct model *obj) {
+    struct model_checkpoint *checkpoint = obj->checkpoint;
+    if (checkpoint == NULL || ++checkpoint->n_batches < checkpoint->interval) {
+        return 1;
+    }
+
+    // If the previous checkpoint is still being written, take this one at a
+    // later batch rather than waiting.
+    struct checkpoint_writer *writer = checkpoint->writer;
+    checkpoint_lock(writer);
+    bool pending = writer->pending;
+    checkpoint_unlock(writer);
+    if (pending) {
+        return 1;
+    }
+
+    if (!checkpoint_capture(obj, &writer->snapshot, &writer->capacity, &writer->size)) {
+        return 0;
+    }
+    checkpoint->n_batches = 0;
+
+    checkpoint_lock(writer);
+    writer->pending = true;
+    checkpoint_broadcast(writer);
+    checkpoint_unlock(writer);
+    return 1;
+}
@@ -2,29 +2,161 @@
 // 2D conv layer.
 
 #include <math.h>
+#include <stdlib.h>
 
 #include "conv2d.h"
 #include "dense.h"
+#include "padding2d.h"
 #include "matrix.h"
 #include "random.h"
 
-// Initialize an empty layer object.
+// Map a padded index to an input index, or -1 for zero padding.
+static int conv2d_padded_index(int index, int dim, enum padding_type padding_type) {
+    if (index >= 0 && index < dim) {
+        return index;
+    }
+
+    switch (padding_type) {
+    case PADDING_SYMMETRIC:
+        // Mirror the input, including the edge value.
+        return index < 0 ? -index - 1 : dim * 2 - 1 - index;
+    case PADDING_REFLECTION:
+        // Mirror the input, excluding the edge value.
+        return index < 0 ? -index : (dim - 1) * 2 - index;
+    default:
+        return -1;
+    }
+}
+
+// Calculate the padding index caches.
+static void conv2d_calculate_caches(struct layer_conv2d *obj) {
+    for (int i = 0; i < obj->output_height; i++) {
+        for (int k = 0; k < obj->filter_size; k++) {
+            obj->row_index[i * obj->filter_size + k] = conv2d_padded_index(i * obj->stride + k * obj->dilation - obj->padding_y, obj->input_height, obj->padding_type);
+        }
+    }
+
+    for (int k = 0; k < obj->filter_size; k++) {
+        // Find the range of output columns which read from inside the input.
+        obj->col_start[k] = obj->output_width;
+        obj->col_end[k] = obj->output_width;
+        for (int j = 0; j < obj->output_width; j++) {
+            int col = j * obj->stride + k * obj->dilation - obj->padding_x;
+            obj->col_index[j * obj->filter_size + k] = conv2d_padded_index(col, obj->input_width, obj->padding_type);
+            if (col >= 0 && col < obj->input_width) {
+                if (obj->col_start[k] == obj->output_width) {
+                    obj->col_start[k] = j;
+                }
+                obj->col_end[k] = j + 1;
+            }
+        }
+    }
+}
+
+// Select the kernel and initialize the packed weights.
+static int conv2d_select_kernel(struct layer_conv2d *obj) {
+    const int kernel_size = obj->filter_size * obj->filter_size;
+
+    if (obj->layout == LAYOUT_NHWC) {
+        obj->kernel = obj->group_channels == 1 ? CONV2D_KERNEL_DEPTHWISE_NHWC : CONV2D_KERNEL_NHWC;
+    } else if (obj->group_channels == 1) {
+        obj->kernel = CONV2D_KERNEL_DEPTHWISE;
+    } else if (obj->filter_size == 1 && obj->stride == 1 && obj->padding_x == 0 && obj->padding_y == 0 && obj->groups == 1) {
+        obj->kernel = CONV2D_KERNEL_POINTWISE;
+    } else {
+        obj->kernel = CONV2D_KERNEL_GENERIC;
+    }
+
+    matrix_free(&obj->packed_weights);
+    matrix_free(&obj->packed_d_weights);
+    obj->packed_weights.buffer = NULL;
+    obj->packed_d_weights.buffer = NULL;
+    obj->prepacked = false;
+    if (obj->layout == LAYOUT_NHWC) {
+        // Initialize the packed weights and gradients.
+        if (!matrix_init(&obj->packed_weights, kernel_size * obj->group_channels, obj->n_filters)) {
+            return 0;
+        }
+        if (obj->d_outputs->buffer != NULL && !matrix_init(&obj->packed_d_weights, kernel_size * obj->group_channels, obj->n_filters)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Initialize an empty layer object, without padding, groups or dilation.
 int layer_conv2d_init(struct layer_conv2d *obj, int n_channels, 
                       int input_height, int input_width, int n_filters, 
                       int filter_size, int stride, struct matrix *input, 
                       struct matrix *output, struct matrix *d_outputs, 
                       struct matrix *d_inputs) {
+    return layer_conv2d_init_grouped(obj, n_channels, input_height, input_width, n_filters, filter_size, stride, 1, 1, 0, 0, PADDING_ZERO, input, output, d_outputs, d_inputs);
+}
+
+// Initialize an empty layer object with implicit padding, without groups or 
+// dilation.
+int layer_conv2d_init_padded(struct layer_conv2d *obj, int n_channels, 
+                             int input_height, int input_width, int n_filters, 
+                             int filter_size, int stride, int padding_x, 
+                             int padding_y, enum padding_type padding_type,
+                             struct matrix *input, struct matrix *output, 
+                             struct matrix *d_outputs, struct matrix *d_inputs) {
+    return layer_conv2d_init_grouped(obj, n_channels, input_height, input_width, n_filters, filter_size, stride, 1, 1, padding_x, padding_y, padding_type, input, output, d_outputs, d_inputs);
+}
+
+// Initialize an empty layer object with implicit padding, groups and 
+// dilation. The number of channels and filters must be divisible by the 
+// number of groups.
+int layer_conv2d_init_grouped(struct layer_conv2d *obj, int n_channels, 
+                              int input_height, int input_width, int n_filters, 
+                              int filter_size, int stride, int dilation, int groups,
+                              int padding_x, int padding_y, 
+                              enum padding_type padding_type,
+                              struct matrix *input, struct matrix *output, 
+                              struct matrix *d_outputs, struct matrix *d_inputs) {
+    // If the groups or dilation are invalid, fail.
+    if (dilation < 1) {
+        LAST_ERROR = "Invalid dilation (must be at least 1).";
+        return 0;
+    }
+    if (groups < 1 || n_channels % groups != 0 || n_filters % groups != 0) {
+        LAST_ERROR = "Invalid number of groups (must divide the number of channels and filters).";
+        return 0;
+    }
+
     // Set the input and output sizes.
     obj->n_channels = n_channels;
     obj->input_height = input_height;
     obj->input_width = input_width;
-    obj->output_height = CALC_CONV2D_OUTPUT_DIM(input_height, filter_size, stride);
-    obj->output_width = CALC_CONV2D_OUTPUT_DIM(input_width, filter_size, stride);
+    obj->output_height = CALC_CONV2D_DILATED_OUTPUT_DIM(input_height, filter_size, stride, padding_y, dilation);
+    obj->output_width = CALC_CONV2D_DILATED_OUTPUT_DIM(input_width, filter_size, stride, padding_x, dilation);
 
     // Set the hyperparameter values.
     obj->n_filters = n_filters;
     obj->filter_size = filter_size;
     obj->stride = stride;
+    obj->dilation = dilation;
+    obj->groups = groups;
+    obj->group_channels = n_channels / groups;
+    obj->group_filters = n_filters / groups;
+    obj->padding_x = padding_x;
+    obj->padding_y = padding_y;
+    obj->padding_type = padding_type;
+
+    // If the padding values are invalid, fail. Symmetric and reflection 
+    // padding can only mirror values from inside the input.
+    if (padding_x < 0 || padding_y < 0) {
+        LAST_ERROR = "Invalid padding dimension (must not be negative).";
+        return 0;
+    }
+    if (padding_type != PADDING_ZERO && (padding_x > input_width - 1 || padding_y > input_height - 1)) {
+        LAST_ERROR = "Invalid padding dimension (must be less than input dimension).";
+        return 0;
+    }
+    if (obj->output_height < 1 || obj->output_width < 1) {
+        LAST_ERROR = "Invalid filter size (must not be larger than the padded input).";
+        return 0;
+    }
 
     // Set the matrices and assert that their sizes are correct. 
     obj->input = input;
@@ -61,24 +193,109 @@ int layer_conv2d_init(struct layer_conv2d *obj, int n_channels,
         return 0;
     }
 
-    // Initialize the weights, biases, and gradients.
-    if (!matrix_init(&obj->weights, n_filters * n_channels, filter_size * filter_size)) {
+    // Initialize the weights, biases, and gradients. Each filter only reads 
+    // the channels of its group. The gradients are not needed for inference
+    // only.
+    if (!matrix_init(&obj->weights, n_filters * obj->group_channels, filter_size * filter_size)) {
         return 0;
     }
     if (!matrix_init(&obj->biases, 1, n_filters)) {
         return 0;
     }
-    if (!matrix_init(&obj->d_weights, n_filters * n_channels, filter_size * filter_size)) {
+    obj->d_weights.buffer = NULL;
+    obj->d_biases.buffer = NULL;
+    if (d_outputs->buffer != NULL) {
+        if (!matrix_init(&obj->d_weights, n_filters * obj->group_channels, filter_size * filter_size)) {
+            return 0;
+        }
+        if (!matrix_init(&obj->d_biases, 1, n_filters)) {
+            return 0;
+        }
+    }
+
+    // Initialize the padding index caches.
+    obj->row_index = malloc(obj->output_height * filter_size * sizeof(int));
+    obj->col_index = malloc(obj->output_width * filter_size * sizeof(int));
+    obj->col_start = malloc(filter_size * sizeof(int));
+    obj->col_end = malloc(filter_size * sizeof(int));
+    if (obj->row_index == NULL || obj->col_index == NULL || obj->col_start == NULL || obj->col_end == NULL) {
+        LAST_ERROR = "Failed to allocate padding cache.";
         return 0;
     }
-    if (!matrix_init(&obj->d_biases, 1, n_filters)) {
+    conv2d_calculate_caches(obj);
+
+    // Use the NCHW layout by default.
+    obj->layout = LAYOUT_NCHW;
+    obj->packed_weights.buffer = NULL;
+    obj->packed_d_weights.buffer = NULL;
+    obj->prepacked = false;
+
+    return conv2d_select_kernel(obj);
+}
+
+// Initialize an empty depthwise layer object. Each input channel is 
+// convolved with depth_multiplier filters of its own, so the layer has 
+// n_channels * depth_multiplier filters. This is a conv layer with one group
+// per channel and no dilation.
+int layer_conv2d_init_depthwise(struct layer_conv2d *obj, int n_channels, 
+                                int input_height, int input_width, 
+                                int depth_multiplier, int filter_size, 
+                                int stride, int padding_x, int padding_y, 
+                                enum padding_type padding_type,
+                                struct matrix *input, struct matrix *output, 
+                                struct matrix *d_outputs, 
+                                struct matrix *d_inputs) {
+    if (depth_multiplier < 1) {
+        LAST_ERROR = "Invalid depth multiplier (must be at least 1).";
         return 0;
     }
+    return layer_conv2d_init_grouped(obj, n_channels, input_height, input_width, n_channels * depth_multiplier, filter_size, stride, 1, n_channels, padding_x, padding_y, padding_type, input, output, d_outputs, d_inputs);
+}
+
+// Set the padding type. Recalculates the padding index caches.
+void layer_conv2d_set_padding_type(struct layer_conv2d *obj, enum padding_type padding_type) {
+    obj->padding_type = padding_type;
+    conv2d_calculate_caches(obj);
+}
+
+// Set the activation layout, and select the kernel again. Returns 1 if 
+// successful.
+int layer_conv2d_set_layout(struct layer_conv2d *obj, enum layout_2d layout) {
+    obj->layout = layout;
+    return conv2d_select_kernel(obj);
+}
+
+// Pack the weights from (filter, channel, kernel) to (kernel, channel, 
+// filter), for the NHWC kernels. Depthwise weights have a single channel.
+static void conv2d_pack_weights(struct layer_conv2d *obj) {
+    const int kernel_size = obj->filter_size * obj->filter_size;
+    const int n_filters = obj->n_filters, group_channels = obj->group_channels;
+    double *packed = obj->packed_weights.buffer;
+
+    for (int filter = 0; filter < n_filters; filter++) {
+        for (int channel = 0; channel < group_channels; channel++) {
+            for (int k = 0; k < kernel_size; k++) {
+                packed[(k * group_channels + channel) * n_filters + filter] = obj->weights.buffer[(filter * group_channels + channel) * kernel_size + k];
+            }
+        }
+    }
+}
+
+// Pack the weights once for inference, so the forward pass does not repack 
+// them. Returns 1 if successful.
+int layer_conv2d_prepack(struct layer_conv2d *obj) {
+    if (obj->packed_weights.buffer != NULL) {
+        conv2d_pack_weights(obj);
+        obj->prepacked = true;
+    }
     return 1;
 }
 
 // Initialize the weights and biases.
 int layer_conv2d_init_values(struct layer_conv2d *obj, enum weight_initializer wi_type, enum bias_initializer bi_type) {
+    // New weights invalidate the prepacked weights.
+    obj->prepacked = false;
+
     // Initialize the weights.
     double val;
     switch (wi_type) {
@@ -157,132 +374,609 @@ void layer_conv2d_free(struct layer_conv2d *obj) {
     matrix_free(&obj->biases);
     matrix_free(&obj->d_weights);
     matrix_free(&obj->d_biases);
+    free(obj->row_index);
+    free(obj->col_index);
+    free(obj->col_start);
+    free(obj->col_end);
+    matrix_free(&obj->packed_weights);
+    matrix_free(&obj->packed_d_weights);
 }
 
-// Perform a forward pass on the layer.
-void layer_conv2d_forward(struct layer_conv2d *obj) {
-    int input_sample_size = obj->input_height * obj->input_width * obj->n_channels;
-    int output_sample_size = obj->output_height * obj->output_width * obj->n_filters;
-    int input_channel_size = obj->input_height * obj->input_width;
-    int output_filter_size = obj->output_height * obj->output_width;
-    int filter_size_per_channel = obj->n_channels * obj->filter_size * obj->filter_size;
-    int filter_size = obj->filter_size * obj->filter_size;
+// Convolve an input plane with a filter plane and add the result to an output
+// plane. For each kernel value, the weight is multiplied with a shifted input
+// row and added to the output row. Output columns which read from inside the
+// input are computed directly, while the border columns use the padding index
+// caches.
+static void conv2d_forward_plane(const struct layer_conv2d *obj, 
+                                 const double *input, const double *weights, 
+                                 double *output) {
+    for (int i = 0; i < obj->filter_size; i++) {
+        for (int j = 0; j < obj->filter_size; j++) {
+            const double weight = weights[i * obj->filter_size + j];
+            const int offset = j * obj->dilation - obj->padding_x;
+            const int start = obj->col_start[j], end = obj->col_end[j];
 
-    double sum;
+            for (int out_i = 0; out_i < obj->output_height; out_i++) {
+                const int row = obj->row_index[out_i * obj->filter_size + i];
+                if (row < 0) {
+                    continue;
+                }
+                const double *input_row = &input[row * obj->input_width];
+                double *output_row = &output[out_i * obj->output_width];
 
-    // Iterate over each sample.
-    for (int sample = 0; sample < obj->input->n_rows; sample++) {
-        // Iterate over each filter.
-        for (int filter = 0; filter < obj->n_filters; filter++) {
-            // Iterate over each stride over the height of the sample.
-            for (int stride_height = 0; stride_height < obj->output_height; stride_height++) {
-                // Iterate over each stride over the width of the sample.
-                for (int stride_width = 0; stride_width < obj->output_width; stride_width++) {
-                    // Iterate over each channel.
-                    sum = 0.0;
-                    for (int channel = 0; channel < obj->n_channels; channel++) {
-                        // Perform the convolution operation with the kernel.
-                        for (int i = 0; i < obj->filter_size; i++) {
-                            for (int j = 0; j < obj->filter_size; j++) {
-                                // The input value is (sample, channel, 
-                                // stride_height * stride + i, stride_width * 
-                                // stride + j). The kernel value is (filter, 
-                                // channel, i, j). 
-                                sum += obj->input->buffer[sample * input_sample_size + channel * input_channel_size + (stride_height * obj->stride + i) * obj->input_width + (stride_width * obj->stride + j)] * 
-                                       obj->weights.buffer[filter * filter_size_per_channel + channel * filter_size + i * obj->filter_size + j];
-                            }
-                        }
+                // Output columns inside the input.
+                for (int out_j = start; out_j < end; out_j++) {
+                    output_row[out_j] += weight * input_row[out_j * obj->stride + offset];
+                }
+
+                // Output columns on the borders.
+                for (int out_j = (start == 0) ? end : 0; out_j < obj->output_width; out_j = (out_j + 1 == start) ? end : out_j + 1) {
+                    const int col = obj->col_index[out_j * obj->filter_size + j];
+                    if (col >= 0) {
+                        output_row[out_j] += weight * input_row[col];
                     }
-                    // Set the output value at (sample, filter, stride_height, stride_width).
-                    obj->output->buffer[sample * output_sample_size + filter * output_filter_size + stride_height * obj->output_width + stride_width] = sum + obj->biases.buffer[filter];
                 }
             }
         }
     }
 }
 
-// Perform a backward pass on the layer.
-void layer_conv2d_backward(struct layer_conv2d *obj) {
-    int output_filter_size = obj->d_outputs->n_rows * obj->output_height * obj->output_width;
-    int weight_filter_size = obj->n_channels * obj->filter_size * obj->filter_size;
-    int weight_channel_size = obj->filter_size * obj->filter_size;
-    
-    double sum, one_over_n_rows = 1.0 / (double)obj->d_outputs->n_rows;
-    
-    // Calculate gradients on biases.
-    for (int i = 0; i < obj->n_filters; i++) {
-        sum = 0.0;
+// Backpropagate an output gradient plane through a filter plane. The weight 
+// gradient is the sum of the output gradients multiplied with the shifted 
+// inputs, while the output gradients multiplied with the weight are added to
+// the shifted input gradients.
+static void conv2d_backward_plane(const struct layer_conv2d *obj, 
+                                  const double *input, double *d_inputs, 
+                                  const double *weights, double *d_weights,
+                                  const double *d_outputs) {
+    for (int i = 0; i < obj->filter_size; i++) {
+        for (int j = 0; j < obj->filter_size; j++) {
+            const double weight = weights[i * obj->filter_size + j];
+            const int offset = j * obj->dilation - obj->padding_x;
+            const int start = obj->col_start[j], end = obj->col_end[j];
+            double sum = 0.0;
 
-        // Sum the values for each filter.
-        for (int j = 0; j < output_filter_size; j++) {
-            sum += obj->d_outputs->buffer[i * output_filter_size + j];
+            for (int out_i = 0; out_i < obj->output_height; out_i++) {
+                const int row = obj->row_index[out_i * obj->filter_size + i];
+                if (row < 0) {
+                    continue;
+                }
+                const double *input_row = &input[row * obj->input_width];
+                double *d_inputs_row = &d_inputs[row * obj->input_width];
+                const double *d_outputs_row = &d_outputs[out_i * obj->output_width];
+
+                // Output columns inside the input.
+                for (int out_j = start; out_j < end; out_j++) {
+                    sum += d_outputs_row[out_j] * input_row[out_j * obj->stride + offset];
+                    d_inputs_row[out_j * obj->stride + offset] += weight * d_outputs_row[out_j];
+                }
+
+                // Output columns on the borders.
+                for (int out_j = (start == 0) ? end : 0; out_j < obj->output_width; out_j = (out_j + 1 == start) ? end : out_j + 1) {
+                    const int col = obj->col_index[out_j * obj->filter_size + j];
+                    if (col >= 0) {
+                        sum += d_outputs_row[out_j] * input_row[col];
+                        d_inputs_row[col] += weight * d_outputs_row[out_j];
+                    }
+                }
+            }
+            d_weights[i * obj->filter_size + j] += sum;
         }
-        obj->d_biases.buffer[i] = sum * one_over_n_rows;
     }
+}
 
-    // Zero the gradients.
+// Zero the weight, bias and input gradients.
+static void conv2d_zero_gradients(struct layer_conv2d *obj) {
     for (int i = 0; i < obj->d_weights.size; i++) {
         obj->d_weights.buffer[i] = 0.0;
     }
+    for (int i = 0; i < obj->d_biases.size; i++) {
+        obj->d_biases.buffer[i] = 0.0;
+    }
     for (int i = 0; i < obj->d_inputs->size; i++) {
         obj->d_inputs->buffer[i] = 0.0;
     }
+}
+
+// Perform a forward pass with the generic NCHW kernel. Each output plane is 
+// the sum of each input plane in the filter's group convolved with the 
+// filter's plane for that channel.
+static void layer_conv2d_forward_generic(struct layer_conv2d *obj) {
+    const int input_channel_size = obj->input_height * obj->input_width;
+    const int output_filter_size = obj->output_height * obj->output_width;
+    const int input_sample_size = obj->n_channels * input_channel_size;
+    const int output_sample_size = obj->n_filters * output_filter_size;
+    const int kernel_size = obj->filter_size * obj->filter_size;
 
-    // Calculate gradients on weights.
+    // Iterate over each sample.
     for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        // Iterate over each filter.
         for (int filter = 0; filter < obj->n_filters; filter++) {
+            double *output = &obj->output->buffer[sample * output_sample_size + filter * output_filter_size];
+
+            // Initialize the outputs with the bias.
+            for (int i = 0; i < output_filter_size; i++) {
+                output[i] = obj->biases.buffer[filter];
+            }
+
+            // Iterate over each channel in the filter's group.
+            const int first_channel = filter / obj->group_filters * obj->group_channels;
+            for (int channel = 0; channel < obj->group_channels; channel++) {
+                conv2d_forward_plane(obj, &obj->input->buffer[sample * input_sample_size + (first_channel + channel) * input_channel_size],
+                                     &obj->weights.buffer[(filter * obj->group_channels + channel) * kernel_size], output);
+            }
+        }
+    }
+}
+
+// Perform a backward pass with the generic NCHW kernel.
+static void layer_conv2d_backward_generic(struct layer_conv2d *obj) {
+    const int input_channel_size = obj->input_height * obj->input_width;
+    const int output_filter_size = obj->output_height * obj->output_width;
+    const int input_sample_size = obj->n_channels * input_channel_size;
+    const int output_sample_size = obj->n_filters * output_filter_size;
+    const int kernel_size = obj->filter_size * obj->filter_size;
+
+    conv2d_zero_gradients(obj);
+
+    // Iterate over each sample.
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        // Iterate over each filter.
+        for (int filter = 0; filter < obj->n_filters; filter++) {
+            const double *d_outputs = &obj->d_outputs->buffer[sample * output_sample_size + filter * output_filter_size];
+
+            // Calculate the gradient on the bias.
+            double sum = 0.0;
+            for (int i = 0; i < output_filter_size; i++) {
+                sum += d_outputs[i];
+            }
+            obj->d_biases.buffer[filter] += sum;
+
+            // Iterate over each channel in the filter's group.
+            const int first_channel = filter / obj->group_filters * obj->group_channels;
+            for (int channel = 0; channel < obj->group_channels; channel++) {
+                const int offset = sample * input_sample_size + (first_channel + channel) * input_channel_size;
+                const int weight_offset = (filter * obj->group_channels + channel) * kernel_size;
+                conv2d_backward_plane(obj, &obj->input->buffer[offset], &obj->d_inputs->buffer[offset],
+                                      &obj->weights.buffer[weight_offset], &obj->d_weights.buffer[weight_offset], d_outputs);
+            }
+        }
+    }
+}
+
+// Perform a forward pass with the depthwise NCHW kernel. Each output plane 
+// is a single input plane convolved with the filter.
+static void layer_conv2d_forward_depthwise(struct layer_conv2d *obj) {
+    const int input_channel_size = obj->input_height * obj->input_width;
+    const int output_filter_size = obj->output_height * obj->output_width;
+    const int input_sample_size = obj->n_channels * input_channel_size;
+    const int output_sample_size = obj->n_filters * output_filter_size;
+    const int kernel_size = obj->filter_size * obj->filter_size;
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        for (int filter = 0; filter < obj->n_filters; filter++) {
+            const int channel = filter / obj->group_filters;
+            double *output = &obj->output->buffer[sample * output_sample_size + filter * output_filter_size];
+
+            // Initialize the outputs with the bias.
+            for (int i = 0; i < output_filter_size; i++) {
+                output[i] = obj->biases.buffer[filter];
+            }
+
+            conv2d_forward_plane(obj, &obj->input->buffer[sample * input_sample_size + channel * input_channel_size],
+                                 &obj->weights.buffer[filter * kernel_size], output);
+        }
+    }
+}
+
+// Perform a backward pass with the depthwise NCHW kernel.
+static void layer_conv2d_backward_depthwise(struct layer_conv2d *obj) {
+    const int input_channel_size = obj->input_height * obj->input_width;
+    const int output_filter_size = obj->output_height * obj->output_width;
+    const int input_sample_size = obj->n_channels * input_channel_size;
+    const int output_sample_size = obj->n_filters * output_filter_size;
+    const int kernel_size = obj->filter_size * obj->filter_size;
+
+    conv2d_zero_gradients(obj);
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        for (int filter = 0; filter < obj->n_filters; filter++) {
+            const int channel = filter / obj->group_filters;
+            const double *d_outputs = &obj->d_outputs->buffer[sample * output_sample_size + filter * output_filter_size];
+
+            // Calculate the gradient on the bias.
+            double sum = 0.0;
+            for (int i = 0; i < output_filter_size; i++) {
+                sum += d_outputs[i];
+            }
+            obj->d_biases.buffer[filter] += sum;
+
+            const int offset = sample * input_sample_size + channel * input_channel_size;
+            conv2d_backward_plane(obj, &obj->input->buffer[offset], &obj->d_inputs->buffer[offset],
+                                  &obj->weights.buffer[filter * kernel_size], &obj->d_weights.buffer[filter * kernel_size], d_outputs);
+        }
+    }
+}
+
+// Perform a forward pass with the pointwise NCHW kernel. For each sample, 
+// the output is the matrix product of the (n_filters, n_channels) weights and
+// the (n_channels, height * width) input, so each step adds a scaled input 
+// plane to an output plane.
+static void layer_conv2d_forward_pointwise(struct layer_conv2d *obj) {
+    const int plane_size = obj->input_height * obj->input_width;
+    const int input_sample_size = obj->n_channels * plane_size;
+    const int output_sample_size = obj->n_filters * plane_size;
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *input = &obj->input->buffer[sample * input_sample_size];
+        for (int filter = 0; filter < obj->n_filters; filter++) {
+            double *output = &obj->output->buffer[sample * output_sample_size + filter * plane_size];
+            const double *weights = &obj->weights.buffer[filter * obj->n_channels];
+
+            // Initialize the outputs with the bias.
+            for (int i = 0; i < plane_size; i++) {
+                output[i] = obj->biases.buffer[filter];
+            }
+
             for (int channel = 0; channel < obj->n_channels; channel++) {
+                const double weight = weights[channel];
+                const double *in = &input[channel * plane_size];
+                for (int i = 0; i < plane_size; i++) {
+                    output[i] += weight * in[i];
+                }
+            }
+        }
+    }
+}
+
+// Perform a backward pass with the pointwise NCHW kernel.
+static void layer_conv2d_backward_pointwise(struct layer_conv2d *obj) {
+    const int plane_size = obj->input_height * obj->input_width;
+    const int input_sample_size = obj->n_channels * plane_size;
+    const int output_sample_size = obj->n_filters * plane_size;
+
+    conv2d_zero_gradients(obj);
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *input = &obj->input->buffer[sample * input_sample_size];
+        double *d_inputs = &obj->d_inputs->buffer[sample * input_sample_size];
+        for (int filter = 0; filter < obj->n_filters; filter++) {
+            const double *d_outputs = &obj->d_outputs->buffer[sample * output_sample_size + filter * plane_size];
+            const double *weights = &obj->weights.buffer[filter * obj->n_channels];
+            double *d_weights = &obj->d_weights.buffer[filter * obj->n_channels];
+
+            // Calculate the gradient on the bias.
+            double sum = 0.0;
+            for (int i = 0; i < plane_size; i++) {
+                sum += d_outputs[i];
+            }
+            obj->d_biases.buffer[filter] += sum;
+
+            for (int channel = 0; channel < obj->n_channels; channel++) {
+                const double weight = weights[channel];
+                const double *in = &input[channel * plane_size];
+                double *d_in = &d_inputs[channel * plane_size];
+                sum = 0.0;
+                for (int i = 0; i < plane_size; i++) {
+                    sum += d_outputs[i] * in[i];
+                    d_in[i] += weight * d_outputs[i];
+                }
+                d_weights[channel] += sum;
+            }
+        }
+    }
+}
+
+// Perform a forward pass with the NHWC layout. For each output pixel, kernel
+// value and group, the input pixel's channel vector for the group is 
+// multiplied with the packed weights and added to the output pixel's filter
+// vector for the group.
+static void layer_conv2d_forward_nhwc(struct layer_conv2d *obj) {
+    const int n_channels = obj->n_channels, n_filters = obj->n_filters;
+    const int group_channels = obj->group_channels, group_filters = obj->group_filters;
+    const int input_sample_size = n_channels * obj->input_height * obj->input_width;
+    const int output_sample_size = n_filters * obj->output_height * obj->output_width;
+    const double *packed = obj->packed_weights.buffer;
+
+    // Pack the weights, unless they were packed for inference.
+    if (!obj->prepacked) {
+        conv2d_pack_weights(obj);
+    }
+
+    // Iterate over each sample.
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *input = &obj->input->buffer[sample * input_sample_size];
+        double *output = &obj->output->buffer[sample * output_sample_size];
+
+        // Iterate over each output pixel.
+        for (int out_i = 0; out_i < obj->output_height; out_i++) {
+            for (int out_j = 0; out_j < obj->output_width; out_j++) {
+                double *out = &output[(out_i * obj->output_width + out_j) * n_filters];
+
+                // Initialize the outputs with the bias.
+                for (int filter = 0; filter < n_filters; filter++) {
+                    out[filter] = obj->biases.buffer[filter];
+                }
+
                 for (int i = 0; i < obj->filter_size; i++) {
+                    const int row = obj->row_index[out_i * obj->filter_size + i];
+                    if (row < 0) {
+                        continue;
+                    }
                     for (int j = 0; j < obj->filter_size; j++) {
-                        sum = 0.0;
-                        for (int stride_height = 0; stride_height < obj->output_height; stride_height++) {
-                            for (int stride_width = 0; stride_width < obj->output_width; stride_width++) {
-                                // Multiply the input value (sample, channel, 
-                                // stride_height * stride + i, stride_width * 
-                                // stride + j) with gradient value (sample, filter, i, j).
-                                sum += obj->input->buffer[sample * (obj->n_channels * obj->input_height * obj->input_width) + channel * obj->input_height * obj->input_width + (stride_height * obj->stride + i) * obj->input_width + (stride_width * obj->stride + j)] * 
-                                       obj->d_outputs->buffer[sample * (obj->n_filters * obj->output_height * obj->output_height) + filter * obj->output_height * obj->output_height + stride_height * obj->output_height + stride_width];
+                        const int col = obj->col_index[out_j * obj->filter_size + j];
+                        if (col < 0) {
+                            continue;
+                        }
+                        const double *in = &input[(row * obj->input_width + col) * n_channels];
+                        const double *w = &packed[(i * obj->filter_size + j) * group_channels * n_filters];
+                        for (int group = 0; group < obj->groups; group++) {
+                            double *out_group = &out[group * group_filters];
+                            for (int channel = 0; channel < group_channels; channel++) {
+                                const double value = in[group * group_channels + channel];
+                                const double *w_row = &w[channel * n_filters + group * group_filters];
+                                for (int filter = 0; filter < group_filters; filter++) {
+                                    out_group[filter] += value * w_row[filter];
+                                }
                             }
                         }
-                        obj->d_weights.buffer[filter * weight_filter_size + channel * weight_channel_size + i * obj->filter_size + j] += sum;
                     }
                 }
             }
         }
     }
+}
 
-    // Normalize weight gradients over all samples.
-    for (int i = 0; i < obj->d_weights.size; i++) {
-        obj->d_weights.buffer[i] *= one_over_n_rows;
+// Perform a backward pass with the NHWC layout. Uses the packed weights from
+// the forward pass.
+static void layer_conv2d_backward_nhwc(struct layer_conv2d *obj) {
+    const int kernel_size = obj->filter_size * obj->filter_size;
+    const int n_channels = obj->n_channels, n_filters = obj->n_filters;
+    const int group_channels = obj->group_channels, group_filters = obj->group_filters;
+    const int input_sample_size = n_channels * obj->input_height * obj->input_width;
+    const int output_sample_size = n_filters * obj->output_height * obj->output_width;
+    const double *packed = obj->packed_weights.buffer;
+    double *packed_d = obj->packed_d_weights.buffer;
+
+    // Zero the gradients.
+    for (int i = 0; i < obj->packed_d_weights.size; i++) {
+        packed_d[i] = 0.0;
+    }
+    for (int i = 0; i < obj->d_biases.size; i++) {
+        obj->d_biases.buffer[i] = 0.0;
+    }
+    for (int i = 0; i < obj->d_inputs->size; i++) {
+        obj->d_inputs->buffer[i] = 0.0;
+    }
+
+    // Iterate over each sample.
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *input = &obj->input->buffer[sample * input_sample_size];
+        double *d_inputs = &obj->d_inputs->buffer[sample * input_sample_size];
+        const double *d_outputs = &obj->d_outputs->buffer[sample * output_sample_size];
+
+        // Iterate over each output pixel.
+        for (int out_i = 0; out_i < obj->output_height; out_i++) {
+            for (int out_j = 0; out_j < obj->output_width; out_j++) {
+                const double *d_out = &d_outputs[(out_i * obj->output_width + out_j) * n_filters];
+
+                // Calculate the gradient on the bias.
+                for (int filter = 0; filter < n_filters; filter++) {
+                    obj->d_biases.buffer[filter] += d_out[filter];
+                }
+
+                for (int i = 0; i < obj->filter_size; i++) {
+                    const int row = obj->row_index[out_i * obj->filter_size + i];
+                    if (row < 0) {
+                        continue;
+                    }
+                    for (int j = 0; j < obj->filter_size; j++) {
+                        const int col = obj->col_index[out_j * obj->filter_size + j];
+                        if (col < 0) {
+                            continue;
+                        }
+                        const double *in = &input[(row * obj->input_width + col) * n_channels];
+                        double *d_in = &d_inputs[(row * obj->input_width + col) * n_channels];
+                        const double *w = &packed[(i * obj->filter_size + j) * group_channels * n_filters];
+                        double *d_w = &packed_d[(i * obj->filter_size + j) * group_channels * n_filters];
+                        for (int group = 0; group < obj->groups; group++) {
+                            const double *d_out_group = &d_out[group * group_filters];
+                            for (int channel = 0; channel < group_channels; channel++) {
+                                const double value = in[group * group_channels + channel];
+                                const double *w_row = &w[channel * n_filters + group * group_filters];
+                                double *d_w_row = &d_w[channel * n_filters + group * group_filters];
+                                double sum = 0.0;
+                                for (int filter = 0; filter < group_filters; filter++) {
+                                    d_w_row[filter] += value * d_out_group[filter];
+                                    sum += w_row[filter] * d_out_group[filter];
+                                }
+                                d_in[group * group_channels + channel] += sum;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Unpack the weight gradients.
+    for (int filter = 0; filter < n_filters; filter++) {
+        for (int channel = 0; channel < group_channels; channel++) {
+            for (int k = 0; k < kernel_size; k++) {
+                obj->d_weights.buffer[(filter * group_channels + channel) * kernel_size + k] = packed_d[(k * group_channels + channel) * n_filters + filter];
+            }
+        }
+    }
+}
+
+// Perform a forward pass with the depthwise NHWC kernel. The weights are 
+// packed into (filter_size * filter_size, n_filters), so each kernel value 
+// scales a whole input channel vector.
+static void layer_conv2d_forward_depthwise_nhwc(struct layer_conv2d *obj) {
+    const int n_channels = obj->n_channels, n_filters = obj->n_filters;
+    const int multiplier = obj->group_filters;
+    const int input_sample_size = n_channels * obj->input_height * obj->input_width;
+    const int output_sample_size = n_filters * obj->output_height * obj->output_width;
+    const double *packed = obj->packed_weights.buffer;
+
+    // Pack the weights from (filter, kernel) to (kernel, filter), unless they
+    // were packed for inference.
+    if (!obj->prepacked) {
+        conv2d_pack_weights(obj);
     }
 
-    // Calculate gradients on inputs.
     for (int sample = 0; sample < obj->input->n_rows; sample++) {
-        for (int stride_height = 0; stride_height < obj->output_height; stride_height++) {
-            for (int stride_width = 0; stride_width < obj->output_width; stride_width++) {
-                for (int kern_i = 0; kern_i < obj->filter_size; kern_i++) {
-                    for (int kern_j = 0; kern_j < obj->filter_size; kern_j++) {
-                        for (int channel = 0; channel < obj->n_channels; channel++) {
-                            sum = 0.0;
-                            for (int filter = 0; filter < obj->n_filters; filter++) {
-                            
-                                // Multiply the weight value (filter, channel, kern_i, kern_j)
-                                // with gradient value (sample, filter, stride_height,
-                                // stride_width).
-                                sum += obj->weights.buffer[filter * (obj->n_channels * obj->filter_size * obj->filter_size) + channel * (obj->filter_size * obj->filter_size) + kern_i * obj->filter_size + kern_j] * 
-                                       obj->d_outputs->buffer[sample * (obj->n_filters * obj->output_height * obj->output_width) + filter * (obj->output_height * obj->output_width) + stride_height * obj->output_width + stride_width];
+        const double *input = &obj->input->buffer[sample * input_sample_size];
+        double *output = &obj->output->buffer[sample * output_sample_size];
+        for (int out_i = 0; out_i < obj->output_height; out_i++) {
+            for (int out_j = 0; out_j < obj->output_width; out_j++) {
+                double *out = &output[(out_i * obj->output_width + out_j) * n_filters];
+
+                // Initialize the outputs with the bias.
+                for (int filter = 0; filter < n_filters; filter++) {
+                    out[filter] = obj->biases.buffer[filter];
+                }
+
+                for (int i = 0; i < obj->filter_size; i++) {
+                    const int row = obj->row_index[out_i * obj->filter_size + i];
+                    if (row < 0) {
+                        continue;
+                    }
+                    for (int j = 0; j < obj->filter_size; j++) {
+                        const int col = obj->col_index[out_j * obj->filter_size + j];
+                        if (col < 0) {
+                            continue;
+                        }
+                        const double *in = &input[(row * obj->input_width + col) * n_channels];
+                        const double *w = &packed[(i * obj->filter_size + j) * n_filters];
+                        if (multiplier == 1) {
+                            for (int channel = 0; channel < n_channels; channel++) {
+                                out[channel] += in[channel] * w[channel];
+                            }
+                        } else {
+                            for (int filter = 0; filter < n_filters; filter++) {
+                                out[filter] += in[filter / multiplier] * w[filter];
                             }
-                            // Add the gradient value to (sample, channel, stride_height * filter_size + i, stride_width * filter_size + j)
-                            obj->d_inputs->buffer[sample * (obj->n_channels * obj->input_height * obj->input_width) + channel * (obj->output_height * obj->output_width) + (stride_height * obj->filter_size + kern_i) * obj->output_width + (stride_width * obj->filter_size + kern_j)] += sum;
                         }
                     }
                 }
             }
         }
     }
+}
+
+// Perform a backward pass with the depthwise NHWC kernel. Uses the packed 
+// weights from the forward pass.
+static void layer_conv2d_backward_depthwise_nhwc(struct layer_conv2d *obj) {
+    const int kernel_size = obj->filter_size * obj->filter_size;
+    const int n_channels = obj->n_channels, n_filters = obj->n_filters;
+    const int multiplier = obj->group_filters;
+    const int input_sample_size = n_channels * obj->input_height * obj->input_width;
+    const int output_sample_size = n_filters * obj->output_height * obj->output_width;
+    const double *packed = obj->packed_weights.buffer;
+    double *packed_d = obj->packed_d_weights.buffer;
 
-    // Normalize input gradients over all samples.
+    // Zero the gradients.
+    for (int i = 0; i < obj->packed_d_weights.size; i++) {
+        packed_d[i] = 0.0;
+    }
+    for (int i = 0; i < obj->d_biases.size; i++) {
+        obj->d_biases.buffer[i] = 0.0;
+    }
     for (int i = 0; i < obj->d_inputs->size; i++) {
-        obj->d_inputs->buffer[i] *= one_over_n_rows;
+        obj->d_inputs->buffer[i] = 0.0;
     }
-}
\ No newline at end of file
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *input = &obj->input->buffer[sample * input_sample_size];
+        double *d_inputs = &obj->d_inputs->buffer[sample * input_sample_size];
+        const double *d_outputs = &obj->d_outputs->buffer[sample * output_sample_size];
+        for (int out_i = 0; out_i < obj->output_height; out_i++) {
+            for (int out_j = 0; out_j < obj->output_width; out_j++) {
+                const double *d_out = &d_outputs[(out_i * obj->output_width + out_j) * n_filters];
+
+                // Calculate the gradient on the bias.
+                for (int filter = 0; filter < n_filters; filter++) {
+                    obj->d_biases.buffer[filter] += d_out[filter];
+                }
+
+                for (int i = 0; i < obj->filter_size; i++) {
+                    const int row = obj->row_index[out_i * obj->filter_size + i];
+                    if (row < 0) {
+                        continue;
+                    }
+                    for (int j = 0; j < obj->filter_size; j++) {
+                        const int col = obj->col_index[out_j * obj->filter_size + j];
+                        if (col < 0) {
+                            continue;
+                        }
+                        const double *in = &input[(row * obj->input_width + col) * n_channels];
+                        double *d_in = &d_inputs[(row * obj->input_width + col) * n_channels];
+                        const double *w = &packed[(i * obj->filter_size + j) * n_filters];
+                        double *d_w = &packed_d[(i * obj->filter_size + j) * n_filters];
+                        if (multiplier == 1) {
+                            for (int channel = 0; channel < n_channels; channel++) {
+                                d_w[channel] += in[channel] * d_out[channel];
+                                d_in[channel] += w[channel] * d_out[channel];
+                            }
+                        } else {
+                            for (int filter = 0; filter < n_filters; filter++) {
+                                d_w[filter] += in[filter / multiplier] * d_out[filter];
+                                d_in[filter / multiplier] += w[filter] * d_out[filter];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Unpack the weight gradients.
+    for (int filter = 0; filter < n_filters; filter++) {
+        for (int k = 0; k < kernel_size; k++) {
+            obj->d_weights.buffer[filter * kernel_size + k] = packed_d[k * n_filters + filter];
+        }
+    }
+}
+
+// Perform a forward pass on the layer.
+void layer_conv2d_forward(struct layer_conv2d *obj) {
+    switch (obj->kernel) {
+    case CONV2D_KERNEL_POINTWISE:
+        layer_conv2d_forward_pointwise(obj);
+        break;
+    case CONV2D_KERNEL_DEPTHWISE:
+        layer_conv2d_forward_depthwise(obj);
+        break;
+    case CONV2D_KERNEL_NHWC:
+        layer_conv2d_forward_nhwc(obj);
+        break;
+    case CONV2D_KERNEL_DEPTHWISE_NHWC:
+        layer_conv2d_forward_depthwise_nhwc(obj);
+        break;
+    default:
+        layer_conv2d_forward_generic(obj);
+        break;
+    }
+}
+
+// Perform a backward pass on the layer.
+void layer_conv2d_backward(struct layer_conv2d *obj) {
+    switch (obj->kernel) {
+    case CONV2D_KERNEL_POINTWISE:
+        layer_conv2d_backward_pointwise(obj);
+        break;
+    case CONV2D_KERNEL_DEPTHWISE:
+        layer_conv2d_backward_depthwise(obj);
+        break;
+    case CONV2D_KERNEL_NHWC:
+        layer_conv2d_backward_nhwc(obj);
+        break;
+    case CONV2D_KERNEL_DEPTHWISE_NHWC:
+        layer_conv2d_backward_depthwise_nhwc(obj);
+        break;
+    default:
+        layer_conv2d_backward_generic(obj);
+        break;
+    }
+}
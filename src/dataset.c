@@ -6,6 +6,7 @@
 
 #include "dataset.h"
 #include "matrix.h"
+#include "random.h"
 
 // Shuffle a dataset. Shuffles assuming the dimensions of each matrix are
 // (n_samples, size).
@@ -20,27 +21,29 @@ int dataset_shuffle(struct matrix *X, struct matrix *Y) {
     const size_t size_y = sizeof(double) * Y->n_cols;
 
     // Allocate the temporary buffers.
-    char *tmp_x = (char*)malloc(size_x);
-    char *tmp_y = (char*)malloc(size_y);
-    const size_t stride_x = size_x * sizeof(char);
-    const size_t stride_y = size_y * sizeof(char);
+    double *tmp_x = (double*)malloc(size_x);
+    double *tmp_y = (double*)malloc(size_y);
+    if (tmp_x == NULL || tmp_y == NULL) {
+        free(tmp_x);
+        free(tmp_y);
+        LAST_ERROR = "Failed to allocate the shuffle buffers.";
+        return 0;
+    }
 
     const int n = X->n_rows;
 
-    if (n > 1) {
-        size_t i;
-        for (i = 0; i < (size_t)(n - 1); ++i) {
-            size_t rnd = (size_t) rand();
-            size_t j = i + rnd / (RAND_MAX / (n - i) + 1);
+    // Draw from the saved RNG, so a run resumed from a training checkpoint
+    // shuffles the same way.
+    for (int i = 0; i < n - 1; i++) {
+        int j = i + (int)random_uniform(0.0, (double)(n - i));
 
-            memcpy(tmp_x, X + j * stride_x, size_x);
-            memcpy(X + j * stride_x, X + i * stride_x, size_x);
-            memcpy(X + i * stride_x, tmp_x, size_x);
+        memcpy(tmp_x, &X->buffer[j * X->n_cols], size_x);
+        memcpy(&X->buffer[j * X->n_cols], &X->buffer[i * X->n_cols], size_x);
+        memcpy(&X->buffer[i * X->n_cols], tmp_x, size_x);
 
-            memcpy(tmp_y, Y + j * stride_y, size_y);
-            memcpy(Y + j * stride_y, Y + i * stride_y, size_y);
-            memcpy(Y + i * stride_y, tmp_y, size_y);
-        }
+        memcpy(tmp_y, &Y->buffer[j * Y->n_cols], size_y);
+        memcpy(&Y->buffer[j * Y->n_cols], &Y->buffer[i * Y->n_cols], size_y);
+        memcpy(&Y->buffer[i * Y->n_cols], tmp_y, size_y);
     }
 
     // Free the temporary buffers.
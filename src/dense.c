@@ -2,6 +2,7 @@
 // Dense layer.
 
 #include <math.h>
+#include <stdlib.h>
 
 #include "dense.h"
 #include "matrix.h"
@@ -51,13 +52,19 @@ int layer_dense_init(struct layer_dense *obj, int input_size,
         return 0;
     }
 
-    // Initialize the weights, biases, and gradients.
+    // Initialize the weights, biases, and gradients. The gradients are not
+    // needed for inference only.
     if (!matrix_init(&obj->weights, input_size, output_size)) {
         return 0;
     }
     if (!matrix_init(&obj->biases, 1, output_size)) {
         return 0;
     }
+    obj->d_weights.buffer = NULL;
+    obj->d_biases.buffer = NULL;
+    if (d_outputs->buffer == NULL) {
+        return 1;
+    }
     if (!matrix_init(&obj->d_weights, input_size, output_size)) {
         return 0;
     }
@@ -157,27 +164,82 @@ void layer_dense_free(struct layer_dense *obj) {
     matrix_free(&obj->d_biases);
 }
 
+// Calculate x*W + b for a single sample. The outputs are split into chunks of
+// columns, each accumulated over the rows of the weights, which are read
+// contiguously. Large layers process the chunks in parallel.
+static void dense_gemv(struct layer_dense *obj, const double *x, double *y) {
+    const int input_size = obj->input_size;
+    const int output_size = obj->output_size;
+    const double *weights = obj->weights.buffer;
+    const double *biases = obj->biases.buffer;
+    const int n_chunks = (output_size + DENSE_GEMV_COLUMNS - 1) / DENSE_GEMV_COLUMNS;
+
+#ifdef _OPENMP
+    #pragma omp parallel for if (input_size * output_size >= DENSE_PARALLEL_SIZE) schedule(static)
+#endif
+    for (int c = 0; c < n_chunks; c++) {
+        const int start = c * DENSE_GEMV_COLUMNS;
+        const int end = start + DENSE_GEMV_COLUMNS < output_size ? start + DENSE_GEMV_COLUMNS : output_size;
+        for (int j = start; j < end; j++) {
+            y[j] = 0.0;
+        }
+        for (int k = 0; k < input_size; k++) {
+            const double *w = &weights[k * output_size];
+            const double a = x[k];
+            for (int j = start; j < end; j++) {
+                y[j] += a * w[j];
+            }
+        }
+        for (int j = start; j < end; j++) {
+            y[j] += biases[j];
+        }
+    }
+}
+
 // Perform a forward pass on the layer.
 void layer_dense_forward(struct layer_dense *obj) {
-    // Calculate W*x + b.
+    // Calculate X*W + b. The weights are read by rows, and each row is 
+    // applied to a block of four samples at once, so a batch reads the weights 
+    // once per block instead of once per sample. A batch of one, and the 
+    // samples after the last block, use the single sample kernel. The sums 
+    // over the inputs are in the same order for every sample, so a sample's 
+    // output does not depend on its batch.
     int n_samples = obj->input->n_rows;
     int input_size = obj->input_size;
     int output_size = obj->output_size;
-    double sum;
+    const double *weights = obj->weights.buffer;
+    const double *biases = obj->biases.buffer;
 
-    // Iterate over each sample.
-    for (int i = 0; i < n_samples; i++) {
-        // Iterate over each output value.
-        for (int j = 0; j < output_size; j++) {
-            // Calculate the output value.
-            sum = 0.0;
-
-            // Calculate the dot product of the inputs and weights, and add the biases.
-            for (int k = 0; k < input_size; k++) {
-                sum += obj->input->buffer[i * input_size + k] * obj->weights.buffer[k * output_size + j];
+    int i = 0;
+    for (; i + 4 <= n_samples; i += 4) {
+        const double *x0 = &obj->input->buffer[i * input_size];
+        const double *x1 = x0 + input_size, *x2 = x1 + input_size, *x3 = x2 + input_size;
+        double *y0 = &obj->output->buffer[i * output_size];
+        double *y1 = y0 + output_size, *y2 = y1 + output_size, *y3 = y2 + output_size;
+        for (int j = 0; j < 4 * output_size; j++) {
+            y0[j] = 0.0;
+        }
+        for (int k = 0; k < input_size; k++) {
+            const double *w = &weights[k * output_size];
+            const double a0 = x0[k], a1 = x1[k], a2 = x2[k], a3 = x3[k];
+            for (int j = 0; j < output_size; j++) {
+                y0[j] += a0 * w[j];
+                y1[j] += a1 * w[j];
+                y2[j] += a2 * w[j];
+                y3[j] += a3 * w[j];
             }
-            obj->output->buffer[i * output_size + j] = sum + obj->biases.buffer[j];
         }
+        for (int j = 0; j < output_size; j++) {
+            y0[j] += biases[j];
+            y1[j] += biases[j];
+            y2[j] += biases[j];
+            y3[j] += biases[j];
+        }
+    }
+
+    // The remaining samples, or a single sample.
+    for (; i < n_samples; i++) {
+        dense_gemv(obj, &obj->input->buffer[i * input_size], &obj->output->buffer[i * output_size]);
     }
 }
 
@@ -1,6 +1,9 @@
 // dropout.c
 // Dropout layer.
 
+#include <stdbool.h>
+#include <stdlib.h>
+
 #include "dropout.h"
 #include "matrix.h"
 
@@ -51,7 +54,11 @@ int layer_dropout_init(struct layer_dropout *obj, int input_size,
     // Set the rate.
     obj->rate = 1.0 - rate;
 
-    // Initialize the .
+    // Initialize the mask, which is not needed for inference only.
+    obj->mask.buffer = NULL;
+    if (d_outputs->buffer == NULL) {
+        return 1;
+    }
     if (!matrix_init(&obj->mask, input->n_rows, input->n_cols)) {
         return 0;
     }
@@ -63,6 +70,16 @@ void layer_dropout_set_rate(struct layer_dropout *obj, double rate) {
     obj->rate = 1.0 - rate;
 }
 
+// Reallocate the mask for the current number of rows of the input matrix. 
+// Layers for inference only have no mask.
+int layer_dropout_resize(struct layer_dropout *obj) {
+    if (obj->mask.buffer == NULL) {
+        return 1;
+    }
+    matrix_free(&obj->mask);
+    return matrix_init(&obj->mask, obj->input->n_rows, obj->input->n_cols);
+}
+
 // Free the matrices owned by the layer.
 void layer_dropout_free(struct layer_dropout *obj) {
     matrix_free(&obj->mask);
@@ -70,29 +87,50 @@ void layer_dropout_free(struct layer_dropout *obj) {
 
 // Perform a forward pass on the layer.
 void layer_dropout_forward(struct layer_dropout *obj) {
-    // Generate the mask and calculate the output.
-    for (int i = 0; i < obj->mask.size; i++) {
+    // Generate the mask and calculate the output. For inference only, the
+    // mask is not stored.
+    const bool store_mask = obj->mask.buffer != NULL;
+    for (int i = 0; i < obj->output->size; i++) {
         if (random_uniform(0.0, 1.0) < obj->rate) {
-            obj->mask.buffer[i] = 1.0;
+            if (store_mask) {
+                obj->mask.buffer[i] = 1.0;
+            }
             obj->output->buffer[i] = obj->input->buffer[i];
         } else {
-            obj->mask.buffer[i] = 0.0;
+            if (store_mask) {
+                obj->mask.buffer[i] = 0.0;
+            }
             obj->output->buffer[i] = 0.0;
         }
     }
 }
 
-// Perform a forward pass on the layer, without applying dropout.
+// Perform a forward pass on the layer, without applying dropout. In place,
+// the output is already the input. For inference only, there is no mask.
 void layer_dropout_forward_predict(struct layer_dropout *obj) {
-    for (int i = 0; i < obj->mask.size; i++) {
-        obj->mask.buffer[i] = 1.0;
-        obj->output->buffer[i] = obj->input->buffer[i];
+    if (obj->mask.buffer != NULL) {
+        for (int i = 0; i < obj->output->size; i++) {
+            obj->mask.buffer[i] = 1.0;
+        }
+    }
+    if (obj->output->buffer != obj->input->buffer) {
+        for (int i = 0; i < obj->output->size; i++) {
+            obj->output->buffer[i] = obj->input->buffer[i];
+        }
+    }
+}
+
+// Perform a forward pass on the layer with the mask from the last forward 
+// pass.
+void layer_dropout_forward_replay(struct layer_dropout *obj) {
+    for (int i = 0; i < obj->output->size; i++) {
+        obj->output->buffer[i] = obj->input->buffer[i] * obj->mask.buffer[i];
     }
 }
 
 // Perform a backward pass on the layer.
 void layer_dropout_backward(struct layer_dropout *obj) {
-    for (int i = 0; i < obj->mask.size; i++) {
+    for (int i = 0; i < obj->d_inputs->size; i++) {
         obj->d_inputs->buffer[i] = obj->d_outputs->buffer[i] * obj->mask.buffer[i];
     }
 }
\ No newline at end of file
@@ -5,7 +5,7 @@
 
 #include "errors.h"
 
-char *LAST_ERROR;
+TOM_THREAD_LOCAL char *LAST_ERROR;
 
 // Print the last error to stdout.
 void print_last_error(void) {
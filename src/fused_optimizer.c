@@ -0,0 +1,197 @@
+// fused_optimizer.c
+// Fused multi-tensor optimizer.
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "fused_optimizer.h"
+#include "matrix.h"
+#include "arena.h"
+#include "model.h"
+
+// Get the number of moment buffers used by the optimizer type.
+static int fused_n_moments(enum optimizer_type type, double momentum) {
+    switch (type) {
+    case OPTIMIZER_SGD:
+        return momentum ? 1 : 0;
+    case OPTIMIZER_ADAM:
+        return 2;
+    case OPTIMIZER_RMSPROP:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Read the optimizer parameters from the variable args.
+static int fused_read_args(struct optimizer_fused *obj, enum optimizer_type type, va_list ap) {
+    obj->type = type;
+    switch (type) {
+    case OPTIMIZER_SGD:
+        obj->learning_rate = va_arg(ap, double);
+        obj->momentum = va_arg(ap, double);
+        obj->decay = va_arg(ap, double);
+        obj->nesterov = (bool)va_arg(ap, int);
+        return 1;
+    case OPTIMIZER_ADAM:
+        obj->learning_rate = va_arg(ap, double);
+        obj->beta_1 = va_arg(ap, double);
+        obj->beta_2 = va_arg(ap, double);
+        obj->decay = va_arg(ap, double);
+        obj->epsilon = va_arg(ap, double);
+        return 1;
+    case OPTIMIZER_RMSPROP:
+        obj->learning_rate = va_arg(ap, double);
+        obj->decay = va_arg(ap, double);
+        obj->epsilon = va_arg(ap, double);
+        obj->rho = va_arg(ap, double);
+        return 1;
+    default:
+        LAST_ERROR = "Invalid optimizer type.";
+        return 0;
+    }
+}
+
+// Get the size of the state arena needed by the optimizer type, in doubles.
+// Returns -1 if the type is invalid.
+int optimizer_fused_state_size(enum optimizer_type type, struct arena *params, va_list ap) {
+    struct optimizer_fused args = {0};
+    if (!fused_read_args(&args, type, ap)) {
+        return -1;
+    }
+    return fused_n_moments(type, args.momentum) * params->used;
+}
+
+// Initialize an empty fused optimizer object. The moment buffers are 
+// allocated from the state arena. Takes the same variable args as 
+// model_init_optimizers.
+int optimizer_fused_init(struct optimizer_fused *obj, enum optimizer_type type,
+                         struct arena *params, struct arena *grads, 
+                         struct arena *state, va_list ap) {
+    if (!fused_read_args(obj, type, ap)) {
+        return 0;
+    }
+    obj->iter = 0;
+    obj->params = params;
+    obj->grads = grads;
+    obj->m.buffer = NULL;
+    obj->c.buffer = NULL;
+
+    // Allocate the moment buffers. The arena is zeroed, so they start at 
+    // zero.
+    switch (fused_n_moments(type, obj->momentum)) {
+    case 2:
+        if (!arena_alloc(state, &obj->c, 1, params->used)) {
+            return 0;
+        }
+        // Fall through.
+    case 1:
+        if (!arena_alloc(state, &obj->m, 1, params->used)) {
+            return 0;
+        }
+        break;
+    default:
+        break;
+    }
+    return 1;
+}
+
+// Update all the parameters with SGD.
+static void fused_update_sgd(struct optimizer_fused *obj, double learning_rate) {
+    const int size = obj->params->used;
+    double *params = obj->params->buffer;
+    const double *grads = obj->grads->buffer;
+    double *m = obj->m.buffer;
+    const double momentum = obj->momentum;
+
+    if (!momentum) {
+#ifdef _OPENMP
+        #pragma omp parallel for if (size >= FUSED_OPTIMIZER_PARALLEL_SIZE) schedule(static)
+#endif
+        for (int i = 0; i < size; i++) {
+            params[i] -= grads[i] * learning_rate;
+        }
+    } else if (!obj->nesterov) {
+#ifdef _OPENMP
+        #pragma omp parallel for if (size >= FUSED_OPTIMIZER_PARALLEL_SIZE) schedule(static)
+#endif
+        for (int i = 0; i < size; i++) {
+            m[i] = m[i] * momentum - grads[i] * learning_rate;
+            params[i] += m[i];
+        }
+    } else {
+#ifdef _OPENMP
+        #pragma omp parallel for if (size >= FUSED_OPTIMIZER_PARALLEL_SIZE) schedule(static)
+#endif
+        for (int i = 0; i < size; i++) {
+            m[i] = m[i] * momentum - grads[i] * learning_rate;
+            params[i] += m[i] * momentum - grads[i] * learning_rate;
+        }
+    }
+}
+
+// Update all the parameters with Adam. The bias corrections are calculated 
+// once per step, and the first moment correction is folded into the 
+// learning rate.
+static void fused_update_adam(struct optimizer_fused *obj, double learning_rate) {
+    const int size = obj->params->used;
+    double *params = obj->params->buffer;
+    const double *grads = obj->grads->buffer;
+    double *m = obj->m.buffer, *c = obj->c.buffer;
+    const double beta_1 = obj->beta_1, beta_2 = obj->beta_2, epsilon = obj->epsilon;
+    const double step = learning_rate / (1.0 - pow(beta_1, (double)(obj->iter + 1)));
+    const double correction_c = 1.0 / (1.0 - pow(beta_2, (double)(obj->iter + 1)));
+
+#ifdef _OPENMP
+    #pragma omp parallel for if (size >= FUSED_OPTIMIZER_PARALLEL_SIZE) schedule(static)
+#endif
+    for (int i = 0; i < size; i++) {
+        const double grad = grads[i];
+        m[i] = m[i] * beta_1 + grad * (1.0 - beta_1);
+        c[i] = c[i] * beta_2 + grad * grad * (1.0 - beta_2);
+        params[i] -= step * m[i] / (sqrt(c[i] * correction_c) + epsilon);
+    }
+}
+
+// Update all the parameters with RMSProp.
+static void fused_update_rmsprop(struct optimizer_fused *obj, double learning_rate) {
+    const int size = obj->params->used;
+    double *params = obj->params->buffer;
+    const double *grads = obj->grads->buffer;
+    double *c = obj->m.buffer;
+    const double rho = obj->rho, epsilon = obj->epsilon;
+
+#ifdef _OPENMP
+    #pragma omp parallel for if (size >= FUSED_OPTIMIZER_PARALLEL_SIZE) schedule(static)
+#endif
+    for (int i = 0; i < size; i++) {
+        const double grad = grads[i];
+        c[i] = rho * c[i] + (1.0 - rho) * grad * grad;
+        params[i] -= learning_rate * grad / sqrt(c[i] + epsilon);
+    }
+}
+
+// Update all the parameters, and advance the iteration.
+void optimizer_fused_update(struct optimizer_fused *obj) {
+    // Calculate the learning rate.
+    double learning_rate = obj->learning_rate;
+    if (obj->decay) {
+        learning_rate = learning_rate * (1.0 / (1.0 + obj->decay * (double)obj->iter));
+    }
+
+    switch (obj->type) {
+    case OPTIMIZER_SGD:
+        fused_update_sgd(obj, learning_rate);
+        break;
+    case OPTIMIZER_ADAM:
+        fused_update_adam(obj, learning_rate);
+        break;
+    case OPTIMIZER_RMSPROP:
+        fused_update_rmsprop(obj, learning_rate);
+        break;
+    default:
+        break;
+    }
+    obj->iter++;
+}
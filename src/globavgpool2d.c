@@ -0,0 +1,129 @@
+// globavgpool2d.c
+// 2D global average pooling layer.
+
+#include "globavgpool2d.h"
+#include "matrix.h"
+
+// Initialize an empty layer object.
+int layer_globavgpool2d_init(struct layer_globavgpool2d *obj, int n_channels, 
+                             int input_height, int input_width, 
+                             struct matrix *input, struct matrix *output, 
+                             struct matrix *d_outputs, struct matrix *d_inputs) {
+    // Set the input dimensions.
+    obj->n_channels = n_channels;
+    obj->input_height = input_height;
+    obj->input_width = input_width;
+
+    // Use the NCHW layout by default.
+    obj->layout = LAYOUT_NCHW;
+
+    // Set the matrices and assert that their sizes are correct. 
+    obj->input = input;
+    if (!(input->n_cols == n_channels * input_height * input_width)) {
+        // Invalid input size.
+        LAST_ERROR = "Invalid input matrix size.";
+        return 0;
+    }
+    
+    obj->output = output;
+    if (!(output->n_cols == n_channels)) {
+        // Invalid output size.
+        LAST_ERROR = "Invalid output matrix size.";
+        return 0;
+    }
+
+    obj->d_outputs = d_outputs;
+    if (!(d_outputs->n_cols == n_channels)) {
+        // Invalid output gradient size.
+        LAST_ERROR = "Invalid d_outputs matrix size.";
+        return 0;
+    }
+
+    obj->d_inputs = d_inputs;
+    if (!(d_inputs->n_cols == n_channels * input_height * input_width)) {
+        // Invalid input gradient size.
+        LAST_ERROR = "Invalid d_inputs matrix size.";
+        return 0;
+    }
+
+    if (!((input->n_rows == output->n_rows) && (input->n_rows == d_outputs->n_rows) && (input->n_rows == d_inputs->n_rows))) {
+        // Invalid output gradient size.
+        LAST_ERROR = "Input, output, d_inputs, and d_outputs matrices must have the same number of rows/samples.";
+        return 0;
+    }
+
+    return 1;
+}
+
+// Set the input activation layout.
+void layer_globavgpool2d_set_layout(struct layer_globavgpool2d *obj, enum layout_2d layout) {
+    obj->layout = layout;
+}
+
+// Perform a forward pass on the layer. In the NCHW layout, each channel plane
+// is summed, while in the NHWC layout the pixel channel vectors are summed,
+// so the inner loops are contiguous in both layouts and vectorize.
+void layer_globavgpool2d_forward(struct layer_globavgpool2d *obj) {
+    const int n_channels = obj->n_channels;
+    const int plane_size = obj->input_height * obj->input_width;
+    const double scale = 1.0 / (double)plane_size;
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *input = &obj->input->buffer[sample * n_channels * plane_size];
+        double *output = &obj->output->buffer[sample * n_channels];
+
+        if (obj->layout == LAYOUT_NHWC) {
+            for (int channel = 0; channel < n_channels; channel++) {
+                output[channel] = 0.0;
+            }
+            for (int i = 0; i < plane_size; i++) {
+                const double *pixel = &input[i * n_channels];
+                for (int channel = 0; channel < n_channels; channel++) {
+                    output[channel] += pixel[channel];
+                }
+            }
+            for (int channel = 0; channel < n_channels; channel++) {
+                output[channel] *= scale;
+            }
+        } else {
+            for (int channel = 0; channel < n_channels; channel++) {
+                const double *plane = &input[channel * plane_size];
+                double sum = 0.0;
+                for (int i = 0; i < plane_size; i++) {
+                    sum += plane[i];
+                }
+                output[channel] = sum * scale;
+            }
+        }
+    }
+}
+
+// Perform a backward pass on the layer. Each input gradient is the output 
+// gradient of its channel divided by the plane size.
+void layer_globavgpool2d_backward(struct layer_globavgpool2d *obj) {
+    const int n_channels = obj->n_channels;
+    const int plane_size = obj->input_height * obj->input_width;
+    const double scale = 1.0 / (double)plane_size;
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *d_outputs = &obj->d_outputs->buffer[sample * n_channels];
+        double *d_inputs = &obj->d_inputs->buffer[sample * n_channels * plane_size];
+
+        if (obj->layout == LAYOUT_NHWC) {
+            for (int i = 0; i < plane_size; i++) {
+                double *pixel = &d_inputs[i * n_channels];
+                for (int channel = 0; channel < n_channels; channel++) {
+                    pixel[channel] = d_outputs[channel] * scale;
+                }
+            }
+        } else {
+            for (int channel = 0; channel < n_channels; channel++) {
+                const double value = d_outputs[channel] * scale;
+                double *plane = &d_inputs[channel * plane_size];
+                for (int i = 0; i < plane_size; i++) {
+                    plane[i] = value;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,378 @@
+// inference_queue.c
+// Dynamic micro-batching inference queue.
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include "inference_queue.h"
+#include "model.h"
+#include "matrix.h"
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION queue_mutex;
+typedef CONDITION_VARIABLE queue_cond;
+typedef HANDLE queue_thread;
+#else
+typedef pthread_mutex_t queue_mutex;
+typedef pthread_cond_t queue_cond;
+typedef pthread_t queue_thread;
+#endif
+
+// A pending request, with a copy of its input.
+struct inference_request {
+    struct inference_request *next;
+    inference_callback callback;
+    void *user_data;
+
+    // The submit time, in microseconds.
+    double submit_time;
+
+    double input[];
+};
+
+// A worker thread, with its own model context and batch matrices.
+struct inference_worker {
+    struct inference_queue *queue;
+    struct model_context context;
+    struct matrix X, Y;
+    struct inference_request **batch;
+    queue_thread thread;
+};
+
+struct inference_queue_state {
+    queue_mutex mutex;
+    queue_cond cond;
+
+    // The pending requests, oldest first.
+    struct inference_request *head, *tail;
+    int n_pending;
+    bool stopping;
+
+    struct inference_worker *workers;
+    int n_started;
+};
+
+// Return a monotonic time in microseconds.
+static double queue_time(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart * 1e6 / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1e6 + (double)now.tv_nsec * 1e-3;
+#endif
+}
+
+static void queue_lock(struct inference_queue_state *state) {
+#ifdef _WIN32
+    EnterCriticalSection(&state->mutex);
+#else
+    pthread_mutex_lock(&state->mutex);
+#endif
+}
+
+static void queue_unlock(struct inference_queue_state *state) {
+#ifdef _WIN32
+    LeaveCriticalSection(&state->mutex);
+#else
+    pthread_mutex_unlock(&state->mutex);
+#endif
+}
+
+static void queue_signal(struct inference_queue_state *state) {
+#ifdef _WIN32
+    WakeConditionVariable(&state->cond);
+#else
+    pthread_cond_signal(&state->cond);
+#endif
+}
+
+static void queue_broadcast(struct inference_queue_state *state) {
+#ifdef _WIN32
+    WakeAllConditionVariable(&state->cond);
+#else
+    pthread_cond_broadcast(&state->cond);
+#endif
+}
+
+// Wait on the queue's condition. A negative timeout, in microseconds, waits
+// until signaled.
+static void queue_wait(struct inference_queue_state *state, double timeout) {
+#ifdef _WIN32
+    SleepConditionVariableCS(&state->cond, &state->mutex, timeout < 0 ? INFINITE : (DWORD)(timeout / 1e3) + 1);
+#else
+    if (timeout < 0) {
+        pthread_cond_wait(&state->cond, &state->mutex);
+        return;
+    }
+
+    // The condition uses the realtime clock, so the deadline is relative to
+    // the current realtime.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long nsec = (long long)deadline.tv_nsec + (long long)(timeout * 1e3);
+    deadline.tv_sec += (time_t)(nsec / 1000000000LL);
+    deadline.tv_nsec = (long)(nsec % 1000000000LL);
+    pthread_cond_timedwait(&state->cond, &state->mutex, &deadline);
+#endif
+}
+
+// Run one batch on a worker, and complete its requests.
+static void inference_worker_run(struct inference_worker *obj, int batch_size) {
+    struct inference_queue *queue = obj->queue;
+    for (int i = 0; i < batch_size; i++) {
+        memcpy(&obj->X.buffer[i * queue->input_size], obj->batch[i]->input, sizeof(double) * queue->input_size);
+    }
+    matrix_set_rows(&obj->X, batch_size);
+    matrix_set_rows(&obj->Y, batch_size);
+    int success = model_context_predict(&obj->context, &obj->X, &obj->Y);
+
+    for (int i = 0; i < batch_size; i++) {
+        struct inference_request *request = obj->batch[i];
+        request->callback(request->user_data, success ? &obj->Y.buffer[i * queue->output_size] : NULL, success);
+        free(request);
+    }
+}
+
+// The worker thread. Wait for requests, wait for the batch to fill or for the
+// oldest request's deadline, and run the batch outside the lock.
+#ifdef _WIN32
+static DWORD WINAPI inference_worker_main(LPVOID arg) {
+#else
+static void *inference_worker_main(void *arg) {
+#endif
+    struct inference_worker *obj = arg;
+    struct inference_queue *queue = obj->queue;
+    struct inference_queue_state *state = queue->state;
+
+    queue_lock(state);
+    while (true) {
+        while (state->n_pending == 0 && !state->stopping) {
+            queue_wait(state, -1);
+        }
+        if (state->n_pending == 0) {
+            break;
+        }
+
+        // Wait for a full batch, until the oldest request's deadline. Another
+        // worker may take the requests meanwhile.
+        while (state->n_pending > 0 && state->n_pending < queue->max_batch_size && !state->stopping) {
+            double remaining = state->head->submit_time + queue->max_delay - queue_time();
+            if (remaining <= 0) {
+                break;
+            }
+            queue_wait(state, remaining);
+        }
+        if (state->n_pending == 0) {
+            continue;
+        }
+
+        // Take the oldest requests.
+        int batch_size = 0;
+        while (state->head != NULL && batch_size < queue->max_batch_size) {
+            obj->batch[batch_size++] = state->head;
+            state->head = state->head->next;
+        }
+        if (state->head == NULL) {
+            state->tail = NULL;
+        }
+        state->n_pending -= batch_size;
+        queue->n_batches++;
+        queue->n_requests += batch_size;
+
+        // Let another worker start on the remaining requests.
+        if (state->n_pending > 0) {
+            queue_signal(state);
+        }
+
+        queue_unlock(state);
+        inference_worker_run(obj, batch_size);
+        queue_lock(state);
+    }
+    queue_unlock(state);
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+// Initialize an inference queue, and start the worker threads.
+int inference_queue_init(struct inference_queue *obj, struct model *model,
+                         int n_workers, int max_batch_size, int max_delay) {
+    obj->model = model;
+    obj->n_workers = n_workers;
+    obj->max_batch_size = max_batch_size;
+    obj->max_delay = max_delay;
+    obj->input_size = 0;
+    obj->output_size = 0;
+    obj->n_batches = 0;
+    obj->n_requests = 0;
+    obj->state = NULL;
+    if (model->input == NULL) {
+        LAST_ERROR = "Model not finalized.";
+        return 0;
+    }
+    if (n_workers < 1 || max_batch_size < 1 || max_delay < 0) {
+        LAST_ERROR = "Invalid inference queue parameters.";
+        return 0;
+    }
+    obj->input_size = model->first->input_size;
+    obj->output_size = model->last->output_size;
+
+    struct inference_queue_state *state = calloc(1, sizeof(struct inference_queue_state));
+    if (state == NULL) {
+        LAST_ERROR = "Failed to allocate inference queue.";
+        return 0;
+    }
+    obj->state = state;
+#ifdef _WIN32
+    InitializeCriticalSection(&state->mutex);
+    InitializeConditionVariable(&state->cond);
+#else
+    pthread_mutex_init(&state->mutex, NULL);
+    pthread_cond_init(&state->cond, NULL);
+#endif
+
+    // Create each worker's context and batch matrices before starting any
+    // threads.
+    state->workers = calloc(n_workers, sizeof(struct inference_worker));
+    if (state->workers == NULL) {
+        LAST_ERROR = "Failed to allocate inference queue.";
+        inference_queue_free(obj);
+        return 0;
+    }
+    for (int i = 0; i < n_workers; i++) {
+        struct inference_worker *worker = &state->workers[i];
+        worker->queue = obj;
+        worker->batch = malloc(max_batch_size * sizeof(struct inference_request *));
+        if (worker->batch == NULL) {
+            LAST_ERROR = "Failed to allocate inference queue.";
+            inference_queue_free(obj);
+            return 0;
+        }
+        if (!model_context_init(&worker->context, model, max_batch_size) ||
+            !matrix_init(&worker->X, max_batch_size, obj->input_size) ||
+            !matrix_init(&worker->Y, max_batch_size, obj->output_size)) {
+            inference_queue_free(obj);
+            return 0;
+        }
+    }
+
+    for (int i = 0; i < n_workers; i++) {
+        struct inference_worker *worker = &state->workers[i];
+#ifdef _WIN32
+        worker->thread = CreateThread(NULL, 0, inference_worker_main, worker, 0, NULL);
+        bool started = worker->thread != NULL;
+#else
+        bool started = pthread_create(&worker->thread, NULL, inference_worker_main, worker) == 0;
+#endif
+        if (!started) {
+            LAST_ERROR = "Failed to start inference worker.";
+            inference_queue_free(obj);
+            return 0;
+        }
+        state->n_started++;
+    }
+    return 1;
+}
+
+// Submit a sample for inference.
+int inference_queue_submit(struct inference_queue *obj, const double *input,
+                           inference_callback callback, void *user_data) {
+    struct inference_queue_state *state = obj->state;
+    struct inference_request *request = malloc(sizeof(struct inference_request) + sizeof(double) * obj->input_size);
+    if (request == NULL) {
+        LAST_ERROR = "Failed to allocate request.";
+        return 0;
+    }
+    request->next = NULL;
+    request->callback = callback;
+    request->user_data = user_data;
+    request->submit_time = queue_time();
+    memcpy(request->input, input, sizeof(double) * obj->input_size);
+
+    queue_lock(state);
+    if (state->stopping) {
+        queue_unlock(state);
+        free(request);
+        LAST_ERROR = "Inference queue is stopping.";
+        return 0;
+    }
+    if (state->tail != NULL) {
+        state->tail->next = request;
+    } else {
+        state->head = request;
+    }
+    state->tail = request;
+    state->n_pending++;
+    queue_signal(state);
+    queue_unlock(state);
+    return 1;
+}
+
+// Stop the queue, complete the pending requests, and join the workers.
+void inference_queue_free(struct inference_queue *obj) {
+    struct inference_queue_state *state = obj->state;
+    if (state == NULL) {
+        return;
+    }
+
+    queue_lock(state);
+    state->stopping = true;
+    queue_broadcast(state);
+    queue_unlock(state);
+
+    if (state->workers != NULL) {
+        for (int i = 0; i < state->n_started; i++) {
+#ifdef _WIN32
+            WaitForSingleObject(state->workers[i].thread, INFINITE);
+            CloseHandle(state->workers[i].thread);
+#else
+            pthread_join(state->workers[i].thread, NULL);
+#endif
+        }
+        for (int i = 0; i < obj->n_workers; i++) {
+            struct inference_worker *worker = &state->workers[i];
+            if (worker->batch != NULL) {
+                model_context_free(&worker->context);
+                matrix_free(&worker->X);
+                matrix_free(&worker->Y);
+            }
+            free(worker->batch);
+        }
+        free(state->workers);
+    }
+
+    // Requests only remain if no worker started.
+    while (state->head != NULL) {
+        struct inference_request *next = state->head->next;
+        free(state->head);
+        state->head = next;
+    }
+
+#ifdef _WIN32
+    DeleteCriticalSection(&state->mutex);
+#else
+    pthread_mutex_destroy(&state->mutex);
+    pthread_cond_destroy(&state->cond);
+#endif
+    free(state);
+    obj->state = NULL;
+}
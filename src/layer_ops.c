@@ -0,0 +1,1190 @@
+// layer_ops.c
+// Layer operations tables, and custom layer types.
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "layer_ops.h"
+#include "model.h"
+#include "matrix.h"
+#include "serialize.h"
+#include "dense.h"
+#include "conv2d.h"
+#include "maxpool2d.h"
+#include "padding2d.h"
+#include "globavgpool2d.h"
+#include "layout2d.h"
+#include "dropout.h"
+#include "sigmoid.h"
+#include "softmax.h"
+#include "relu.h"
+#include "leaky_relu.h"
+#include "tanh.h"
+#include "batch_normalization.h"
+#include "sgd.h"
+#include "adam.h"
+#include "rmsprop.h"
+#include "sgd_conv2d.h"
+#include "adam_conv2d.h"
+#include "rmsprop_conv2d.h"
+#include "sgd_bn.h"
+#include "adam_bn.h"
+#include "rmsprop_bn.h"
+
+// Set the input, output and gradient matrices of a copied layer object.
+#define LAYER_SET_MATRICES(layer, in, out, d_out, d_in) { \
+    (layer)->input = (in); \
+    (layer)->output = (out); \
+    (layer)->d_outputs = (d_out); \
+    (layer)->d_inputs = (d_in); \
+}
+
+// Copy a layer object for a shared layer, with the matrices of the layer.
+// Returns NULL if it failed.
+static void* layer_copy_object(struct layer *obj, const struct layer *shared, size_t size) {
+    void *copy = malloc(size);
+    if (copy == NULL) {
+        LAST_ERROR = "Failed to allocate layer.";
+        return NULL;
+    }
+    memcpy(copy, shared->obj, size);
+    obj->obj = copy;
+    return copy;
+}
+
+// Write a value to a file.
+static int write_value(const void *value, size_t size, FILE *fp) {
+    if (fwrite(value, size, 1, fp) != 1) {
+        LAST_ERROR = "Failed to write file.";
+        return 0;
+    }
+    return 1;
+}
+
+// Read a value from a file.
+static int read_value(void *value, size_t size, FILE *fp) {
+    if (fread(value, size, 1, fp) != 1) {
+        LAST_ERROR = "Failed to read file.";
+        return 0;
+    }
+    return 1;
+}
+
+// Add a matrix to a list if it is allocated. Returns the new list size.
+static int add_allocated(struct matrix **list, int n, struct matrix *matrix) {
+    if (matrix->buffer != NULL) {
+        list[n++] = matrix;
+    }
+    return n;
+}
+
+// The optimizer hyperparameters passed to layer_init_optimizer. Only the ones
+// used by the optimizer type are set.
+struct optimizer_args {
+    double learning_rate, momentum, decay, beta_1, beta_2, epsilon, rho;
+    bool nesterov;
+};
+
+// Read the optimizer hyperparameters from the variable args list.
+static int read_optimizer_args(enum optimizer_type type, va_list ap, struct optimizer_args *args) {
+    switch (type) {
+    case OPTIMIZER_SGD:
+        // Stochastic gradient descent.
+        args->learning_rate = va_arg(ap, double);
+        args->momentum = va_arg(ap, double);
+        args->decay = va_arg(ap, double);
+        args->nesterov = (bool)va_arg(ap, int);
+        return 1;
+    case OPTIMIZER_ADAM:
+        // Adam.
+        args->learning_rate = va_arg(ap, double);
+        args->beta_1 = va_arg(ap, double);
+        args->beta_2 = va_arg(ap, double);
+        args->decay = va_arg(ap, double);
+        args->epsilon = va_arg(ap, double);
+        return 1;
+    case OPTIMIZER_RMSPROP:
+        // RMSProp.
+        args->learning_rate = va_arg(ap, double);
+        args->decay = va_arg(ap, double);
+        args->epsilon = va_arg(ap, double);
+        args->rho = va_arg(ap, double);
+        return 1;
+    default:
+        LAST_ERROR = "Invalid optimizer type.";
+        return 0;
+    }
+}
+
+// Allocate an optimizer object, and store it in the layer once it is
+// initialized. Frees the object if the initialization failed.
+#define OPTIMIZER_INIT(layer, type, init) { \
+    struct type *opt = calloc(1, sizeof(struct type)); \
+    if (opt == NULL) { \
+        LAST_ERROR = "Failed to allocate optimizer."; \
+        return 0; \
+    } \
+    if (!(init)) { \
+        free(opt); \
+        return 0; \
+    } \
+    (layer)->opt.obj = opt; \
+    return 1; \
+}
+
+// Dense layer.
+
+static int dense_init(struct layer *obj) {
+    struct layer_dense *dense = calloc(1, sizeof(struct layer_dense));
+    if (!layer_dense_init(dense, obj->input_size, obj->output_size, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(dense);
+        return 0;
+    }
+    obj->obj = dense;
+    return 1;
+}
+
+static int dense_forward(struct layer *obj, bool training) {
+    (void)training;
+    layer_dense_forward(obj->obj);
+    return 1;
+}
+
+static int dense_backward(struct layer *obj) {
+    layer_dense_backward(obj->obj);
+    return 1;
+}
+
+static void dense_free(struct layer *obj) {
+    layer_dense_free(obj->obj);
+}
+
+static int dense_get_params(struct layer *obj, struct matrix **params, struct matrix **grads) {
+    struct layer_dense *dense = obj->obj;
+    params[0] = &dense->weights;
+    params[1] = &dense->biases;
+    grads[0] = &dense->d_weights;
+    grads[1] = &dense->d_biases;
+    return 2;
+}
+
+static int dense_init_optimizer(struct layer *obj, enum optimizer_type type, va_list ap) {
+    struct optimizer_args args;
+    if (!read_optimizer_args(type, ap, &args)) {
+        return 0;
+    }
+    switch (type) {
+    case OPTIMIZER_SGD:
+        OPTIMIZER_INIT(obj, optimizer_sgd, optimizer_sgd_init(opt, obj->obj, args.learning_rate, args.momentum, args.decay, args.nesterov));
+    case OPTIMIZER_ADAM:
+        OPTIMIZER_INIT(obj, optimizer_adam, optimizer_adam_init(opt, obj->obj, args.learning_rate, args.beta_1, args.beta_2, args.decay, args.epsilon));
+    default:
+        // RMSProp. The type was checked when reading the args.
+        OPTIMIZER_INIT(obj, optimizer_rmsprop, optimizer_rmsprop_init(opt, obj->obj, args.learning_rate, args.decay, args.epsilon, args.rho));
+    }
+}
+
+static int dense_update(struct layer *obj) {
+    switch (obj->opt.type) {
+    case OPTIMIZER_SGD:
+        optimizer_sgd_update(obj->opt.obj, obj->opt.iter);
+        return 1;
+    case OPTIMIZER_ADAM:
+        optimizer_adam_update(obj->opt.obj, obj->opt.iter);
+        return 1;
+    case OPTIMIZER_RMSPROP:
+        optimizer_rmsprop_update(obj->opt.obj, obj->opt.iter);
+        return 1;
+    default:
+        LAST_ERROR = "Invalid optimizer type.";
+        return 0;
+    }
+}
+
+static int dense_get_optimizer_state(struct layer *obj, struct matrix **state) {
+    int n = 0;
+    switch (obj->opt.type) {
+    case OPTIMIZER_SGD:
+    {
+        struct optimizer_sgd *sgd = obj->opt.obj;
+        n = add_allocated(state, n, &sgd->weight_m);
+        n = add_allocated(state, n, &sgd->bias_m);
+        break;
+    }
+    case OPTIMIZER_ADAM:
+    {
+        struct optimizer_adam *adam = obj->opt.obj;
+        n = add_allocated(state, n, &adam->weight_m);
+        n = add_allocated(state, n, &adam->bias_m);
+        n = add_allocated(state, n, &adam->weight_c);
+        n = add_allocated(state, n, &adam->bias_c);
+        break;
+    }
+    case OPTIMIZER_RMSPROP:
+    {
+        struct optimizer_rmsprop *rmsprop = obj->opt.obj;
+        n = add_allocated(state, n, &rmsprop->weight_c);
+        n = add_allocated(state, n, &rmsprop->bias_c);
+        break;
+    }
+    }
+    return n;
+}
+
+static void dense_free_optimizer(struct layer *obj) {
+    switch (obj->opt.type) {
+    case OPTIMIZER_SGD:
+        optimizer_sgd_free(obj->opt.obj);
+        break;
+    case OPTIMIZER_ADAM:
+        optimizer_adam_free(obj->opt.obj);
+        break;
+    case OPTIMIZER_RMSPROP:
+        optimizer_rmsprop_free(obj->opt.obj);
+        break;
+    }
+}
+
+static int dense_serialize(struct layer *obj, FILE *fp) {
+    struct layer_dense *dense = obj->obj;
+    return serialize_matrix(&dense->weights, fp) && serialize_matrix(&dense->biases, fp);
+}
+
+static int dense_deserialize(struct layer *obj, FILE *fp) {
+    struct layer_dense *dense = obj->obj;
+    return deserialize_matrix(&dense->weights, fp) && deserialize_matrix(&dense->biases, fp);
+}
+
+static int dense_init_shared(struct layer *obj, const struct layer *shared) {
+    struct layer_dense *dense = layer_copy_object(obj, shared, sizeof(struct layer_dense));
+    if (dense == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(dense, obj->input, obj->output, obj->d_output, obj->d_input);
+    dense->d_weights.buffer = NULL;
+    dense->d_biases.buffer = NULL;
+    return 1;
+}
+
+static const struct layer_ops DENSE_OPS = {
+    .name = "dense",
+    .backward_skips_output = true,
+    .init = dense_init,
+    .forward = dense_forward,
+    .backward = dense_backward,
+    .free = dense_free,
+    .get_params = dense_get_params,
+    .init_optimizer = dense_init_optimizer,
+    .update = dense_update,
+    .get_optimizer_state = dense_get_optimizer_state,
+    .free_optimizer = dense_free_optimizer,
+    .serialize = dense_serialize,
+    .deserialize = dense_deserialize,
+    .init_shared = dense_init_shared
+};
+
+// Conv 2D and depthwise conv 2D layers.
+
+// Initialize a conv 2D layer with a number of groups.
+static int conv2d_init_groups(struct layer *obj, int groups) {
+    struct layer_conv2d *conv2d = calloc(1, sizeof(struct layer_conv2d));
+    if (!layer_conv2d_init_grouped(conv2d, obj->input_channels, obj->input_height, obj->input_width, obj->output_channels, obj->filter_size, obj->stride, obj->dilation, groups, obj->padding_x, obj->padding_y, obj->padding_type, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(conv2d);
+        return 0;
+    }
+    if (!layer_conv2d_set_layout(conv2d, obj->layout)) {
+        layer_conv2d_free(conv2d);
+        free(conv2d);
+        return 0;
+    }
+    obj->obj = conv2d;
+    return 1;
+}
+
+static int conv2d_init(struct layer *obj) {
+    return conv2d_init_groups(obj, obj->groups);
+}
+
+static int depthwise_conv2d_init(struct layer *obj) {
+    return conv2d_init_groups(obj, obj->input_channels);
+}
+
+static int conv2d_forward(struct layer *obj, bool training) {
+    (void)training;
+    layer_conv2d_forward(obj->obj);
+    return 1;
+}
+
+static int conv2d_backward(struct layer *obj) {
+    layer_conv2d_backward(obj->obj);
+    return 1;
+}
+
+static void conv2d_free(struct layer *obj) {
+    layer_conv2d_free(obj->obj);
+}
+
+static int conv2d_get_params(struct layer *obj, struct matrix **params, struct matrix **grads) {
+    struct layer_conv2d *conv2d = obj->obj;
+    params[0] = &conv2d->weights;
+    params[1] = &conv2d->biases;
+    grads[0] = &conv2d->d_weights;
+    grads[1] = &conv2d->d_biases;
+    return 2;
+}
+
+static int conv2d_get_weights(struct layer *obj, struct matrix **weights) {
+    struct matrix *grads[LAYER_MAX_PARAMS];
+    int n = conv2d_get_params(obj, weights, grads);
+
+    // The packed weights only follow the weights if they are prepacked.
+    struct layer_conv2d *conv2d = obj->obj;
+    if (conv2d->layout == LAYOUT_NHWC) {
+        weights[n++] = conv2d->prepacked ? &conv2d->packed_weights : NULL;
+    }
+    return n;
+}
+
+static int conv2d_init_optimizer(struct layer *obj, enum optimizer_type type, va_list ap) {
+    struct optimizer_args args;
+    if (!read_optimizer_args(type, ap, &args)) {
+        return 0;
+    }
+    switch (type) {
+    case OPTIMIZER_SGD:
+        OPTIMIZER_INIT(obj, optimizer_sgd_conv2d, optimizer_sgd_conv2d_init(opt, obj->obj, args.learning_rate, args.momentum, args.decay, args.nesterov));
+    case OPTIMIZER_ADAM:
+        OPTIMIZER_INIT(obj, optimizer_adam_conv2d, optimizer_adam_conv2d_init(opt, obj->obj, args.learning_rate, args.beta_1, args.beta_2, args.decay, args.epsilon));
+    default:
+        // RMSProp. The type was checked when reading the args.
+        OPTIMIZER_INIT(obj, optimizer_rmsprop_conv2d, optimizer_rmsprop_conv2d_init(opt, obj->obj, args.learning_rate, args.decay, args.epsilon, args.rho));
+    }
+}
+
+static int conv2d_update(struct layer *obj) {
+    switch (obj->opt.type) {
+    case OPTIMIZER_SGD:
+        optimizer_sgd_conv2d_update(obj->opt.obj, obj->opt.iter);
+        return 1;
+    case OPTIMIZER_ADAM:
+        optimizer_adam_conv2d_update(obj->opt.obj, obj->opt.iter);
+        return 1;
+    case OPTIMIZER_RMSPROP:
+        optimizer_rmsprop_conv2d_update(obj->opt.obj, obj->opt.iter);
+        return 1;
+    default:
+        LAST_ERROR = "Invalid optimizer type.";
+        return 0;
+    }
+}
+
+static int conv2d_get_optimizer_state(struct layer *obj, struct matrix **state) {
+    int n = 0;
+    switch (obj->opt.type) {
+    case OPTIMIZER_SGD:
+    {
+        struct optimizer_sgd_conv2d *sgd = obj->opt.obj;
+        n = add_allocated(state, n, &sgd->weight_m);
+        n = add_allocated(state, n, &sgd->bias_m);
+        break;
+    }
+    case OPTIMIZER_ADAM:
+    {
+        struct optimizer_adam_conv2d *adam = obj->opt.obj;
+        n = add_allocated(state, n, &adam->weight_m);
+        n = add_allocated(state, n, &adam->bias_m);
+        n = add_allocated(state, n, &adam->weight_c);
+        n = add_allocated(state, n, &adam->bias_c);
+        break;
+    }
+    case OPTIMIZER_RMSPROP:
+    {
+        struct optimizer_rmsprop_conv2d *rmsprop = obj->opt.obj;
+        n = add_allocated(state, n, &rmsprop->weight_c);
+        n = add_allocated(state, n, &rmsprop->bias_c);
+        break;
+    }
+    }
+    return n;
+}
+
+static void conv2d_free_optimizer(struct layer *obj) {
+    switch (obj->opt.type) {
+    case OPTIMIZER_SGD:
+        optimizer_sgd_conv2d_free(obj->opt.obj);
+        break;
+    case OPTIMIZER_ADAM:
+        optimizer_adam_conv2d_free(obj->opt.obj);
+        break;
+    case OPTIMIZER_RMSPROP:
+        optimizer_rmsprop_conv2d_free(obj->opt.obj);
+        break;
+    }
+}
+
+static int conv2d_serialize(struct layer *obj, FILE *fp) {
+    struct layer_conv2d *conv2d = obj->obj;
+    if (!serialize_matrix(&conv2d->weights, fp) || !serialize_matrix(&conv2d->biases, fp)) {
+        return 0;
+    }
+
+    // Save the padding type if the layer is padded.
+    if (obj->padding_x || obj->padding_y) {
+        return write_value(&conv2d->padding_type, sizeof(enum padding_type), fp);
+    }
+    return 1;
+}
+
+// Read a conv 2D layer's padding type.
+static int conv2d_deserialize_padding_type(struct layer *obj, FILE *fp) {
+    enum padding_type padding_type;
+    if (!read_value(&padding_type, sizeof(enum padding_type), fp)) {
+        return 0;
+    }
+    obj->padding_type = padding_type;
+    layer_conv2d_set_padding_type(obj->obj, padding_type);
+    return 1;
+}
+
+static int conv2d_deserialize(struct layer *obj, FILE *fp) {
+    // If the layer absorbed a padding 2D layer when the model was finalized,
+    // the padding type was saved before the weights.
+    struct layer_conv2d *conv2d = obj->obj;
+    if (obj->fused_padding && !conv2d_deserialize_padding_type(obj, fp)) {
+        return 0;
+    }
+    if (!deserialize_matrix(&conv2d->weights, fp) || !deserialize_matrix(&conv2d->biases, fp)) {
+        return 0;
+    }
+    if (!obj->fused_padding && (obj->padding_x || obj->padding_y)) {
+        return conv2d_deserialize_padding_type(obj, fp);
+    }
+    return 1;
+}
+
+static int conv2d_init_shared(struct layer *obj, const struct layer *shared) {
+    struct layer_conv2d *conv2d = layer_copy_object(obj, shared, sizeof(struct layer_conv2d));
+    if (conv2d == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(conv2d, obj->input, obj->output, obj->d_output, obj->d_input);
+    conv2d->d_weights.buffer = NULL;
+    conv2d->d_biases.buffer = NULL;
+    conv2d->packed_d_weights.buffer = NULL;
+
+    // The NHWC kernels pack the weights on each forward pass, unless the
+    // model's weights are prepacked, which are then shared.
+    const struct matrix *packed = &((const struct layer_conv2d*)shared->obj)->packed_weights;
+    conv2d->packed_weights.buffer = NULL;
+    if (conv2d->prepacked) {
+        matrix_init_view(&conv2d->packed_weights, packed->n_rows, packed->n_cols, packed->buffer);
+    } else if (packed->buffer != NULL) {
+        return matrix_init(&conv2d->packed_weights, packed->n_rows, packed->n_cols);
+    }
+    return 1;
+}
+
+static void conv2d_free_shared(struct layer *obj) {
+    matrix_free(&((struct layer_conv2d*)obj->obj)->packed_weights);
+}
+
+static const struct layer_ops CONV2D_OPS = {
+    .name = "conv 2D",
+    .layout_2d = true,
+    .backward_skips_output = true,
+    .init = conv2d_init,
+    .forward = conv2d_forward,
+    .backward = conv2d_backward,
+    .free = conv2d_free,
+    .get_params = conv2d_get_params,
+    .get_weights = conv2d_get_weights,
+    .init_optimizer = conv2d_init_optimizer,
+    .update = conv2d_update,
+    .get_optimizer_state = conv2d_get_optimizer_state,
+    .free_optimizer = conv2d_free_optimizer,
+    .serialize = conv2d_serialize,
+    .deserialize = conv2d_deserialize,
+    .init_shared = conv2d_init_shared,
+    .free_shared = conv2d_free_shared
+};
+
+static const struct layer_ops DEPTHWISE_CONV2D_OPS = {
+    .name = "depthwise conv 2D",
+    .layout_2d = true,
+    .backward_skips_output = true,
+    .init = depthwise_conv2d_init,
+    .forward = conv2d_forward,
+    .backward = conv2d_backward,
+    .free = conv2d_free,
+    .get_params = conv2d_get_params,
+    .get_weights = conv2d_get_weights,
+    .init_optimizer = conv2d_init_optimizer,
+    .update = conv2d_update,
+    .get_optimizer_state = conv2d_get_optimizer_state,
+    .free_optimizer = conv2d_free_optimizer,
+    .serialize = conv2d_serialize,
+    .deserialize = conv2d_deserialize,
+    .init_shared = conv2d_init_shared,
+    .free_shared = conv2d_free_shared
+};
+
+// Max pooling 2D layer.
+
+static int maxpool2d_init(struct layer *obj) {
+    struct layer_maxpool2d *maxpool2d = calloc(1, sizeof(struct layer_maxpool2d));
+    if (!layer_maxpool2d_init(maxpool2d, obj->input_channels, obj->input_height, obj->input_width, obj->filter_size, obj->stride, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(maxpool2d);
+        return 0;
+    }
+    if (!layer_maxpool2d_set_layout(maxpool2d, obj->layout)) {
+        layer_maxpool2d_free(maxpool2d);
+        free(maxpool2d);
+        return 0;
+    }
+    obj->obj = maxpool2d;
+    return 1;
+}
+
+static int maxpool2d_forward(struct layer *obj, bool training) {
+    (void)training;
+    layer_maxpool2d_forward(obj->obj);
+    return 1;
+}
+
+static int maxpool2d_resize(struct layer *obj) {
+    return layer_maxpool2d_resize(obj->obj);
+}
+
+static int maxpool2d_backward(struct layer *obj) {
+    layer_maxpool2d_backward(obj->obj);
+    return 1;
+}
+
+static void maxpool2d_free(struct layer *obj) {
+    layer_maxpool2d_free(obj->obj);
+}
+
+static int maxpool2d_init_shared(struct layer *obj, const struct layer *shared) {
+    struct layer_maxpool2d *maxpool2d = layer_copy_object(obj, shared, sizeof(struct layer_maxpool2d));
+    if (maxpool2d == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(maxpool2d, obj->input, obj->output, obj->d_output, obj->d_input);
+    maxpool2d->cache.buffer = NULL;
+    maxpool2d->row_max.buffer = NULL;
+    return layer_maxpool2d_resize(maxpool2d);
+}
+
+static void maxpool2d_free_shared(struct layer *obj) {
+    matrix_free(&((struct layer_maxpool2d*)obj->obj)->row_max);
+}
+
+static const struct layer_ops MAXPOOL2D_OPS = {
+    .name = "max pooling 2D",
+    .layout_2d = true,
+    .init = maxpool2d_init,
+    .forward = maxpool2d_forward,
+    .resize = maxpool2d_resize,
+    .backward = maxpool2d_backward,
+    .free = maxpool2d_free,
+    .init_shared = maxpool2d_init_shared,
+    .free_shared = maxpool2d_free_shared
+};
+
+// Padding 2D layer.
+
+static int padding2d_init(struct layer *obj) {
+    struct layer_padding2d *padding2d = calloc(1, sizeof(struct layer_padding2d));
+    if (!layer_padding2d_init(padding2d, obj->input_channels, obj->input_height, obj->input_width, obj->padding_x, obj->padding_y, obj->padding_type, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(padding2d);
+        return 0;
+    }
+    layer_padding2d_set_layout(padding2d, obj->layout);
+    obj->obj = padding2d;
+    return 1;
+}
+
+static int padding2d_forward(struct layer *obj, bool training) {
+    (void)training;
+    return layer_padding2d_forward(obj->obj);
+}
+
+static int padding2d_backward(struct layer *obj) {
+    layer_padding2d_backward(obj->obj);
+    return 1;
+}
+
+static void padding2d_free(struct layer *obj) {
+    layer_padding2d_free(obj->obj);
+}
+
+static int padding2d_serialize(struct layer *obj, FILE *fp) {
+    return write_value(&((struct layer_padding2d*)obj->obj)->type, sizeof(enum padding_type), fp);
+}
+
+static int padding2d_deserialize(struct layer *obj, FILE *fp) {
+    return read_value(&((struct layer_padding2d*)obj->obj)->type, sizeof(enum padding_type), fp);
+}
+
+static int padding2d_init_shared(struct layer *obj, const struct layer *shared) {
+    struct layer_padding2d *padding2d = layer_copy_object(obj, shared, sizeof(struct layer_padding2d));
+    if (padding2d == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(padding2d, obj->input, obj->output, obj->d_output, obj->d_input);
+
+    // The caches are calculated on the first forward pass.
+    padding2d->has_caches = false;
+    padding2d->output_cache = malloc(padding2d->output_height * padding2d->output_width * sizeof(int));
+    if (padding2d->output_cache == NULL) {
+        LAST_ERROR = "Failed to allocate padding cache.";
+        return 0;
+    }
+    return 1;
+}
+
+static const struct layer_ops PADDING2D_OPS = {
+    .name = "padding 2D",
+    .layout_2d = true,
+    .backward_skips_input = true,
+    .backward_skips_output = true,
+    .init = padding2d_init,
+    .forward = padding2d_forward,
+    .backward = padding2d_backward,
+    .free = padding2d_free,
+    .serialize = padding2d_serialize,
+    .deserialize = padding2d_deserialize,
+    .init_shared = padding2d_init_shared,
+    .free_shared = padding2d_free
+};
+
+// Global average pooling 2D layer.
+
+static int globavgpool2d_init(struct layer *obj) {
+    struct layer_globavgpool2d *globavgpool2d = calloc(1, sizeof(struct layer_globavgpool2d));
+    if (!layer_globavgpool2d_init(globavgpool2d, obj->input_channels, obj->input_height, obj->input_width, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(globavgpool2d);
+        return 0;
+    }
+    layer_globavgpool2d_set_layout(globavgpool2d, obj->layout);
+    obj->obj = globavgpool2d;
+    return 1;
+}
+
+static int globavgpool2d_forward(struct layer *obj, bool training) {
+    (void)training;
+    layer_globavgpool2d_forward(obj->obj);
+    return 1;
+}
+
+static int globavgpool2d_backward(struct layer *obj) {
+    layer_globavgpool2d_backward(obj->obj);
+    return 1;
+}
+
+static int globavgpool2d_init_shared(struct layer *obj, const struct layer *shared) {
+    struct layer_globavgpool2d *globavgpool2d = layer_copy_object(obj, shared, sizeof(struct layer_globavgpool2d));
+    if (globavgpool2d == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(globavgpool2d, obj->input, obj->output, obj->d_output, obj->d_input);
+    return 1;
+}
+
+static const struct layer_ops GLOBAVGPOOL2D_OPS = {
+    .name = "global average pooling 2D",
+    .layout_2d_reduces = true,
+    .backward_skips_input = true,
+    .backward_skips_output = true,
+    .init = globavgpool2d_init,
+    .forward = globavgpool2d_forward,
+    .backward = globavgpool2d_backward,
+    .init_shared = globavgpool2d_init_shared
+};
+
+// 2D layout conversion layer.
+
+static int layout2d_init(struct layer *obj) {
+    struct layer_layout2d *layout2d = calloc(1, sizeof(struct layer_layout2d));
+    if (!layer_layout2d_init(layout2d, obj->input_channels, obj->input_height, obj->input_width, obj->layout, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(layout2d);
+        return 0;
+    }
+    obj->obj = layout2d;
+    return 1;
+}
+
+static int layout2d_forward(struct layer *obj, bool training) {
+    (void)training;
+    layer_layout2d_forward(obj->obj);
+    return 1;
+}
+
+static int layout2d_backward(struct layer *obj) {
+    layer_layout2d_backward(obj->obj);
+    return 1;
+}
+
+static int layout2d_init_shared(struct layer *obj, const struct layer *shared) {
+    struct layer_layout2d *layout2d = layer_copy_object(obj, shared, sizeof(struct layer_layout2d));
+    if (layout2d == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(layout2d, obj->input, obj->output, obj->d_output, obj->d_input);
+    return 1;
+}
+
+static const struct layer_ops LAYOUT2D_OPS = {
+    .name = "2D layout conversion",
+    .backward_skips_input = true,
+    .backward_skips_output = true,
+    .init = layout2d_init,
+    .forward = layout2d_forward,
+    .backward = layout2d_backward,
+    .init_shared = layout2d_init_shared
+};
+
+// Dropout layer.
+
+static int dropout_init(struct layer *obj) {
+    // Uses a default rate of 0.0.
+    struct layer_dropout *dropout = calloc(1, sizeof(struct layer_dropout));
+    if (!layer_dropout_init(dropout, obj->input_size, 0.0, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(dropout);
+        return 0;
+    }
+    obj->obj = dropout;
+    return 1;
+}
+
+static int dropout_forward(struct layer *obj, bool training) {
+    if (training) {
+        layer_dropout_forward(obj->obj);
+    } else {
+        layer_dropout_forward_predict(obj->obj);
+    }
+    return 1;
+}
+
+static int dropout_recompute(struct layer *obj) {
+    layer_dropout_forward_replay(obj->obj);
+    return 1;
+}
+
+static int dropout_resize(struct layer *obj) {
+    return layer_dropout_resize(obj->obj);
+}
+
+static int dropout_backward(struct layer *obj) {
+    layer_dropout_backward(obj->obj);
+    return 1;
+}
+
+static void dropout_free(struct layer *obj) {
+    layer_dropout_free(obj->obj);
+}
+
+static int dropout_serialize(struct layer *obj, FILE *fp) {
+    return write_value(&((struct layer_dropout*)obj->obj)->rate, sizeof(double), fp);
+}
+
+static int dropout_deserialize(struct layer *obj, FILE *fp) {
+    return read_value(&((struct layer_dropout*)obj->obj)->rate, sizeof(double), fp);
+}
+
+static int dropout_init_shared(struct layer *obj, const struct layer *shared) {
+    struct layer_dropout *dropout = layer_copy_object(obj, shared, sizeof(struct layer_dropout));
+    if (dropout == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(dropout, obj->input, obj->output, obj->d_output, obj->d_input);
+    dropout->mask.buffer = NULL;
+    return 1;
+}
+
+static const struct layer_ops DROPOUT_OPS = {
+    .name = "dropout",
+    .elementwise = true,
+    .backward_skips_input = true,
+    .backward_skips_output = true,
+    .init = dropout_init,
+    .forward = dropout_forward,
+    .recompute = dropout_recompute,
+    .resize = dropout_resize,
+    .backward = dropout_backward,
+    .free = dropout_free,
+    .serialize = dropout_serialize,
+    .deserialize = dropout_deserialize,
+    .init_shared = dropout_init_shared
+};
+
+// Activation layers. Apart from leaky RELU and softmax, they have no state
+// of their own.
+
+// Define the operations of an activation layer without state.
+#define ACTIVATION_OPS(ops, type, prefix, label) \
+    static int prefix##_init(struct layer *obj) { \
+        struct type *activation = calloc(1, sizeof(struct type)); \
+        if (!type##_init(activation, obj->input_size, obj->input, obj->output, obj->d_output, obj->d_input)) { \
+            free(activation); \
+            return 0; \
+        } \
+        obj->obj = activation; \
+        return 1; \
+    } \
+    static int prefix##_forward(struct layer *obj, bool training) { \
+        (void)training; \
+        type##_forward(obj->obj); \
+        return 1; \
+    } \
+    static int prefix##_backward(struct layer *obj) { \
+        type##_backward(obj->obj); \
+        return 1; \
+    } \
+    static int prefix##_init_shared(struct layer *obj, const struct layer *shared) { \
+        struct type *activation = layer_copy_object(obj, shared, sizeof(struct type)); \
+        if (activation == NULL) { \
+            return 0; \
+        } \
+        LAYER_SET_MATRICES(activation, obj->input, obj->output, obj->d_output, obj->d_input); \
+        return 1; \
+    } \
+    static const struct layer_ops ops = { \
+        .name = label, \
+        .elementwise = true, \
+        .backward_skips_input = true, \
+        .init = prefix##_init, \
+        .forward = prefix##_forward, \
+        .backward = prefix##_backward, \
+        .init_shared = prefix##_init_shared \
+    };
+
+ACTIVATION_OPS(RELU_OPS, activation_relu, relu, "RELU")
+ACTIVATION_OPS(SIGMOID_OPS, activation_sigmoid, sigmoid, "sigmoid")
+ACTIVATION_OPS(TANH_OPS, activation_tanh, tanh, "tanh")
+
+static int leaky_relu_init(struct layer *obj) {
+    struct activation_leaky_relu *relu = calloc(1, sizeof(struct activation_leaky_relu));
+    if (!activation_leaky_relu_init(relu, obj->input_size, 0.01, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(relu);
+        return 0;
+    }
+    obj->obj = relu;
+    return 1;
+}
+
+static int leaky_relu_forward(struct layer *obj, bool training) {
+    (void)training;
+    activation_leaky_relu_forward(obj->obj);
+    return 1;
+}
+
+static int leaky_relu_backward(struct layer *obj) {
+    activation_leaky_relu_backward(obj->obj);
+    return 1;
+}
+
+static int leaky_relu_serialize(struct layer *obj, FILE *fp) {
+    return write_value(&((struct activation_leaky_relu*)obj->obj)->rate, sizeof(double), fp);
+}
+
+static int leaky_relu_deserialize(struct layer *obj, FILE *fp) {
+    return read_value(&((struct activation_leaky_relu*)obj->obj)->rate, sizeof(double), fp);
+}
+
+static int leaky_relu_init_shared(struct layer *obj, const struct layer *shared) {
+    struct activation_leaky_relu *relu = layer_copy_object(obj, shared, sizeof(struct activation_leaky_relu));
+    if (relu == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(relu, obj->input, obj->output, obj->d_output, obj->d_input);
+    return 1;
+}
+
+static const struct layer_ops LEAKY_RELU_OPS = {
+    .name = "leaky RELU",
+    .elementwise = true,
+    .backward_skips_input = true,
+    .init = leaky_relu_init,
+    .forward = leaky_relu_forward,
+    .backward = leaky_relu_backward,
+    .serialize = leaky_relu_serialize,
+    .deserialize = leaky_relu_deserialize,
+    .init_shared = leaky_relu_init_shared
+};
+
+static int softmax_init(struct layer *obj) {
+    struct activation_softmax *softmax = calloc(1, sizeof(struct activation_softmax));
+    if (!activation_softmax_init(softmax, obj->input_size, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(softmax);
+        return 0;
+    }
+    obj->obj = softmax;
+    return 1;
+}
+
+static int softmax_forward(struct layer *obj, bool training) {
+    (void)training;
+    activation_softmax_forward_stable(obj->obj);
+    return 1;
+}
+
+static int softmax_backward(struct layer *obj) {
+    activation_softmax_backward(obj->obj);
+    return 1;
+}
+
+static void softmax_free(struct layer *obj) {
+    activation_softmax_free(obj->obj);
+}
+
+static int softmax_init_shared(struct layer *obj, const struct layer *shared) {
+    struct activation_softmax *softmax = layer_copy_object(obj, shared, sizeof(struct activation_softmax));
+    if (softmax == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(softmax, obj->input, obj->output, obj->d_output, obj->d_input);
+    softmax->jacobian.buffer = NULL;
+    return 1;
+}
+
+static const struct layer_ops SOFTMAX_OPS = {
+    .name = "softmax",
+    .backward_skips_input = true,
+    .init = softmax_init,
+    .forward = softmax_forward,
+    .backward = softmax_backward,
+    .free = softmax_free,
+    .init_shared = softmax_init_shared
+};
+
+// Batch normalization layer.
+
+static int normalization_init(struct layer *obj) {
+    struct layer_normalization *bn = calloc(1, sizeof(struct layer_normalization));
+    if (!layer_normalization_init(bn, obj->input_size, 0.001, 0.0, obj->input, obj->output, obj->d_output, obj->d_input)) {
+        free(bn);
+        return 0;
+    }
+    obj->obj = bn;
+    return 1;
+}
+
+static int normalization_forward(struct layer *obj, bool training) {
+    if (training) {
+        layer_normalization_forward(obj->obj);
+    } else {
+        layer_normalization_forward_predict(obj->obj);
+    }
+    return 1;
+}
+
+static int normalization_recompute(struct layer *obj) {
+    layer_normalization_forward_replay(obj->obj);
+    return 1;
+}
+
+static int normalization_backward(struct layer *obj) {
+    layer_normalization_backward(obj->obj);
+    return 1;
+}
+
+static void normalization_free(struct layer *obj) {
+    layer_normalization_free(obj->obj);
+}
+
+static int normalization_get_params(struct layer *obj, struct matrix **params, struct matrix **grads) {
+    struct layer_normalization *normalization = obj->obj;
+    params[0] = &normalization->gamma;
+    params[1] = &normalization->beta;
+    grads[0] = &normalization->d_gamma;
+    grads[1] = &normalization->d_beta;
+    return 2;
+}
+
+static int normalization_get_weights(struct layer *obj, struct matrix **weights) {
+    struct matrix *grads[LAYER_MAX_PARAMS];
+    int n = normalization_get_params(obj, weights, grads);
+    struct layer_normalization *normalization = obj->obj;
+    weights[n++] = &normalization->running_mean;
+    weights[n++] = &normalization->running_variance;
+    return n;
+}
+
+static int normalization_init_optimizer(struct layer *obj, enum optimizer_type type, va_list ap) {
+    struct optimizer_args args;
+    if (!read_optimizer_args(type, ap, &args)) {
+        return 0;
+    }
+    switch (type) {
+    case OPTIMIZER_SGD:
+        OPTIMIZER_INIT(obj, optimizer_sgd_bn, optimizer_sgd_bn_init(opt, obj->obj, args.learning_rate, args.momentum, args.decay, args.nesterov));
+    case OPTIMIZER_ADAM:
+        OPTIMIZER_INIT(obj, optimizer_adam_bn, optimizer_adam_bn_init(opt, obj->obj, args.learning_rate, args.beta_1, args.beta_2, args.decay, args.epsilon));
+    default:
+        // RMSProp. The type was checked when reading the args.
+        OPTIMIZER_INIT(obj, optimizer_rmsprop_bn, optimizer_rmsprop_bn_init(opt, obj->obj, args.learning_rate, args.decay, args.epsilon, args.rho));
+    }
+}
+
+static int normalization_update(struct layer *obj) {
+    switch (obj->opt.type) {
+    case OPTIMIZER_SGD:
+        optimizer_sgd_bn_update(obj->opt.obj, obj->opt.iter);
+        return 1;
+    case OPTIMIZER_ADAM:
+        optimizer_adam_bn_update(obj->opt.obj, obj->opt.iter);
+        return 1;
+    case OPTIMIZER_RMSPROP:
+        optimizer_rmsprop_bn_update(obj->opt.obj, obj->opt.iter);
+        return 1;
+    default:
+        LAST_ERROR = "Invalid optimizer type.";
+        return 0;
+    }
+}
+
+static int normalization_get_optimizer_state(struct layer *obj, struct matrix **state) {
+    int n = 0;
+    switch (obj->opt.type) {
+    case OPTIMIZER_SGD:
+    {
+        struct optimizer_sgd_bn *sgd = obj->opt.obj;
+        n = add_allocated(state, n, &sgd->gamma_m);
+        n = add_allocated(state, n, &sgd->beta_m);
+        break;
+    }
+    case OPTIMIZER_ADAM:
+    {
+        struct optimizer_adam_bn *adam = obj->opt.obj;
+        n = add_allocated(state, n, &adam->gamma_m);
+        n = add_allocated(state, n, &adam->beta_m);
+        n = add_allocated(state, n, &adam->gamma_c);
+        n = add_allocated(state, n, &adam->beta_c);
+        break;
+    }
+    case OPTIMIZER_RMSPROP:
+    {
+        struct optimizer_rmsprop_bn *rmsprop = obj->opt.obj;
+        n = add_allocated(state, n, &rmsprop->gamma_c);
+        n = add_allocated(state, n, &rmsprop->beta_c);
+        break;
+    }
+    }
+    return n;
+}
+
+static void normalization_free_optimizer(struct layer *obj) {
+    switch (obj->opt.type) {
+    case OPTIMIZER_SGD:
+        optimizer_sgd_bn_free(obj->opt.obj);
+        break;
+    case OPTIMIZER_ADAM:
+        optimizer_adam_bn_free(obj->opt.obj);
+        break;
+    case OPTIMIZER_RMSPROP:
+        optimizer_rmsprop_bn_free(obj->opt.obj);
+        break;
+    }
+}
+
+static int normalization_serialize(struct layer *obj, FILE *fp) {
+    // Save the constants, gamma and beta, along with the running mean and
+    // variance.
+    struct layer_normalization *normalization = obj->obj;
+    return write_value(&normalization->epsilon, sizeof(double), fp) &&
+        write_value(&normalization->momentum, sizeof(double), fp) &&
+        serialize_matrix(&normalization->gamma, fp) &&
+        serialize_matrix(&normalization->beta, fp) &&
+        serialize_matrix(&normalization->running_mean, fp) &&
+        serialize_matrix(&normalization->running_variance, fp);
+}
+
+static int normalization_deserialize(struct layer *obj, FILE *fp) {
+    struct layer_normalization *normalization = obj->obj;
+    return read_value(&normalization->epsilon, sizeof(double), fp) &&
+        read_value(&normalization->momentum, sizeof(double), fp) &&
+        deserialize_matrix(&normalization->gamma, fp) &&
+        deserialize_matrix(&normalization->beta, fp) &&
+        deserialize_matrix(&normalization->running_mean, fp) &&
+        deserialize_matrix(&normalization->running_variance, fp);
+}
+
+static int normalization_init_shared(struct layer *obj, const struct layer *shared) {
+    struct layer_normalization *normalization = layer_copy_object(obj, shared, sizeof(struct layer_normalization));
+    if (normalization == NULL) {
+        return 0;
+    }
+    LAYER_SET_MATRICES(normalization, obj->input, obj->output, obj->d_output, obj->d_input);
+    normalization->d_gamma.buffer = NULL;
+    normalization->d_beta.buffer = NULL;
+    return 1;
+}
+
+static const struct layer_ops NORMALIZATION_OPS = {
+    .name = "batch normalization",
+    .backward_skips_output = true,
+    .init = normalization_init,
+    .forward = normalization_forward,
+    .recompute = normalization_recompute,
+    .backward = normalization_backward,
+    .free = normalization_free,
+    .get_params = normalization_get_params,
+    .get_weights = normalization_get_weights,
+    .init_optimizer = normalization_init_optimizer,
+    .update = normalization_update,
+    .get_optimizer_state = normalization_get_optimizer_state,
+    .free_optimizer = normalization_free_optimizer,
+    .serialize = normalization_serialize,
+    .deserialize = normalization_deserialize,
+    .init_shared = normalization_init_shared
+};
+
+// The operations table of each layer type, indexed by type. The custom types
+// follow the built-in ones.
+static const struct layer_ops *LAYER_TYPES[LAYER_MAX_TYPES] = {
+    [LAYER_DENSE] = &DENSE_OPS,
+    [LAYER_CONV2D] = &CONV2D_OPS,
+    [LAYER_MAXPOOL2D] = &MAXPOOL2D_OPS,
+    [LAYER_PADDING2D] = &PADDING2D_OPS,
+    [LAYER_DROPOUT] = &DROPOUT_OPS,
+    [LAYER_RELU] = &RELU_OPS,
+    [LAYER_LEAKY_RELU] = &LEAKY_RELU_OPS,
+    [LAYER_SIGMOID] = &SIGMOID_OPS,
+    [LAYER_SOFTMAX] = &SOFTMAX_OPS,
+    [LAYER_TANH] = &TANH_OPS,
+    [LAYER_NORMALIZATION] = &NORMALIZATION_OPS,
+    [LAYER_LAYOUT2D] = &LAYOUT2D_OPS,
+    [LAYER_DEPTHWISE_CONV2D] = &DEPTHWISE_CONV2D_OPS,
+    [LAYER_GLOBAVGPOOL2D] = &GLOBAVGPOOL2D_OPS
+};
+
+// The number of layer types.
+static int N_LAYER_TYPES = LAYER_CUSTOM;
+
+// Register a custom layer type, and set its type.
+int layer_register_type(const struct layer_ops *ops, enum layer_type *type) {
+    if (ops == NULL || ops->init == NULL || ops->forward == NULL) {
+        LAST_ERROR = "Layer operations require init and forward functions.";
+        return 0;
+    }
+    if (N_LAYER_TYPES == LAYER_MAX_TYPES) {
+        LAST_ERROR = "Too many layer types.";
+        return 0;
+    }
+    LAYER_TYPES[N_LAYER_TYPES] = ops;
+    *type = (enum layer_type)N_LAYER_TYPES++;
+    return 1;
+}
+
+// Get the operations table of a layer type, or NULL if the type is not
+// registered.
+const struct layer_ops* layer_get_ops(enum layer_type type) {
+    if ((int)type < 0 || (int)type >= N_LAYER_TYPES) {
+        return NULL;
+    }
+    return LAYER_TYPES[type];
+}
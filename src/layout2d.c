@@ -0,0 +1,94 @@
+// layout2d.c
+// 2D activation layout conversion layer.
+
+#include "layout2d.h"
+#include "matrix.h"
+
+// Initialize an empty layer object.
+int layer_layout2d_init(struct layer_layout2d *obj, int n_channels,
+                        int height, int width, enum layout_2d output_layout,
+                        struct matrix *input, struct matrix *output,
+                        struct matrix *d_outputs, struct matrix *d_inputs) {
+    const int size = n_channels * height * width;
+
+    // Set the dimensions and the output layout.
+    obj->n_channels = n_channels;
+    obj->height = height;
+    obj->width = width;
+    obj->output_layout = output_layout;
+
+    // Set the matrices and assert that their sizes are correct. 
+    obj->input = input;
+    if (!(input->n_cols == size)) {
+        // Invalid input size.
+        LAST_ERROR = "Invalid input matrix size.";
+        return 0;
+    }
+    
+    obj->output = output;
+    if (!(output->n_cols == size)) {
+        // Invalid output size.
+        LAST_ERROR = "Invalid output matrix size.";
+        return 0;
+    }
+
+    obj->d_outputs = d_outputs;
+    if (!(d_outputs->n_cols == size)) {
+        // Invalid output gradient size.
+        LAST_ERROR = "Invalid d_outputs matrix size.";
+        return 0;
+    }
+
+    obj->d_inputs = d_inputs;
+    if (!(d_inputs->n_cols == size)) {
+        // Invalid input gradient size.
+        LAST_ERROR = "Invalid d_inputs matrix size.";
+        return 0;
+    }
+
+    if (!((input->n_rows == output->n_rows) && (input->n_rows == d_outputs->n_rows) && (input->n_rows == d_inputs->n_rows))) {
+        // Invalid output gradient size.
+        LAST_ERROR = "Input, output, d_inputs, and d_outputs matrices must have the same number of rows/samples.";
+        return 0;
+    }
+
+    return 1;
+}
+
+// Transpose each sample from (rows, cols) to (cols, rows).
+static void layout2d_transpose(const double *src, double *dst, int n_samples, int rows, int cols) {
+    const int sample_size = rows * cols;
+    for (int sample = 0; sample < n_samples; sample++) {
+        const double *s = &src[sample * sample_size];
+        double *d = &dst[sample * sample_size];
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                d[j * rows + i] = s[i * cols + j];
+            }
+        }
+    }
+}
+
+// Perform a forward pass on the layer.
+void layer_layout2d_forward(struct layer_layout2d *obj) {
+    const int plane_size = obj->height * obj->width;
+    if (obj->output_layout == LAYOUT_NHWC) {
+        // Each sample is (n_channels, plane_size) in the input.
+        layout2d_transpose(obj->input->buffer, obj->output->buffer, obj->input->n_rows, obj->n_channels, plane_size);
+    } else {
+        // Each sample is (plane_size, n_channels) in the input.
+        layout2d_transpose(obj->input->buffer, obj->output->buffer, obj->input->n_rows, plane_size, obj->n_channels);
+    }
+}
+
+// Perform a backward pass on the layer.
+void layer_layout2d_backward(struct layer_layout2d *obj) {
+    const int plane_size = obj->height * obj->width;
+    if (obj->output_layout == LAYOUT_NHWC) {
+        // Convert the gradients back to NCHW.
+        layout2d_transpose(obj->d_outputs->buffer, obj->d_inputs->buffer, obj->input->n_rows, plane_size, obj->n_channels);
+    } else {
+        // Convert the gradients back to NHWC.
+        layout2d_transpose(obj->d_outputs->buffer, obj->d_inputs->buffer, obj->input->n_rows, obj->n_channels, plane_size);
+    }
+}
@@ -11,6 +11,7 @@ int matrix_init(struct matrix *obj, int n_rows, int n_cols) {
     obj->n_rows = n_rows;
     obj->n_cols = n_cols;
     obj->size = n_rows * n_cols;
+    obj->view = false;
 
     // Initialize the matrix buffer.
     obj->buffer = (double *)malloc(n_rows * n_cols * sizeof(double));
@@ -21,9 +22,27 @@ int matrix_init(struct matrix *obj, int n_rows, int n_cols) {
     return 1;
 }
 
-// Free a matrix buffer.
+// Initialize a matrix view of an existing buffer.
+void matrix_init_view(struct matrix *obj, int n_rows, int n_cols, double *buffer) {
+    obj->n_rows = n_rows;
+    obj->n_cols = n_cols;
+    obj->size = n_rows * n_cols;
+    obj->buffer = buffer;
+    obj->view = true;
+}
+
+// Set the number of rows in use. The buffer must hold at least n_rows * 
+// n_cols values.
+void matrix_set_rows(struct matrix *obj, int n_rows) {
+    obj->n_rows = n_rows;
+    obj->size = n_rows * obj->n_cols;
+}
+
+// Free a matrix buffer. Views only drop their buffer.
 void matrix_free(struct matrix *obj) {
     // Free the buffer.
-    free(obj->buffer);
+    if (!obj->view) {
+        free(obj->buffer);
+    }
     obj->buffer = NULL;
 }
\ No newline at end of file
@@ -7,6 +7,41 @@
 #include "maxpool2d.h"
 #include "matrix.h"
 
+// Select the kernel and initialize its caches.
+static int maxpool2d_select_kernel(struct layer_maxpool2d *obj) {
+    matrix_free(&obj->cache);
+    matrix_free(&obj->row_max);
+    obj->cache.buffer = NULL;
+    obj->row_max.buffer = NULL;
+
+    // Select the kernel. The common pooling configurations use specialized
+    // kernels which process whole rows at a time.
+    if (obj->layout == LAYOUT_NHWC) {
+        obj->kernel = MAXPOOL2D_KERNEL_NHWC;
+    } else if (obj->pool_size == 2 && obj->stride == 2) {
+        obj->kernel = MAXPOOL2D_KERNEL_2X2_S2;
+    } else if (obj->pool_size == 3 && obj->stride == 2) {
+        obj->kernel = MAXPOOL2D_KERNEL_3X3_S2;
+    } else {
+        obj->kernel = MAXPOOL2D_KERNEL_GENERIC;
+    }
+
+    switch (obj->kernel) {
+    case MAXPOOL2D_KERNEL_GENERIC:
+        // Initialize the max pool cache, which is only needed for training.
+        if (obj->d_outputs->buffer == NULL) {
+            return 1;
+        }
+        return matrix_init(&obj->cache, obj->input->n_rows, obj->n_channels * obj->input_height * obj->input_width);
+    case MAXPOOL2D_KERNEL_2X2_S2:
+    case MAXPOOL2D_KERNEL_3X3_S2:
+        // Initialize the row cache.
+        return matrix_init(&obj->row_max, 1, obj->input_width);
+    default:
+        return 1;
+    }
+}
+
 // Initialize an empty layer object.
 int layer_maxpool2d_init(struct layer_maxpool2d *obj, int n_channels, 
                          int input_height, int input_width, int pool_size, 
@@ -59,21 +94,261 @@ int layer_maxpool2d_init(struct layer_maxpool2d *obj, int n_channels,
         return 0;
     }
 
-    // Initialize the max pool cache. 
-    if (!matrix_init(&obj->cache, obj->input->n_rows, obj->n_channels * obj->input_height * obj->input_width)) {
-        return 0;
-    }
+    // Use the NCHW layout by default.
+    obj->layout = LAYOUT_NCHW;
+    obj->cache.buffer = NULL;
+    obj->row_max.buffer = NULL;
+
+    return maxpool2d_select_kernel(obj);
+}
 
-    return 1;
+// Set the activation layout. Returns 1 if successful.
+int layer_maxpool2d_set_layout(struct layer_maxpool2d *obj, enum layout_2d layout) {
+    obj->layout = layout;
+    return maxpool2d_select_kernel(obj);
+}
+
+// Reallocate the cache for the current number of rows of the input matrix.
+// Returns 1 if successful.
+int layer_maxpool2d_resize(struct layer_maxpool2d *obj) {
+    return maxpool2d_select_kernel(obj);
 }
 
 // Free the cache owned by the layer.
 void layer_maxpool2d_free(struct layer_maxpool2d *obj) {
     matrix_free(&obj->cache);
+    matrix_free(&obj->row_max);
+}
+
+// Return the maximum of two values. Written as a select so that the row loops
+// compile to vector max instructions.
+static inline double max2(double a, double b) {
+    return a > b ? a : b;
+}
+
+// Perform a forward pass with the 2x2, stride 2 kernel.
+static void layer_maxpool2d_forward_2x2_s2(struct layer_maxpool2d *obj) {
+    const int input_channel_size = obj->input_height * obj->input_width;
+    const int output_channel_size = obj->output_height * obj->output_width;
+    const int n_planes = obj->input->n_rows * obj->n_channels;
+    const int width = obj->input_width;
+    const int row_size = obj->output_width * 2;
+    double *row_max = obj->row_max.buffer;
+
+    // Each (sample, channel) pair is a contiguous plane of the input.
+    for (int plane = 0; plane < n_planes; plane++) {
+        const double *input = &obj->input->buffer[plane * input_channel_size];
+        double *output = &obj->output->buffer[plane * output_channel_size];
+        for (int i = 0; i < obj->output_height; i++) {
+            const double *r0 = &input[i * 2 * width];
+            const double *r1 = r0 + width;
+
+            // Take the maximum over the two input rows.
+            for (int x = 0; x < row_size; x++) {
+                row_max[x] = max2(r0[x], r1[x]);
+            }
+
+            // Take the maximum over each pair of columns.
+            for (int j = 0; j < obj->output_width; j++) {
+                output[i * obj->output_width + j] = max2(row_max[j * 2], row_max[j * 2 + 1]);
+            }
+        }
+    }
+}
+
+// Perform a forward pass with the 3x3, stride 2 kernel.
+static void layer_maxpool2d_forward_3x3_s2(struct layer_maxpool2d *obj) {
+    const int input_channel_size = obj->input_height * obj->input_width;
+    const int output_channel_size = obj->output_height * obj->output_width;
+    const int n_planes = obj->input->n_rows * obj->n_channels;
+    const int width = obj->input_width;
+    const int row_size = obj->output_width * 2 + 1;
+    double *row_max = obj->row_max.buffer;
+
+    // Each (sample, channel) pair is a contiguous plane of the input.
+    for (int plane = 0; plane < n_planes; plane++) {
+        const double *input = &obj->input->buffer[plane * input_channel_size];
+        double *output = &obj->output->buffer[plane * output_channel_size];
+        for (int i = 0; i < obj->output_height; i++) {
+            const double *r0 = &input[i * 2 * width];
+            const double *r1 = r0 + width;
+            const double *r2 = r1 + width;
+
+            // Take the maximum over the three input rows.
+            for (int x = 0; x < row_size; x++) {
+                row_max[x] = max2(max2(r0[x], r1[x]), r2[x]);
+            }
+
+            // Take the maximum over each overlapping triple of columns.
+            for (int j = 0; j < obj->output_width; j++) {
+                output[i * obj->output_width + j] = max2(max2(row_max[j * 2], row_max[j * 2 + 1]), row_max[j * 2 + 2]);
+            }
+        }
+    }
+}
+
+// Perform a backward pass with the 2x2, stride 2 kernel. The pooling windows
+// do not overlap, so each input gradient is written exactly once.
+static void layer_maxpool2d_backward_2x2_s2(struct layer_maxpool2d *obj) {
+    const int input_channel_size = obj->input_height * obj->input_width;
+    const int output_channel_size = obj->output_height * obj->output_width;
+    const int n_planes = obj->input->n_rows * obj->n_channels;
+    const int width = obj->input_width;
+
+    for (int plane = 0; plane < n_planes; plane++) {
+        const double *input = &obj->input->buffer[plane * input_channel_size];
+        const double *output = &obj->output->buffer[plane * output_channel_size];
+        const double *d_outputs = &obj->d_outputs->buffer[plane * output_channel_size];
+        double *d_inputs = &obj->d_inputs->buffer[plane * input_channel_size];
+        for (int i = 0; i < obj->output_height; i++) {
+            for (int r = 0; r < 2; r++) {
+                const double *in_row = &input[(i * 2 + r) * width];
+                double *d_in_row = &d_inputs[(i * 2 + r) * width];
+                for (int j = 0; j < obj->output_width; j++) {
+                    // Pass the gradient to each input equal to the maximum.
+                    double max = output[i * obj->output_width + j];
+                    double grad = d_outputs[i * obj->output_width + j];
+                    d_in_row[j * 2] = in_row[j * 2] == max ? grad : 0.0;
+                    d_in_row[j * 2 + 1] = in_row[j * 2 + 1] == max ? grad : 0.0;
+                }
+
+                // Zero the columns which are not covered by a window.
+                for (int x = obj->output_width * 2; x < width; x++) {
+                    d_in_row[x] = 0.0;
+                }
+            }
+        }
+
+        // Zero the rows which are not covered by a window.
+        for (int x = obj->output_height * 2 * width; x < input_channel_size; x++) {
+            d_inputs[x] = 0.0;
+        }
+    }
+}
+
+// Perform a backward pass with the 3x3, stride 2 kernel. The pooling windows
+// overlap, so the input gradients are accumulated.
+static void layer_maxpool2d_backward_3x3_s2(struct layer_maxpool2d *obj) {
+    const int input_channel_size = obj->input_height * obj->input_width;
+    const int output_channel_size = obj->output_height * obj->output_width;
+    const int n_planes = obj->input->n_rows * obj->n_channels;
+    const int width = obj->input_width;
+
+    // Zero the gradients.
+    for (int i = 0; i < obj->d_inputs->size; i++) {
+        obj->d_inputs->buffer[i] = 0.0;
+    }
+
+    for (int plane = 0; plane < n_planes; plane++) {
+        const double *input = &obj->input->buffer[plane * input_channel_size];
+        const double *output = &obj->output->buffer[plane * output_channel_size];
+        const double *d_outputs = &obj->d_outputs->buffer[plane * output_channel_size];
+        double *d_inputs = &obj->d_inputs->buffer[plane * input_channel_size];
+        for (int i = 0; i < obj->output_height; i++) {
+            for (int r = 0; r < 3; r++) {
+                const double *in_row = &input[(i * 2 + r) * width];
+                double *d_in_row = &d_inputs[(i * 2 + r) * width];
+                for (int j = 0; j < obj->output_width; j++) {
+                    // Pass the gradient to each input equal to the maximum.
+                    double max = output[i * obj->output_width + j];
+                    double grad = d_outputs[i * obj->output_width + j];
+                    for (int x = j * 2; x < j * 2 + 3; x++) {
+                        if (in_row[x] == max) {
+                            d_in_row[x] += grad;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Perform a forward pass with the NHWC layout. Each output pixel is the 
+// maximum over the channel vectors of the input pixels in its window.
+static void layer_maxpool2d_forward_nhwc(struct layer_maxpool2d *obj) {
+    const int n_channels = obj->n_channels;
+    const int input_sample_size = n_channels * obj->input_height * obj->input_width;
+    const int output_sample_size = n_channels * obj->output_height * obj->output_width;
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *input = &obj->input->buffer[sample * input_sample_size];
+        double *output = &obj->output->buffer[sample * output_sample_size];
+        for (int i = 0; i < obj->output_height; i++) {
+            for (int j = 0; j < obj->output_width; j++) {
+                double *out = &output[(i * obj->output_width + j) * n_channels];
+                const double *in = &input[(i * obj->stride * obj->input_width + j * obj->stride) * n_channels];
+
+                // Start with the first pixel in the window.
+                for (int c = 0; c < n_channels; c++) {
+                    out[c] = in[c];
+                }
+                for (int x = 0; x < obj->pool_size; x++) {
+                    for (int y = 0; y < obj->pool_size; y++) {
+                        const double *in_pixel = &in[(x * obj->input_width + y) * n_channels];
+                        for (int c = 0; c < n_channels; c++) {
+                            out[c] = max2(out[c], in_pixel[c]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Perform a backward pass with the NHWC layout. The pooling windows may 
+// overlap, so the input gradients are accumulated.
+static void layer_maxpool2d_backward_nhwc(struct layer_maxpool2d *obj) {
+    const int n_channels = obj->n_channels;
+    const int input_sample_size = n_channels * obj->input_height * obj->input_width;
+    const int output_sample_size = n_channels * obj->output_height * obj->output_width;
+
+    // Zero the gradients.
+    for (int i = 0; i < obj->d_inputs->size; i++) {
+        obj->d_inputs->buffer[i] = 0.0;
+    }
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *input = &obj->input->buffer[sample * input_sample_size];
+        const double *output = &obj->output->buffer[sample * output_sample_size];
+        const double *d_outputs = &obj->d_outputs->buffer[sample * output_sample_size];
+        double *d_inputs = &obj->d_inputs->buffer[sample * input_sample_size];
+        for (int i = 0; i < obj->output_height; i++) {
+            for (int j = 0; j < obj->output_width; j++) {
+                const double *out = &output[(i * obj->output_width + j) * n_channels];
+                const double *d_out = &d_outputs[(i * obj->output_width + j) * n_channels];
+                for (int x = 0; x < obj->pool_size; x++) {
+                    for (int y = 0; y < obj->pool_size; y++) {
+                        // Pass the gradient to each input equal to the maximum.
+                        const int offset = ((i * obj->stride + x) * obj->input_width + j * obj->stride + y) * n_channels;
+                        const double *in = &input[offset];
+                        double *d_in = &d_inputs[offset];
+                        for (int c = 0; c < n_channels; c++) {
+                            d_in[c] += in[c] == out[c] ? d_out[c] : 0.0;
+                        }
+                    }
+                }
+            }
+        }
+    }
 }
 
 // Perform a forward pass on the layer.
 void layer_maxpool2d_forward(struct layer_maxpool2d *obj) {
+    switch (obj->kernel) {
+    case MAXPOOL2D_KERNEL_2X2_S2:
+        layer_maxpool2d_forward_2x2_s2(obj);
+        return;
+    case MAXPOOL2D_KERNEL_3X3_S2:
+        layer_maxpool2d_forward_3x3_s2(obj);
+        return;
+    case MAXPOOL2D_KERNEL_NHWC:
+        layer_maxpool2d_forward_nhwc(obj);
+        return;
+    default:
+        break;
+    }
+
+    // Use the generic kernel.
     double max, current;
 
     // Iterate over each output value.
@@ -98,7 +373,10 @@ void layer_maxpool2d_forward(struct layer_maxpool2d *obj) {
                     // Set the max value.
                     obj->output->buffer[sample * (obj->n_channels * obj->output_height * obj->output_width) + channel * (obj->output_height * obj->output_width) + i * obj->output_width + j] = max;
                 
-                    // Set the cache.
+                    // Set the cache, unless the layer is for inference only.
+                    if (obj->cache.buffer == NULL) {
+                        continue;
+                    }
                     for (int x = 0; x < obj->pool_size; x++) {
                         for (int y = 0; y < obj->pool_size; y++) {
                             // Set the cache value to 1.0 if the value is the maximum.
@@ -117,7 +395,21 @@ void layer_maxpool2d_forward(struct layer_maxpool2d *obj) {
 
 // Perform a backward pass on the layer.
 void layer_maxpool2d_backward(struct layer_maxpool2d *obj) { 
-    // Zero the gradients.
+    switch (obj->kernel) {
+    case MAXPOOL2D_KERNEL_2X2_S2:
+        layer_maxpool2d_backward_2x2_s2(obj);
+        return;
+    case MAXPOOL2D_KERNEL_3X3_S2:
+        layer_maxpool2d_backward_3x3_s2(obj);
+        return;
+    case MAXPOOL2D_KERNEL_NHWC:
+        layer_maxpool2d_backward_nhwc(obj);
+        return;
+    default:
+        break;
+    }
+
+    // Use the generic kernel. Zero the gradients.
     for (int i = 0; i < obj->d_inputs->size; i++) {
         obj->d_inputs->buffer[i] = 0.0;
     }
@@ -0,0 +1,108 @@
+// memory_plan.c
+// Liveness-based memory planning for activation buffers.
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "memory_plan.h"
+#include "arena.h"
+
+// Check if two tensors are live at the same time. The ranges of tensor i are
+// ranges[order[start[i]]] to ranges[order[start[i + 1] - 1]].
+static bool tensors_overlap(int a, int b, const struct memory_plan_range *ranges, 
+                            const int *order, const int *start) {
+    for (int i = start[a]; i < start[a + 1]; i++) {
+        const struct memory_plan_range *range_a = &ranges[order[i]];
+        for (int j = start[b]; j < start[b + 1]; j++) {
+            const struct memory_plan_range *range_b = &ranges[order[j]];
+            if (range_a->first_use <= range_b->last_use && range_b->first_use <= range_a->last_use) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Assign an offset to each tensor, so that tensors which are live at the 
+// same time do not overlap. Every offset is aligned to ARENA_ALIGNMENT. 
+// Returns the size of the buffer needed by the plan, in doubles, or -1 if 
+// it failed.
+int memory_plan_assign(struct memory_plan_tensor *tensors, int n_tensors,
+                       const struct memory_plan_range *ranges, int n_ranges) {
+    int *order = malloc(n_tensors * sizeof(int));
+    int *placed = malloc(n_tensors * sizeof(int));
+    int *range_order = malloc((n_ranges + 1) * sizeof(int));
+    int *range_start = calloc(n_tensors + 1, sizeof(int));
+    if (order == NULL || placed == NULL || range_order == NULL || range_start == NULL) {
+        free(order);
+        free(placed);
+        free(range_order);
+        free(range_start);
+        LAST_ERROR = "Failed to allocate memory plan.";
+        return -1;
+    }
+
+    // Group the ranges by tensor.
+    for (int i = 0; i < n_ranges; i++) {
+        range_start[ranges[i].tensor + 1]++;
+    }
+    for (int i = 0; i < n_tensors; i++) {
+        range_start[i + 1] += range_start[i];
+        placed[i] = range_start[i];
+    }
+    for (int i = 0; i < n_ranges; i++) {
+        range_order[placed[ranges[i].tensor]++] = i;
+    }
+
+    // Place the tensors from largest to smallest, since the large ones 
+    // decide the size of the plan.
+    for (int i = 0; i < n_tensors; i++) {
+        int j = i;
+        while (j > 0 && tensors[order[j - 1]].size < tensors[i].size) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    // Place each tensor at the lowest offset where it fits between the 
+    // placed tensors which are live at the same time. The placed list is 
+    // kept sorted by offset.
+    int total = 0, n_placed = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        struct memory_plan_tensor *tensor = &tensors[order[i]];
+        int size = ARENA_ALIGN_SIZE(tensor->size);
+        int offset = 0;
+        for (int j = 0; j < n_placed; j++) {
+            const struct memory_plan_tensor *other = &tensors[placed[j]];
+            if (!tensors_overlap(order[i], placed[j], ranges, range_order, range_start)) {
+                continue;
+            }
+            if (offset + size <= other->offset) {
+                break;
+            }
+            int end = other->offset + ARENA_ALIGN_SIZE(other->size);
+            if (end > offset) {
+                offset = end;
+            }
+        }
+        tensor->offset = offset;
+        if (offset + size > total) {
+            total = offset + size;
+        }
+
+        // Insert into the placed list.
+        int j = n_placed++;
+        while (j > 0 && tensors[placed[j - 1]].offset > offset) {
+            placed[j] = placed[j - 1];
+            j--;
+        }
+        placed[j] = order[i];
+    }
+
+    free(order);
+    free(placed);
+    free(range_order);
+    free(range_start);
+    return total;
+}
@@ -8,32 +8,26 @@
 #include <stdio.h>
 #include <math.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
 #include "model.h"
+#include "layer_ops.h"
 #include "matrix.h"
-#include "dense.h"
 #include "conv2d.h"
 #include "maxpool2d.h"
-#include "padding2d.h"
-#include "dropout.h"
-#include "sigmoid.h"
+#include "arena.h"
+#include "fused_optimizer.h"
+#include "checkpoint.h"
 #include "softmax.h"
-#include "relu.h"
-#include "leaky_relu.h"
-#include "tanh.h"
-#include "sgd.h"
-#include "adam.h"
-#include "rmsprop.h"
-#include "sgd_conv2d.h"
-#include "adam_conv2d.h"
-#include "rmsprop_conv2d.h"
 #include "mse.h"
 #include "mae.h"
 #include "crossentropy.h"
 #include "binary_crossentropy.h"
-#include "batch_normalization.h"
-#include "sgd_bn.h"
-#include "adam_bn.h"
-#include "rmsprop_bn.h"
 
 
 // Initialize a layer object. The layer should have its type, input size, and 
@@ -42,594 +36,152 @@
 // matrix and output gradients.
 int layer_init(struct layer *obj, int n_samples, struct matrix *inputs, 
                struct matrix *d_prev) {
-    // Create the new output matrix.
-    struct matrix* current_output = calloc(1, sizeof(struct matrix));
-    if (!matrix_init(current_output, n_samples, obj->output_size)) {
-        free(current_output);
-        return 0;
-    }
-
-    // Create the new gradient matrix.
-    struct matrix* current_gradient = calloc(1, sizeof(struct matrix));
-    if (!matrix_init(current_gradient, n_samples, obj->output_size)) {
-        free(current_gradient);
+    // Look up the operations of the layer type.
+    obj->ops = layer_get_ops(obj->type);
+    if (obj->ops == NULL) {
+        LAST_ERROR = "Invalid layer type.";
         return 0;
     }
 
-    switch (obj->type) {
-    case LAYER_DENSE:
-    {
-        // Initialize the dense layer.
-        struct layer_dense* dense = calloc(1, sizeof(struct layer_dense));
-        if (!layer_dense_init(dense, obj->input_size, obj->output_size, inputs, current_output, current_gradient, d_prev)) {
-            free(dense);
-            return 0;
-        }
-        obj->trainable = true;
-        obj->obj = dense;
-        break;
-    }
-    case LAYER_CONV2D:
-    {
-        // Initialize the conv 2D layer.
-        struct layer_conv2d* conv2d = calloc(1, sizeof(struct layer_conv2d));
-        if (!layer_conv2d_init(conv2d, obj->input_channels, obj->input_height, obj->input_width, obj->output_channels, obj->filter_size, obj->stride, inputs, current_output, current_gradient, d_prev)) {
-            free(conv2d);
-            return 0;
-        }
-        obj->trainable = true;
-        obj->obj = conv2d;
-        break;
-    }
-    case LAYER_MAXPOOL2D:
-    {
-        // Initialize the max pooling 2D layer.
-        struct layer_maxpool2d* maxpool2d = calloc(1, sizeof(struct layer_maxpool2d));
-        if (!layer_maxpool2d_init(maxpool2d, obj->input_channels, obj->input_height, obj->input_width, obj->filter_size, obj->stride, inputs, current_output, current_gradient, d_prev)) {
-            free(maxpool2d);
-            return 0;
-        }
-        obj->obj = maxpool2d;
-        break;
-    }
-    case LAYER_PADDING2D:
-    {
-        // Initialize the padding 2D layer.
-        struct layer_padding2d* padding2d = calloc(1, sizeof(struct layer_padding2d));
-        if (!layer_padding2d_init(padding2d, obj->input_channels, obj->input_height, obj->input_width, obj->padding_x, obj->padding_y, PADDING_ZERO, inputs, current_output, current_gradient, d_prev)) {
-            free(padding2d);
-            return 0;
-        }
-        obj->obj = padding2d;
-        break;
-    }
-    case LAYER_DROPOUT:
-    {
-        // Initialize the dropout layer. Uses a default mask of 0.0.
-        struct layer_dropout *dropout = calloc(1, sizeof(struct layer_dropout));
-        if (!layer_dropout_init(dropout, obj->input_size, 0.0, inputs, current_output, current_gradient, d_prev)) {
-            free(dropout);
-            return 0;
-        }
-        obj->obj = dropout;
-        break;
-    }
-    case LAYER_SOFTMAX:
-    {
-        // Initialize the softmax activation layer.
-        struct activation_softmax* softmax = calloc(1, sizeof(struct activation_softmax));
-        if (!activation_softmax_init(softmax, obj->input_size, inputs, current_output, current_gradient, d_prev)) {
-            free(softmax);
+    // Create the new output matrix, unless the memory planner set it.
+    struct matrix* current_output = obj->output;
+    if (current_output == NULL) {
+        current_output = calloc(1, sizeof(struct matrix));
+        if (!matrix_init(current_output, n_samples, obj->output_size)) {
+            free(current_output);
             return 0;
         }
-        obj->obj = softmax;
-        break;
-    }
-    case LAYER_SIGMOID:
-    {
-        // Initialize the sigmoid activation layer.
-        struct activation_sigmoid* sigmoid = calloc(1, sizeof(struct activation_sigmoid));
-        if (!activation_sigmoid_init(sigmoid, obj->input_size, inputs, current_output, current_gradient, d_prev)) {
-            free(sigmoid);
-            return 0;
-        }
-        obj->obj = sigmoid;
-        break;
-    }
-    case LAYER_RELU:
-    {
-        // Initialize the RELU activation layer.
-        struct activation_relu* relu = calloc(1, sizeof(struct activation_relu));
-        if (!activation_relu_init(relu, obj->input_size, inputs, current_output, current_gradient, d_prev)) {
-            free(relu);
-            return 0;
-        }
-        obj->obj = relu;
-        break;
     }
-	case LAYER_LEAKY_RELU:
-	{
-		// Initialize the leaky RELU activation layer.
-		struct activation_leaky_relu* relu = calloc(1, sizeof(struct activation_leaky_relu));
-		if (!activation_leaky_relu_init(relu, obj->input_size, 0.01, inputs, current_output, current_gradient, d_prev)) {
-			free(relu);
-			return 0;
-		}
-		obj->obj = relu;
-		break;
-	}
-	case LAYER_TANH:
-	{
-		// Initialize the tanh activation layer.
-		struct activation_tanh* tanh = calloc(1, sizeof(struct activation_tanh));
-		if (!activation_tanh_init(tanh, obj->input_size, inputs, current_output, current_gradient, d_prev)) {
-			free(tanh);
-			return 0;
-		}
-		obj->obj = tanh;
-		break;
-	}
-    case LAYER_NORMALIZATION:
-    {
-        // Initialize the batch normalization layer.
-        struct layer_normalization* bn = calloc(1, sizeof(struct layer_normalization));
-        if (!layer_normalization_init(bn, obj->input_size, 0.001, 0.0, inputs, current_output, current_gradient, d_prev)) {
-            free(bn);
+
+    // Create the new gradient matrix, unless the memory planner set it.
+    struct matrix* current_gradient = obj->d_output;
+    if (current_gradient == NULL) {
+        current_gradient = calloc(1, sizeof(struct matrix));
+        if (!matrix_init(current_gradient, n_samples, obj->output_size)) {
+            free(current_gradient);
             return 0;
         }
-        obj->trainable = true;
-        obj->obj = bn;
-        break;
-    }
-    default:
-        LAST_ERROR = "Invalid layer type.";
-        return 0;
     }
 
-    // Set the values for the layer.
+    // Set the values for the layer, and initialize the layer object. Layers
+    // with their own optimizers are trainable.
     obj->input = inputs;
     obj->output = current_output;
     obj->d_output = current_gradient;
     obj->d_input = d_prev;
-
-    return 1;
+    obj->trainable = obj->ops->init_optimizer != NULL;
+    return obj->ops->init(obj);
 }
 
 // Initialize the layer's optimizer. Requires an optimizer type and variable
 // args list, which will be used by the function.
 int layer_init_optimizer(struct layer* obj, enum optimizer_type type, 
                          va_list ap) {
-    obj->opt.type = type;
-    obj->opt.iter = 0;
-
-    switch (obj->type) {
-    case LAYER_DENSE:
-        switch (type) {
-        case OPTIMIZER_SGD:
-        {
-            // Stochastic gradient descent.
-            double lr, mom, dec;
-            bool nesterov;
-	    	lr = va_arg(ap, double);
-            mom = va_arg(ap, double);
-            dec = va_arg(ap, double);
-            nesterov = (bool)va_arg(ap, int);
-	    	struct optimizer_sgd* sgd = calloc(1, sizeof(struct optimizer_sgd));
-            obj->opt.obj = sgd;
-            if (!optimizer_sgd_init(sgd, obj->obj, lr, mom, dec, nesterov)) {
-                free(sgd);
-                return 0;
-            }
-            break;
-        }
-        case OPTIMIZER_ADAM:
-        {
-            // Adam.
-            double lr, b1, b2, dec, eps;
-            lr = va_arg(ap, double);
-            b1 = va_arg(ap, double);
-            b2 = va_arg(ap, double);
-            dec = va_arg(ap, double);
-            eps = va_arg(ap, double);
-            struct optimizer_adam* adam = calloc(1, sizeof(struct optimizer_adam));
-            obj->opt.obj = adam;
-            if (!optimizer_adam_init(adam, obj->obj, lr, b1, b2, dec, eps)) {
-                free(adam);
-                return 0;
-            }
-            break;
-        }
-		case OPTIMIZER_RMSPROP:
-		{
-	    	// RMSProp.
-	    	double lr, dec, epsilon, rho;
-	    	lr = va_arg(ap, double);
-	    	dec = va_arg(ap, double);
-	    	epsilon = va_arg(ap, double);
-	    	rho = va_arg(ap, double);
-	    	struct optimizer_rmsprop* rmsprop = calloc(1, sizeof(struct optimizer_rmsprop));
-	    	obj->opt.obj = rmsprop;
-	    	if (!optimizer_rmsprop_init(rmsprop, obj->obj, lr, dec, epsilon, rho)) {
-				free(rmsprop);
-				return 0;
-	    	}
-	    	break;
-		}
-        default:
-            LAST_ERROR = "Invalid optimizer type.";
-            return 0;
-        }
-        break;
-    case LAYER_CONV2D:
-        switch (type) {
-        case OPTIMIZER_SGD:
-        {
-            // Stochastic gradient descent.
-            double lr, mom, dec;
-	    	bool nesterov;
-            lr = va_arg(ap, double);
-            mom = va_arg(ap, double);
-            dec = va_arg(ap, double);
-	    	nesterov = (bool)va_arg(ap, int);
-            struct optimizer_sgd_conv2d* sgd = calloc(1, sizeof(struct optimizer_sgd_conv2d));
-            obj->opt.obj = sgd;
-            if (!optimizer_sgd_conv2d_init(sgd, obj->obj, lr, mom, dec, nesterov)) {
-                free(sgd);
-                return 0;
-            }
-            break;
-        }
-        case OPTIMIZER_ADAM:
-        {
-            // Adam.
-            double lr, b1, b2, dec, eps;
-            lr = va_arg(ap, double);
-            b1 = va_arg(ap, double);
-            b2 = va_arg(ap, double);
-            dec = va_arg(ap, double);
-            eps = va_arg(ap, double);
-            struct optimizer_adam_conv2d* adam = calloc(1, sizeof(struct optimizer_adam_conv2d));
-            obj->opt.obj = adam;
-            if (!optimizer_adam_conv2d_init(adam, obj->obj, lr, b1, b2, dec, eps)) {
-                free(adam);
-                return 0;
-            }
-            break;
-        }
-		case OPTIMIZER_RMSPROP:
-		{
-	    	// RMSProp.
-	    	double lr, dec, eps, rho;
-	    	lr = va_arg(ap, double);
-	    	dec = va_arg(ap, double);
-	    	eps = va_arg(ap, double);
-	    	rho = va_arg(ap, double);
-	    	struct optimizer_rmsprop_conv2d* rmsprop = calloc(1, sizeof(struct optimizer_rmsprop_conv2d));
-	    	obj->opt.obj = rmsprop;
-	    	if (!optimizer_rmsprop_conv2d_init(rmsprop, obj->obj, lr, dec, eps, rho)) {
-				free(rmsprop);
-				return 0;
-	    	}
-	    	break;
-		}
-        default:
-            LAST_ERROR = "Invalid optimizer type.";
-            return 0;
-        }
-        break;
-    case LAYER_NORMALIZATION:
-        switch (type) {
-        case OPTIMIZER_SGD:
-        {
-            // Stochastic gradient descent.
-            double lr, mom, dec;
-	    	bool nesterov;
-            lr = va_arg(ap, double);
-            mom = va_arg(ap, double);
-            dec = va_arg(ap, double);
-	    	nesterov = (bool)va_arg(ap, int);
-            struct optimizer_sgd_bn* sgd = calloc(1, sizeof(struct optimizer_sgd_bn));
-            obj->opt.obj = sgd;
-            if (!optimizer_sgd_bn_init(sgd, obj->obj, lr, mom, dec, nesterov)) {
-                free(sgd);
-                return 0;
-            }
-            break;
-        }
-        case OPTIMIZER_ADAM:
-        {
-            // Adam.
-            double lr, b1, b2, dec, eps;
-            lr = va_arg(ap, double);
-            b1 = va_arg(ap, double);
-            b2 = va_arg(ap, double);
-            dec = va_arg(ap, double);
-            eps = va_arg(ap, double);
-            struct optimizer_adam_bn* adam = calloc(1, sizeof(struct optimizer_adam_bn));
-            obj->opt.obj = adam;
-            if (!optimizer_adam_bn_init(adam, obj->obj, lr, b1, b2, dec, eps)) {
-                free(adam);
-                return 0;
-            }
-            break;
-        }
-		case OPTIMIZER_RMSPROP:
-		{
-	    	// RMSProp.
-	    	double lr, dec, eps, rho;
-	    	lr = va_arg(ap, double);
-	    	dec = va_arg(ap, double);
-	    	eps = va_arg(ap, double);
-	    	rho = va_arg(ap, double);
-	    	struct optimizer_rmsprop_bn* rmsprop = calloc(1, sizeof(struct optimizer_rmsprop_bn));
-	    	obj->opt.obj = rmsprop;
-	    	if (!optimizer_rmsprop_bn_init(rmsprop, obj->obj, lr, dec, eps, rho)) {
-				free(rmsprop);
-				return 0;
-	    	}
-	    	break;
-		}
-        default:
-            LAST_ERROR = "Invalid optimizer type.";
-            return 0;
-        }
-        break;
-    default:
+    if (obj->ops->init_optimizer == NULL) {
         LAST_ERROR = "Layer is untrainable; cannot initialize optimizer.";
         return 0;
     }
 
-    return 1;
+    // Set the optimizer values.
+    obj->opt.type = type;
+    obj->opt.iter = 0;
+
+    return obj->ops->init_optimizer(obj, type, ap);
 }
 
 // Perform a forward pass on the layer.
 int layer_forward(struct layer *obj, bool training) {
-    switch (obj->type) {
-    case LAYER_DENSE:
-        layer_dense_forward(obj->obj);
-        break;
-    case LAYER_CONV2D:
-        layer_conv2d_forward(obj->obj);
-        break;
-    case LAYER_MAXPOOL2D:
-        layer_maxpool2d_forward(obj->obj);
-        break;
-    case LAYER_PADDING2D:
-        if (!layer_padding2d_forward(obj->obj)) {
-            return 0;
-        }
-        break;
-    case LAYER_DROPOUT:
-        if (training) {
-            layer_dropout_forward(obj->obj);
-        } else {
-            layer_dropout_forward_predict(obj->obj);
-        }
-        break;
-    case LAYER_SOFTMAX:
-        activation_softmax_forward_stable(obj->obj);
-        break;
-    case LAYER_SIGMOID:
-        activation_sigmoid_forward(obj->obj);
-        break;
-    case LAYER_RELU:
-        activation_relu_forward(obj->obj);
-        break;
-	case LAYER_LEAKY_RELU:
-		activation_leaky_relu_forward(obj->obj);
-		break;
-	case LAYER_TANH:
-		activation_tanh_forward(obj->obj);
-		break;
-    case LAYER_NORMALIZATION:
-        layer_normalization_forward(obj->obj);
-        break;
-    default:
-        LAST_ERROR = "Invalid layer type.";
-        return 0;
+    return obj->ops->forward(obj, training);
+}
+
+// Repeat the last training forward pass on the layer, for gradient 
+// checkpointing. Dropout masks and batch statistics are reused, so the 
+// output is the same.
+int layer_recompute(struct layer *obj) {
+    if (obj->ops->recompute == NULL) {
+        return obj->ops->forward(obj, true);
     }
-    return 1;
+    return obj->ops->recompute(obj);
+}
+
+// Reallocate the layer's per-sample state for the current number of rows of
+// its matrices. Most layers have none.
+int layer_resize(struct layer *obj) {
+    return obj->ops->resize == NULL || obj->ops->resize(obj);
 }
 
 // Perform a backward pass on the layer.
 int layer_backward(struct layer *obj) {
-    switch (obj->type) {
-    case LAYER_DENSE:
-        layer_dense_backward(obj->obj);
-        break;
-    case LAYER_CONV2D:
-        layer_conv2d_backward(obj->obj);
-        break;
-    case LAYER_MAXPOOL2D:
-        layer_maxpool2d_backward(obj->obj);
-        break;
-    case LAYER_PADDING2D:
-        layer_padding2d_backward(obj->obj);
-        break;
-    case LAYER_DROPOUT:
-        layer_dropout_backward(obj->obj);
-        break;
-    case LAYER_SOFTMAX:
-        activation_softmax_backward(obj->obj);
-        break;
-    case LAYER_SIGMOID:
-        activation_sigmoid_backward(obj->obj);
-        break;
-    case LAYER_RELU:
-        activation_relu_backward(obj->obj);
-        break;
-	case LAYER_LEAKY_RELU:
-		activation_leaky_relu_backward(obj->obj);
-		break;
-	case LAYER_TANH:
-		activation_tanh_backward(obj->obj);
-		break;
-    case LAYER_NORMALIZATION:
-        layer_normalization_backward(obj->obj);
-    default:
-        LAST_ERROR = "Invalid layer type.";
+    if (obj->ops->backward == NULL) {
+        LAST_ERROR = "Layer has no backward pass.";
         return 0;
     }
-    return 1;
+    return obj->ops->backward(obj);
 }
 
 // Free the layer, along with its matrices and optimizer. If a matrix is 
 // already freed or not initialized, it will be skipped.
 int layer_free(struct layer *obj) {
-    switch (obj->type) {
-        case LAYER_DENSE:
-            layer_dense_free((struct layer_dense*)(obj->obj));
-            break;
-        case LAYER_CONV2D:
-            layer_conv2d_free((struct layer_conv2d*)(obj->obj));
-            break;
-        case LAYER_MAXPOOL2D:
-            layer_maxpool2d_free((struct layer_maxpool2d*)(obj->obj));
-            break;
-        case LAYER_PADDING2D:
-            layer_padding2d_free((struct layer_padding2d*)(obj->obj));
-            break;
-        case LAYER_DROPOUT:
-            layer_dropout_free((struct layer_dropout*)(obj->obj));
-            break;
-        case LAYER_SOFTMAX:
-            activation_softmax_free((struct activation_softmax*)(obj->obj));
-            break;
-        case LAYER_NORMALIZATION:
-            layer_normalization_free((struct layer_normalization*)(obj->obj));
-            break;
-        case LAYER_SIGMOID:
-        case LAYER_RELU:
-		case LAYER_LEAKY_RELU:
-		case LAYER_TANH:
-			break;
-        default:
-            LAST_ERROR = "Invalid layer type.";
-            return 0;
+    if (obj->ops == NULL) {
+        LAST_ERROR = "Invalid layer type.";
+        return 0;
     }
 
     // Free the layer itself.
+    if (obj->ops->free != NULL) {
+        obj->ops->free(obj);
+    }
     free(obj->obj);
 
     // Free the optimizer.
     if (obj->opt.obj != NULL) {
-        switch (obj->type) {
-        case LAYER_DENSE:
-            switch (obj->opt.type) {
-            case OPTIMIZER_SGD:
-                optimizer_sgd_free((struct optimizer_sgd*)(obj->opt.obj));
-                break;
-            case OPTIMIZER_ADAM:
-                optimizer_adam_free((struct optimizer_adam*)(obj->opt.obj));
-                break;
-            case OPTIMIZER_RMSPROP:
-				optimizer_rmsprop_free((struct optimizer_rmsprop*)(obj->opt.obj));
-				break;
-	    default:
-                LAST_ERROR = "Invalid optimizer type.";
-                return 0;
-            }
-            break;
-        case LAYER_CONV2D:
-            switch (obj->opt.type) {
-            case OPTIMIZER_SGD:
-                optimizer_sgd_conv2d_free((struct optimizer_sgd_conv2d*)(obj->opt.obj));
-                break;
-            case OPTIMIZER_ADAM:
-                optimizer_adam_conv2d_free((struct optimizer_adam_conv2d*)(obj->opt.obj));
-                break;
-	    	case OPTIMIZER_RMSPROP:
-				optimizer_rmsprop_conv2d_free((struct optimizer_rmsprop_conv2d*)(obj->opt.obj));
-				break;
-            default:
-                LAST_ERROR = "Invalid optimizer type.";
-                return 0;
-            }
-            break;
-        case LAYER_NORMALIZATION:
-            switch (obj->opt.type) {
-            case OPTIMIZER_SGD:
-                optimizer_sgd_bn_free((struct optimizer_sgd_bn*)(obj->opt.obj));
-                break;
-            case OPTIMIZER_ADAM:
-                optimizer_adam_bn_free((struct optimizer_adam_bn*)(obj->opt.obj));
-                break;
-	    	case OPTIMIZER_RMSPROP:
-				optimizer_rmsprop_bn_free((struct optimizer_rmsprop_bn*)(obj->opt.obj));
-				break;
-            default:
-                LAST_ERROR = "Invalid optimizer type.";
-                return 0;
-            }
-            break;
-        default:
-            LAST_ERROR = "Layer is untrainable; cannot free optimizer.";
-            return 0;
+        if (obj->ops->free_optimizer != NULL) {
+            obj->ops->free_optimizer(obj);
         }
-
-        // Free the optimizer itself.
         free(obj->opt.obj);
     }
 
     return 1;
 }
 
+// Get the layer's trainable parameter matrices and their gradients. Returns 
+// the number of matrices, at most LAYER_MAX_PARAMS.
+int layer_get_params(struct layer* obj, struct matrix **params, struct matrix **grads) {
+    if (obj->ops->get_params == NULL) {
+        return 0;
+    }
+    return obj->ops->get_params(obj, params, grads);
+}
+
+// Get the matrices allocated by the layer's optimizer. Returns the number of
+// matrices, at most LAYER_MAX_OPTIMIZER_STATE.
+int layer_get_optimizer_state(struct layer* obj, struct matrix **state) {
+    if (obj->opt.obj == NULL || obj->ops->get_optimizer_state == NULL) {
+        return 0;
+    }
+    return obj->ops->get_optimizer_state(obj, state);
+}
+
+// Get the layer's weight matrices for hot reloading. Returns the number of 
+// matrices, at most LAYER_MAX_WEIGHTS.
+int layer_get_weights(struct layer* obj, struct matrix **weights) {
+    if (obj->ops->get_weights == NULL) {
+        struct matrix *grads[LAYER_MAX_PARAMS];
+        return layer_get_params(obj, weights, grads);
+    }
+    return obj->ops->get_weights(obj, weights);
+}
+
 // Perform an update on the layer's optimizer.
 int layer_update(struct layer* obj) {
     if (obj->opt.obj != NULL) {
-        switch (obj->type) {
-        case LAYER_DENSE:
-            switch (obj->opt.type) {
-            case OPTIMIZER_SGD:
-                optimizer_sgd_update(obj->opt.obj, obj->opt.iter);
-                break;
-            case OPTIMIZER_ADAM:
-                optimizer_adam_update(obj->opt.obj, obj->opt.iter);
-                break;
-	    	case OPTIMIZER_RMSPROP:
-				optimizer_rmsprop_update(obj->opt.obj, obj->opt.iter);
-				break;
-            default:
-                LAST_ERROR = "Invalid optimizer type.";
-                return 0;
-            }
-            break;
-        case LAYER_CONV2D:
-            switch (obj->opt.type) {
-            case OPTIMIZER_SGD:
-                optimizer_sgd_conv2d_update(obj->opt.obj, obj->opt.iter);
-                break;
-            case OPTIMIZER_ADAM:
-                optimizer_adam_conv2d_update(obj->opt.obj, obj->opt.iter);
-                break;
-	    	case OPTIMIZER_RMSPROP:
-				optimizer_rmsprop_conv2d_update(obj->opt.obj, obj->opt.iter);
-				break;
-            default:
-                LAST_ERROR = "Invalid optimizer type.";
-                return 0;
-            }
-            break;
-        case LAYER_NORMALIZATION:
-            switch (obj->opt.type) {
-            case OPTIMIZER_SGD:
-                optimizer_sgd_bn_update(obj->opt.obj, obj->opt.iter);
-                break;
-            case OPTIMIZER_ADAM:
-                optimizer_adam_bn_update(obj->opt.obj, obj->opt.iter);
-                break;
-	    	case OPTIMIZER_RMSPROP:
-				optimizer_rmsprop_bn_update(obj->opt.obj, obj->opt.iter);
-				break;
-            default:
-                LAST_ERROR = "Invalid optimizer type.";
-                return 0;
-            }
-            break;
-        default:
+        if (obj->ops->update == NULL) {
             LAST_ERROR = "Layer is untrainable; cannot update optimizer.";
             return 0;
         }
+        if (!obj->ops->update(obj)) {
+            return 0;
+        }
     }
 
     // Increment optimizer iteration.
@@ -750,6 +302,8 @@ int loss_backward(struct loss *obj) {
 // Free the loss object.
 int loss_free(struct loss *obj) {
     switch (obj->type) {
+        case LOSS_NONE:
+            return 1;
         case LOSS_MSE:
         case LOSS_MAE:        
         case LOSS_CROSSENTROPY:
@@ -766,10 +320,170 @@ int loss_free(struct loss *obj) {
     return 1;
 }
 
+// Allocate the lock guarding the model's published weights.
+static int model_init_weights_lock(struct model *obj) {
+    if (obj->weights_lock != NULL) {
+        return 1;
+    }
+#ifdef _WIN32
+    SRWLOCK *lock = malloc(sizeof(SRWLOCK));
+    if (lock != NULL) {
+        InitializeSRWLock(lock);
+    }
+#else
+    pthread_mutex_t *lock = malloc(sizeof(pthread_mutex_t));
+    if (lock != NULL && pthread_mutex_init(lock, NULL) != 0) {
+        free(lock);
+        lock = NULL;
+    }
+#endif
+    if (lock == NULL) {
+        LAST_ERROR = "Failed to allocate weights lock.";
+        return 0;
+    }
+    obj->weights_lock = lock;
+    return 1;
+}
+
+static void model_lock_weights(struct model *obj) {
+#ifdef _WIN32
+    AcquireSRWLockExclusive(obj->weights_lock);
+#else
+    pthread_mutex_lock(obj->weights_lock);
+#endif
+}
+
+static void model_unlock_weights(struct model *obj) {
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(obj->weights_lock);
+#else
+    pthread_mutex_unlock(obj->weights_lock);
+#endif
+}
+
+// Free a version of the weights.
+static void model_weights_free(struct model_weights *obj) {
+    arena_free(&obj->arena);
+    free(obj->buffers);
+    free(obj);
+}
+
+// Take a reference to the published weights. Returns NULL if there are none.
+static struct model_weights *model_acquire_weights(struct model *obj) {
+    model_lock_weights(obj);
+    struct model_weights *weights = obj->weights;
+    if (weights != NULL) {
+        weights->refs++;
+    }
+    model_unlock_weights(obj);
+    return weights;
+}
+
+// Release a reference to a version of the weights, and free it with its last
+// reference.
+static void model_release_weights(struct model *obj, struct model_weights *weights) {
+    if (weights == NULL) {
+        return;
+    }
+    model_lock_weights(obj);
+    const bool last = --weights->refs == 0;
+    model_unlock_weights(obj);
+    if (last) {
+        model_weights_free(weights);
+    }
+}
+
+// Bind a list of layers to a version of the weights.
+static void model_bind_weights(struct layer *first, const struct model_weights *weights) {
+    int k = 0;
+    for (struct layer *current = first; current != NULL; current = current->next) {
+        struct matrix *matrices[LAYER_MAX_WEIGHTS];
+        const int n = layer_get_weights(current, matrices);
+        for (int i = 0; i < n; i++, k++) {
+            if (matrices[i] != NULL) {
+                matrices[i]->buffer = weights->buffers[k];
+            }
+        }
+    }
+}
+
+// Bind a reader's layers to the published weights if they changed. The reader
+// keeps its reference to the weights it is bound to, so they stay valid 
+// until it binds to newer ones.
+static void model_refresh_weights(struct model *obj, struct layer *first, struct model_weights **bound) {
+    if (obj->weights_lock == NULL) {
+        return;
+    }
+    struct model_weights *weights = model_acquire_weights(obj);
+    if (weights == NULL || weights == *bound) {
+        model_release_weights(obj, weights);
+        return;
+    }
+    model_bind_weights(first, weights);
+    model_release_weights(obj, *bound);
+    *bound = weights;
+}
+
+// Restore the model's original weights, release the published weights, and 
+// free the lock.
+static void model_free_weights(struct model *obj) {
+    if (obj->weights_lock == NULL) {
+        return;
+    }
+    if (obj->original_weights != NULL) {
+        model_bind_weights(obj->first, obj->original_weights);
+        model_weights_free(obj->original_weights);
+        obj->original_weights = NULL;
+    }
+    model_release_weights(obj, obj->bound_weights);
+    model_release_weights(obj, obj->weights);
+    obj->bound_weights = NULL;
+    obj->weights = NULL;
+#ifndef _WIN32
+    pthread_mutex_destroy(obj->weights_lock);
+#endif
+    free(obj->weights_lock);
+    obj->weights_lock = NULL;
+}
+
 // Initialize an empty model object.
 int model_init(struct model *obj, int n_samples) {
-    // Set the number of samples.
+    // Set the number of samples. Full batches are used until the model sets
+    // its active samples.
     obj->n_samples = n_samples;
+    obj->active_samples = n_samples;
+    obj->input = NULL;
+
+    // The arenas are allocated when the model is finalized and when the 
+    // optimizers are initialized.
+    obj->params = (struct arena){0};
+    obj->grads = (struct arena){0};
+    obj->optimizer_state = (struct arena){0};
+    obj->fused_optimizer = NULL;
+    obj->y = NULL;
+    obj->loss_output = NULL;
+
+    // The model has no loss until one is set.
+    obj->loss.type = LOSS_NONE;
+    obj->loss.obj = NULL;
+
+    // Share the activation buffers during training by default.
+    obj->memory_plan = MEMORY_PLAN_TRAINING;
+    obj->activations = (struct arena){0};
+    obj->planned_activation_size = 0;
+    obj->unplanned_activation_size = 0;
+    obj->checkpoint_interval = 0;
+
+    // No weights are published until the model is reloaded.
+    obj->weights = NULL;
+    obj->bound_weights = NULL;
+    obj->original_weights = NULL;
+    obj->weights_lock = NULL;
+    obj->mapping = NULL;
+    obj->mapping_size = 0;
+    obj->epoch = 0;
+    obj->batch = 0;
+    obj->checkpoint = NULL;
 
     return 1;
 }
@@ -781,16 +495,23 @@ int model_free(struct model *obj) {
         LAST_ERROR = "Model not initialized.";
         return 0;
     }
+
+    // Stop the checkpoint writer, once the pending checkpoint is written.
+    model_set_checkpoint(obj, NULL, 0);
     
-    // Free y matrix.
-    matrix_free(obj->y);
-    free(obj->y);
-    obj->y = NULL;
+    // Free y matrix. Inference only models have none.
+    if (obj->y != NULL) {
+        matrix_free(obj->y);
+        free(obj->y);
+        obj->y = NULL;
+    }
 
     // Free the loss output matrix.
-    matrix_free(obj->loss_output);
-    free(obj->loss_output);
-    obj->loss_output = NULL;
+    if (obj->loss_output != NULL) {
+        matrix_free(obj->loss_output);
+        free(obj->loss_output);
+        obj->loss_output = NULL;
+    }
 
     // Free the first input matrix.
     matrix_free(obj->input);
@@ -818,6 +539,10 @@ int model_free(struct model *obj) {
         current = current->next;
     } while (current != NULL);
 
+    // Bind the original weights again, so the layers free their own buffers,
+    // and release the published weights.
+    model_free_weights(obj);
+
     // Free layers and optimizers.
     current = obj->first;
     struct layer *next;
@@ -830,36 +555,411 @@ int model_free(struct model *obj) {
         current = next;
     } while (current != NULL);
 
+    // Free the arenas.
+    arena_free(&obj->params);
+    arena_free(&obj->grads);
+    arena_free(&obj->optimizer_state);
+    arena_free(&obj->activations);
+
+    // Free the fused optimizer. Its state is in the arena.
+    free(obj->fused_optimizer);
+    obj->fused_optimizer = NULL;
+
+    // Unmap the model file, now that no layer uses its weights.
+    if (obj->mapping != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(obj->mapping);
+#else
+        munmap(obj->mapping, obj->mapping_size);
+#endif
+        obj->mapping = NULL;
+        obj->mapping_size = 0;
+    }
+
     // Free the loss.
     return loss_free(&obj->loss);
 }
 
-// Add a layer without initializing it. Returns the layer if successful.
-struct layer* model_add_layer(struct model *obj, enum layer_type type, int input_size, int output_size) {
-    // Create the layer and set the values.
-    struct layer *l = (struct layer*)calloc(1, sizeof(struct layer));
-    l->prev = obj->last;
-    obj->last = l;
-    l->type = type;
-    l->input_size = input_size;
-    l->output_size = output_size;
-
-    // If this is the first layer, set the first layer.
-    if (!obj->n_layers) {
-        obj->first = l;
-    } else {
-        // If this is not the first layer, set the "next" value for the 
-        // previous layer.
-        l->prev->next = l;
+// Move matrices into a new arena. The matrices become views into the arena.
+// If copy is set, their values are copied, otherwise the views are zero.
+static int model_pack_matrices(struct arena *arena, struct matrix **matrices, int n, bool copy) {
+    // Calculate the arena size.
+    int size = 0;
+    for (int i = 0; i < n; i++) {
+        size += ARENA_ALIGN_SIZE(matrices[i]->size);
     }
 
-    obj->n_layers++;
+    arena_free(arena);
+    if (!arena_init(arena, size)) {
+        return 0;
+    }
 
-    return l;
+    for (int i = 0; i < n; i++) {
+        // Replace the buffer with a view, and free the old buffer.
+        struct matrix old = *matrices[i];
+        if (!arena_alloc(arena, matrices[i], old.n_rows, old.n_cols)) {
+            return 0;
+        }
+        if (copy) {
+            memcpy(matrices[i]->buffer, old.buffer, old.size * sizeof(double));
+        }
+        matrix_free(&old);
+    }
+    return 1;
 }
 
-// Add a conv 2D layer without initializing it. Returns the layer if 
-// successful.
+// Move the parameters and gradients of each layer into the model's arenas.
+static int model_pack_params(struct model *obj) {
+    struct matrix **params = malloc(obj->n_layers * LAYER_MAX_PARAMS * sizeof(struct matrix*));
+    struct matrix **grads = malloc(obj->n_layers * LAYER_MAX_PARAMS * sizeof(struct matrix*));
+    if (params == NULL || grads == NULL) {
+        free(params);
+        free(grads);
+        LAST_ERROR = "Failed to allocate parameter list.";
+        return 0;
+    }
+
+    // Collect the matrices.
+    int n = 0;
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        n += layer_get_params(current, &params[n], &grads[n]);
+    }
+
+    // For inference only, the layers have no gradients.
+    int result = model_pack_matrices(&obj->params, params, n, true);
+    if (result && obj->memory_plan != MEMORY_PLAN_INFERENCE) {
+        result = model_pack_matrices(&obj->grads, grads, n, false);
+    }
+    free(params);
+    free(grads);
+    return result;
+}
+
+// Check if the layer's backward pass reads its input. Unknown layers are 
+// assumed to read it.
+static bool layer_backward_reads_input(enum layer_type type) {
+    const struct layer_ops *ops = layer_get_ops(type);
+    return ops == NULL || !ops->backward_skips_input;
+}
+
+// Check if the layer's backward pass reads its output. Unknown layers are 
+// assumed to read it.
+static bool layer_backward_reads_output(enum layer_type type) {
+    const struct layer_ops *ops = layer_get_ops(type);
+    return ops == NULL || !ops->backward_skips_output;
+}
+
+// Check if the layer is elementwise, and can run in place.
+static bool layer_is_elementwise(enum layer_type type) {
+    const struct layer_ops *ops = layer_get_ops(type);
+    return ops != NULL && ops->elementwise;
+}
+
+// Mark the elementwise layers which can run in place. The output of the 
+// previous layer is overwritten, so when training, it must not be needed by 
+// the backward pass of either layer. The first layer keeps the model input 
+// intact.
+static void model_assign_in_place(struct model *obj) {
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        current->in_place = current->prev != NULL && layer_is_elementwise(current->type) &&
+            current->input_size == current->output_size &&
+            (obj->memory_plan == MEMORY_PLAN_INFERENCE || 
+            (!layer_backward_reads_input(current->type) && !layer_backward_reads_output(current->prev->type)));
+    }
+}
+
+// Mark the layers whose outputs are kept as checkpoints, every interval 
+// layers. A checkpoint can not be followed by an in place layer, which would
+// overwrite it, so it moves to the end of the in place chain.
+static void model_assign_checkpoints(struct model *obj) {
+    int interval = obj->checkpoint_interval;
+    if (interval == MODEL_CHECKPOINT_AUTO) {
+        interval = (int)ceil(sqrt((double)obj->n_layers));
+    }
+    if (obj->memory_plan != MEMORY_PLAN_TRAINING) {
+        interval = 0;
+    }
+
+    int since_checkpoint = 0;
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        since_checkpoint++;
+        current->checkpoint = interval > 0 && since_checkpoint >= interval && 
+            current->next != NULL && !current->next->in_place;
+        if (current->checkpoint) {
+            since_checkpoint = 0;
+        }
+    }
+}
+
+// Get the first layer of the checkpointing segment which ends with a layer.
+static struct layer* model_segment_start(struct layer *end) {
+    struct layer *start = end;
+    while (start->prev != NULL && !start->prev->checkpoint) {
+        start = start->prev;
+    }
+    return start;
+}
+
+// Get the first layer which writes the checkpoint at the end of a segment. 
+// The in place layers before the checkpoint share its buffer, so only the 
+// layers before this one are recomputed.
+static struct layer* model_segment_checkpoint_start(struct layer *end) {
+    struct layer *start = end;
+    while (start->in_place) {
+        start = start->prev;
+    }
+    return start;
+}
+
+// The live ranges of the model's tensors, built by walking the schedule of 
+// the forward and backward passes.
+struct model_liveness {
+    struct memory_plan_range *ranges;
+    int n_ranges;
+
+    // The current range of each tensor, or -1.
+    int *current;
+
+    // The current step.
+    int step;
+};
+
+// Mark a tensor as read in the current step. Reads of a tensor without a 
+// value, such as the model input, are skipped.
+static void liveness_read(struct model_liveness *obj, int tensor) {
+    if (tensor >= 0 && obj->current[tensor] >= 0) {
+        obj->ranges[obj->current[tensor]].last_use = obj->step;
+    }
+}
+
+// Mark a tensor as written in the current step. The old value is dead, 
+// unless it was read in the same step by an in place layer.
+static void liveness_write(struct model_liveness *obj, int tensor) {
+    if (tensor < 0) {
+        return;
+    }
+    if (obj->current[tensor] >= 0 && obj->ranges[obj->current[tensor]].last_use >= obj->step) {
+        return;
+    }
+    obj->current[tensor] = obj->n_ranges;
+    obj->ranges[obj->n_ranges++] = (struct memory_plan_range){tensor, obj->step, obj->step};
+}
+
+// Plan the layer outputs and gradients for a number of samples, so that the
+// ones which are never live at the same time share memory. The lifetimes 
+// come from the schedule of the passes: the forward pass, then for training
+// the loss and the backward pass of each checkpointing segment, from the 
+// last one, after recomputing its forward pass. In place layers share the
+// tensors of the previous layer. The offsets of the output and gradient of
+// each layer are stored in offsets. Returns the size of the plan, in 
+// doubles, or -1 if it failed.
+static int model_plan_offsets(struct model *obj, int n_samples, enum memory_plan_mode mode, int *offsets) {
+    const int n = obj->n_layers;
+    const bool crossentropy_softmax = IS_CROSSENTROPY_SOFTMAX(obj);
+
+    // The tensors, the output and gradient tensor of each layer, and the 
+    // layers by index.
+    struct memory_plan_tensor *tensors = malloc(2 * n * sizeof(struct memory_plan_tensor));
+    int *layer_tensors = malloc(2 * n * sizeof(int));
+    struct layer **layers = malloc(n * sizeof(struct layer*));
+    struct model_liveness liveness = {0};
+    liveness.ranges = malloc((4 * n + 1) * sizeof(struct memory_plan_range));
+    liveness.current = malloc(2 * n * sizeof(int));
+    if (tensors == NULL || layer_tensors == NULL || layers == NULL || liveness.ranges == NULL || liveness.current == NULL) {
+        free(tensors);
+        free(layer_tensors);
+        free(layers);
+        free(liveness.ranges);
+        free(liveness.current);
+        LAST_ERROR = "Failed to allocate memory plan.";
+        return -1;
+    }
+
+    // Create the tensors. In place layers use the tensors of the previous 
+    // layer.
+    int i = 0, n_tensors = 0;
+    for (struct layer *current = obj->first; current != NULL; current = current->next, i++) {
+        layers[i] = current;
+        if (current->in_place) {
+            layer_tensors[2 * i] = layer_tensors[2 * i - 2];
+            layer_tensors[2 * i + 1] = layer_tensors[2 * i - 1];
+        } else {
+            for (int j = 0; j < 2; j++) {
+                layer_tensors[2 * i + j] = n_tensors;
+                liveness.current[n_tensors] = -1;
+                tensors[n_tensors++] = (struct memory_plan_tensor){n_samples * current->output_size, 0};
+            }
+        }
+    }
+
+    // The output and gradient tensors of a layer index. The model input and
+    // its gradient are not planned.
+    #define OUTPUT_TENSOR(index) ((index) >= 0 ? layer_tensors[2 * (index)] : -1)
+    #define GRADIENT_TENSOR(index) ((index) >= 0 ? layer_tensors[2 * (index) + 1] : -1)
+
+    // The forward pass.
+    for (i = 0; i < n; i++, liveness.step++) {
+        liveness_read(&liveness, OUTPUT_TENSOR(i - 1));
+        liveness_write(&liveness, OUTPUT_TENSOR(i));
+    }
+
+    if (mode == MEMORY_PLAN_TRAINING) {
+        // The loss writes the gradient of the last layer, or of the softmax 
+        // input with the crossentropy softmax loss.
+        liveness_read(&liveness, OUTPUT_TENSOR(n - 1));
+        liveness_write(&liveness, GRADIENT_TENSOR(crossentropy_softmax ? n - 2 : n - 1));
+        liveness.step++;
+
+        // The segments, from the last one.
+        int end = n - 1;
+        while (end >= 0) {
+            int start = end;
+            while (start > 0 && !layers[start - 1]->checkpoint) {
+                start--;
+            }
+
+            // Recompute the segment, except for the layers writing its 
+            // checkpoint. The last segment is still live from the forward 
+            // pass.
+            if (end != n - 1) {
+                int checkpoint_start = end;
+                while (layers[checkpoint_start]->in_place) {
+                    checkpoint_start--;
+                }
+                for (i = start; i < checkpoint_start; i++, liveness.step++) {
+                    liveness_read(&liveness, OUTPUT_TENSOR(i - 1));
+                    liveness_write(&liveness, OUTPUT_TENSOR(i));
+                }
+            }
+
+            // The backward passes.
+            for (i = end; i >= start; i--, liveness.step++) {
+                if (crossentropy_softmax && i == n - 1) {
+                    continue;
+                }
+                liveness_read(&liveness, GRADIENT_TENSOR(i));
+                if (layer_backward_reads_output(layers[i]->type)) {
+                    liveness_read(&liveness, OUTPUT_TENSOR(i));
+                }
+                if (layer_backward_reads_input(layers[i]->type)) {
+                    liveness_read(&liveness, OUTPUT_TENSOR(i - 1));
+                }
+                liveness_write(&liveness, GRADIENT_TENSOR(i - 1));
+            }
+            end = start - 1;
+        }
+    }
+
+    // The model output is kept.
+    liveness.step = MEMORY_PLAN_FOREVER;
+    liveness_read(&liveness, OUTPUT_TENSOR(n - 1));
+
+    #undef OUTPUT_TENSOR
+    #undef GRADIENT_TENSOR
+
+    // Assign the offsets.
+    int size = memory_plan_assign(tensors, n_tensors, liveness.ranges, liveness.n_ranges);
+    for (i = 0; i < 2 * n && size >= 0; i++) {
+        offsets[i] = tensors[layer_tensors[i]].offset;
+    }
+    free(liveness.ranges);
+    free(liveness.current);
+    free(layers);
+    free(tensors);
+    free(layer_tensors);
+    return size;
+}
+
+// Plan the layer outputs and gradients with the model's memory plan, and 
+// allocate them in the activations arena. The planned matrices are set on 
+// the layers as views, before the layers are initialized. When the model is
+// planned again, the layers keep their matrices.
+static int model_plan_activations(struct model *obj) {
+    int *offsets = malloc(2 * obj->n_layers * sizeof(int));
+    if (offsets == NULL) {
+        LAST_ERROR = "Failed to allocate memory plan.";
+        return 0;
+    }
+    int size = model_plan_offsets(obj, obj->n_samples, obj->memory_plan, offsets);
+    arena_free(&obj->activations);
+    if (size < 0 || !arena_init(&obj->activations, size)) {
+        free(offsets);
+        return 0;
+    }
+    obj->planned_activation_size = size;
+
+    // Set the views on the layers. For inference only, the gradients have
+    // the right sizes but no buffers, so the layers skip their training
+    // state.
+    const bool inference = obj->memory_plan == MEMORY_PLAN_INFERENCE;
+    int i = 0;
+    obj->unplanned_activation_size = 0;
+    for (struct layer *current = obj->first; current != NULL; current = current->next, i++) {
+        obj->unplanned_activation_size += 2 * obj->n_samples * current->output_size;
+        if (current->output == NULL) {
+            current->output = calloc(1, sizeof(struct matrix));
+        }
+        if (current->d_output == NULL) {
+            current->d_output = calloc(1, sizeof(struct matrix));
+        }
+        if (current->output == NULL || current->d_output == NULL) {
+            free(offsets);
+            LAST_ERROR = "Failed to allocate matrix.";
+            return 0;
+        }
+        matrix_init_view(current->output, obj->n_samples, current->output_size, &obj->activations.buffer[offsets[2 * i]]);
+        matrix_init_view(current->d_output, obj->n_samples, current->output_size, inference ? NULL : &obj->activations.buffer[offsets[2 * i + 1]]);
+    }
+
+    free(offsets);
+    return 1;
+}
+
+// Move the optimizer state of each layer into the model's arena.
+static int model_pack_optimizer_state(struct model *obj) {
+    struct matrix **state = malloc(obj->n_layers * LAYER_MAX_OPTIMIZER_STATE * sizeof(struct matrix*));
+    if (state == NULL) {
+        LAST_ERROR = "Failed to allocate optimizer state list.";
+        return 0;
+    }
+
+    // Collect the matrices.
+    int n = 0;
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        n += layer_get_optimizer_state(current, &state[n]);
+    }
+
+    int result = model_pack_matrices(&obj->optimizer_state, state, n, true);
+    free(state);
+    return result;
+}
+
+// Add a layer without initializing it. Returns the layer if successful.
+struct layer* model_add_layer(struct model *obj, enum layer_type type, int input_size, int output_size) {
+    // Create the layer and set the values.
+    struct layer *l = (struct layer*)calloc(1, sizeof(struct layer));
+    l->prev = obj->last;
+    obj->last = l;
+    l->type = type;
+    l->input_size = input_size;
+    l->output_size = output_size;
+
+    // If this is the first layer, set the first layer.
+    if (!obj->n_layers) {
+        obj->first = l;
+    } else {
+        // If this is not the first layer, set the "next" value for the 
+        // previous layer.
+        l->prev->next = l;
+    }
+
+    obj->n_layers++;
+
+    return l;
+}
+
+// Add a conv 2D layer without initializing it. Returns the layer if 
+// successful.
 struct layer* model_add_conv2d_layer(struct model* obj,
                                      int input_channels, int input_height,
                                      int input_width, int n_filters,
@@ -877,6 +977,8 @@ struct layer* model_add_conv2d_layer(struct model* obj,
     l->output_width = CALC_CONV2D_OUTPUT_DIM(input_width, filter_size, stride);
     l->filter_size = filter_size;
     l->stride = stride;
+    l->dilation = 1;
+    l->groups = 1;
     
     // Calculate the input and output sizes.
     l->input_size = input_channels * input_height * input_width;
@@ -897,6 +999,59 @@ struct layer* model_add_conv2d_layer(struct model* obj,
     return l;
 }
 
+// Add a conv 2D layer with implicit padding without initializing it. Returns 
+// the layer if successful.
+struct layer* model_add_conv2d_padded_layer(struct model* obj,
+                                            int input_channels, int input_height,
+                                            int input_width, int n_filters,
+                                            int filter_size, int stride,
+                                            int padding_x, int padding_y,
+                                            enum padding_type padding_type) {
+    return model_add_conv2d_grouped_layer(obj, input_channels, input_height, input_width, n_filters, filter_size, stride, padding_x, padding_y, padding_type, 1, 1);
+}
+
+// Add a conv 2D layer with implicit padding, groups and dilation without 
+// initializing it. The number of input channels and filters must be 
+// divisible by the number of groups. Returns the layer if successful.
+struct layer* model_add_conv2d_grouped_layer(struct model* obj,
+                                             int input_channels, int input_height,
+                                             int input_width, int n_filters,
+                                             int filter_size, int stride,
+                                             int padding_x, int padding_y,
+                                             enum padding_type padding_type,
+                                             int groups, int dilation) {
+    // Create the layer and set the padding, groups and dilation.
+    struct layer* l = model_add_conv2d_layer(obj, input_channels, input_height, input_width, n_filters, filter_size, stride);
+    l->output_height = CALC_CONV2D_DILATED_OUTPUT_DIM(input_height, filter_size, stride, padding_y, dilation);
+    l->output_width = CALC_CONV2D_DILATED_OUTPUT_DIM(input_width, filter_size, stride, padding_x, dilation);
+    l->padding_x = padding_x;
+    l->padding_y = padding_y;
+    l->padding_type = padding_type;
+    l->dilation = dilation;
+    l->groups = groups;
+
+    // Recalculate the output size.
+    l->output_size = n_filters * l->output_height * l->output_width;
+
+    return l;
+}
+
+// Add a depthwise conv 2D layer without initializing it. Each input channel
+// is convolved with depth_multiplier filters. Returns the layer if 
+// successful.
+struct layer* model_add_depthwise_conv2d_layer(struct model* obj,
+                                               int input_channels, int input_height,
+                                               int input_width, int depth_multiplier,
+                                               int filter_size, int stride,
+                                               int padding_x, int padding_y,
+                                               enum padding_type padding_type) {
+    // Create the layer and set the values.
+    struct layer* l = model_add_conv2d_grouped_layer(obj, input_channels, input_height, input_width, input_channels * depth_multiplier, filter_size, stride, padding_x, padding_y, padding_type, input_channels, 1);
+    l->type = LAYER_DEPTHWISE_CONV2D;
+
+    return l;
+}
+
 // Add a max pooling 2D layer without initializing it. Returns the layer if 
 // successful.
 struct layer* model_add_maxpool2d_layer(struct model* obj,
@@ -975,12 +1130,219 @@ struct layer* model_add_padding2d_layer(struct model* obj,
     return l;
 }
 
+// Add a global average pooling 2D layer without initializing it. Each 
+// channel is reduced to its average, so the output size is input_channels.
+// Returns the layer if successful.
+struct layer* model_add_globavgpool2d_layer(struct model* obj,
+                                            int input_channels, int input_height,
+                                            int input_width) {
+    // Create the layer and set the values.
+    struct layer* l = (struct layer*)calloc(1, sizeof(struct layer));
+    l->prev = obj->last;
+    obj->last = l;
+    l->type = LAYER_GLOBAVGPOOL2D;
+    l->input_channels = input_channels;
+    l->input_height = input_height;
+    l->input_width = input_width;
+    l->output_channels = input_channels;
+    l->output_height = 1;
+    l->output_width = 1;
+
+    // Calculate the input and output sizes.
+    l->input_size = input_channels * input_height * input_width;
+    l->output_size = input_channels;
+
+    // If this is the first layer, set the first layer.
+    if (!obj->n_layers) {
+        obj->first = l;
+    }
+    else {
+        // If this is not the first layer, set the "next" value for the 
+        // previous layer.
+        l->prev->next = l;
+    }
+
+    obj->n_layers++;
+
+    return l;
+}
+
+// Add a 2D layout conversion layer without initializing it. The conversion 
+// direction is set during model finalization. Returns the layer if 
+// successful.
+struct layer* model_add_layout2d_layer(struct model* obj,
+                                       int channels, int height, int width) {
+    // Create the layer and set the values.
+    struct layer* l = (struct layer*)calloc(1, sizeof(struct layer));
+    l->prev = obj->last;
+    obj->last = l;
+    l->type = LAYER_LAYOUT2D;
+    l->input_channels = l->output_channels = channels;
+    l->input_height = l->output_height = height;
+    l->input_width = l->output_width = width;
+    l->input_size = l->output_size = channels * height * width;
+
+    // If this is the first layer, set the first layer.
+    if (!obj->n_layers) {
+        obj->first = l;
+    }
+    else {
+        // If this is not the first layer, set the "next" value for the 
+        // previous layer.
+        l->prev->next = l;
+    }
+
+    obj->n_layers++;
+
+    return l;
+}
+
+// Set the activation layout to use inside chains of 2D layers. Layout 
+// conversion layers are inserted at the chain boundaries when the model is 
+// finalized.
+void model_set_layout_2d(struct model *obj, enum layout_2d layout) {
+    obj->layout_2d = layout;
+}
+
+// Set the memory plan mode used to share buffers between the layer outputs
+// and gradients when the model is finalized.
+void model_set_memory_plan(struct model *obj, enum memory_plan_mode mode) {
+    obj->memory_plan = mode;
+}
+
+// Enable gradient checkpointing when the model is finalized, with a 
+// checkpoint every interval layers, or MODEL_CHECKPOINT_AUTO. Zero disables
+// it.
+void model_set_checkpointing(struct model *obj, int interval) {
+    obj->checkpoint_interval = interval;
+}
+
 // Set the layer's loss.
 void model_set_loss(struct model *obj, enum loss_type type) {
     // Create the loss object.
     obj->loss.type = type;
 }
 
+// Merge each padding 2D layer followed by an unpadded conv 2D layer into the 
+// conv 2D layer. The padding layers are removed from the model and freed.
+static void model_merge_padding(struct model *obj) {
+    struct layer *current = obj->first;
+    while (current != NULL && current->next != NULL) {
+        struct layer *conv = current->next;
+        if (current->type != LAYER_PADDING2D || (conv->type != LAYER_CONV2D && conv->type != LAYER_DEPTHWISE_CONV2D) || conv->padding_x || conv->padding_y) {
+            current = conv;
+            continue;
+        }
+
+        // Move the padding onto the conv layer. The output dimensions are 
+        // unchanged.
+        conv->input_channels = current->input_channels;
+        conv->input_height = current->input_height;
+        conv->input_width = current->input_width;
+        conv->input_size = current->input_size;
+        conv->padding_x = current->padding_x;
+        conv->padding_y = current->padding_y;
+        conv->padding_type = current->padding_type;
+        conv->fused_padding = true;
+
+        // Unlink and free the padding layer.
+        conv->prev = current->prev;
+        if (current->prev != NULL) {
+            current->prev->next = conv;
+        } else {
+            obj->first = conv;
+        }
+        obj->n_layers--;
+        free(current);
+
+        current = conv;
+    }
+}
+
+// Insert a 2D layout conversion layer before a layer, or at the end of the 
+// model if the layer is NULL.
+static struct layer* model_insert_layout2d(struct model *obj, struct layer *next, 
+                                           int channels, int height, int width) {
+    struct layer *l = (struct layer*)calloc(1, sizeof(struct layer));
+    l->type = LAYER_LAYOUT2D;
+    l->input_channels = l->output_channels = channels;
+    l->input_height = l->output_height = height;
+    l->input_width = l->output_width = width;
+    l->input_size = l->output_size = channels * height * width;
+
+    // Link the layer.
+    l->next = next;
+    l->prev = next != NULL ? next->prev : obj->last;
+    if (l->prev != NULL) {
+        l->prev->next = l;
+    } else {
+        obj->first = l;
+    }
+    if (next != NULL) {
+        next->prev = l;
+    } else {
+        obj->last = l;
+    }
+    obj->n_layers++;
+
+    return l;
+}
+
+// Returns true if the layer type is a 2D layer which supports the NHWC 
+// layout.
+static bool is_layout_2d_layer(enum layer_type type) {
+    const struct layer_ops *ops = layer_get_ops(type);
+    return ops != NULL && ops->layout_2d;
+}
+
+// Returns true if the layer type reads its input in either layout, and its 
+// output is the same in both layouts.
+static bool is_layout_2d_reducing_layer(enum layer_type type) {
+    const struct layer_ops *ops = layer_get_ops(type);
+    return ops != NULL && ops->layout_2d_reduces;
+}
+
+// Assign the activation layout of each 2D layer. If the model uses the NHWC
+// layout, layout conversion layers are inserted around each chain of 2D 
+// layers, so the rest of the model only sees the NCHW layout. Each layout 
+// conversion layer switches between the two layouts.
+static void model_assign_layouts(struct model *obj) {
+    enum layout_2d current_layout = LAYOUT_NCHW;
+    struct layer *prev_2d = NULL;
+    struct layer *current = obj->first;
+    while (current != NULL) {
+        if (current->type == LAYER_LAYOUT2D) {
+            // Switch the layout.
+            current_layout = current_layout == LAYOUT_NCHW ? LAYOUT_NHWC : LAYOUT_NCHW;
+            current->layout = current_layout;
+            prev_2d = current;
+        } else if (is_layout_2d_layer(current->type)) {
+            if (obj->layout_2d == LAYOUT_NHWC && current_layout == LAYOUT_NCHW) {
+                // Start a chain.
+                model_insert_layout2d(obj, current, current->input_channels, current->input_height, current->input_width)->layout = LAYOUT_NHWC;
+                current_layout = LAYOUT_NHWC;
+            }
+            current->layout = current_layout;
+            prev_2d = current;
+        } else if (is_layout_2d_reducing_layer(current->type)) {
+            // Read the input in the current layout. The output is the same in
+            // both layouts, so it ends the chain without a conversion.
+            current->layout = current_layout;
+            current_layout = LAYOUT_NCHW;
+        } else if (current_layout == LAYOUT_NHWC && !layer_is_elementwise(current->type)) {
+            // End the chain before a layer which needs the NCHW layout.
+            model_insert_layout2d(obj, current, prev_2d->output_channels, prev_2d->output_height, prev_2d->output_width)->layout = LAYOUT_NCHW;
+            current_layout = LAYOUT_NCHW;
+        }
+        current = current->next;
+    }
+
+    // End the final chain.
+    if (current_layout == LAYOUT_NHWC) {
+        model_insert_layout2d(obj, NULL, prev_2d->output_channels, prev_2d->output_height, prev_2d->output_width)->layout = LAYOUT_NCHW;
+    }
+}
+
 // Finalize and initialize the model.
 int model_finalize(struct model *obj) {
     // Ensure that there is at least one layer.
@@ -989,6 +1351,13 @@ int model_finalize(struct model *obj) {
         return 0;
     }
 
+    // Merge padding 2D layers into the conv 2D layers which follow them, so
+    // the conv layer reads the unpadded input directly.
+    model_merge_padding(obj);
+
+    // Assign the activation layouts of the 2D layers.
+    model_assign_layouts(obj);
+
     // Initialize the input matrix.
     obj->input = calloc(1, sizeof(struct matrix));
     if (!matrix_init(obj->input, obj->n_samples, obj->first->input_size)) {
@@ -997,13 +1366,31 @@ int model_finalize(struct model *obj) {
     }
     obj->output = obj->input;
 
-    // Initialize the gradients on the first layer.
+    // Initialize the gradients on the first layer. For inference only, it
+    // has no buffer.
     obj->last_gradient = calloc(1, sizeof(struct matrix));
-    if (!matrix_init(obj->last_gradient, obj->n_samples, obj->first->input_size)) {
+    if (obj->memory_plan == MEMORY_PLAN_INFERENCE) {
+        matrix_init_view(obj->last_gradient, obj->n_samples, obj->first->input_size, NULL);
+    } else if (!matrix_init(obj->last_gradient, obj->n_samples, obj->first->input_size)) {
         free(obj->last_gradient);
         return 0;
     }
     
+    // Plan the layer outputs and gradients.
+    if (obj->memory_plan == MEMORY_PLAN_NONE) {
+        obj->unplanned_activation_size = 0;
+        for (struct layer *current = obj->first; current != NULL; current = current->next) {
+            obj->unplanned_activation_size += 2 * obj->n_samples * current->output_size;
+        }
+        obj->planned_activation_size = obj->unplanned_activation_size;
+    } else {
+        model_assign_in_place(obj);
+        model_assign_checkpoints(obj);
+        if (!model_plan_activations(obj)) {
+            return 0;
+        }
+    }
+
     // Initialize each layer.
     struct layer *current = obj->first;
     do {
@@ -1020,6 +1407,24 @@ int model_finalize(struct model *obj) {
         current = current->next;
     } while (current != NULL);
 
+    // Move the parameters and gradients into the arenas.
+    if (!model_pack_params(obj)) {
+        return 0;
+    }
+
+    // Models for inference only, or without a loss, have no y matrix, loss
+    // output or loss.
+    obj->y = NULL;
+    obj->loss_output = NULL;
+    obj->loss.obj = NULL;
+    if (obj->memory_plan == MEMORY_PLAN_INFERENCE) {
+        // Models for inference can be reloaded.
+        return model_init_weights_lock(obj);
+    }
+    if (obj->loss.type == LOSS_NONE) {
+        return 1;
+    }
+
     // Initialize the y matrix.
     obj->y = calloc(1, sizeof(struct matrix));
     if (!matrix_init(obj->y, obj->n_samples, obj->output->n_cols)) {
@@ -1050,8 +1455,179 @@ int model_finalize(struct model *obj) {
     return 1;
 }
 
+// Pack the weights of the model's layers once for inference, into the 
+// layouts read by the forward kernels. Only models planned for inference can
+// be prepacked, as their parameters are not updated.
+int model_prepack(struct model *obj) {
+    if (obj->memory_plan != MEMORY_PLAN_INFERENCE) {
+        LAST_ERROR = "Only models planned for inference can be prepacked.";
+        return 0;
+    }
+    if (obj->input == NULL) {
+        LAST_ERROR = "Model not finalized.";
+        return 0;
+    }
+
+    // Dense weights are already stored by input rows, as the kernels read 
+    // them, so only the NHWC conv layers are packed.
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        if ((current->type == LAYER_CONV2D || current->type == LAYER_DEPTHWISE_CONV2D) &&
+            !layer_conv2d_prepack(current->obj)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Count the weight matrices of a list of layers.
+static int model_count_weights(struct layer *first) {
+    int n = 0;
+    for (struct layer *current = first; current != NULL; current = current->next) {
+        struct matrix *matrices[LAYER_MAX_WEIGHTS];
+        n += layer_get_weights(current, matrices);
+    }
+    return n;
+}
+
+// Copy the buffers bound to the model's layers, as its original weights.
+static struct model_weights *model_copy_bound_weights(struct model *obj) {
+    struct model_weights *weights = calloc(1, sizeof(struct model_weights));
+    const int n = model_count_weights(obj->first);
+    if (weights == NULL || (weights->buffers = malloc(n * sizeof(double*))) == NULL) {
+        free(weights);
+        LAST_ERROR = "Failed to allocate weights.";
+        return NULL;
+    }
+    weights->n_buffers = n;
+    int k = 0;
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        struct matrix *matrices[LAYER_MAX_WEIGHTS];
+        const int n_matrices = layer_get_weights(current, matrices);
+        for (int i = 0; i < n_matrices; i++, k++) {
+            weights->buffers[k] = matrices[i] != NULL ? matrices[i]->buffer : NULL;
+        }
+    }
+    return weights;
+}
+
+// Copy the weights of a source model with the same layers into a new version,
+// and pack the weights of the layers which the model prepacks. Only the 
+// source's layers and the model's layer shapes are read, as the model's 
+// buffers may be rebound by a prediction meanwhile.
+static struct model_weights *model_copy_source_weights(struct model *obj, struct model *source) {
+    if (source->input == NULL) {
+        LAST_ERROR = "Model not finalized.";
+        return NULL;
+    }
+    if (source->n_layers != obj->n_layers) {
+        LAST_ERROR = "Models have different layers.";
+        return NULL;
+    }
+
+    // Check the layers and their weight shapes, and calculate the size.
+    int n = 0, size = 0;
+    for (struct layer *current = obj->first, *other = source->first; current != NULL; current = current->next, other = other->next) {
+        struct matrix *matrices[LAYER_MAX_WEIGHTS], *others[LAYER_MAX_WEIGHTS];
+        const int n_matrices = layer_get_weights(current, matrices);
+        if (other->type != current->type || layer_get_weights(other, others) != n_matrices) {
+            LAST_ERROR = "Models have different layers.";
+            return NULL;
+        }
+        for (int i = 0; i < n_matrices; i++) {
+            if (others[i] != NULL && matrices[i] != NULL && 
+                (others[i]->n_rows != matrices[i]->n_rows || others[i]->n_cols != matrices[i]->n_cols)) {
+                LAST_ERROR = "Models have different weight shapes.";
+                return NULL;
+            }
+            if (matrices[i] != NULL) {
+                size += ARENA_ALIGN_SIZE(matrices[i]->size);
+            }
+        }
+        n += n_matrices;
+    }
+
+    struct model_weights *weights = calloc(1, sizeof(struct model_weights));
+    if (weights == NULL || (weights->buffers = calloc(n, sizeof(double*))) == NULL) {
+        free(weights);
+        LAST_ERROR = "Failed to allocate weights.";
+        return NULL;
+    }
+    weights->n_buffers = n;
+    if (!arena_init(&weights->arena, size)) {
+        model_weights_free(weights);
+        return NULL;
+    }
+
+    // Copy the weights, and pack the weights of prepacked conv layers, which
+    // always follow the biases.
+    int k = 0;
+    for (struct layer *current = obj->first, *other = source->first; current != NULL; current = current->next, other = other->next) {
+        struct matrix *matrices[LAYER_MAX_WEIGHTS], *others[LAYER_MAX_WEIGHTS];
+        const int n_matrices = layer_get_weights(current, matrices);
+        layer_get_weights(other, others);
+        const bool conv2d = current->type == LAYER_CONV2D || current->type == LAYER_DEPTHWISE_CONV2D;
+        const int first = k;
+        for (int i = 0; i < n_matrices; i++, k++) {
+            if (matrices[i] == NULL) {
+                continue;
+            }
+            struct matrix view;
+            if (!arena_alloc(&weights->arena, &view, matrices[i]->n_rows, matrices[i]->n_cols)) {
+                model_weights_free(weights);
+                return NULL;
+            }
+            weights->buffers[k] = view.buffer;
+            if (!(conv2d && i == 2)) {
+                memcpy(view.buffer, others[i]->buffer, view.size * sizeof(double));
+            }
+        }
+        if (conv2d && ((struct layer_conv2d*)current->obj)->prepacked) {
+            struct layer_conv2d packed = *(struct layer_conv2d*)other->obj;
+            packed.weights.buffer = weights->buffers[first];
+            packed.packed_weights.buffer = weights->buffers[first + 2];
+            layer_conv2d_prepack(&packed);
+        }
+    }
+    return weights;
+}
+
+// Publish the weights of another model with the same layers as the model's
+// new weights.
+int model_publish_weights(struct model *obj, struct model *source) {
+    if (obj->weights_lock == NULL) {
+        LAST_ERROR = "Only finalized models planned for inference can be reloaded.";
+        return 0;
+    }
+
+    // Keep the original weights, so the layers can free them.
+    if (obj->original_weights == NULL && (obj->original_weights = model_copy_bound_weights(obj)) == NULL) {
+        return 0;
+    }
+
+    struct model_weights *weights = model_copy_source_weights(obj, source);
+    if (weights == NULL) {
+        return 0;
+    }
+
+    // Swap the published weights. The old version is freed once its readers
+    // bind to newer weights.
+    model_lock_weights(obj);
+    struct model_weights *old = obj->weights;
+    weights->refs = 1;
+    weights->version = old != NULL ? old->version + 1 : 1;
+    obj->weights = weights;
+    model_unlock_weights(obj);
+    model_release_weights(obj, old);
+    return 1;
+}
+
 // Initialize optimizers on the model.
 int model_init_optimizers(struct model* obj, enum optimizer_type type, ...) {
+    if (obj->memory_plan == MEMORY_PLAN_INFERENCE) {
+        LAST_ERROR = "Model is planned for inference only.";
+        return 0;
+    }
+
     va_list ap;
     va_start(ap, type);
 
@@ -1074,6 +1650,167 @@ int model_init_optimizers(struct model* obj, enum optimizer_type type, ...) {
 
     va_end(ap);
 
+    // The per-layer optimizers replace the fused optimizer, whose state is 
+    // freed along with the arena.
+    free(obj->fused_optimizer);
+    obj->fused_optimizer = NULL;
+
+    // Move the optimizer state into the arena.
+    return model_pack_optimizer_state(obj);
+}
+
+// Initialize a fused optimizer on the model, which updates all the 
+// parameters in a single pass. Takes the same variable args as 
+// model_init_optimizers.
+int model_init_fused_optimizer(struct model *obj, enum optimizer_type type, ...) {
+    if (obj->params.buffer == NULL) {
+        LAST_ERROR = "Model not finalized.";
+        return 0;
+    }
+    if (obj->memory_plan == MEMORY_PLAN_INFERENCE) {
+        LAST_ERROR = "Model is planned for inference only.";
+        return 0;
+    }
+
+    va_list ap, ap_copy;
+    va_start(ap, type);
+
+    // Size the state arena for the moment buffers.
+    va_copy(ap_copy, ap);
+    int state_size = optimizer_fused_state_size(type, &obj->params, ap_copy);
+    va_end(ap_copy);
+    if (state_size < 0) {
+        va_end(ap);
+        return 0;
+    }
+
+    // Replace any existing optimizer state. The per-layer optimizers are not
+    // used while the fused optimizer is set.
+    arena_free(&obj->optimizer_state);
+    if (state_size && !arena_init(&obj->optimizer_state, state_size)) {
+        va_end(ap);
+        return 0;
+    }
+
+    if (obj->fused_optimizer == NULL) {
+        obj->fused_optimizer = (struct optimizer_fused*)malloc(sizeof(struct optimizer_fused));
+        if (obj->fused_optimizer == NULL) {
+            va_end(ap);
+            LAST_ERROR = "Failed to allocate fused optimizer.";
+            return 0;
+        }
+    }
+
+    int result = optimizer_fused_init(obj->fused_optimizer, type, &obj->params, &obj->grads, 
+                                      &obj->optimizer_state, ap);
+    va_end(ap);
+    return result;
+}
+
+// Check that the model has a loss, so it can evaluate the loss and run
+// backward passes. Returns 1 if it does.
+static int model_check_loss(struct model *obj) {
+    if (obj->memory_plan == MEMORY_PLAN_INFERENCE) {
+        LAST_ERROR = "Model is planned for inference only.";
+        return 0;
+    }
+    if (obj->loss.type == LOSS_NONE) {
+        LAST_ERROR = "Model has no loss.";
+        return 0;
+    }
+    return 1;
+}
+
+// Set the number of samples in the current batch, at most n_samples. The 
+// matrices keep their buffers, so only their number of rows changes.
+int model_set_active_samples(struct model *obj, int n_samples) {
+    if (obj->input == NULL) {
+        LAST_ERROR = "Model not finalized.";
+        return 0;
+    }
+    if (n_samples < 1 || n_samples > obj->n_samples) {
+        LAST_ERROR = "Invalid number of active samples.";
+        return 0;
+    }
+    obj->active_samples = n_samples;
+
+    // The layer inputs and input gradients are the outputs and gradients of
+    // the previous layers.
+    matrix_set_rows(obj->input, n_samples);
+    matrix_set_rows(obj->first->d_input, n_samples);
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        matrix_set_rows(current->output, n_samples);
+        matrix_set_rows(current->d_output, n_samples);
+    }
+    if (obj->y != NULL) {
+        matrix_set_rows(obj->y, n_samples);
+        matrix_set_rows(obj->loss_output, n_samples);
+    }
+    return 1;
+}
+
+// Reallocate a matrix for a number of rows. The values are lost.
+static int model_realloc_matrix(struct matrix *obj, int n_rows) {
+    matrix_free(obj);
+    return matrix_init(obj, n_rows, obj->n_cols);
+}
+
+// Change the batch size of a finalized model. The layer matrices are only
+// reallocated if the batch size grows past n_samples, and their values are 
+// lost.
+int model_set_batch_size(struct model *obj, int n_samples) {
+    if (obj->input == NULL) {
+        LAST_ERROR = "Model not finalized.";
+        return 0;
+    }
+    if (n_samples < 1) {
+        LAST_ERROR = "Invalid batch size.";
+        return 0;
+    }
+    if (n_samples <= obj->n_samples) {
+        return model_set_active_samples(obj, n_samples);
+    }
+    obj->n_samples = n_samples;
+
+    // Reallocate the input and its gradient. For inference only, the 
+    // gradient has no buffer.
+    if (!model_realloc_matrix(obj->input, n_samples)) {
+        return 0;
+    }
+    if (obj->first->d_input->buffer == NULL) {
+        matrix_set_rows(obj->first->d_input, n_samples);
+    } else if (!model_realloc_matrix(obj->first->d_input, n_samples)) {
+        return 0;
+    }
+
+    // Reallocate the layer outputs and gradients, or plan them again.
+    if (obj->memory_plan == MEMORY_PLAN_NONE) {
+        obj->unplanned_activation_size = 0;
+        for (struct layer *current = obj->first; current != NULL; current = current->next) {
+            if (!model_realloc_matrix(current->output, n_samples) || !model_realloc_matrix(current->d_output, n_samples)) {
+                return 0;
+            }
+            obj->unplanned_activation_size += 2 * n_samples * current->output_size;
+        }
+        obj->planned_activation_size = obj->unplanned_activation_size;
+    } else if (!model_plan_activations(obj)) {
+        return 0;
+    }
+
+    // Reallocate the y matrix and the loss output.
+    if (obj->y != NULL) {
+        if (!model_realloc_matrix(obj->y, n_samples) || !model_realloc_matrix(obj->loss_output, n_samples)) {
+            return 0;
+        }
+    }
+
+    // Reallocate the per-sample state of the layers.
+    for (struct layer *current = obj->first; current != NULL; current = current->next) {
+        if (!layer_resize(current)) {
+            return 0;
+        }
+    }
+    obj->active_samples = n_samples;
     return 1;
 }
 
@@ -1085,71 +1822,106 @@ int model_predict(struct model* obj, struct matrix* X, struct matrix* Y) {
         return 0;
     }
     
-    // Loop over each batch.
-    int current_batch_size = obj->n_samples;
-    for (int batch_start = 0; batch_start < X->n_rows; batch_start += obj->n_samples) {
-        // If we exceed the number of samples, truncate the batch.
-        if (batch_start + obj->n_samples >= X->n_rows) {
-            current_batch_size = X->n_rows - batch_start;
+    // Use the latest published weights, if any.
+    model_refresh_weights(obj, obj->first, &obj->bound_weights);
+
+    // Loop over each batch. The last batch only processes the remaining 
+    // samples.
+    const int active_samples = obj->active_samples;
+    int result = 1;
+    for (int batch_start = 0; batch_start < X->n_rows && result; batch_start += obj->n_samples) {
+        const int batch_size = X->n_rows - batch_start < obj->n_samples ? X->n_rows - batch_start : obj->n_samples;
+        if (!model_set_active_samples(obj, batch_size)) {
+            return 0;
         }
 
         // Copy the input data into the model.
-        memcpy(obj->input->buffer, (void*)&X->buffer[batch_start * X->n_cols], sizeof(double) * X->n_cols * current_batch_size);
+        memcpy(obj->input->buffer, (void*)&X->buffer[batch_start * X->n_cols], sizeof(double) * X->n_cols * batch_size);
 
-        // Perform the forward pass over the network.
-        if (!model_forward(obj, false)) {
-            return 0;
+        // Perform the forward pass over the network, without the loss.
+        result = model_forward(obj, MODEL_FORWARD_INFERENCE);
+        if (result) {
+            // Copy the output data to the matrix.
+            memcpy((void*)&Y->buffer[batch_start * Y->n_cols], obj->output->buffer, sizeof(double) * Y->n_cols * batch_size);
         }
-
-        // Copy the output data to the matrix.
-        memcpy((void*)&Y->buffer[batch_start * Y->n_cols], obj->output->buffer, sizeof(double) * Y->n_cols * current_batch_size);
     }
     
-    return 1;
+    // Restore the batch size.
+    return model_set_active_samples(obj, active_samples) && result;
 }
 
 // Calculate model loss.
 double model_calc_loss(struct model *obj, struct matrix *X, struct matrix *Y) {
-    double loss = 0.0;
-    for (int batch_start = 0; batch_start < X->n_rows; batch_start += obj->n_samples) {
-        // Copy the input data and Y values into the model.
-        memcpy(obj->input->buffer, (void*)&X->buffer[batch_start * X->n_cols], sizeof(double) * X->n_cols * obj->n_samples);
-        memcpy(obj->y->buffer, (void*)&Y->buffer[batch_start * Y->n_cols], sizeof(double) * Y->n_cols * obj->n_samples);
+    if (!model_check_loss(obj)) {
+        return 0;
+    }
 
-        // Perform the forward pass over the network.
-        if (!model_forward(obj, false)) {
+    const int active_samples = obj->active_samples;
+    double loss = 0.0;
+    int result = 1;
+    for (int batch_start = 0; batch_start < X->n_rows && result; batch_start += obj->n_samples) {
+        // The last batch only processes the remaining samples.
+        const int batch_size = X->n_rows - batch_start < obj->n_samples ? X->n_rows - batch_start : obj->n_samples;
+        if (!model_set_active_samples(obj, batch_size)) {
             return 0;
         }
 
-        // Accumulate the loss.
-        loss += obj->loss.batch_loss;
+        // Copy the input data and Y values into the model.
+        memcpy(obj->input->buffer, (void*)&X->buffer[batch_start * X->n_cols], sizeof(double) * X->n_cols * batch_size);
+        memcpy(obj->y->buffer, (void*)&Y->buffer[batch_start * Y->n_cols], sizeof(double) * Y->n_cols * batch_size);
+
+        // Perform the forward pass over the network, and accumulate the 
+        // loss of each sample.
+        result = model_forward(obj, MODEL_FORWARD_EVALUATE);
+        loss += obj->loss.batch_loss * batch_size;
+    }
+
+    // Restore the batch size.
+    if (!model_set_active_samples(obj, active_samples) || !result) {
+        return 0;
     }
 
     // Return the average loss.
-    return loss / (double)(X->n_rows / obj->n_samples);
+    return loss / (double)X->n_rows;
 }
 
-// Train the model. If debug is true, it will output the current batch num to
-// stdout and recalculate the loss each epoch.
-int model_train(struct model* obj, struct matrix* X, struct matrix* Y, int epochs, bool debug) {
+// Train the model from the training cursor, and move the cursor after each
+// batch.
+static int model_train_epochs(struct model* obj, struct matrix* X, struct matrix* Y, int epochs, bool debug) {
     // Ensure that the X and Y matrices have the same number of samples.
     if (X->n_rows != Y->n_rows) {
         LAST_ERROR = "X and Y matrices must have same number of samples.";
         return 0;
     }
 
+    // Ensure that the model can be trained.
+    if (!model_check_loss(obj)) {
+        return 0;
+    }
+
     // Ensure that the dataset divides by the batch size.
     if (X->n_rows % obj->n_samples) {
         LAST_ERROR = "Dataset does not divide evenly over batch size.";
         return 0;
     }
+    if (!model_set_active_samples(obj, obj->n_samples)) {
+        return 0;
+    }
+
+    // Start from the training cursor, which is only set when resuming from a
+    // checkpoint.
+    const int n_batches = X->n_rows / obj->n_samples;
+    if (obj->epoch < 0 || obj->batch < 0 || obj->batch >= n_batches) {
+        LAST_ERROR = "Training cursor is outside the dataset.";
+        return 0;
+    }
 
     int batch_n;
     double acc_loss;
-    for (int epoch = 0; epoch < epochs; epoch++) {
+    for (int epoch = obj->epoch; epoch < epochs; epoch++) {
         batch_n = 0;
         acc_loss = 0.0;
-        for (int batch_start = 0; batch_start < X->n_rows; batch_start += obj->n_samples) {
+        for (int batch_start = obj->batch * obj->n_samples; batch_start < X->n_rows; batch_start += obj->n_samples) {
             if (debug) {
                 // Display the current batch.
                 if (batch_n == 0) {
@@ -1164,8 +1936,9 @@ int model_train(struct model* obj, struct matrix* X, struct matrix* Y, int epoch
             memcpy(obj->input->buffer, (void*)&X->buffer[batch_start * X->n_cols], sizeof(double) * X->n_cols * obj->n_samples);
             memcpy(obj->y->buffer, (void*)&Y->buffer[batch_start * Y->n_cols], sizeof(double) * Y->n_cols * obj->n_samples);
 
-            // Perform the forward pass over the network.
-            if (!model_forward(obj, true)) {
+            // Perform the forward pass over the network. The loss value is
+            // only needed for the debug output.
+            if (!model_forward(obj, debug ? MODEL_FORWARD_TRAINING_LOSS : MODEL_FORWARD_TRAINING)) {
                 return 0;
             }
 
@@ -1188,6 +1961,16 @@ int model_train(struct model* obj, struct matrix* X, struct matrix* Y, int epoch
             }
 
             batch_n++;
+
+            // Move the cursor to the next batch, and checkpoint if due.
+            obj->batch = batch_start / obj->n_samples + 1;
+            if (obj->batch == n_batches) {
+                obj->epoch = epoch + 1;
+                obj->batch = 0;
+            }
+            if (!model_checkpoint_batch(obj)) {
+                return 0;
+            }
         }
 
         if (debug) {
@@ -1200,8 +1983,26 @@ int model_train(struct model* obj, struct matrix* X, struct matrix* Y, int epoch
     return 1;
 }
 
+// Train the model. If debug is true, it will output the current batch num to
+// stdout and recalculate the loss each epoch.
+int model_train(struct model* obj, struct matrix* X, struct matrix* Y, int epochs, bool debug) {
+    const int result = model_train_epochs(obj, X, Y, epochs, debug);
+
+    // Reset the cursor whether or not training completed, so the next call 
+    // starts over instead of resuming from a failed run.
+    obj->epoch = 0;
+    obj->batch = 0;
+    return result;
+}
+
 // Perform a forward pass on the entire model.
-int model_forward(struct model *obj, bool training) {
+int model_forward(struct model *obj, enum model_forward_mode mode) {
+    const bool training = mode == MODEL_FORWARD_TRAINING || mode == MODEL_FORWARD_TRAINING_LOSS;
+    const bool loss = mode == MODEL_FORWARD_EVALUATE || mode == MODEL_FORWARD_TRAINING_LOSS;
+    if (loss && !model_check_loss(obj)) {
+        return 0;
+    }
+
     // Perform the forward pass through each layer.
     struct layer *current = obj->first;
     do {
@@ -1211,12 +2012,19 @@ int model_forward(struct model *obj, bool training) {
         current = current->next;
     } while (current != NULL);
 
-    // Perform the forward pass through the loss.
+    // Perform the forward pass through the loss, if its value is needed.
+    if (!loss) {
+        return 1;
+    }
     return loss_forward(&obj->loss);
 }
 
 // Perform a backward pass on the model.
 int model_backward(struct model *obj) {
+    if (!model_check_loss(obj)) {
+        return 0;
+    }
+
     // Perform the backward pass through the loss.
     if (IS_CROSSENTROPY_SOFTMAX(obj)) {
         loss_crossentropy_backward_softmax(obj->loss.obj);
@@ -1226,25 +2034,49 @@ int model_backward(struct model *obj) {
         }
     }
 
-    // Perform the backward pass through each layer.
-    struct layer *current = obj->last;
-    if (IS_CROSSENTROPY_SOFTMAX(obj)) {
-        // Skip the softmax layer.
-        current = current->prev;
-    }
+    // Perform the backward pass through each checkpointing segment, from the
+    // last one. Without checkpoints, the whole model is one segment.
+    struct layer *end = obj->last;
+    while (end != NULL) {
+        struct layer *start = model_segment_start(end);
+
+        // Recompute the outputs inside the segment from the previous 
+        // checkpoint, except for the layers writing its checkpoint. The last
+        // segment is still live from the forward pass.
+        if (end != obj->last) {
+            struct layer *checkpoint_start = model_segment_checkpoint_start(end);
+            for (struct layer *current = start; current != checkpoint_start; current = current->next) {
+                if (!layer_recompute(current)) {
+                    return 0;
+                }
+            }
+        }
 
-    do {
-        if (!layer_backward(current)) {
-            return 0;
+        // Perform the backward pass through each layer of the segment.
+        for (struct layer *current = end; current != start->prev; current = current->prev) {
+            if (current == obj->last && IS_CROSSENTROPY_SOFTMAX(obj)) {
+                // Skip the softmax layer.
+                continue;
+            }
+            if (!layer_backward(current)) {
+                return 0;
+            }
         }
-        current = current->prev;
-    } while (current != NULL);
+        end = start->prev;
+    }
     
     return 1;
 }
 
-// Update each trainable layer in the model.
+// Update each trainable layer in the model, or all the parameters at once
+// with the fused optimizer.
 int model_update(struct model *obj) {
+    // The fused optimizer updates all the parameters at once.
+    if (obj->fused_optimizer != NULL) {
+        optimizer_fused_update(obj->fused_optimizer);
+        return 1;
+    }
+
     struct layer *current = obj->first;
     do {
         if (current->trainable) {
@@ -1257,3 +2089,196 @@ int model_update(struct model *obj) {
 
     return 1;
 }
+
+// Calculate the L2 norm of all the parameter gradients in the model.
+double model_gradient_norm(struct model* obj) {
+    // The padding between the gradients is zero, so the whole arena can be
+    // summed.
+    double sum = 0.0;
+    for (int i = 0; i < obj->grads.used; i++) {
+        sum += obj->grads.buffer[i] * obj->grads.buffer[i];
+    }
+    return sqrt(sum);
+}
+
+// Initialize a layer which shares the parameters of an initialized layer, 
+// for inference only. The layer object is a copy of the shared one, with the
+// output and gradient matrices of obj, and its own scratch state, such as 
+// the packed conv weights, the max pooling row cache and the padding cache. 
+// The state of the backward passes is not allocated.
+static int layer_init_shared(struct layer *obj, const struct layer *shared) {
+    obj->obj = NULL;
+    if (obj->ops->init_shared == NULL) {
+        LAST_ERROR = "Layer type does not support model contexts.";
+        return 0;
+    }
+    return obj->ops->init_shared(obj, shared);
+}
+
+// Free a layer which shares the parameters of another layer. Only its own 
+// scratch state is freed.
+static void layer_free_shared(struct layer *obj) {
+    if (obj->obj == NULL) {
+        return;
+    }
+    if (obj->ops->free_shared != NULL) {
+        obj->ops->free_shared(obj);
+    }
+    free(obj->obj);
+    obj->obj = NULL;
+}
+
+// Initialize an execution context for a finalized model, for inference with
+// up to n_samples samples per batch. The model's parameters are shared, and
+// must not change while the context is used. The layer outputs are planned 
+// for inference into the context's own arena.
+int model_context_init(struct model_context *obj, struct model *model, int n_samples) {
+    obj->model = model;
+    obj->n_samples = n_samples;
+    obj->active_samples = n_samples;
+    obj->n_layers = 0;
+    obj->layers = NULL;
+    obj->activations = (struct arena){0};
+    obj->input = (struct matrix){0};
+    obj->d_input = (struct matrix){0};
+    obj->output = NULL;
+    obj->weights = NULL;
+    if (model->input == NULL) {
+        LAST_ERROR = "Model not finalized.";
+        return 0;
+    }
+    if (n_samples < 1) {
+        LAST_ERROR = "Invalid batch size.";
+        return 0;
+    }
+
+    // Plan the layer outputs, and allocate the input.
+    const int n = model->n_layers;
+    int *offsets = malloc(2 * n * sizeof(int));
+    obj->layers = calloc(n, sizeof(struct layer));
+    if (offsets == NULL || obj->layers == NULL) {
+        free(offsets);
+        LAST_ERROR = "Failed to allocate model context.";
+        return 0;
+    }
+    int size = model_plan_offsets(model, n_samples, MEMORY_PLAN_INFERENCE, offsets);
+    if (size < 0 || !arena_init(&obj->activations, size) || !matrix_init(&obj->input, n_samples, model->first->input_size)) {
+        free(offsets);
+        return 0;
+    }
+    matrix_init_view(&obj->d_input, n_samples, model->first->input_size, NULL);
+
+    // Copy each layer, with its own output and a gradient without a buffer.
+    struct matrix *output = &obj->input, *d_output = &obj->d_input;
+    int i = 0;
+    for (struct layer *shared = model->first; shared != NULL; shared = shared->next, i++) {
+        struct layer *current = &obj->layers[i];
+        *current = *shared;
+        current->prev = i > 0 ? &obj->layers[i - 1] : NULL;
+        current->next = shared->next != NULL ? &obj->layers[i + 1] : NULL;
+        current->trainable = false;
+        current->opt = (struct optimizer){0};
+        current->obj = NULL;
+        current->input = output;
+        current->d_input = d_output;
+        current->output = calloc(1, sizeof(struct matrix));
+        current->d_output = calloc(1, sizeof(struct matrix));
+        obj->n_layers++;
+        if (current->output == NULL || current->d_output == NULL) {
+            free(offsets);
+            LAST_ERROR = "Failed to allocate matrix.";
+            return 0;
+        }
+        matrix_init_view(current->output, n_samples, current->output_size, &obj->activations.buffer[offsets[2 * i]]);
+        matrix_init_view(current->d_output, n_samples, current->output_size, NULL);
+        if (!layer_init_shared(current, shared)) {
+            free(offsets);
+            return 0;
+        }
+        output = current->output;
+        d_output = current->d_output;
+    }
+    obj->output = output;
+
+    // Bind the layers to the published weights, if any.
+    model_refresh_weights(model, obj->layers, &obj->weights);
+
+    free(offsets);
+    return 1;
+}
+
+// Free the context's layers and activations. The shared model is not freed.
+void model_context_free(struct model_context *obj) {
+    for (int i = 0; i < obj->n_layers; i++) {
+        layer_free_shared(&obj->layers[i]);
+        free(obj->layers[i].output);
+        free(obj->layers[i].d_output);
+    }
+    free(obj->layers);
+    obj->layers = NULL;
+    obj->n_layers = 0;
+    matrix_free(&obj->input);
+    arena_free(&obj->activations);
+    if (obj->weights != NULL) {
+        model_release_weights(obj->model, obj->weights);
+        obj->weights = NULL;
+    }
+}
+
+// Set the number of samples in the current batch of the context, at most 
+// n_samples.
+static void model_context_set_active_samples(struct model_context *obj, int n_samples) {
+    obj->active_samples = n_samples;
+    matrix_set_rows(&obj->input, n_samples);
+    matrix_set_rows(&obj->d_input, n_samples);
+    for (int i = 0; i < obj->n_layers; i++) {
+        matrix_set_rows(obj->layers[i].output, n_samples);
+        matrix_set_rows(obj->layers[i].d_output, n_samples);
+    }
+}
+
+// Run the context's layers on its input.
+static int model_context_run(struct model_context *obj) {
+    for (int i = 0; i < obj->n_layers; i++) {
+        if (!layer_forward(&obj->layers[i], false)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Perform an inference forward pass on the context's input, with the latest
+// published weights.
+int model_context_forward(struct model_context *obj) {
+    model_refresh_weights(obj->model, obj->layers, &obj->weights);
+    return model_context_run(obj);
+}
+
+// Predict with the context. Takes an input and output matrix with any number
+// of samples.
+int model_context_predict(struct model_context *obj, struct matrix *X, struct matrix *Y) {
+    // Ensure that the X and Y matrices have the same number of samples.
+    if (X->n_rows != Y->n_rows) {
+        LAST_ERROR = "X and Y matrices must have same number of samples.";
+        return 0;
+    }
+
+    // Every batch uses the weights published when the prediction starts.
+    model_refresh_weights(obj->model, obj->layers, &obj->weights);
+
+    // Loop over each batch. The last batch only processes the remaining 
+    // samples.
+    int result = 1;
+    for (int batch_start = 0; batch_start < X->n_rows && result; batch_start += obj->n_samples) {
+        const int batch_size = X->n_rows - batch_start < obj->n_samples ? X->n_rows - batch_start : obj->n_samples;
+        model_context_set_active_samples(obj, batch_size);
+        memcpy(obj->input.buffer, &X->buffer[batch_start * X->n_cols], sizeof(double) * X->n_cols * batch_size);
+        result = model_context_run(obj);
+        if (result) {
+            memcpy(&Y->buffer[batch_start * Y->n_cols], obj->output->buffer, sizeof(double) * Y->n_cols * batch_size);
+        }
+    }
+
+    model_context_set_active_samples(obj, obj->n_samples);
+    return result;
+}
@@ -79,6 +79,9 @@ int layer_padding2d_init(struct layer_padding2d *obj, int n_channels,
 
     obj->has_caches = false;
 
+    // Use the NCHW layout by default.
+    obj->layout = LAYOUT_NCHW;
+
     return 1;
 }
 
@@ -87,6 +90,17 @@ void layer_padding2d_free(struct layer_padding2d *obj) {
     free(obj->output_cache);
 }
 
+// Set the padding type.
+void layer_padding2d_set_type(struct layer_padding2d *obj, enum padding_type type) {
+    obj->type = type;
+    obj->has_caches = false;
+}
+
+// Set the activation layout.
+void layer_padding2d_set_layout(struct layer_padding2d *obj, enum layout_2d layout) {
+    obj->layout = layout;
+}
+
 // Recalculate the caches.
 int layer_padding2d_recalculate_caches(struct layer_padding2d *obj) {
     // Fill the output cache with the input matrix.
@@ -222,6 +236,42 @@ int layer_padding2d_recalculate_caches(struct layer_padding2d *obj) {
     return 1;
 }
 
+// Perform a forward pass with the NHWC layout.
+static void layer_padding2d_forward_nhwc(struct layer_padding2d *obj) {
+    const int n_channels = obj->n_channels;
+    const int sample_size = n_channels * obj->output_height * obj->output_width;
+    const int input_sample_size = n_channels * obj->input_height * obj->input_width;
+    const int input_row_size = n_channels * obj->input_width;
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        const double *input = &obj->input->buffer[sample * input_sample_size];
+        double *output = &obj->output->buffer[sample * sample_size];
+
+        if (obj->type == PADDING_ZERO) {
+            // Set all the output values to zero, then copy each input row.
+            for (int i = 0; i < sample_size; i++) {
+                output[i] = 0.0;
+            }
+            for (int i = 0; i < obj->input_height; i++) {
+                double *out = &output[((i + obj->padding_y) * obj->output_width + obj->padding_x) * n_channels];
+                const double *in = &input[i * input_row_size];
+                for (int x = 0; x < input_row_size; x++) {
+                    out[x] = in[x];
+                }
+            }
+        } else {
+            // Copy the input pixel at output_cache[i] to each output pixel.
+            for (int i = 0; i < obj->output_height * obj->output_width; i++) {
+                double *out = &output[i * n_channels];
+                const double *in = &input[obj->output_cache[i] * n_channels];
+                for (int c = 0; c < n_channels; c++) {
+                    out[c] = in[c];
+                }
+            }
+        }
+    }
+}
+
 // Perform a forward pass on the layer.
 int layer_padding2d_forward(struct layer_padding2d *obj) {
     if (!obj->has_caches) {
@@ -231,6 +281,11 @@ int layer_padding2d_forward(struct layer_padding2d *obj) {
         }
     }
 
+    if (obj->layout == LAYOUT_NHWC) {
+        layer_padding2d_forward_nhwc(obj);
+        return 1;
+    }
+
     const int sample_size = obj->n_channels * obj->output_height * obj->output_width;
     const int channel_size = obj->output_height * obj->output_width;
     const int input_sample_size = obj->n_channels * obj->input_height * obj->input_width;
@@ -286,13 +341,45 @@ int layer_padding2d_forward(struct layer_padding2d *obj) {
     return 1;
 }
 
-// Perform a backward pass on the layer.
+// Perform a backward pass on the layer. With zero padding, the output 
+// gradients inside the padding are copied to the input gradients. Otherwise,
+// each output gradient is added to the gradient of the input value it was 
+// copied from.
 void layer_padding2d_backward(struct layer_padding2d *obj) {
-    // Copy each output gradient value to the inputs gradient.
-    for (int i = 0; i < obj->input_height; i++) {
-        for (int j = 0; j < obj->input_width; j++) {
-            // Set the value at (i, j) to (i + padding_y, j + padding_x)
-            obj->d_inputs->buffer[i * obj->input_width + j] = obj->d_outputs->buffer[(i + obj->padding_y) * obj->output_width + j + obj->padding_x];
+    const int n_pixels = obj->output_height * obj->output_width;
+    const int input_size = obj->n_channels * obj->input_height * obj->input_width;
+    const int output_size = obj->n_channels * n_pixels;
+    const bool nhwc = obj->layout == LAYOUT_NHWC;
+
+    // The distance between adjacent channels, and between adjacent pixels.
+    const int channel_stride = nhwc ? 1 : obj->input_height * obj->input_width;
+    const int output_channel_stride = nhwc ? 1 : n_pixels;
+    const int pixel_stride = nhwc ? obj->n_channels : 1;
+
+    for (int sample = 0; sample < obj->input->n_rows; sample++) {
+        double *d_inputs = &obj->d_inputs->buffer[sample * input_size];
+        const double *d_outputs = &obj->d_outputs->buffer[sample * output_size];
+
+        if (obj->type == PADDING_ZERO) {
+            // Copy the gradients inside the padding.
+            for (int c = 0; c < obj->n_channels; c++) {
+                for (int i = 0; i < obj->input_height; i++) {
+                    for (int j = 0; j < obj->input_width; j++) {
+                        d_inputs[c * channel_stride + (i * obj->input_width + j) * pixel_stride] = d_outputs[c * output_channel_stride + ((i + obj->padding_y) * obj->output_width + j + obj->padding_x) * pixel_stride];
+                    }
+                }
+            }
+            continue;
+        }
+
+        // Accumulate the gradients from each output value.
+        for (int i = 0; i < input_size; i++) {
+            d_inputs[i] = 0.0;
+        }
+        for (int c = 0; c < obj->n_channels; c++) {
+            for (int i = 0; i < n_pixels; i++) {
+                d_inputs[c * channel_stride + obj->output_cache[i] * pixel_stride] += d_outputs[c * output_channel_stride + i * pixel_stride];
+            }
         }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,157 @@
+// precision.c
+// Conversions between doubles and reduced precision values. The loops have no
+// branches on the values, so the compiler can vectorize them.
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "precision.h"
+
+static inline uint32_t float_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline float bits_float(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Convert a float to half precision, rounding to nearest even.
+static inline uint16_t float_to_half(float value) {
+    uint32_t x = float_bits(value);
+    uint32_t sign = x & 0x80000000u;
+    x ^= sign;
+
+    uint32_t half;
+    if (x >= 0x47800000u) {
+        // Out of range, an infinity, or a NaN.
+        half = x > 0x7F800000u ? 0x7E00 : 0x7C00;
+    } else if (x < 0x38800000u) {
+        // A subnormal half, or zero. Adding 0.5 aligns the mantissa, and the
+        // float addition rounds it.
+        half = float_bits(bits_float(x) + 0.5f) - 0x3F000000u;
+    } else {
+        // A normal half. Rebias the exponent, and round the mantissa.
+        uint32_t odd = (x >> 13) & 1;
+        half = (x + 0xC8000FFFu + odd) >> 13;
+    }
+    return (uint16_t)(half | (sign >> 16));
+}
+
+// Convert a half precision value to a float.
+static inline float half_to_float(uint16_t half) {
+    uint32_t x = (uint32_t)(half & 0x7FFF) << 13;
+    uint32_t exponent = x & 0x0F800000u;
+
+    // Rebias the exponent. Infinities and NaNs keep the largest exponent, 
+    // and subnormals are normalized by subtracting the implicit bit.
+    x += 0x38000000u;
+    float value = bits_float(x);
+    if (exponent == 0x0F800000u) {
+        value = bits_float(x + 0x38000000u);
+    } else if (exponent == 0) {
+        value = bits_float(x + 0x00800000u) - bits_float(0x38800000u);
+    }
+    return bits_float(float_bits(value) | (uint32_t)(half & 0x8000) << 16);
+}
+
+// Convert doubles to 32-bit floats.
+void precision_to_float32(const double *src, float *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = (float)src[i];
+    }
+}
+
+// Convert 32-bit floats to doubles.
+void precision_from_float32(const float *src, double *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = (double)src[i];
+    }
+}
+
+// Convert doubles to IEEE half precision values.
+void precision_to_float16(const double *src, uint16_t *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = float_to_half((float)src[i]);
+    }
+}
+
+// Convert IEEE half precision values to doubles.
+void precision_from_float16(const uint16_t *src, double *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = (double)half_to_float(src[i]);
+    }
+}
+
+// Convert doubles to bfloat16 values.
+void precision_to_bfloat16(const double *src, uint16_t *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        uint32_t x = float_bits((float)src[i]);
+
+        // Round to nearest even, keeping NaNs quiet.
+        uint32_t rounded = (x + 0x7FFFu + ((x >> 16) & 1)) >> 16;
+        dst[i] = (uint16_t)((x & 0x7FFFFFFFu) > 0x7F800000u ? (x >> 16) | 0x40 : rounded);
+    }
+}
+
+// Convert bfloat16 values to doubles.
+void precision_from_bfloat16(const uint16_t *src, double *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = (double)bits_float((uint32_t)src[i] << 16);
+    }
+}
+
+// Quantize doubles to 8-bit integers with a symmetric scale for each channel.
+void precision_to_int8(const double *src, int8_t *dst, float *scales, int n,
+                       int n_channels, int channel_block) {
+    int row_size = n_channels * channel_block;
+
+    // Find the largest magnitude in each channel.
+    for (int c = 0; c < n_channels; c++) {
+        scales[c] = 0.0f;
+    }
+    for (int i = 0; i < n; i++) {
+        int c = (i % row_size) / channel_block;
+        float magnitude = (float)fabs(src[i]);
+        if (magnitude > scales[c]) {
+            scales[c] = magnitude;
+        }
+    }
+    for (int c = 0; c < n_channels; c++) {
+        scales[c] /= 127.0f;
+    }
+
+    for (int i = 0; i < n; i++) {
+        float scale = scales[(i % row_size) / channel_block];
+        dst[i] = scale > 0.0f ? (int8_t)lrint(src[i] / scale) : 0;
+    }
+}
+
+// Convert 8-bit integers with a scale for each channel to doubles.
+void precision_from_int8(const int8_t *src, const float *scales, double *dst, int n,
+                         int n_channels, int channel_block) {
+    int row_size = n_channels * channel_block;
+    for (int row = 0; row < n; row += row_size) {
+        if (channel_block == 1) {
+            // One channel per value, like the columns of dense weights.
+            for (int c = 0; c < n_channels; c++) {
+                dst[row + c] = (double)src[row + c] * (double)scales[c];
+            }
+        } else {
+            // Blocks of values sharing a scale, like the filters of conv 
+            // weights.
+            for (int c = 0; c < n_channels; c++) {
+                double scale = (double)scales[c];
+                const int8_t *block = &src[row + c * channel_block];
+                double *out = &dst[row + c * channel_block];
+                for (int i = 0; i < channel_block; i++) {
+                    out[i] = (double)block[i] * scale;
+                }
+            }
+        }
+    }
+}
@@ -1,45 +1,69 @@
 // random.c
 // Random number generation.
 
-#include <stdlib.h>
 #include <time.h>
 #include <math.h>
 
 #include "random.h"
 
+// The generator state.
+static struct random_state generator = {0x853C49E6748FEA9Bull, 0.0, 0, 0};
+
+// Get the next 64 random bits.
+static uint64_t random_next(void) {
+    uint64_t z = (generator.state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
 // Initialize the RNG.
 void random_init(void) {
-    srand((unsigned int)time(NULL)); 
+    random_seed((uint64_t)time(NULL));
+}
+
+// Initialize the RNG from a seed.
+void random_seed(uint64_t seed) {
+    generator.state = seed;
+    generator.spare = 0.0;
+    generator.has_spare = 0;
+}
+
+// Get the state of the RNG.
+void random_get_state(struct random_state *state) {
+    *state = generator;
+}
+
+// Restore a state of the RNG.
+void random_set_state(const struct random_state *state) {
+    generator = *state;
 }
 
 // Generate a uniform random value from min to min+range.
 double random_uniform(double min, double range) {
-    return (double)rand() / RAND_MAX * (range) + min;
+    // The top 53 bits, as a value in [0, 1).
+    return (double)(random_next() >> 11) * (1.0 / 9007199254740992.0) * (range) + min;
 }
 
 // Generate a normal random value. Source: https://phoxis.org/2013/05/04/generating-random-numbers-from-normal-distribution-in-c/
 double random_normal(double mu, double sigma) {
     double U1, U2, W, mult;
-    static double X1, X2;
-    static int call = 0;
 
-    if (call == 1) {
-        call = !call;
-        return (mu + sigma * (double) X2);
+    if (generator.has_spare) {
+        generator.has_spare = 0;
+        return (mu + sigma * generator.spare);
     }
 
     do {
-        U1 = -1 + ((double)rand() / RAND_MAX) * 2;
-        U2 = -1 + ((double)rand() / RAND_MAX) * 2;
+        U1 = -1 + random_uniform(0.0, 1.0) * 2;
+        U2 = -1 + random_uniform(0.0, 1.0) * 2;
         W = pow(U1, 2) + pow(U2, 2);
     }
     while (W >= 1 || W == 0);
 
     mult = sqrt((-2 * log(W)) / W);
-    X1 = U1 * mult;
-    X2 = U2 * mult;
+    generator.spare = U2 * mult;
+    generator.has_spare = 1;
 
-    call = !call;
-
-    return (mu + sigma * (double)X1);
-}
\ No newline at end of file
+    return (mu + sigma * U1 * mult);
+}
@@ -62,11 +62,12 @@ void activation_relu_forward(struct activation_relu *obj) {
     }
 }
 
-// Perform a backward pass on the activation.
+// Perform a backward pass on the activation. The output is positive exactly
+// where the input is, so the output is used, which also works in place.
 void activation_relu_backward(struct activation_relu *obj) {
     // Iterate over every output value.
     for (int i = 0; i < obj->d_outputs->size; i++) {
-        if (obj->input->buffer[i] <= 0.0) {
+        if (obj->output->buffer[i] <= 0.0) {
             obj->d_inputs->buffer[i] = 0.0;
         } else {
             obj->d_inputs->buffer[i] = obj->d_outputs->buffer[i];
@@ -4,11 +4,24 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 #include "serialize.h"
 #include "model.h"
+#include "layer_ops.h"
 #include "matrix.h"
-#include "dense.h"
+#include "arena.h"
+#include "precision.h"
 #include "dropout.h"
 #include "conv2d.h"
 #include "maxpool2d.h"
@@ -50,200 +63,136 @@ int serialize_layer(struct layer* obj, FILE* fp) {
 		return 0;
 	}
 
+	// Write the groups and dilation for conv 2D layers.
+	if (obj->type == LAYER_CONV2D || obj->type == LAYER_DEPTHWISE_CONV2D) {
+		if (fwrite(&obj->groups, sizeof(int), 1, fp) != 1 || fwrite(&obj->dilation, sizeof(int), 1, fp) != 1) {
+			LAST_ERROR = "Failed to write file.";
+			return 0;
+		}
+	}
+
 	return 1;
 }
 
 // Serialize a layer's parameters.
 int serialize_layer_params(struct layer* obj, FILE* fp) {
-	// Write the trainable parameters.
-	switch (obj->type) {
-	case LAYER_DENSE:
-		if (!serialize_matrix(&((struct layer_dense*)(obj->obj))->weights, fp)) {
-			return 0;	
-		}
-		if (!serialize_matrix(&((struct layer_dense*)(obj->obj))->biases, fp)) {
-			return 0;
-		}
-		break;
+	// Write the values of the layer type, such as the trainable parameters.
+	if (obj->ops->serialize == NULL) {
+		return 1;
+	}
+	return obj->ops->serialize(obj, fp);
+}
+
+// Add a layer described by a layer record to a model. Layout conversion 
+// layers are skipped, since the model inserts its own for its 2D layout when
+// it is finalized.
+static int model_file_add_layer(struct model* obj, const struct model_file_layer* record) {
+	struct layer* layer;
+	switch (record->type) {
 	case LAYER_CONV2D:
-		if (!serialize_matrix(&((struct layer_conv2d*)(obj->obj))->weights, fp)) {
-			return 0;	
-		}
-		if (!serialize_matrix(&((struct layer_conv2d*)(obj->obj))->biases, fp)) {
-			return 0;
-		}
+		// Conv 2D layer.
+		layer = model_add_conv2d_grouped_layer(obj, record->input_channels, record->input_height, record->input_width, record->output_channels, record->filter_size, record->stride, record->padding_x, record->padding_y, PADDING_ZERO, record->groups, record->dilation);
 		break;
-	case LAYER_PADDING2D:
-		if (fwrite(&((struct layer_padding2d*)(obj->obj))->type, sizeof(enum padding_type), 1, fp) != 1) {
-			LAST_ERROR = "Failed to write file.";
-			return 0;
-		}
+	case LAYER_DEPTHWISE_CONV2D:
+		// Depthwise conv 2D layer.
+		layer = model_add_depthwise_conv2d_layer(obj, record->input_channels, record->input_height, record->input_width, record->output_channels / record->input_channels, record->filter_size, record->stride, record->padding_x, record->padding_y, PADDING_ZERO);
 		break;
-	case LAYER_DROPOUT:
-		if (fwrite(&((struct layer_dropout*)(obj->obj))->rate, sizeof(double), 1, fp) != 1) {
-			LAST_ERROR = "Failed to write file.";
-			return 0;
-		}
+	case LAYER_MAXPOOL2D:
+		// Max pooling 2D layer.
+		layer = model_add_maxpool2d_layer(obj, record->input_channels, record->input_height, record->input_width, record->filter_size, record->stride);
 		break;
-	case LAYER_LEAKY_RELU:
-		if (fwrite(&((struct activation_leaky_relu*)(obj->obj))->rate, sizeof(double), 1, fp) != 1) {
-			LAST_ERROR = "Failed to write file.";
-			return 0;
-		}
+	case LAYER_PADDING2D:
+		// Padding 2D layer.
+		layer = model_add_padding2d_layer(obj, record->input_channels, record->input_height, record->input_width, record->padding_x, record->padding_y);
 		break;
-	case LAYER_NORMALIZATION:
-		if (fwrite(&((struct layer_normalization*)(obj->obj))->epsilon, sizeof(double), 1, fp) != 1) {
-			LAST_ERROR = "Failed to write file.";
-			return 0;
-		}
-		if (fwrite(&((struct layer_normalization*)(obj->obj))->momentum, sizeof(double), 1, fp) != 1) {
-			LAST_ERROR = "Failed to write file.";
-			return 0;
-		}
-
-		// Save gamma and beta, along with the running mean and variance.
-		if (!serialize_matrix(&((struct layer_normalization*)(obj->obj))->gamma, fp)) {
-			return 0;	
-		}
-		if (!serialize_matrix(&((struct layer_normalization*)(obj->obj))->beta, fp)) {
-			return 0;
-		}
-		if (!serialize_matrix(&((struct layer_normalization*)(obj->obj))->running_mean, fp)) {
-			return 0;	
-		}
-		if (!serialize_matrix(&((struct layer_normalization*)(obj->obj))->running_variance, fp)) {
-			return 0;
-		}
+	case LAYER_GLOBAVGPOOL2D:
+		// Global average pooling 2D layer.
+		layer = model_add_globavgpool2d_layer(obj, record->input_channels, record->input_height, record->input_width);
 		break;
+	case LAYER_LAYOUT2D:
+		return 1;
 	default:
+		layer = model_add_layer(obj, record->type, record->input_size, record->output_size);
+		if (layer != NULL && record->type >= LAYER_CUSTOM) {
+			// Custom layers read their dimensions and hyperparameters from 
+			// the layer.
+			layer->input_channels = record->input_channels;
+			layer->input_height = record->input_height;
+			layer->input_width = record->input_width;
+			layer->output_channels = record->output_channels;
+			layer->output_height = record->output_height;
+			layer->output_width = record->output_width;
+			layer->filter_size = record->filter_size;
+			layer->stride = record->stride;
+			layer->padding_x = record->padding_x;
+			layer->padding_y = record->padding_y;
+			layer->padding_type = (enum padding_type)record->padding_type;
+			layer->dilation = record->dilation;
+			layer->groups = record->groups;
+		}
 		break;
 	}
-	
-	return 1;
+	return layer != NULL;
 }
 
-// Deserialize a layer and add it to a model.
-int deserialize_layer(struct model* obj, FILE* fp) {
+// Deserialize a layer of a stream with the given version and add it to a 
+// model. Version 0 is the original format.
+static int deserialize_layer_version(struct model* obj, FILE* fp, int version) {
 	// Read the layer type.
 	enum layer_type ltype;
 	if (fread(&ltype, sizeof(enum layer_type), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
 
 	// Read the layer parameters.
-	int input_size, output_size;
-	int input_channels, input_height, input_width;
-	int output_channels, output_height, output_width;
-	int filter_size, stride;
-	int padding_x, padding_y;
-	if (fread(&input_size, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&output_size, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&input_channels, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&input_height, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&input_width, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&output_channels, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&output_height, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&output_width, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&filter_size, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&stride, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&padding_x, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-	if (fread(&padding_y, sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
-
-	switch (ltype) {
-	case LAYER_CONV2D:
-		// Conv 2D layer.
-		model_add_conv2d_layer(obj, input_channels, input_height, input_width, output_channels, filter_size, stride);
-		break;
-	case LAYER_MAXPOOL2D:
-		// Max pooling 2D layer.
-		model_add_maxpool2d_layer(obj, input_channels, input_height, input_width, filter_size, stride);
-		break;
-	case LAYER_PADDING2D:
-		// Padding 2D layer.
-		model_add_padding2d_layer(obj, input_channels, input_height, input_width, padding_x, padding_y);
-		break;
-	default:
-		model_add_layer(obj, ltype, input_size, output_size);
-		break;
+	struct model_file_layer record = {0};
+	int fields[12];
+	if (fread(fields, sizeof(int), 12, fp) != 12) {LAST_ERROR = "Failed to read file."; return 0;}
+	record.type = ltype;
+	record.input_size = fields[0];
+	record.output_size = fields[1];
+	record.input_channels = fields[2];
+	record.input_height = fields[3];
+	record.input_width = fields[4];
+	record.output_channels = fields[5];
+	record.output_height = fields[6];
+	record.output_width = fields[7];
+	record.filter_size = fields[8];
+	record.stride = fields[9];
+	record.padding_x = fields[10];
+	record.padding_y = fields[11];
+
+	// Read the groups and dilation for conv 2D layers, which the original 
+	// format does not have.
+	record.groups = 1;
+	record.dilation = 1;
+	if (version >= 1 && (ltype == LAYER_CONV2D || ltype == LAYER_DEPTHWISE_CONV2D)) {
+		if (fread(&fields[0], sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
+		if (fread(&fields[1], sizeof(int), 1, fp) != 1) {LAST_ERROR = "Failed to read file."; return 0;}
+		record.groups = fields[0];
+		record.dilation = fields[1];
 	}
-	
-	return 1;
+
+	return model_file_add_layer(obj, &record);
+}
+
+// Deserialize a layer written by serialize_layer and add it to a model.
+int deserialize_layer(struct model* obj, FILE* fp) {
+	return deserialize_layer_version(obj, fp, SERIALIZE_VERSION);
 }
 
 // Deserialize a layer's parameters.
 int deserialize_layer_params(struct layer* obj, FILE* fp) {
-	switch (obj->type) {
-	case LAYER_CONV2D:
-		// Conv 2D layer.
-		if (!deserialize_matrix(&((struct layer_conv2d*)(obj->obj))->weights, fp)) {
-			return 0;
-		}
-		if (!deserialize_matrix(&((struct layer_conv2d*)(obj->obj))->biases, fp)) {
-			return 0;
-		}
-		break;
-	case LAYER_DENSE:
-		// Dense layer.
-		if (!deserialize_matrix(&((struct layer_dense*)(obj->obj))->weights, fp)) {
-			return 0;
-		}
-		if (!deserialize_matrix(&((struct layer_dense*)(obj->obj))->biases, fp)) {
-			return 0;
-		}
-		break;
-	case LAYER_PADDING2D:
-		// Padding 2D layer.
-		if (fread(&((struct layer_padding2d*)(obj->obj))->type, sizeof(enum padding_type), 1, fp) != 1) {
-			LAST_ERROR = "Failed to read file.";
-			return 0;
-		}
-		break;
-	case LAYER_DROPOUT:
-		// Dropout layer.
-		if (fread(&((struct layer_dropout*)(obj->obj))->rate, sizeof(double), 1, fp) != 1) {
-			LAST_ERROR = "Failed to read file.";
-			return 0;
-		}
-		break;
-	case LAYER_LEAKY_RELU:
-		// Leaky RELU layer.
-		if (fread(&((struct activation_leaky_relu*)(obj->obj))->rate, sizeof(double), 1, fp) != 1) {
-			LAST_ERROR = "Failed to read file.";
-			return 0;
-		}
-		break;
-	case LAYER_NORMALIZATION:
-		// Batch normalization layer.
-		if (fread(&((struct layer_normalization*)(obj->obj))->epsilon, sizeof(double), 1, fp) != 1) {
-			LAST_ERROR = "Failed to read file.";
-			return 0;
-		}
-		if (fread(&((struct layer_normalization*)(obj->obj))->momentum, sizeof(double), 1, fp) != 1) {
-			LAST_ERROR = "Failed to read file.";
-			return 0;
-		}
-		if (!deserialize_matrix(&((struct layer_normalization*)(obj->obj))->gamma, fp)) {
-			return 0;
-		}
-		if (!deserialize_matrix(&((struct layer_normalization*)(obj->obj))->beta, fp)) {
-			return 0;
-		}
-		if (!deserialize_matrix(&((struct layer_normalization*)(obj->obj))->running_mean, fp)) {
-			return 0;
-		}
-		if (!deserialize_matrix(&((struct layer_normalization*)(obj->obj))->running_variance, fp)) {
-			return 0;
-		}
-		break;
-	default:
-		break;
+	if (obj->ops->deserialize == NULL) {
+		return 1;
 	}
-	return 1;
+	return obj->ops->deserialize(obj, fp);
 }
 
 // Serialize a model. We serialize in two passes, once for layer information,
 // and again for layer parameters.
 int serialize_model(struct model* obj, FILE* fp) {
-	// Write the number of layers.
-	if (fwrite(&obj->n_layers, sizeof(int), 1, fp) != 1) {
+	// Write the magic word, the version and the number of layers.
+	int header[3] = {SERIALIZE_MAGIC, SERIALIZE_VERSION, obj->n_layers};
+	if (fwrite(header, sizeof(int), 3, fp) != 3) {
 		LAST_ERROR = "Failed to write file.";
 		return 0;
 	}
@@ -278,12 +227,23 @@ int serialize_model(struct model* obj, FILE* fp) {
 // Deserialize a model. Again, deserialize in two passes, loading layer data,
 // initializing and finalizing the model, and then loading layer parameters.
 int deserialize_model(struct model* obj, FILE* fp) {
-	// Get the number of layers.
-	int n_layers;
+	// Get the number of layers. Streams in the original format start with 
+	// it, and newer ones with the magic word and the version.
+	int n_layers, version = 0;
 	if (fread(&n_layers, sizeof(int), 1, fp) != 1) {
 		LAST_ERROR = "Failed to read file.";
 		return 0;
 	}
+	if (n_layers == SERIALIZE_MAGIC) {
+		if (fread(&version, sizeof(int), 1, fp) != 1 || fread(&n_layers, sizeof(int), 1, fp) != 1) {
+			LAST_ERROR = "Failed to read file.";
+			return 0;
+		}
+		if (version < 1 || version > SERIALIZE_VERSION) {
+			LAST_ERROR = "Unsupported model stream version.";
+			return 0;
+		}
+	}
 
 	// Get the loss type.
 	if (fread(&obj->loss.type, sizeof(enum loss_type), 1, fp) != 1) {
@@ -293,7 +253,7 @@ int deserialize_model(struct model* obj, FILE* fp) {
 
 	// Load each layer.
 	for (int i = 0; i < n_layers; i++) {
-		if (!deserialize_layer(obj, fp)) {
+		if (!deserialize_layer_version(obj, fp, version)) {
 			return 0;
 		}
 	}
@@ -312,5 +272,717 @@ int deserialize_model(struct model* obj, FILE* fp) {
 		current = current->next;
 	} while (current != NULL);
 
+	// Pack the weights once, if the model is loaded for inference.
+	if (obj->memory_plan == MEMORY_PLAN_INFERENCE && !model_prepack(obj)) {
+		return 0;
+	}
+
 	return 1;
 }
+
+// Deserialize a model with the same layers into a shadow model, and publish
+// its weights as the model's new weights.
+int deserialize_model_weights(struct model* obj, FILE* fp) {
+	struct model source = {0};
+	model_init(&source, 1);
+	model_set_memory_plan(&source, MEMORY_PLAN_INFERENCE);
+	model_set_layout_2d(&source, obj->layout_2d);
+
+	int result = deserialize_model(&source, fp) && model_publish_weights(obj, &source);
+	if (source.input != NULL) {
+		model_free(&source);
+	}
+	return result;
+}
+
+// Round an offset up to the model file alignment.
+#define MODEL_FILE_ALIGN(offset) (((offset) + MODEL_FILE_ALIGNMENT - 1) / MODEL_FILE_ALIGNMENT * MODEL_FILE_ALIGNMENT)
+
+// Build the table for CRC-32 checksums.
+void crc32_init(uint32_t table[256]) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+		}
+		table[i] = c;
+	}
+}
+
+// Continue a CRC-32 checksum over data. Start with a checksum of zero.
+uint32_t crc32_update(const uint32_t table[256], uint32_t crc, const void* data, size_t size) {
+	const unsigned char* bytes = data;
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) {
+		crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+// Get the tensors stored for a layer: its parameters, and the running 
+// statistics of batch normalization layers. Returns the number of tensors.
+static int model_file_layer_tensors(struct layer* obj, struct matrix** tensors) {
+	struct matrix* grads[LAYER_MAX_PARAMS];
+	int n = layer_get_params(obj, tensors, grads);
+	if (obj->type == LAYER_NORMALIZATION) {
+		tensors[n++] = &((struct layer_normalization*)(obj->obj))->running_mean;
+		tensors[n++] = &((struct layer_normalization*)(obj->obj))->running_variance;
+	}
+	return n;
+}
+
+// Fill a layer record, apart from its tensors.
+static void model_file_layer_record(struct layer* obj, struct model_file_layer* record) {
+	record->type = obj->type;
+	record->input_size = obj->input_size;
+	record->output_size = obj->output_size;
+	record->input_channels = obj->input_channels;
+	record->input_height = obj->input_height;
+	record->input_width = obj->input_width;
+	record->output_channels = obj->output_channels;
+	record->output_height = obj->output_height;
+	record->output_width = obj->output_width;
+	record->filter_size = obj->filter_size;
+	record->stride = obj->stride;
+	record->padding_x = obj->padding_x;
+	record->padding_y = obj->padding_y;
+	record->dilation = obj->dilation;
+	record->groups = obj->groups;
+
+	switch (obj->type) {
+	case LAYER_CONV2D:
+	case LAYER_DEPTHWISE_CONV2D:
+		record->padding_type = ((struct layer_conv2d*)(obj->obj))->padding_type;
+		break;
+	case LAYER_PADDING2D:
+		record->padding_type = ((struct layer_padding2d*)(obj->obj))->type;
+		break;
+	case LAYER_DROPOUT:
+		record->values[0] = ((struct layer_dropout*)(obj->obj))->rate;
+		break;
+	case LAYER_LEAKY_RELU:
+		record->values[0] = ((struct activation_leaky_relu*)(obj->obj))->rate;
+		break;
+	case LAYER_NORMALIZATION:
+		record->values[0] = ((struct layer_normalization*)(obj->obj))->epsilon;
+		record->values[1] = ((struct layer_normalization*)(obj->obj))->momentum;
+		break;
+	default:
+		break;
+	}
+}
+
+// Apply the values of a layer record which are not set when the layer is 
+// added: the padding type, the rates, and the batch normalization constants.
+static void model_file_apply_layer(struct layer* obj, const struct model_file_layer* record) {
+	switch (obj->type) {
+	case LAYER_CONV2D:
+	case LAYER_DEPTHWISE_CONV2D:
+		if (obj->padding_x || obj->padding_y) {
+			obj->padding_type = record->padding_type;
+			layer_conv2d_set_padding_type(obj->obj, record->padding_type);
+		}
+		break;
+	case LAYER_PADDING2D:
+		((struct layer_padding2d*)(obj->obj))->type = record->padding_type;
+		break;
+	case LAYER_DROPOUT:
+		((struct layer_dropout*)(obj->obj))->rate = record->values[0];
+		break;
+	case LAYER_LEAKY_RELU:
+		((struct activation_leaky_relu*)(obj->obj))->rate = record->values[0];
+		break;
+	case LAYER_NORMALIZATION:
+		((struct layer_normalization*)(obj->obj))->epsilon = record->values[0];
+		((struct layer_normalization*)(obj->obj))->momentum = record->values[1];
+		break;
+	default:
+		break;
+	}
+}
+
+// Get the type a layer's tensor is stored as in a file written with a 
+// precision, and its channels if it is quantized. Only the weights of dense 
+// and conv layers are quantized to 8-bit integers.
+static enum model_file_type model_file_tensor_type(struct layer* obj, int index, enum model_file_type type,
+												   int* n_channels, int* channel_block) {
+	*n_channels = 0;
+	*channel_block = 0;
+	if (type != MODEL_FILE_INT8) {
+		return type;
+	}
+	if (index == 0 && obj->type == LAYER_DENSE) {
+		// One channel for each output.
+		*n_channels = obj->output_size;
+		*channel_block = 1;
+		return MODEL_FILE_INT8;
+	}
+	if (index == 0 && (obj->type == LAYER_CONV2D || obj->type == LAYER_DEPTHWISE_CONV2D)) {
+		// One channel for each filter, with the filter's planes.
+		struct layer_conv2d* conv2d = obj->obj;
+		*n_channels = conv2d->n_filters;
+		*channel_block = conv2d->weights.size / conv2d->n_filters;
+		return MODEL_FILE_INT8;
+	}
+	return MODEL_FILE_FLOAT32;
+}
+
+// Get the size of a tensor's data in bytes, from its record.
+static uint64_t model_file_tensor_size(const struct model_file_tensor* record) {
+	uint64_t n = (uint64_t)record->n_rows * (uint64_t)record->n_cols;
+	switch (record->type) {
+	case MODEL_FILE_FLOAT64:
+		return n * sizeof(double);
+	case MODEL_FILE_FLOAT32:
+		return n * sizeof(float);
+	case MODEL_FILE_FLOAT16:
+	case MODEL_FILE_BFLOAT16:
+		return n * sizeof(uint16_t);
+	case MODEL_FILE_INT8:
+		return (uint64_t)record->n_channels * sizeof(float) + n;
+	default:
+		return 0;
+	}
+}
+
+// Encode a matrix in the type of its tensor record. Returns the data, which 
+// the caller frees, or NULL if the allocation failed.
+static void* model_file_encode(struct matrix* obj, const struct model_file_tensor* record) {
+	unsigned char* data = malloc(record->size > 0 ? record->size : 1);
+	if (data == NULL) {
+		LAST_ERROR = "Failed to allocate memory.";
+		return NULL;
+	}
+	switch (record->type) {
+	case MODEL_FILE_FLOAT32:
+		precision_to_float32(obj->buffer, (float*)data, obj->size);
+		break;
+	case MODEL_FILE_FLOAT16:
+		precision_to_float16(obj->buffer, (uint16_t*)data, obj->size);
+		break;
+	case MODEL_FILE_BFLOAT16:
+		precision_to_bfloat16(obj->buffer, (uint16_t*)data, obj->size);
+		break;
+	case MODEL_FILE_INT8:
+		precision_to_int8(obj->buffer, (int8_t*)(data + record->n_channels * sizeof(float)), (float*)data, 
+						  obj->size, record->n_channels, record->channel_block);
+		break;
+	default:
+		memcpy(data, obj->buffer, record->size);
+		break;
+	}
+	return data;
+}
+
+// Decode a tensor's data into a matrix of its shape.
+static void model_file_decode(const void* data, const struct model_file_tensor* record, struct matrix* obj) {
+	switch (record->type) {
+	case MODEL_FILE_FLOAT32:
+		precision_from_float32(data, obj->buffer, obj->size);
+		break;
+	case MODEL_FILE_FLOAT16:
+		precision_from_float16(data, obj->buffer, obj->size);
+		break;
+	case MODEL_FILE_BFLOAT16:
+		precision_from_bfloat16(data, obj->buffer, obj->size);
+		break;
+	case MODEL_FILE_INT8:
+		precision_from_int8((const int8_t*)data + record->n_channels * sizeof(float), data, obj->buffer,
+							obj->size, record->n_channels, record->channel_block);
+		break;
+	default:
+		memcpy(obj->buffer, data, record->size);
+		break;
+	}
+}
+
+// Write zeros up to an offset.
+static int model_file_pad(FILE* fp, uint64_t* offset, uint64_t target) {
+	static const char zeros[MODEL_FILE_ALIGNMENT] = {0};
+	size_t n = (size_t)(target - *offset);
+	if (n > 0 && fwrite(zeros, 1, n, fp) != n) {
+		LAST_ERROR = "Failed to write file.";
+		return 0;
+	}
+	*offset = target;
+	return 1;
+}
+
+// Write a finalized model in the model file format.
+int serialize_model_file(struct model* obj, FILE* fp, enum model_file_type type) {
+	if (obj->input == NULL) {
+		LAST_ERROR = "Model not finalized.";
+		return 0;
+	}
+	if (type < MODEL_FILE_FLOAT64 || type > MODEL_FILE_INT8) {
+		LAST_ERROR = "Invalid model file type.";
+		return 0;
+	}
+	uint32_t table[256];
+	crc32_init(table);
+
+	// Count the tensors.
+	int n_tensors = 0;
+	struct matrix* tensors[LAYER_MAX_WEIGHTS];
+	for (struct layer* current = obj->first; current != NULL; current = current->next) {
+		n_tensors += model_file_layer_tensors(current, tensors);
+	}
+
+	// The encoded data of each tensor, or NULL if the tensor is stored as 
+	// doubles and written from its matrix.
+	struct model_file_layer* layers = calloc(obj->n_layers, sizeof(struct model_file_layer));
+	struct model_file_tensor* records = calloc(n_tensors > 0 ? n_tensors : 1, sizeof(struct model_file_tensor));
+	void** data = calloc(n_tensors > 0 ? n_tensors : 1, sizeof(void*));
+	if (layers == NULL || records == NULL || data == NULL) {
+		free(layers);
+		free(records);
+		free(data);
+		LAST_ERROR = "Failed to allocate memory.";
+		return 0;
+	}
+
+	// Lay out the file: the header, the tables, and then each tensor on an
+	// aligned offset.
+	struct model_file_header header = {0};
+	memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+	header.version = MODEL_FILE_VERSION;
+	header.byte_order = MODEL_FILE_BYTE_ORDER;
+	header.n_layers = obj->n_layers;
+	header.n_tensors = n_tensors;
+	header.loss_type = obj->loss.type;
+	header.type = type;
+	header.layer_offset = MODEL_FILE_ALIGN(sizeof(struct model_file_header));
+	header.tensor_offset = MODEL_FILE_ALIGN(header.layer_offset + obj->n_layers * sizeof(struct model_file_layer));
+	header.data_offset = MODEL_FILE_ALIGN(header.tensor_offset + n_tensors * sizeof(struct model_file_tensor));
+
+	int result = 1;
+	uint64_t offset = header.data_offset;
+	int i = 0, t = 0;
+	for (struct layer* current = obj->first; result && current != NULL; current = current->next, i++) {
+		model_file_layer_record(current, &layers[i]);
+		int n = model_file_layer_tensors(current, tensors);
+		layers[i].first_tensor = t;
+		layers[i].n_tensors = n;
+		for (int j = 0; j < n; j++, t++) {
+			records[t].n_rows = tensors[j]->n_rows;
+			records[t].n_cols = tensors[j]->n_cols;
+			records[t].type = model_file_tensor_type(current, j, type, &records[t].n_channels, &records[t].channel_block);
+			records[t].offset = offset;
+			records[t].size = model_file_tensor_size(&records[t]);
+			if (records[t].type != MODEL_FILE_FLOAT64 && (data[t] = model_file_encode(tensors[j], &records[t])) == NULL) {
+				result = 0;
+				break;
+			}
+			records[t].checksum = crc32_update(table, 0, data[t] != NULL ? data[t] : (void*)tensors[j]->buffer, records[t].size);
+			offset = MODEL_FILE_ALIGN(offset + records[t].size);
+		}
+	}
+	header.file_size = offset;
+	header.table_checksum = crc32_update(table, 0, layers, obj->n_layers * sizeof(struct model_file_layer));
+	header.table_checksum = crc32_update(table, header.table_checksum, records, n_tensors * sizeof(struct model_file_tensor));
+	header.header_checksum = crc32_update(table, 0, &header, offsetof(struct model_file_header, header_checksum));
+
+	// Write the header and the tables.
+	if (result) {
+		offset = 0;
+		result = fwrite(&header, sizeof(struct model_file_header), 1, fp) == 1;
+		offset += sizeof(struct model_file_header);
+		result = result && model_file_pad(fp, &offset, header.layer_offset);
+		result = result && fwrite(layers, sizeof(struct model_file_layer), obj->n_layers, fp) == (size_t)obj->n_layers;
+		offset += obj->n_layers * sizeof(struct model_file_layer);
+		result = result && model_file_pad(fp, &offset, header.tensor_offset);
+		result = result && fwrite(records, sizeof(struct model_file_tensor), n_tensors, fp) == (size_t)n_tensors;
+		offset += n_tensors * sizeof(struct model_file_tensor);
+		result = result && model_file_pad(fp, &offset, header.data_offset);
+
+		// Write the tensors.
+		t = 0;
+		for (struct layer* current = obj->first; result && current != NULL; current = current->next) {
+			int n = model_file_layer_tensors(current, tensors);
+			for (int j = 0; result && j < n; j++, t++) {
+				if (data[t] != NULL) {
+					result = fwrite(data[t], 1, records[t].size, fp) == records[t].size;
+				} else {
+					result = serialize_matrix(tensors[j], fp);
+				}
+				offset += records[t].size;
+				result = result && model_file_pad(fp, &offset, MODEL_FILE_ALIGN(offset));
+			}
+		}
+		if (!result) {
+			LAST_ERROR = "Failed to write file.";
+		}
+	}
+
+	for (t = 0; t < n_tensors; t++) {
+		free(data[t]);
+	}
+	free(data);
+	free(layers);
+	free(records);
+	return result;
+}
+
+// Check a model file's header, given the number of bytes in the file.
+static int model_file_check_header(const struct model_file_header* header, uint64_t file_size, const uint32_t table[256]) {
+	if (memcmp(header->magic, MODEL_FILE_MAGIC, sizeof(header->magic)) != 0) {
+		LAST_ERROR = "Not a model file.";
+		return 0;
+	}
+	if (header->byte_order != MODEL_FILE_BYTE_ORDER) {
+		LAST_ERROR = "Model file has a different byte order.";
+		return 0;
+	}
+	if (header->version != MODEL_FILE_VERSION) {
+		LAST_ERROR = "Unsupported model file version.";
+		return 0;
+	}
+	if (header->header_checksum != crc32_update(table, 0, header, offsetof(struct model_file_header, header_checksum))) {
+		LAST_ERROR = "Model file header is corrupt.";
+		return 0;
+	}
+	if (header->file_size > file_size ||
+		header->layer_offset % MODEL_FILE_ALIGNMENT || header->tensor_offset % MODEL_FILE_ALIGNMENT ||
+		header->layer_offset + (uint64_t)header->n_layers * sizeof(struct model_file_layer) > header->tensor_offset ||
+		header->tensor_offset + (uint64_t)header->n_tensors * sizeof(struct model_file_tensor) > header->data_offset ||
+		header->data_offset > header->file_size) {
+		LAST_ERROR = "Model file is truncated or corrupt.";
+		return 0;
+	}
+	return 1;
+}
+
+// Check a model file's tables.
+static int model_file_check_tables(const struct model_file_header* header, const struct model_file_layer* layers,
+								   const struct model_file_tensor* tensors, const uint32_t table[256]) {
+	uint32_t checksum = crc32_update(table, 0, layers, header->n_layers * sizeof(struct model_file_layer));
+	checksum = crc32_update(table, checksum, tensors, header->n_tensors * sizeof(struct model_file_tensor));
+	if (checksum != header->table_checksum) {
+		LAST_ERROR = "Model file tables are corrupt.";
+		return 0;
+	}
+	for (uint32_t i = 0; i < header->n_layers; i++) {
+		if (layers[i].first_tensor < 0 || layers[i].n_tensors < 0 || layers[i].n_tensors > LAYER_MAX_WEIGHTS ||
+			(uint64_t)layers[i].first_tensor + layers[i].n_tensors > header->n_tensors) {
+			LAST_ERROR = "Model file tables are corrupt.";
+			return 0;
+		}
+	}
+	for (uint32_t i = 0; i < header->n_tensors; i++) {
+		if (tensors[i].type < MODEL_FILE_FLOAT64 || tensors[i].type > MODEL_FILE_INT8) {
+			LAST_ERROR = "Unsupported model file tensor type.";
+			return 0;
+		}
+		if (tensors[i].type == MODEL_FILE_INT8 && 
+			(tensors[i].n_channels <= 0 || tensors[i].channel_block <= 0 ||
+			 ((uint64_t)tensors[i].n_rows * tensors[i].n_cols) % ((uint64_t)tensors[i].n_channels * tensors[i].channel_block))) {
+			LAST_ERROR = "Model file tables are corrupt.";
+			return 0;
+		}
+		if (tensors[i].n_rows < 0 || tensors[i].n_cols < 0 ||
+			tensors[i].size != model_file_tensor_size(&tensors[i]) ||
+			tensors[i].offset % MODEL_FILE_ALIGNMENT || tensors[i].offset < header->data_offset ||
+			tensors[i].offset + tensors[i].size > header->file_size) {
+			LAST_ERROR = "Model file tables are corrupt.";
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Get the index of the first layer record from i which is not a layout 
+// conversion layer. The records of the other layers match the model's layers
+// which are not layout conversion layers, in order, whichever 2D layout the 
+// file was written with.
+static uint32_t model_file_skip_layouts(const struct model_file_header* header, const struct model_file_layer* layers, uint32_t i) {
+	while (i < header->n_layers && layers[i].type == LAYER_LAYOUT2D) {
+		i++;
+	}
+	return i;
+}
+
+// Add the layers of a model file to a model, finalize it, and apply the layer
+// values. The layers' tensors are checked against their matrices.
+static int model_file_build(struct model* obj, const struct model_file_header* header, 
+							const struct model_file_layer* layers, const struct model_file_tensor* tensors) {
+	for (uint32_t i = 0; i < header->n_layers; i++) {
+		if (!model_file_add_layer(obj, &layers[i])) {
+			return 0;
+		}
+	}
+	obj->loss.type = header->loss_type;
+	if (!model_finalize(obj)) {
+		return 0;
+	}
+
+	uint32_t i = 0;
+	struct matrix* matrices[LAYER_MAX_WEIGHTS];
+	for (struct layer* current = obj->first; current != NULL; current = current->next) {
+		if (current->type == LAYER_LAYOUT2D) {
+			continue;
+		}
+		i = model_file_skip_layouts(header, layers, i);
+		if (i == header->n_layers || layers[i].type != (int32_t)current->type) {
+			LAST_ERROR = "Model layers changed when finalized.";
+			return 0;
+		}
+		model_file_apply_layer(current, &layers[i]);
+		int n = model_file_layer_tensors(current, matrices);
+		if (n != layers[i].n_tensors) {
+			LAST_ERROR = "Model file tensors do not match the layers.";
+			return 0;
+		}
+		for (int j = 0; j < n; j++) {
+			const struct model_file_tensor* tensor = &tensors[layers[i].first_tensor + j];
+			if (tensor->n_rows != matrices[j]->n_rows || tensor->n_cols != matrices[j]->n_cols) {
+				LAST_ERROR = "Model file tensors do not match the layers.";
+				return 0;
+			}
+		}
+		i++;
+	}
+	if (model_file_skip_layouts(header, layers, i) != header->n_layers) {
+		LAST_ERROR = "Model layers changed when finalized.";
+		return 0;
+	}
+	return 1;
+}
+
+// Read a model in the model file format.
+int deserialize_model_file(struct model* obj, FILE* fp) {
+	uint32_t table[256];
+	crc32_init(table);
+
+	// Offsets are relative to the start of the model file, which may be 
+	// embedded in a larger file.
+	long start = ftell(fp);
+	if (start < 0 || fseek(fp, 0, SEEK_END) != 0) {
+		LAST_ERROR = "Failed to read file.";
+		return 0;
+	}
+	long end = ftell(fp);
+	struct model_file_header header;
+	if (end < start || fseek(fp, start, SEEK_SET) != 0 || fread(&header, sizeof(struct model_file_header), 1, fp) != 1) {
+		LAST_ERROR = "Failed to read file.";
+		return 0;
+	}
+	if (!model_file_check_header(&header, (uint64_t)(end - start), table)) {
+		return 0;
+	}
+
+	// Read the tables.
+	struct model_file_layer* layers = malloc(header.n_layers * sizeof(struct model_file_layer) + 1);
+	struct model_file_tensor* tensors = malloc(header.n_tensors * sizeof(struct model_file_tensor) + 1);
+	int result = layers != NULL && tensors != NULL;
+	if (!result) {
+		LAST_ERROR = "Failed to allocate memory.";
+	}
+	if (result) {
+		result = fseek(fp, start + (long)header.layer_offset, SEEK_SET) == 0 &&
+				 fread(layers, sizeof(struct model_file_layer), header.n_layers, fp) == header.n_layers &&
+				 fseek(fp, start + (long)header.tensor_offset, SEEK_SET) == 0 &&
+				 fread(tensors, sizeof(struct model_file_tensor), header.n_tensors, fp) == header.n_tensors;
+		if (!result) {
+			LAST_ERROR = "Failed to read file.";
+		}
+	}
+	result = result && model_file_check_tables(&header, layers, tensors, table);
+	result = result && model_file_build(obj, &header, layers, tensors);
+
+	// Read each tensor into its matrix, and check it. Tensors stored in 
+	// other types are read whole, and converted once checked.
+	uint32_t i = 0;
+	struct matrix* matrices[LAYER_MAX_WEIGHTS];
+	for (struct layer* current = obj->first; result && current != NULL; current = current->next) {
+		if (current->type == LAYER_LAYOUT2D) {
+			continue;
+		}
+		i = model_file_skip_layouts(&header, layers, i);
+		int n = model_file_layer_tensors(current, matrices);
+		for (int j = 0; result && j < n; j++) {
+			const struct model_file_tensor* tensor = &tensors[layers[i].first_tensor + j];
+			if (fseek(fp, start + (long)tensor->offset, SEEK_SET) != 0) {
+				LAST_ERROR = "Failed to read file.";
+				result = 0;
+			} else if (tensor->type == MODEL_FILE_FLOAT64) {
+				result = deserialize_matrix(matrices[j], fp);
+				if (result && crc32_update(table, 0, matrices[j]->buffer, tensor->size) != tensor->checksum) {
+					LAST_ERROR = "Model file tensor is corrupt.";
+					result = 0;
+				}
+			} else {
+				void* data = malloc(tensor->size > 0 ? tensor->size : 1);
+				if (data == NULL) {
+					LAST_ERROR = "Failed to allocate memory.";
+					result = 0;
+				} else if (fread(data, 1, tensor->size, fp) != tensor->size) {
+					LAST_ERROR = "Failed to read file.";
+					result = 0;
+				} else if (crc32_update(table, 0, data, tensor->size) != tensor->checksum) {
+					LAST_ERROR = "Model file tensor is corrupt.";
+					result = 0;
+				} else {
+					model_file_decode(data, tensor, matrices[j]);
+				}
+				free(data);
+			}
+		}
+		i++;
+	}
+
+	// Leave the file after the model.
+	result = result && fseek(fp, start + (long)header.file_size, SEEK_SET) == 0;
+	free(layers);
+	free(tensors);
+
+	// Pack the weights once, if the model is loaded for inference.
+	return result && (obj->memory_plan != MEMORY_PLAN_INFERENCE || model_prepack(obj));
+}
+
+// Unmap a model file.
+static void model_file_unmap(void* mapping, size_t size) {
+#ifdef _WIN32
+	(void)size;
+	UnmapViewOfFile(mapping);
+#else
+	munmap(mapping, size);
+#endif
+}
+
+// Map a model file into memory, read only and shared.
+static void* model_file_map(const char* path, size_t* size) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		LAST_ERROR = "Failed to open file.";
+		return NULL;
+	}
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(file);
+		LAST_ERROR = "Failed to read file.";
+		return NULL;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) {
+		LAST_ERROR = "Failed to map file.";
+		return NULL;
+	}
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (view == NULL) {
+		LAST_ERROR = "Failed to map file.";
+		return NULL;
+	}
+	*size = (size_t)file_size.QuadPart;
+	return view;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LAST_ERROR = "Failed to open file.";
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		LAST_ERROR = "Failed to read file.";
+		return NULL;
+	}
+	void* view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (view == MAP_FAILED) {
+		LAST_ERROR = "Failed to map file.";
+		return NULL;
+	}
+	*size = (size_t)st.st_size;
+	return view;
+#endif
+}
+
+// Map a model file into memory and load the model with its tensors used in
+// place.
+int map_model_file(struct model* obj, const char* path, bool verify) {
+	if (obj->memory_plan != MEMORY_PLAN_INFERENCE) {
+		LAST_ERROR = "Mapped models must be planned for inference.";
+		return 0;
+	}
+	uint32_t table[256];
+	crc32_init(table);
+
+	size_t size = 0;
+	unsigned char* base = model_file_map(path, &size);
+	if (base == NULL) {
+		return 0;
+	}
+
+	// The tables are read in place too.
+	const struct model_file_header* header = (const struct model_file_header*)base;
+	int result = size >= sizeof(struct model_file_header);
+	if (!result) {
+		LAST_ERROR = "Model file is truncated or corrupt.";
+	}
+	result = result && model_file_check_header(header, size, table);
+	const struct model_file_layer* layers = result ? (const struct model_file_layer*)(base + header->layer_offset) : NULL;
+	const struct model_file_tensor* tensors = result ? (const struct model_file_tensor*)(base + header->tensor_offset) : NULL;
+	result = result && model_file_check_tables(header, layers, tensors, table);
+
+	// Check the tensors before the model uses them, if asked to.
+	for (uint32_t i = 0; result && verify && i < header->n_tensors; i++) {
+		if (crc32_update(table, 0, base + tensors[i].offset, tensors[i].size) != tensors[i].checksum) {
+			LAST_ERROR = "Model file tensor is corrupt.";
+			result = 0;
+		}
+	}
+	result = result && model_file_build(obj, header, layers, tensors);
+	if (!result) {
+		model_file_unmap(base, size);
+		return 0;
+	}
+
+	// Point the layers' matrices at the mapped tensors. The parameters are 
+	// views into the params arena, and the running statistics own their 
+	// buffers. Tensors stored in other types are converted into the matrices
+	// instead.
+	uint32_t i = 0;
+	int n_mapped = 0;
+	bool in_place = true;
+	struct matrix* matrices[LAYER_MAX_WEIGHTS];
+	for (struct layer* current = obj->first; current != NULL; current = current->next) {
+		if (current->type == LAYER_LAYOUT2D) {
+			continue;
+		}
+		i = model_file_skip_layouts(header, layers, i);
+		int n = model_file_layer_tensors(current, matrices);
+		for (int j = 0; j < n; j++) {
+			const struct model_file_tensor* tensor = &tensors[layers[i].first_tensor + j];
+			if (tensor->type != MODEL_FILE_FLOAT64) {
+				model_file_decode(base + tensor->offset, tensor, matrices[j]);
+				in_place = false;
+			} else if (!matrices[j]->view) {
+				matrix_free(matrices[j]);
+				matrix_init_view(matrices[j], tensor->n_rows, tensor->n_cols, (double*)(base + tensor->offset));
+				n_mapped++;
+			} else {
+				matrices[j]->buffer = (double*)(base + tensor->offset);
+				n_mapped++;
+			}
+		}
+		i++;
+	}
+
+	// If the parameters are all read from the mapping, drop the arena.
+	// Keep the mapping only while tensors are used from it.
+	if (in_place) {
+		arena_free(&obj->params);
+	}
+	if (n_mapped > 0) {
+		obj->mapping = base;
+		obj->mapping_size = size;
+	} else {
+		model_file_unmap(base, size);
+	}
+
+	// Pack the weights once. The packed weights are not shared.
+	return model_prepack(obj);
+}
@@ -56,7 +56,7 @@ int activation_sigmoid_init(struct activation_sigmoid *obj, int input_size,
 void activation_sigmoid_forward(struct activation_sigmoid *obj) {
     // Iterate over each value.
     for (int i = 0; i < obj->input->size; i++) {
-        obj->output->buffer[i] = 1.0 / (1.0 + exp(-obj->output->buffer[i]));
+        obj->output->buffer[i] = 1.0 / (1.0 + exp(-obj->input->buffer[i]));
     }
 }
 
@@ -2,6 +2,7 @@
 // Softmax activation function.
 
 #include <math.h>
+#include <stdlib.h>
 
 #include "softmax.h"
 #include "matrix.h"
@@ -49,8 +50,9 @@ int activation_softmax_init(struct activation_softmax *obj, int input_size,
         return 0;
     }
     
-    // Allocate the Jacobian cache.
-    if (!matrix_init(&obj->jacobian, input_size, input_size)) {
+    // Allocate the Jacobian cache, which is not needed for inference only.
+    obj->jacobian.buffer = NULL;
+    if (d_outputs->buffer != NULL && !matrix_init(&obj->jacobian, input_size, input_size)) {
         return 0;
     }
 
@@ -57,8 +57,8 @@ void activation_tanh_forward(struct activation_tanh *obj) {
     // Iterate over each value.
 	double exp_x, exp_minus_x;
     for (int i = 0; i < obj->input->size; i++) {
-		exp_x = exp(obj->output->buffer[i]);
-		exp_minus_x = exp(-obj->output->buffer[i]);
+		exp_x = exp(obj->input->buffer[i]);
+		exp_minus_x = exp(-obj->input->buffer[i]);
         obj->output->buffer[i] = (exp_x - exp_minus_x) / (exp_x + exp_minus_x);
     }
 }
@@ -0,0 +1,203 @@
+// checkpoint_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "tom.h"
+#include "batch_normalization.h"
+#include "dataset.h"
+
+#define PERIODIC_PATH "checkpoint_test.chk"
+#define SAVED_PATH "checkpoint_test_saved.chk"
+#define SAMPLES 6
+#define N_SAMPLES 60
+#define EPOCHS 6
+#define STOPPED_EPOCHS 3
+#define INTERVAL 7
+#define SEED 1234
+
+// Build a model with dropout and batch normalization, so resuming needs the
+// RNG state and the running statistics as well as the parameters and the
+// optimizer state.
+static void build(struct model* m, bool fused) {
+	QUIT_ON_ERROR(model_init(m, SAMPLES));
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 8, 16) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_NORMALIZATION, 16, 16) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_RELU, 16, 16) != NULL);
+	struct layer* dropout = model_add_layer(m, LAYER_DROPOUT, 16, 16);
+	QUIT_ON_ERROR(dropout != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 16, 3) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_SOFTMAX, 3, 3) != NULL);
+	model_set_loss(m, LOSS_CROSSENTROPY);
+	QUIT_ON_ERROR(model_finalize(m));
+	layer_dropout_set_rate(dropout->obj, 0.25);
+
+	int k = 0;
+	for (struct layer* current = m->first; current != NULL; current = current->next) {
+		struct matrix* params[LAYER_MAX_PARAMS];
+		struct matrix* grads[LAYER_MAX_PARAMS];
+		int n = layer_get_params(current, params, grads);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < params[i]->size; j++) {
+				params[i]->buffer[j] = sin(k++ * 0.61) * 0.5;
+			}
+		}
+	}
+
+	if (fused) {
+		QUIT_ON_ERROR(model_init_fused_optimizer(m, OPTIMIZER_ADAM, 0.01, 0.9, 0.999, 0.0, 1e-7));
+	} else {
+		QUIT_ON_ERROR(model_init_optimizers(m, OPTIMIZER_ADAM, 0.01, 0.9, 0.999, 0.0, 1e-7));
+	}
+}
+
+// Get the largest difference between the parameters and the running
+// statistics of two models built the same way.
+static double compare(struct model* a, struct model* b) {
+	double error = 0.0;
+	for (struct layer *x = a->first, *y = b->first; x != NULL && y != NULL; x = x->next, y = y->next) {
+		struct matrix* params[2][LAYER_MAX_PARAMS];
+		struct matrix* grads[2][LAYER_MAX_PARAMS];
+		int n = layer_get_params(x, params[0], grads[0]);
+		layer_get_params(y, params[1], grads[1]);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < params[0][i]->size; j++) {
+				error = fmax(error, fabs(params[0][i]->buffer[j] - params[1][i]->buffer[j]));
+			}
+		}
+		if (x->type == LAYER_NORMALIZATION) {
+			struct layer_normalization* p = x->obj;
+			struct layer_normalization* q = y->obj;
+			for (int j = 0; j < p->running_mean.size; j++) {
+				error = fmax(error, fabs(p->running_mean.buffer[j] - q->running_mean.buffer[j]));
+				error = fmax(error, fabs(p->running_variance.buffer[j] - q->running_variance.buffer[j]));
+			}
+		}
+	}
+	return error;
+}
+
+// Train a model straight through, and a model which stops with periodic
+// checkpoints written in the background. Resume from the last periodic
+// checkpoint, and from a checkpoint saved after resuming, and require the
+// same parameters as the straight run.
+static int check(bool fused, struct matrix* X, struct matrix* Y) {
+	struct model straight = {0}, stopped = {0}, resumed = {0}, saved = {0};
+	random_seed(SEED);
+	build(&straight, fused);
+	QUIT_ON_ERROR(model_train(&straight, X, Y, EPOCHS, false));
+
+	random_seed(SEED);
+	build(&stopped, fused);
+	QUIT_ON_ERROR(model_set_checkpoint(&stopped, PERIODIC_PATH, INTERVAL));
+	QUIT_ON_ERROR(model_train(&stopped, X, Y, STOPPED_EPOCHS, false));
+	QUIT_ON_ERROR(model_wait_checkpoint(&stopped));
+	int n_written = stopped.checkpoint->n_written;
+	model_free(&stopped);
+
+	// Another seed, which the checkpoint's RNG state replaces.
+	random_seed(SEED + 1);
+	build(&resumed, fused);
+	QUIT_ON_ERROR(model_load_checkpoint(&resumed, PERIODIC_PATH));
+	int epoch = resumed.epoch, batch = resumed.batch;
+	QUIT_ON_ERROR(model_save_checkpoint(&resumed, SAVED_PATH));
+	QUIT_ON_ERROR(model_train(&resumed, X, Y, EPOCHS, false));
+	double error = compare(&straight, &resumed);
+
+	random_seed(SEED + 2);
+	build(&saved, fused);
+	QUIT_ON_ERROR(model_load_checkpoint(&saved, SAVED_PATH));
+	QUIT_ON_ERROR(model_train(&saved, X, Y, EPOCHS, false));
+	error = fmax(error, compare(&straight, &saved));
+
+	printf("%s: %d checkpoints written, resumed at epoch %d, batch %d, error %g\n", \
+			fused ? "fused optimizer" : "per-layer optimizers", n_written, epoch, batch, error);
+	bool failed = error != 0.0 || n_written == 0 || (epoch == 0 && batch == 0);
+
+	// The cursor is reset once training returns, even if it failed, here 
+	// because the cursor is outside a single batch of the dataset.
+	failed = failed || resumed.epoch != 0 || resumed.batch != 0;
+	QUIT_ON_ERROR(model_load_checkpoint(&saved, SAVED_PATH));
+	matrix_set_rows(X, SAMPLES);
+	matrix_set_rows(Y, SAMPLES);
+	failed = failed || model_train(&saved, X, Y, EPOCHS, false) || saved.epoch != 0 || saved.batch != 0;
+	matrix_set_rows(X, N_SAMPLES);
+	matrix_set_rows(Y, N_SAMPLES);
+
+	model_free(&straight);
+	model_free(&resumed);
+	model_free(&saved);
+	remove(PERIODIC_PATH);
+	remove(SAVED_PATH);
+	return failed;
+}
+
+// Shuffle copies of a dataset from the same RNG state, and require the same
+// order, with each sample kept next to its label.
+static int check_shuffle(struct matrix* X, struct matrix* Y) {
+	struct matrix copies[2][2];
+	struct random_state state;
+	random_seed(SEED);
+	random_get_state(&state);
+	for (int i = 0; i < 2; i++) {
+		QUIT_ON_ERROR(matrix_init(&copies[i][0], X->n_rows, X->n_cols));
+		QUIT_ON_ERROR(matrix_init(&copies[i][1], Y->n_rows, Y->n_cols));
+		memcpy(copies[i][0].buffer, X->buffer, sizeof(double) * X->size);
+		memcpy(copies[i][1].buffer, Y->buffer, sizeof(double) * Y->size);
+		random_set_state(&state);
+		QUIT_ON_ERROR(dataset_shuffle(&copies[i][0], &copies[i][1]));
+	}
+
+	int failed = 0, moved = 0;
+	for (int i = 0; i < X->n_rows; i++) {
+		// The first value of each sample is its index.
+		int index = (int)copies[0][0].buffer[i * X->n_cols];
+		moved += index != i;
+		for (int j = 0; j < X->n_cols; j++) {
+			failed |= copies[0][0].buffer[i * X->n_cols + j] != copies[1][0].buffer[i * X->n_cols + j];
+			failed |= copies[0][0].buffer[i * X->n_cols + j] != X->buffer[index * X->n_cols + j];
+		}
+		for (int j = 0; j < Y->n_cols; j++) {
+			failed |= copies[0][1].buffer[i * Y->n_cols + j] != Y->buffer[index * Y->n_cols + j];
+		}
+	}
+	printf("shuffle: %d of %d samples moved\n", moved, X->n_rows);
+
+	for (int i = 0; i < 2; i++) {
+		matrix_free(&copies[i][0]);
+		matrix_free(&copies[i][1]);
+	}
+	return failed || moved == 0;
+}
+
+int main(void) {
+	struct matrix X, Y;
+	QUIT_ON_ERROR(matrix_init(&X, N_SAMPLES, 8));
+	QUIT_ON_ERROR(matrix_init(&Y, N_SAMPLES, 3));
+	for (int i = 0; i < X.n_rows; i++) {
+		X.buffer[i * X.n_cols] = i;
+		for (int j = 1; j < X.n_cols; j++) {
+			X.buffer[i * X.n_cols + j] = sin((i * X.n_cols + j) * 0.37);
+		}
+	}
+	for (int i = 0; i < Y.n_rows; i++) {
+		for (int j = 0; j < Y.n_cols; j++) {
+			Y.buffer[i * Y.n_cols + j] = i % Y.n_cols == j;
+		}
+	}
+
+	int failed = check_shuffle(&X, &Y);
+
+	// Scale the sample indices down for training.
+	for (int i = 0; i < X.n_rows; i++) {
+		X.buffer[i * X.n_cols] /= N_SAMPLES;
+	}
+	failed |= check(false, &X, &Y);
+	failed |= check(true, &X, &Y);
+
+	matrix_free(&X);
+	matrix_free(&Y);
+	return failed;
+}
@@ -0,0 +1,154 @@
+// context_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "tom.h"
+
+#define THREADS 4
+#define REPEATS 20
+
+// A thread predicting with its own context over the shared model.
+struct worker {
+	struct model* model;
+	struct matrix* X;
+	struct matrix* expected;
+	int n_samples;
+	double error;
+	bool failed;
+};
+
+// Build a model for inference, with deterministic parameters.
+static void build(struct model* m, enum layout_2d layout) {
+	QUIT_ON_ERROR(model_init(m, 8));
+	model_set_memory_plan(m, MEMORY_PLAN_INFERENCE);
+	model_set_layout_2d(m, layout);
+	QUIT_ON_ERROR(model_add_conv2d_padded_layer(m, 3, 8, 8, 6, 3, 1, 1, 1, PADDING_SYMMETRIC) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_RELU, 6 * 8 * 8, 6 * 8 * 8) != NULL);
+	QUIT_ON_ERROR(model_add_depthwise_conv2d_layer(m, 6, 8, 8, 1, 3, 2, 1, 1, PADDING_ZERO) != NULL);
+	QUIT_ON_ERROR(model_add_maxpool2d_layer(m, 6, 4, 4, 2, 2) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 6 * 2 * 2, 10) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_NORMALIZATION, 10, 10) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_TANH, 10, 10) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 10, 4) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_SOFTMAX, 4, 4) != NULL);
+	model_set_loss(m, LOSS_CROSSENTROPY);
+	QUIT_ON_ERROR(model_finalize(m));
+
+	int k = 0;
+	for (struct layer* current = m->first; current != NULL; current = current->next) {
+		struct matrix* params[LAYER_MAX_PARAMS];
+		struct matrix* grads[LAYER_MAX_PARAMS];
+		int n = layer_get_params(current, params, grads);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < params[i]->size; j++) {
+				params[i]->buffer[j] = sin(k++ * 0.61) * 0.5 + (i == 0 ? 0.2 : 0.0);
+			}
+		}
+	}
+	QUIT_ON_ERROR(model_prepack(m));
+}
+
+// Predict repeatedly with a context, and record the largest difference with
+// the model's predictions.
+static void work(struct worker* worker) {
+	struct model_context context;
+	struct matrix Y;
+	if (!model_context_init(&context, worker->model, worker->n_samples)) {
+		printf("%s\n", LAST_ERROR);
+		worker->failed = true;
+		return;
+	}
+	if (!matrix_init(&Y, worker->expected->n_rows, worker->expected->n_cols)) {
+		printf("%s\n", LAST_ERROR);
+		worker->failed = true;
+		model_context_free(&context);
+		return;
+	}
+
+	for (int repeat = 0; repeat < REPEATS; repeat++) {
+		if (!model_context_predict(&context, worker->X, &Y)) {
+			printf("%s\n", LAST_ERROR);
+			worker->failed = true;
+			break;
+		}
+		for (int i = 0; i < Y.size; i++) {
+			worker->error = fmax(worker->error, fabs(Y.buffer[i] - worker->expected->buffer[i]));
+		}
+	}
+
+	matrix_free(&Y);
+	model_context_free(&context);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg) {
+	work(arg);
+	return 0;
+}
+#else
+static void* worker_main(void* arg) {
+	work(arg);
+	return NULL;
+}
+#endif
+
+// Run contexts with different batch sizes on threads over a shared model,
+// and compare their predictions with model_predict.
+static double check(enum layout_2d layout) {
+	struct model m = {0};
+	struct matrix X, expected;
+	build(&m, layout);
+	QUIT_ON_ERROR(matrix_init(&X, 37, 3 * 8 * 8));
+	QUIT_ON_ERROR(matrix_init(&expected, 37, 4));
+	for (int i = 0; i < X.size; i++) {
+		X.buffer[i] = sin(i * 0.37);
+	}
+	QUIT_ON_ERROR(model_predict(&m, &X, &expected));
+
+	struct worker workers[THREADS];
+#ifdef _WIN32
+	HANDLE threads[THREADS];
+#else
+	pthread_t threads[THREADS];
+#endif
+	for (int i = 0; i < THREADS; i++) {
+		workers[i] = (struct worker){&m, &X, &expected, 1 + i * 3, 0.0, false};
+#ifdef _WIN32
+		threads[i] = CreateThread(NULL, 0, worker_main, &workers[i], 0, NULL);
+		QUIT_ON_ERROR(threads[i] != NULL);
+#else
+		QUIT_ON_ERROR(pthread_create(&threads[i], NULL, worker_main, &workers[i]) == 0);
+#endif
+	}
+
+	double error = 0.0;
+	for (int i = 0; i < THREADS; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+		printf("layout %d, context with %d samples: error %g\n", layout, workers[i].n_samples, workers[i].error);
+		error = fmax(error, workers[i].failed ? INFINITY : workers[i].error);
+	}
+
+	matrix_free(&X);
+	matrix_free(&expected);
+	model_free(&m);
+	return error;
+}
+
+int main(void) {
+	double error = check(LAYOUT_NCHW);
+	error = fmax(error, check(LAYOUT_NHWC));
+	return error > 1e-12;
+}
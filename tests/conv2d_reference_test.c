@@ -0,0 +1,169 @@
+// conv2d_reference_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "tom.h"
+
+// Get the input index of a padded index, or -1 for zero padding.
+static int padded_index(int index, int dim, enum padding_type type) {
+	if (index >= 0 && index < dim) {
+		return index;
+	}
+	if (type == PADDING_SYMMETRIC) {
+		return index < 0 ? -index - 1 : dim * 2 - 1 - index;
+	}
+	if (type == PADDING_REFLECTION) {
+		return index < 0 ? -index : (dim - 1) * 2 - index;
+	}
+	return -1;
+}
+
+// Get the index of a value in a sample, for the NCHW or NHWC layout.
+static int value_index(int channel, int i, int j, int channels, int height, int width, enum layout_2d layout) {
+	if (layout == LAYOUT_NHWC) {
+		return (i * width + j) * channels + channel;
+	}
+	return (channel * height + i) * width + j;
+}
+
+// Check a conv layer against a naive convolution, for the forward pass and
+// the gradients on the inputs, weights and biases.
+static double check(int channels, int height, int width, int filters, int filter_size, int stride, int dilation,
+		int groups, int padding_x, int padding_y, enum padding_type type, enum layout_2d layout, enum conv2d_kernel kernel) {
+	int samples = 3;
+	int out_height = CALC_CONV2D_DILATED_OUTPUT_DIM(height, filter_size, stride, padding_y, dilation);
+	int out_width = CALC_CONV2D_DILATED_OUTPUT_DIM(width, filter_size, stride, padding_x, dilation);
+	int in_size = channels * height * width, out_size = filters * out_height * out_width;
+	int group_channels = channels / groups, group_filters = filters / groups;
+	int kernel_size = filter_size * filter_size;
+	struct layer_conv2d l;
+	struct matrix in, out, d_in, d_out;
+
+	QUIT_ON_ERROR(matrix_init(&in, samples, in_size));
+	QUIT_ON_ERROR(matrix_init(&out, samples, out_size));
+	QUIT_ON_ERROR(matrix_init(&d_in, samples, in_size));
+	QUIT_ON_ERROR(matrix_init(&d_out, samples, out_size));
+
+	QUIT_ON_ERROR(layer_conv2d_init_grouped(&l, channels, height, width, filters, filter_size, stride, dilation, groups, \
+			padding_x, padding_y, type, &in, &out, &d_out, &d_in));
+	QUIT_ON_ERROR(layer_conv2d_set_layout(&l, layout));
+
+	for (int i = 0; i < l.weights.size; i++) {
+		l.weights.buffer[i] = random_normal(0.0, 1.0);
+	}
+	for (int i = 0; i < l.biases.size; i++) {
+		l.biases.buffer[i] = random_normal(0.0, 1.0);
+	}
+	for (int i = 0; i < in.size; i++) {
+		in.buffer[i] = random_normal(0.0, 1.0);
+	}
+	for (int i = 0; i < d_out.size; i++) {
+		d_out.buffer[i] = random_normal(0.0, 1.0);
+	}
+
+	layer_conv2d_forward(&l);
+	layer_conv2d_backward(&l);
+
+	double *expected_out = calloc(out.size, sizeof(double));
+	double *expected_d_in = calloc(in.size, sizeof(double));
+	double *expected_d_weights = calloc(l.weights.size, sizeof(double));
+	double *expected_d_biases = calloc(filters, sizeof(double));
+	if (expected_out == NULL || expected_d_in == NULL || expected_d_weights == NULL || expected_d_biases == NULL) {
+		printf("Failed to allocate reference buffers.\n");
+		exit(1);
+	}
+
+	for (int sample = 0; sample < samples; sample++) {
+		const double *x = &in.buffer[sample * in_size];
+		const double *dy = &d_out.buffer[sample * out_size];
+		double *y = &expected_out[sample * out_size];
+		double *dx = &expected_d_in[sample * in_size];
+		for (int filter = 0; filter < filters; filter++) {
+			int first_channel = filter / group_filters * group_channels;
+			for (int i = 0; i < out_height; i++) {
+				for (int j = 0; j < out_width; j++) {
+					int index = value_index(filter, i, j, filters, out_height, out_width, layout);
+					double sum = l.biases.buffer[filter];
+					expected_d_biases[filter] += dy[index];
+					for (int channel = 0; channel < group_channels; channel++) {
+						for (int ki = 0; ki < filter_size; ki++) {
+							int row = padded_index(i * stride + ki * dilation - padding_y, height, type);
+							for (int kj = 0; kj < filter_size; kj++) {
+								int col = padded_index(j * stride + kj * dilation - padding_x, width, type);
+								if (row < 0 || col < 0) {
+									continue;
+								}
+								int w = (filter * group_channels + channel) * kernel_size + ki * filter_size + kj;
+								int v = value_index(first_channel + channel, row, col, channels, height, width, layout);
+								sum += l.weights.buffer[w] * x[v];
+								expected_d_weights[w] += dy[index] * x[v];
+								dx[v] += dy[index] * l.weights.buffer[w];
+							}
+						}
+					}
+					y[index] = sum;
+				}
+			}
+		}
+	}
+
+	double error = 0.0;
+	for (int i = 0; i < out.size; i++) {
+		error = fmax(error, fabs(out.buffer[i] - expected_out[i]));
+	}
+	for (int i = 0; i < in.size; i++) {
+		error = fmax(error, fabs(d_in.buffer[i] - expected_d_in[i]));
+	}
+	for (int i = 0; i < l.d_weights.size; i++) {
+		error = fmax(error, fabs(l.d_weights.buffer[i] - expected_d_weights[i]));
+	}
+	for (int i = 0; i < filters; i++) {
+		error = fmax(error, fabs(l.d_biases.buffer[i] - expected_d_biases[i]));
+	}
+
+	printf("kernel %d, %d->%d filters %d stride %d dilation %d groups %d padding %dx%d type %d (%dx%d): error %g\n", \
+			l.kernel, channels, filters, filter_size, stride, dilation, groups, padding_x, padding_y, type, height, width, error);
+	if (l.kernel != kernel) {
+		printf("Expected kernel %d.\n", kernel);
+		error += 1.0;
+	}
+
+	free(expected_out);
+	free(expected_d_in);
+	free(expected_d_weights);
+	free(expected_d_biases);
+	layer_conv2d_free(&l);
+	matrix_free(&in);
+	matrix_free(&out);
+	matrix_free(&d_in);
+	matrix_free(&d_out);
+	return error;
+}
+
+int main(void) {
+	random_init();
+
+	enum padding_type types[] = {PADDING_ZERO, PADDING_SYMMETRIC, PADDING_REFLECTION};
+	double error = 0.0;
+	for (int layout = LAYOUT_NCHW; layout <= LAYOUT_NHWC; layout++) {
+		enum conv2d_kernel generic = layout == LAYOUT_NHWC ? CONV2D_KERNEL_NHWC : CONV2D_KERNEL_GENERIC;
+		enum conv2d_kernel depthwise = layout == LAYOUT_NHWC ? CONV2D_KERNEL_DEPTHWISE_NHWC : CONV2D_KERNEL_DEPTHWISE;
+		for (int t = 0; t < 3; t++) {
+			error = fmax(error, check(3, 9, 8, 4, 3, 1, 1, 1, 1, 1, types[t], layout, generic));
+			error = fmax(error, check(4, 11, 10, 6, 3, 2, 1, 2, 2, 1, types[t], layout, generic));
+			error = fmax(error, check(4, 12, 12, 4, 3, 1, 2, 1, 2, 2, types[t], layout, generic));
+			error = fmax(error, check(6, 13, 9, 6, 3, 2, 3, 3, 3, 2, types[t], layout, generic));
+			error = fmax(error, check(4, 10, 10, 8, 3, 1, 1, 4, 1, 1, types[t], layout, depthwise));
+			error = fmax(error, check(3, 12, 11, 3, 5, 2, 2, 3, 4, 3, types[t], layout, depthwise));
+			error = fmax(error, check(4, 7, 7, 6, 1, 2, 1, 1, 1, 1, types[t], layout, generic));
+		}
+		error = fmax(error, check(5, 6, 7, 3, 1, 1, 1, 1, 0, 0, PADDING_ZERO, layout, \
+				layout == LAYOUT_NHWC ? CONV2D_KERNEL_NHWC : CONV2D_KERNEL_POINTWISE));
+		error = fmax(error, check(4, 8, 8, 4, 2, 1, 1, 2, 0, 0, PADDING_ZERO, layout, generic));
+	}
+
+	printf("max error: %g\n", error);
+	return error > 1e-12;
+}
@@ -0,0 +1,272 @@
+// hot_reload_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "tom.h"
+
+#define SAMPLES 6
+#define READERS 3
+#define PREDICTIONS 2000
+#define PUBLISHES 400
+
+#ifdef _WIN32
+#define LOCK(x) EnterCriticalSection(x)
+#define UNLOCK(x) LeaveCriticalSection(x)
+#else
+#define LOCK(x) pthread_mutex_lock(x)
+#define UNLOCK(x) pthread_mutex_unlock(x)
+#endif
+
+// The progress of the threads. The publisher keeps publishing until the 
+// readers made half of their predictions, and the readers keep predicting 
+// until the publisher is done, so both run at the same time.
+struct progress {
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+#else
+	pthread_mutex_t lock;
+#endif
+	int predictions;
+	bool publishing;
+};
+
+// A thread predicting with its own context while weights are published. Each
+// prediction is a single forward pass, so it must match the outputs of one
+// version of the weights.
+struct reader {
+	struct model* model;
+	struct progress* progress;
+	struct matrix* X;
+	struct matrix* expected[2];
+	int seen[2], mixed;
+	bool failed;
+};
+
+// A thread publishing the two versions of the weights in turn.
+struct publisher {
+	struct model* model;
+	struct progress* progress;
+	struct model* sources[2];
+	int publishes;
+	bool failed;
+};
+
+// Build a model with the parameters of a version of the weights.
+static void build(struct model* m, enum memory_plan_mode plan, int version) {
+	QUIT_ON_ERROR(model_init(m, SAMPLES));
+	model_set_memory_plan(m, plan);
+	model_set_layout_2d(m, LAYOUT_NHWC);
+	QUIT_ON_ERROR(model_add_conv2d_padded_layer(m, 2, 6, 6, 4, 3, 1, 1, 1, PADDING_ZERO) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_RELU, 4 * 6 * 6, 4 * 6 * 6) != NULL);
+	QUIT_ON_ERROR(model_add_maxpool2d_layer(m, 4, 6, 6, 2, 2) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 4 * 3 * 3, 8) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_NORMALIZATION, 8, 8) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 8, 3) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_SOFTMAX, 3, 3) != NULL);
+	model_set_loss(m, LOSS_CROSSENTROPY);
+	QUIT_ON_ERROR(model_finalize(m));
+
+	int k = 0;
+	for (struct layer* current = m->first; current != NULL; current = current->next) {
+		struct matrix* params[LAYER_MAX_PARAMS];
+		struct matrix* grads[LAYER_MAX_PARAMS];
+		int n = layer_get_params(current, params, grads);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < params[i]->size; j++) {
+				params[i]->buffer[j] = sin(k++ * (version ? 0.43 : 0.61)) * 0.5;
+			}
+		}
+	}
+	if (plan == MEMORY_PLAN_INFERENCE) {
+		QUIT_ON_ERROR(model_prepack(m));
+	}
+}
+
+// Get the largest difference between two matrices.
+static double difference(struct matrix* a, struct matrix* b) {
+	double error = 0.0;
+	for (int i = 0; i < a->size; i++) {
+		error = fmax(error, fabs(a->buffer[i] - b->buffer[i]));
+	}
+	return error;
+}
+
+static void read_weights(struct reader* reader) {
+	struct model_context context;
+	struct matrix Y;
+	if (!model_context_init(&context, reader->model, SAMPLES)) {
+		printf("%s\n", LAST_ERROR);
+		reader->failed = true;
+		return;
+	}
+	if (!matrix_init(&Y, SAMPLES, 3)) {
+		printf("%s\n", LAST_ERROR);
+		reader->failed = true;
+		model_context_free(&context);
+		return;
+	}
+
+	for (int i = 0; ; i++) {
+		LOCK(&reader->progress->lock);
+		bool done = i >= PREDICTIONS && !reader->progress->publishing;
+		reader->progress->predictions += !done;
+		UNLOCK(&reader->progress->lock);
+		if (done) {
+			break;
+		}
+		if (!model_context_predict(&context, reader->X, &Y)) {
+			printf("%s\n", LAST_ERROR);
+			reader->failed = true;
+			break;
+		}
+		if (difference(&Y, reader->expected[0]) <= 1e-12) {
+			reader->seen[0]++;
+		} else if (difference(&Y, reader->expected[1]) <= 1e-12) {
+			reader->seen[1]++;
+		} else {
+			reader->mixed++;
+		}
+	}
+
+	matrix_free(&Y);
+	model_context_free(&context);
+}
+
+static void publish_weights(struct publisher* publisher) {
+	for (int i = 0; ; i++) {
+		LOCK(&publisher->progress->lock);
+		bool done = i >= PUBLISHES && publisher->progress->predictions >= READERS * PREDICTIONS / 2;
+		publisher->progress->publishing = !done;
+		UNLOCK(&publisher->progress->lock);
+		if (done) {
+			break;
+		}
+		if (!model_publish_weights(publisher->model, publisher->sources[(i + 1) % 2])) {
+			printf("%s\n", LAST_ERROR);
+			publisher->failed = true;
+			LOCK(&publisher->progress->lock);
+			publisher->progress->publishing = false;
+			UNLOCK(&publisher->progress->lock);
+			return;
+		}
+		publisher->publishes++;
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI reader_main(LPVOID arg) {
+	read_weights(arg);
+	return 0;
+}
+
+static DWORD WINAPI publisher_main(LPVOID arg) {
+	publish_weights(arg);
+	return 0;
+}
+#else
+static void* reader_main(void* arg) {
+	read_weights(arg);
+	return NULL;
+}
+
+static void* publisher_main(void* arg) {
+	publish_weights(arg);
+	return NULL;
+}
+#endif
+
+// Publish two versions of the weights in turn while contexts predict on
+// other threads. Each prediction must see either version, never a mix of
+// both.
+int main(void) {
+	struct model m = {0};
+	struct model sources[2] = {{0}, {0}};
+	struct matrix X, expected[2];
+	build(&m, MEMORY_PLAN_INFERENCE, 0);
+	build(&sources[0], MEMORY_PLAN_TRAINING, 0);
+	build(&sources[1], MEMORY_PLAN_TRAINING, 1);
+
+	QUIT_ON_ERROR(matrix_init(&X, SAMPLES, 2 * 6 * 6));
+	for (int i = 0; i < X.size; i++) {
+		X.buffer[i] = sin(i * 0.37);
+	}
+	for (int i = 0; i < 2; i++) {
+		QUIT_ON_ERROR(matrix_init(&expected[i], SAMPLES, 3));
+		QUIT_ON_ERROR(model_predict(&sources[i], &X, &expected[i]));
+	}
+	printf("difference between the versions: %g\n", difference(&expected[0], &expected[1]));
+
+	struct progress progress = {.predictions = 0, .publishing = true};
+#ifdef _WIN32
+	InitializeCriticalSection(&progress.lock);
+#else
+	QUIT_ON_ERROR(pthread_mutex_init(&progress.lock, NULL) == 0);
+#endif
+	struct reader readers[READERS];
+	struct publisher publisher = {&m, &progress, {&sources[0], &sources[1]}, 0, false};
+#ifdef _WIN32
+	HANDLE threads[READERS + 1];
+#else
+	pthread_t threads[READERS + 1];
+#endif
+	for (int i = 0; i < READERS; i++) {
+		readers[i] = (struct reader){&m, &progress, &X, {&expected[0], &expected[1]}, {0, 0}, 0, false};
+#ifdef _WIN32
+		threads[i] = CreateThread(NULL, 0, reader_main, &readers[i], 0, NULL);
+		QUIT_ON_ERROR(threads[i] != NULL);
+#else
+		QUIT_ON_ERROR(pthread_create(&threads[i], NULL, reader_main, &readers[i]) == 0);
+#endif
+	}
+#ifdef _WIN32
+	threads[READERS] = CreateThread(NULL, 0, publisher_main, &publisher, 0, NULL);
+	QUIT_ON_ERROR(threads[READERS] != NULL);
+#else
+	QUIT_ON_ERROR(pthread_create(&threads[READERS], NULL, publisher_main, &publisher) == 0);
+#endif
+
+	for (int i = 0; i <= READERS; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+#ifdef _WIN32
+	DeleteCriticalSection(&progress.lock);
+#else
+	pthread_mutex_destroy(&progress.lock);
+#endif
+	bool failed = publisher.failed;
+	printf("%d versions published\n", publisher.publishes);
+	for (int i = 0; i < READERS; i++) {
+		printf("reader %d: %d of the first version, %d of the second, %d mixed\n", i, readers[i].seen[0], readers[i].seen[1], readers[i].mixed);
+		failed = failed || readers[i].failed || readers[i].mixed > 0;
+	}
+
+	// After the last version is published, predictions use it.
+	struct matrix Y;
+	QUIT_ON_ERROR(matrix_init(&Y, SAMPLES, 3));
+	QUIT_ON_ERROR(model_predict(&m, &X, &Y));
+	double error = difference(&Y, &expected[publisher.publishes % 2]);
+	printf("last version: error %g\n", error);
+
+	// The contexts are freed, so the model can be freed.
+	matrix_free(&Y);
+	matrix_free(&X);
+	for (int i = 0; i < 2; i++) {
+		matrix_free(&expected[i]);
+		model_free(&sources[i]);
+	}
+	model_free(&m);
+	return failed || error > 1e-12;
+}
@@ -0,0 +1,169 @@
+// inference_queue_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "tom.h"
+
+#define SUBMITTERS 4
+#define REQUESTS 500
+#define INPUT_SIZE 20
+#define OUTPUT_SIZE 5
+
+// The result of one request.
+struct result {
+	double output[OUTPUT_SIZE];
+	int calls, success;
+};
+
+// A thread submitting every SUBMITTERS-th request.
+struct submitter {
+	struct inference_queue* queue;
+	struct matrix* X;
+	struct result* results;
+	int first;
+	bool failed;
+};
+
+// Copy a request's output. Each request has its own result, so no lock is
+// needed.
+static void on_complete(void* user_data, const double* output, int success) {
+	struct result* result = user_data;
+	result->calls++;
+	result->success = success;
+	if (success) {
+		memcpy(result->output, output, sizeof(result->output));
+	}
+}
+
+static void submit(struct submitter* submitter) {
+	for (int i = submitter->first; i < REQUESTS; i += SUBMITTERS) {
+		if (!inference_queue_submit(submitter->queue, &submitter->X->buffer[i * INPUT_SIZE], on_complete, &submitter->results[i])) {
+			printf("%s\n", LAST_ERROR);
+			submitter->failed = true;
+			return;
+		}
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI submitter_main(LPVOID arg) {
+	submit(arg);
+	return 0;
+}
+#else
+static void* submitter_main(void* arg) {
+	submit(arg);
+	return NULL;
+}
+#endif
+
+// Submit requests from several threads, and compare each result with
+// model_predict.
+static double check(struct model* m, struct matrix* X, struct matrix* expected, int n_workers, int max_batch_size, int max_delay) {
+	struct inference_queue queue;
+	struct result* results = calloc(REQUESTS, sizeof(struct result));
+	if (results == NULL) {
+		printf("Failed to allocate results.\n");
+		exit(1);
+	}
+	QUIT_ON_ERROR(inference_queue_init(&queue, m, n_workers, max_batch_size, max_delay));
+
+	struct submitter submitters[SUBMITTERS];
+#ifdef _WIN32
+	HANDLE threads[SUBMITTERS];
+#else
+	pthread_t threads[SUBMITTERS];
+#endif
+	for (int i = 0; i < SUBMITTERS; i++) {
+		submitters[i] = (struct submitter){&queue, X, results, i, false};
+#ifdef _WIN32
+		threads[i] = CreateThread(NULL, 0, submitter_main, &submitters[i], 0, NULL);
+		QUIT_ON_ERROR(threads[i] != NULL);
+#else
+		QUIT_ON_ERROR(pthread_create(&threads[i], NULL, submitter_main, &submitters[i]) == 0);
+#endif
+	}
+	bool failed = false;
+	for (int i = 0; i < SUBMITTERS; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+		failed = failed || submitters[i].failed;
+	}
+
+	// Freeing the queue completes the pending requests.
+	inference_queue_free(&queue);
+
+	double error = failed ? INFINITY : 0.0;
+	for (int i = 0; i < REQUESTS; i++) {
+		if (results[i].calls != 1 || !results[i].success) {
+			printf("request %d: %d calls, success %d\n", i, results[i].calls, results[i].success);
+			error = INFINITY;
+			continue;
+		}
+		for (int j = 0; j < OUTPUT_SIZE; j++) {
+			error = fmax(error, fabs(results[i].output[j] - expected->buffer[i * OUTPUT_SIZE + j]));
+		}
+	}
+	printf("%d workers, batches of up to %d, delay %d: %ld batches, error %g\n", \
+			n_workers, max_batch_size, max_delay, queue.n_batches, error);
+
+	free(results);
+	return error;
+}
+
+int main(void) {
+	struct model m = {0};
+	QUIT_ON_ERROR(model_init(&m, 16));
+	model_set_memory_plan(&m, MEMORY_PLAN_INFERENCE);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, INPUT_SIZE, 32) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_RELU, 32, 32) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, 32, 32) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_TANH, 32, 32) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, 32, OUTPUT_SIZE) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_SOFTMAX, OUTPUT_SIZE, OUTPUT_SIZE) != NULL);
+	model_set_loss(&m, LOSS_CROSSENTROPY);
+	QUIT_ON_ERROR(model_finalize(&m));
+
+	int k = 0;
+	for (struct layer* current = m.first; current != NULL; current = current->next) {
+		struct matrix* params[LAYER_MAX_PARAMS];
+		struct matrix* grads[LAYER_MAX_PARAMS];
+		int n = layer_get_params(current, params, grads);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < params[i]->size; j++) {
+				params[i]->buffer[j] = sin(k++ * 0.61) * 0.5;
+			}
+		}
+	}
+
+	struct matrix X, expected;
+	QUIT_ON_ERROR(matrix_init(&X, REQUESTS, INPUT_SIZE));
+	QUIT_ON_ERROR(matrix_init(&expected, REQUESTS, OUTPUT_SIZE));
+	for (int i = 0; i < X.size; i++) {
+		X.buffer[i] = sin(i * 0.37);
+	}
+	QUIT_ON_ERROR(model_predict(&m, &X, &expected));
+
+	double error = check(&m, &X, &expected, 1, 1, 0);
+	error = fmax(error, check(&m, &X, &expected, 1, 16, 200));
+	error = fmax(error, check(&m, &X, &expected, 3, 7, 100));
+	error = fmax(error, check(&m, &X, &expected, 4, 32, 1000));
+
+	matrix_free(&X);
+	matrix_free(&expected);
+	model_free(&m);
+	return error > 1e-12;
+}
@@ -0,0 +1,429 @@
+// layer_ops_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "tom.h"
+
+#define SAMPLES 10
+#define N_SAMPLES 60
+#define PATH "layer_ops_test.dat"
+#define MODEL_FILE_PATH "layer_ops_test.tom"
+
+// A custom layer scaling and shifting each feature, y = x * w + b.
+struct layer_scale {
+	struct matrix *input, *output, *d_outputs, *d_inputs;
+	struct matrix weights, biases, d_weights, d_biases;
+};
+
+static int scale_init(struct layer* obj) {
+	struct layer_scale* scale = calloc(1, sizeof(struct layer_scale));
+	if (scale == NULL) {
+		LAST_ERROR = "Failed to allocate the scale layer.";
+		return 0;
+	}
+	obj->obj = scale;
+	scale->input = obj->input;
+	scale->output = obj->output;
+	scale->d_outputs = obj->d_output;
+	scale->d_inputs = obj->d_input;
+	if (!matrix_init(&scale->weights, 1, obj->input_size) || !matrix_init(&scale->biases, 1, obj->input_size) ||
+			!matrix_init(&scale->d_weights, 1, obj->input_size) || !matrix_init(&scale->d_biases, 1, obj->input_size)) {
+		return 0;
+	}
+	for (int i = 0; i < obj->input_size; i++) {
+		scale->weights.buffer[i] = 1.0 + 0.1 * i;
+		scale->biases.buffer[i] = 0.0;
+	}
+	return 1;
+}
+
+static int scale_forward(struct layer* obj, bool training) {
+	(void)training;
+	struct layer_scale* scale = obj->obj;
+	const int n = scale->input->n_cols;
+	for (int i = 0; i < scale->input->n_rows; i++) {
+		for (int j = 0; j < n; j++) {
+			scale->output->buffer[i * n + j] = scale->input->buffer[i * n + j] * scale->weights.buffer[j] + scale->biases.buffer[j];
+		}
+	}
+	return 1;
+}
+
+static int scale_backward(struct layer* obj) {
+	struct layer_scale* scale = obj->obj;
+	const int n = scale->input->n_cols;
+	for (int j = 0; j < n; j++) {
+		scale->d_weights.buffer[j] = 0.0;
+		scale->d_biases.buffer[j] = 0.0;
+	}
+	for (int i = 0; i < scale->input->n_rows; i++) {
+		for (int j = 0; j < n; j++) {
+			double d_output = scale->d_outputs->buffer[i * n + j];
+			scale->d_weights.buffer[j] += d_output * scale->input->buffer[i * n + j];
+			scale->d_biases.buffer[j] += d_output;
+			if (scale->d_inputs->buffer != NULL) {
+				scale->d_inputs->buffer[i * n + j] = d_output * scale->weights.buffer[j];
+			}
+		}
+	}
+	return 1;
+}
+
+static void scale_free(struct layer* obj) {
+	struct layer_scale* scale = obj->obj;
+	matrix_free(&scale->weights);
+	matrix_free(&scale->biases);
+	matrix_free(&scale->d_weights);
+	matrix_free(&scale->d_biases);
+}
+
+static int scale_get_params(struct layer* obj, struct matrix** params, struct matrix** grads) {
+	struct layer_scale* scale = obj->obj;
+	params[0] = &scale->weights;
+	params[1] = &scale->biases;
+	grads[0] = &scale->d_weights;
+	grads[1] = &scale->d_biases;
+	return 2;
+}
+
+static int scale_serialize(struct layer* obj, FILE* fp) {
+	struct layer_scale* scale = obj->obj;
+	return serialize_matrix(&scale->weights, fp) && serialize_matrix(&scale->biases, fp);
+}
+
+static int scale_deserialize(struct layer* obj, FILE* fp) {
+	struct layer_scale* scale = obj->obj;
+	return deserialize_matrix(&scale->weights, fp) && deserialize_matrix(&scale->biases, fp);
+}
+
+// Share the parameters, with the context's matrices.
+static int scale_init_shared(struct layer* obj, const struct layer* shared) {
+	struct layer_scale* scale = malloc(sizeof(struct layer_scale));
+	if (scale == NULL) {
+		LAST_ERROR = "Failed to allocate the scale layer.";
+		return 0;
+	}
+	*scale = *(struct layer_scale*)shared->obj;
+	scale->input = obj->input;
+	scale->output = obj->output;
+	scale->d_outputs = obj->d_output;
+	scale->d_inputs = obj->d_input;
+	obj->obj = scale;
+	return 1;
+}
+
+static const struct layer_ops SCALE_OPS = {
+	.name = "scale",
+	.backward_skips_output = true,
+	.init = scale_init,
+	.forward = scale_forward,
+	.backward = scale_backward,
+	.free = scale_free,
+	.get_params = scale_get_params,
+	.serialize = scale_serialize,
+	.deserialize = scale_deserialize,
+	.init_shared = scale_init_shared
+};
+
+// A custom GELU activation layer, y = x * sigmoid(1.702 * x). It is 
+// elementwise, but its backward pass reads its input, so it can only run in
+// place for inference.
+struct layer_gelu {
+	struct matrix *input, *output, *d_outputs, *d_inputs;
+};
+
+static int gelu_init(struct layer* obj) {
+	struct layer_gelu* gelu = calloc(1, sizeof(struct layer_gelu));
+	if (gelu == NULL) {
+		LAST_ERROR = "Failed to allocate the GELU layer.";
+		return 0;
+	}
+	obj->obj = gelu;
+	gelu->input = obj->input;
+	gelu->output = obj->output;
+	gelu->d_outputs = obj->d_output;
+	gelu->d_inputs = obj->d_input;
+	return 1;
+}
+
+static int gelu_forward(struct layer* obj, bool training) {
+	(void)training;
+	struct layer_gelu* gelu = obj->obj;
+	for (int i = 0; i < gelu->input->size; i++) {
+		double x = gelu->input->buffer[i];
+		gelu->output->buffer[i] = x / (1.0 + exp(-1.702 * x));
+	}
+	return 1;
+}
+
+static int gelu_backward(struct layer* obj) {
+	struct layer_gelu* gelu = obj->obj;
+	if (gelu->d_inputs->buffer == NULL) {
+		return 1;
+	}
+	for (int i = 0; i < gelu->input->size; i++) {
+		double x = gelu->input->buffer[i];
+		double s = 1.0 / (1.0 + exp(-1.702 * x));
+		gelu->d_inputs->buffer[i] = gelu->d_outputs->buffer[i] * (s + 1.702 * x * s * (1.0 - s));
+	}
+	return 1;
+}
+
+static const struct layer_ops GELU_OPS = {
+	.name = "gelu",
+	.elementwise = true,
+	.backward_skips_output = true,
+	.init = gelu_init,
+	.forward = gelu_forward,
+	.backward = gelu_backward
+};
+
+// Get the largest difference between two matrices.
+static double difference(struct matrix* a, struct matrix* b) {
+	double error = 0.0;
+	for (int i = 0; i < a->size; i++) {
+		error = fmax(error, fabs(a->buffer[i] - b->buffer[i]));
+	}
+	return error;
+}
+
+// Read a model written with serialize_model or serialize_model_file, and
+// compare its predictions.
+static double check_load(const char* path, bool model_file, struct matrix* X, struct matrix* expected) {
+	struct model m = {0};
+	QUIT_ON_ERROR(model_init(&m, SAMPLES));
+	FILE* fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Failed to open %s.\n", path);
+		exit(1);
+	}
+	QUIT_ON_ERROR(model_file ? deserialize_model_file(&m, fp) : deserialize_model(&m, fp));
+	fclose(fp);
+
+	struct matrix Y;
+	QUIT_ON_ERROR(matrix_init(&Y, expected->n_rows, expected->n_cols));
+	QUIT_ON_ERROR(model_predict(&m, X, &Y));
+	double error = difference(&Y, expected);
+	matrix_free(&Y);
+	model_free(&m);
+	remove(path);
+	return error;
+}
+
+// Train a model with a custom layer, and round trip it through both
+// serialization formats and a model context.
+static int check_custom(enum layer_type scale_type) {
+	struct matrix X, Y, expected, P;
+	QUIT_ON_ERROR(matrix_init(&X, N_SAMPLES, 4));
+	QUIT_ON_ERROR(matrix_init(&Y, N_SAMPLES, 3));
+	for (int i = 0; i < N_SAMPLES; i++) {
+		for (int j = 0; j < 4; j++) {
+			X.buffer[i * 4 + j] = i % 3 + 0.3 * sin(i * 4 + j) - 0.1 * j;
+		}
+		for (int j = 0; j < 3; j++) {
+			Y.buffer[i * 3 + j] = i % 3 == j;
+		}
+	}
+
+	struct model m = {0};
+	QUIT_ON_ERROR(model_init(&m, SAMPLES));
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, 4, 8) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, scale_type, 8, 8) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_RELU, 8, 8) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, 8, 3) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_SOFTMAX, 3, 3) != NULL);
+	model_set_loss(&m, LOSS_CROSSENTROPY);
+	QUIT_ON_ERROR(model_finalize(&m));
+	random_seed(1);
+	QUIT_ON_ERROR(layer_dense_init_values(m.first->obj, WI_RANDOM_UNIFORM, BI_ZEROS));
+	QUIT_ON_ERROR(layer_dense_init_values(m.last->prev->obj, WI_RANDOM_UNIFORM, BI_ZEROS));
+
+	// The custom layer has no optimizer of its own, so it is trained with
+	// the fused optimizer.
+	QUIT_ON_ERROR(model_init_fused_optimizer(&m, OPTIMIZER_ADAM, 0.01, 0.9, 0.999, 0.0, 1e-7));
+	double initial_loss = model_calc_loss(&m, &X, &Y);
+	QUIT_ON_ERROR(model_train(&m, &X, &Y, 200, false));
+	double loss = model_calc_loss(&m, &X, &Y);
+	struct layer_scale* scale = m.first->next->obj;
+	printf("custom layer: loss %g -> %g, scale %g -> %g\n", initial_loss, loss, 1.0, scale->weights.buffer[0]);
+	int failed = !(loss < initial_loss * 0.5) || scale->weights.buffer[0] == 1.0;
+
+	QUIT_ON_ERROR(matrix_init(&expected, N_SAMPLES, 3));
+	QUIT_ON_ERROR(matrix_init(&P, N_SAMPLES, 3));
+	QUIT_ON_ERROR(model_predict(&m, &X, &expected));
+
+	FILE* fp = fopen(PATH, "wb");
+	QUIT_ON_ERROR(fp != NULL && serialize_model(&m, fp));
+	fclose(fp);
+	double error = check_load(PATH, false, &X, &expected);
+	printf("serialize_model: error %g\n", error);
+	failed = failed || error > 1e-12;
+
+	fp = fopen(MODEL_FILE_PATH, "wb");
+	QUIT_ON_ERROR(fp != NULL && serialize_model_file(&m, fp, MODEL_FILE_FLOAT64));
+	fclose(fp);
+	error = check_load(MODEL_FILE_PATH, true, &X, &expected);
+	printf("serialize_model_file: error %g\n", error);
+	failed = failed || error > 1e-12;
+
+	struct model_context context;
+	QUIT_ON_ERROR(model_context_init(&context, &m, 7));
+	QUIT_ON_ERROR(model_context_predict(&context, &X, &P));
+	error = difference(&P, &expected);
+	printf("model context: error %g\n", error);
+	failed = failed || error > 1e-12;
+	model_context_free(&context);
+
+	model_free(&m);
+	matrix_free(&X);
+	matrix_free(&Y);
+	matrix_free(&expected);
+	matrix_free(&P);
+	return failed;
+}
+
+// Compute the gradients of a model with an elementwise custom layer with
+// and without the training memory plan. The layer reads its input in the
+// backward pass, so it must not run in place.
+static int check_in_place(enum layer_type gelu_type) {
+	struct model models[2] = {{0}, {0}};
+	const enum memory_plan_mode plans[2] = {MEMORY_PLAN_NONE, MEMORY_PLAN_TRAINING};
+	for (int i = 0; i < 2; i++) {
+		struct model* m = &models[i];
+		QUIT_ON_ERROR(model_init(m, SAMPLES));
+		model_set_memory_plan(m, plans[i]);
+		QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 4, 8) != NULL);
+		QUIT_ON_ERROR(model_add_layer(m, gelu_type, 8, 8) != NULL);
+		QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 8, 3) != NULL);
+		QUIT_ON_ERROR(model_add_layer(m, LAYER_SOFTMAX, 3, 3) != NULL);
+		model_set_loss(m, LOSS_CROSSENTROPY);
+		QUIT_ON_ERROR(model_finalize(m));
+
+		int k = 0;
+		for (struct layer* current = m->first; current != NULL; current = current->next) {
+			struct matrix* params[LAYER_MAX_PARAMS];
+			struct matrix* grads[LAYER_MAX_PARAMS];
+			int n = layer_get_params(current, params, grads);
+			for (int j = 0; j < n; j++) {
+				for (int l = 0; l < params[j]->size; l++) {
+					params[j]->buffer[l] = sin(k++ * 0.61) * 0.5;
+				}
+			}
+		}
+		for (int j = 0; j < m->input->size; j++) {
+			m->input->buffer[j] = sin(j * 0.37) * 2.0;
+		}
+		for (int j = 0; j < m->y->size; j++) {
+			m->y->buffer[j] = j % 3 == (j / 3) % 3;
+		}
+		QUIT_ON_ERROR(model_forward(m, MODEL_FORWARD_TRAINING_LOSS));
+		QUIT_ON_ERROR(model_backward(m));
+	}
+
+	double error = 0.0;
+	struct layer* a = models[0].first;
+	for (struct layer* b = models[1].first; b != NULL; a = a->next, b = b->next) {
+		struct matrix* params[2][LAYER_MAX_PARAMS];
+		struct matrix* grads[2][LAYER_MAX_PARAMS];
+		int n = layer_get_params(a, params[0], grads[0]);
+		layer_get_params(b, params[1], grads[1]);
+		for (int i = 0; i < n; i++) {
+			error = fmax(error, difference(grads[0][i], grads[1][i]));
+		}
+	}
+	bool in_place = models[1].first->next->in_place;
+	printf("custom elementwise layer: in place %d, gradient error %g\n", in_place, error);
+	for (int i = 0; i < 2; i++) {
+		model_free(&models[i]);
+	}
+	return in_place || error > 1e-12;
+}
+
+// Build an NHWC model ending its 2D layers with a global average pooling
+// layer of a type, and count the layout conversion layers. The predictions
+// must match the NCHW model.
+static int check_reduces(const char* name, enum layer_type pool_type, int expected_layouts) {
+	struct model models[2] = {{0}, {0}};
+	struct matrix X, Y[2];
+	QUIT_ON_ERROR(matrix_init(&X, 5, 2 * 6 * 6));
+	for (int i = 0; i < X.size; i++) {
+		X.buffer[i] = sin(i * 0.37);
+	}
+
+	int n_layouts = 0;
+	for (int layout = LAYOUT_NCHW; layout <= LAYOUT_NHWC; layout++) {
+		struct model* m = &models[layout];
+		QUIT_ON_ERROR(model_init(m, 5));
+		model_set_layout_2d(m, layout);
+		QUIT_ON_ERROR(model_add_conv2d_padded_layer(m, 2, 6, 6, 4, 3, 1, 1, 1, PADDING_ZERO) != NULL);
+		QUIT_ON_ERROR(model_add_layer(m, LAYER_RELU, 4 * 6 * 6, 4 * 6 * 6) != NULL);
+		struct layer* pool = model_add_globavgpool2d_layer(m, 4, 6, 6);
+		QUIT_ON_ERROR(pool != NULL);
+		pool->type = pool_type;
+		QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 4, 3) != NULL);
+		QUIT_ON_ERROR(model_add_layer(m, LAYER_SOFTMAX, 3, 3) != NULL);
+		model_set_loss(m, LOSS_CROSSENTROPY);
+		QUIT_ON_ERROR(model_finalize(m));
+
+		int k = 0;
+		for (struct layer* current = m->first; current != NULL; current = current->next) {
+			struct matrix* params[LAYER_MAX_PARAMS];
+			struct matrix* grads[LAYER_MAX_PARAMS];
+			int n = layer_get_params(current, params, grads);
+			for (int i = 0; i < n; i++) {
+				for (int j = 0; j < params[i]->size; j++) {
+					params[i]->buffer[j] = sin(k++ * 0.61) * 0.5;
+				}
+			}
+			n_layouts += layout == LAYOUT_NHWC && current->type == LAYER_LAYOUT2D;
+		}
+		QUIT_ON_ERROR(matrix_init(&Y[layout], 5, 3));
+		QUIT_ON_ERROR(model_predict(m, &X, &Y[layout]));
+	}
+
+	double error = difference(&Y[0], &Y[1]);
+	printf("%s: %d layout conversions, error %g\n", name, n_layouts, error);
+	for (int i = 0; i < 2; i++) {
+		matrix_free(&Y[i]);
+		model_free(&models[i]);
+	}
+	matrix_free(&X);
+	return n_layouts != expected_layouts || error > 1e-12;
+}
+
+int main(void) {
+	enum layer_type scale_type, invalid_type;
+	QUIT_ON_ERROR(layer_register_type(&SCALE_OPS, &scale_type));
+	int failed = layer_get_ops(scale_type) != &SCALE_OPS || layer_get_ops((enum layer_type)(scale_type + 1)) != NULL;
+
+	// A table without init and forward functions is rejected.
+	struct layer_ops invalid = {0};
+	invalid.name = "invalid";
+	failed |= layer_register_type(&invalid, &invalid_type);
+	failed |= check_custom(scale_type);
+
+	// An elementwise layer whose backward pass reads its input only runs in
+	// place for inference.
+	enum layer_type gelu_type;
+	QUIT_ON_ERROR(layer_register_type(&GELU_OPS, &gelu_type));
+	failed |= check_in_place(gelu_type);
+
+	// model_finalize ends a chain of NHWC layers at a layer which reduces the
+	// 2D layout, and converts the layout before other layers, whatever
+	// their type.
+	const struct layer_ops* pool_ops = layer_get_ops(LAYER_GLOBAVGPOOL2D);
+	failed |= pool_ops == NULL || !pool_ops->layout_2d_reduces;
+	struct layer_ops reducing = *pool_ops, not_reducing = *pool_ops;
+	reducing.name = "custom reducing pool";
+	not_reducing.name = "custom pool";
+	not_reducing.layout_2d_reduces = false;
+	enum layer_type reducing_type, not_reducing_type;
+	QUIT_ON_ERROR(layer_register_type(&reducing, &reducing_type));
+	QUIT_ON_ERROR(layer_register_type(&not_reducing, &not_reducing_type));
+	failed |= check_reduces("global average pooling", LAYER_GLOBAVGPOOL2D, 1);
+	failed |= check_reduces("custom reducing pool", reducing_type, 1);
+	failed |= check_reduces("custom pool", not_reducing_type, 2);
+	return failed;
+}
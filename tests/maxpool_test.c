@@ -0,0 +1,88 @@
+// maxpool_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "tom.h"
+
+// Check a max pooling layer against a naive max pooling implementation.
+static double check(int channels, int height, int width, int pool_size, int stride) {
+	int samples = 3;
+	int out_height = CALC_MAXPOOL2D_OUTPUT_DIM(height, pool_size, stride);
+	int out_width = CALC_MAXPOOL2D_OUTPUT_DIM(width, pool_size, stride);
+	struct layer_maxpool2d l;
+	struct matrix in, out, d_in, d_out, expected;
+
+	QUIT_ON_ERROR(matrix_init(&in, samples, channels * height * width));
+	QUIT_ON_ERROR(matrix_init(&out, samples, channels * out_height * out_width));
+	QUIT_ON_ERROR(matrix_init(&d_in, samples, channels * height * width));
+	QUIT_ON_ERROR(matrix_init(&d_out, samples, channels * out_height * out_width));
+	QUIT_ON_ERROR(matrix_init(&expected, samples, channels * height * width));
+
+	QUIT_ON_ERROR(layer_maxpool2d_init(&l, channels, height, width, pool_size, stride, \
+			&in, &out, &d_out, &d_in));
+
+	for (int i = 0; i < in.size; i++) {
+		in.buffer[i] = random_normal(0.0, 1.0);
+	}
+	for (int i = 0; i < d_out.size; i++) {
+		d_out.buffer[i] = random_normal(0.0, 1.0);
+	}
+	for (int i = 0; i < expected.size; i++) {
+		expected.buffer[i] = 0.0;
+	}
+
+	layer_maxpool2d_forward(&l);
+	layer_maxpool2d_backward(&l);
+
+	double error = 0.0;
+	for (int plane = 0; plane < samples * channels; plane++) {
+		for (int i = 0; i < out_height; i++) {
+			for (int j = 0; j < out_width; j++) {
+				double max = -INFINITY;
+				for (int x = 0; x < pool_size; x++) {
+					for (int y = 0; y < pool_size; y++) {
+						max = fmax(max, in.buffer[(plane * height + i * stride + x) * width + j * stride + y]);
+					}
+				}
+				int index = (plane * out_height + i) * out_width + j;
+				error += fabs(out.buffer[index] - max);
+				for (int x = 0; x < pool_size; x++) {
+					for (int y = 0; y < pool_size; y++) {
+						if (in.buffer[(plane * height + i * stride + x) * width + j * stride + y] == max) {
+							expected.buffer[(plane * height + i * stride + x) * width + j * stride + y] += d_out.buffer[index];
+						}
+					}
+				}
+			}
+		}
+	}
+	for (int i = 0; i < d_in.size; i++) {
+		error += fabs(d_in.buffer[i] - expected.buffer[i]);
+	}
+
+	printf("pool %d stride %d (%dx%d), kernel %d: error %f\n", pool_size, stride, height, width, l.kernel, error);
+
+	layer_maxpool2d_free(&l);
+	matrix_free(&in);
+	matrix_free(&out);
+	matrix_free(&d_in);
+	matrix_free(&d_out);
+	matrix_free(&expected);
+	return error;
+}
+
+int main(void) {
+	random_init();
+
+	double error = 0.0;
+	error += check(4, 28, 28, 2, 2);
+	error += check(3, 7, 9, 2, 2);
+	error += check(4, 27, 27, 3, 2);
+	error += check(3, 8, 9, 3, 2);
+	error += check(2, 6, 6, 3, 3);
+
+	printf("total error: %f\n", error);
+	return error > 1e-9;
+}
@@ -102,6 +102,49 @@ void load_validation_dataset(struct matrix* X, struct matrix* Y) {
     fclose(labels);
 }
 
+// Get the fraction of samples whose largest prediction is their label.
+static double accuracy(struct model* m, struct matrix* X, struct matrix* Y) {
+    struct matrix P;
+    matrix_init(&P, X->n_rows, Y->n_cols);
+    QUIT_ON_ERROR(model_predict(m, X, &P));
+    int correct = 0;
+    for (int i = 0; i < X->n_rows; i++) {
+        int predicted = 0, label = 0;
+        for (int j = 1; j < Y->n_cols; j++) {
+            if (P.buffer[i * Y->n_cols + j] > P.buffer[i * Y->n_cols + predicted]) {
+                predicted = j;
+            }
+            if (Y->buffer[i * Y->n_cols + j] > Y->buffer[i * Y->n_cols + label]) {
+                label = j;
+            }
+        }
+        correct += predicted == label;
+    }
+    matrix_free(&P);
+    return (double)correct / X->n_rows;
+}
+
+// Save the model in each model file precision, load it back for inference, 
+// and report the file size and the validation accuracy.
+static void precision_report(struct model* m, struct matrix* X, struct matrix* Y) {
+    const char* names[] = {"float64", "float32", "float16", "bfloat16", "int8"};
+    printf("accuracy: %f\n", accuracy(m, X, Y));
+    for (int type = MODEL_FILE_FLOAT64; type <= MODEL_FILE_INT8; type++) {
+        FILE* fp = tmpfile();
+        QUIT_ON_ERROR(serialize_model_file(m, fp, type));
+        long size = ftell(fp);
+        rewind(fp);
+
+        struct model loaded = {0};
+        model_init(&loaded, 200);
+        model_set_memory_plan(&loaded, MEMORY_PLAN_INFERENCE);
+        QUIT_ON_ERROR(deserialize_model_file(&loaded, fp));
+        fclose(fp);
+        printf("%-8s checkpoint: %8ld bytes, accuracy %f\n", names[type], size, accuracy(&loaded, X, Y));
+        model_free(&loaded);
+    }
+}
+
 int main() {
     // Initialize RNG.
     random_init();
@@ -153,6 +196,7 @@ int main() {
     shuffle(X.buffer, Y.buffer, data_size, sizeof(double) * input_size, sizeof(double) * 10);
     double val_loss = model_calc_loss(m, &X, &Y);
     printf("validation loss: %f\n", val_loss);
+    precision_report(m, &X, &Y);
 
     matrix_free(&X);
     matrix_free(&Y);
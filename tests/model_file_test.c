@@ -0,0 +1,221 @@
+// model_file_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "tom.h"
+#include "batch_normalization.h"
+
+#define PATH "model_file_test.tom"
+#define SAMPLES 5
+
+// Build a model with deterministic parameters and batch normalization
+// statistics.
+static void build(struct model* m, enum layout_2d layout) {
+	QUIT_ON_ERROR(model_init(m, SAMPLES));
+	model_set_layout_2d(m, layout);
+	QUIT_ON_ERROR(model_add_padding2d_layer(m, 2, 7, 7, 1, 1) != NULL);
+	QUIT_ON_ERROR(model_add_conv2d_layer(m, 2, 9, 9, 4, 3, 1) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_RELU, 4 * 7 * 7, 4 * 7 * 7) != NULL);
+	QUIT_ON_ERROR(model_add_depthwise_conv2d_layer(m, 4, 7, 7, 2, 3, 2, 1, 1, PADDING_REFLECTION) != NULL);
+	QUIT_ON_ERROR(model_add_maxpool2d_layer(m, 8, 4, 4, 2, 2) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 8 * 2 * 2, 6) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_NORMALIZATION, 6, 6) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_LEAKY_RELU, 6, 6) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 6, 3) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_SOFTMAX, 3, 3) != NULL);
+	model_set_loss(m, LOSS_CROSSENTROPY);
+	QUIT_ON_ERROR(model_finalize(m));
+
+	int k = 0;
+	for (struct layer* current = m->first; current != NULL; current = current->next) {
+		struct matrix* params[LAYER_MAX_PARAMS];
+		struct matrix* grads[LAYER_MAX_PARAMS];
+		int n = layer_get_params(current, params, grads);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < params[i]->size; j++) {
+				params[i]->buffer[j] = sin(k++ * 0.61) * 0.5;
+			}
+		}
+		if (current->type == LAYER_NORMALIZATION) {
+			struct layer_normalization* bn = current->obj;
+			for (int j = 0; j < bn->running_mean.size; j++) {
+				bn->running_mean.buffer[j] = sin(k++ * 0.61) * 0.1;
+				bn->running_variance.buffer[j] = 1.0 + sin(k++ * 0.61) * 0.5;
+			}
+		}
+	}
+}
+
+// Write a model file, and read it back into memory.
+static unsigned char* write_file(struct model* m, enum model_file_type type, size_t* size) {
+	FILE* fp = fopen(PATH, "wb+");
+	if (fp == NULL) {
+		printf("Failed to open %s.\n", PATH);
+		exit(1);
+	}
+	QUIT_ON_ERROR(serialize_model_file(m, fp, type));
+	*size = (size_t)ftell(fp);
+	unsigned char* bytes = malloc(*size);
+	rewind(fp);
+	if (bytes == NULL || fread(bytes, 1, *size, fp) != *size) {
+		printf("Failed to read %s.\n", PATH);
+		exit(1);
+	}
+	fclose(fp);
+	return bytes;
+}
+
+// Replace the model file with the given bytes.
+static void replace_file(const unsigned char* bytes, size_t size) {
+	FILE* fp = fopen(PATH, "wb");
+	if (fp == NULL || fwrite(bytes, 1, size, fp) != size) {
+		printf("Failed to write %s.\n", PATH);
+		exit(1);
+	}
+	fclose(fp);
+}
+
+// Load the model file into a model with a layout, by reading it or by mapping
+// it. Returns 1 if successful, and the largest difference between the
+// model's predictions and the expected ones.
+static int load(enum layout_2d layout, bool map, struct matrix* X, struct matrix* expected, double* error) {
+	struct model m = {0};
+	QUIT_ON_ERROR(model_init(&m, SAMPLES));
+	model_set_memory_plan(&m, MEMORY_PLAN_INFERENCE);
+	model_set_layout_2d(&m, layout);
+
+	int result;
+	if (map) {
+		result = map_model_file(&m, PATH, true);
+	} else {
+		FILE* fp = fopen(PATH, "rb");
+		if (fp == NULL) {
+			printf("Failed to open %s.\n", PATH);
+			exit(1);
+		}
+		result = deserialize_model_file(&m, fp);
+		fclose(fp);
+	}
+
+	*error = 0.0;
+	if (result) {
+		struct matrix Y;
+		QUIT_ON_ERROR(matrix_init(&Y, expected->n_rows, expected->n_cols));
+		QUIT_ON_ERROR(model_predict(&m, X, &Y));
+		for (int i = 0; i < Y.size; i++) {
+			*error = fmax(*error, fabs(Y.buffer[i] - expected->buffer[i]));
+		}
+		matrix_free(&Y);
+	}
+	if (m.input != NULL) {
+		model_free(&m);
+	}
+	return result;
+}
+
+// Check that loading the model file fails with an error, both by reading and
+// by mapping it.
+static int check_error(const char* name, const char* error, struct matrix* X, struct matrix* expected) {
+	int failed = 0;
+	for (int map = 0; map < 2; map++) {
+		double unused;
+		if (load(LAYOUT_NCHW, map, X, expected, &unused)) {
+			printf("%s, %s: loaded\n", name, map ? "mapped" : "read");
+			failed = 1;
+		} else if (strcmp(LAST_ERROR, error) != 0) {
+			printf("%s, %s: %s\n", name, map ? "mapped" : "read", LAST_ERROR);
+			failed = 1;
+		} else {
+			printf("%s, %s: %s\n", name, map ? "mapped" : "read", LAST_ERROR);
+		}
+	}
+	return failed;
+}
+
+// Write a model file with each layout, load it into models with each layout
+// by reading and by mapping it, and check the errors on corrupt, truncated
+// and newer files.
+int main(void) {
+	struct matrix X, expected;
+	QUIT_ON_ERROR(matrix_init(&X, 12, 2 * 7 * 7));
+	QUIT_ON_ERROR(matrix_init(&expected, 12, 3));
+	for (int i = 0; i < X.size; i++) {
+		X.buffer[i] = sin(i * 0.37);
+	}
+
+	int failed = 0;
+	for (int written = LAYOUT_NCHW; written <= LAYOUT_NHWC; written++) {
+		struct model m = {0};
+		build(&m, written);
+		QUIT_ON_ERROR(model_predict(&m, &X, &expected));
+		size_t size;
+		free(write_file(&m, MODEL_FILE_FLOAT64, &size));
+		model_free(&m);
+
+		for (int layout = LAYOUT_NCHW; layout <= LAYOUT_NHWC; layout++) {
+			for (int map = 0; map < 2; map++) {
+				double error;
+				if (!load(layout, map, &X, &expected, &error)) {
+					printf("written with layout %d, %s with layout %d: %s\n", written, map ? "mapped" : "read", layout, LAST_ERROR);
+					failed = 1;
+					continue;
+				}
+				printf("written with layout %d, %s with layout %d: error %g\n", written, map ? "mapped" : "read", layout, error);
+				failed = failed || error > 1e-12;
+			}
+		}
+	}
+
+	// The model file written with the NHWC layout.
+	size_t size;
+	struct model m = {0};
+	build(&m, LAYOUT_NHWC);
+	unsigned char* bytes = write_file(&m, MODEL_FILE_FLOAT64, &size);
+	model_free(&m);
+	struct model_file_header header;
+	memcpy(&header, bytes, sizeof(header));
+	unsigned char* copy = malloc(size);
+	if (copy == NULL) {
+		printf("Failed to allocate memory.\n");
+		return 1;
+	}
+
+	// Corrupt the last tensor, a layer record, and the header's loss type.
+	struct model_file_tensor last;
+	memcpy(&last, bytes + header.tensor_offset + (header.n_tensors - 1) * sizeof(last), sizeof(last));
+	memcpy(copy, bytes, size);
+	copy[last.offset + last.size - 1] ^= 0x10;
+	replace_file(copy, size);
+	failed |= check_error("corrupt tensor", "Model file tensor is corrupt.", &X, &expected);
+
+	memcpy(copy, bytes, size);
+	copy[header.layer_offset + offsetof(struct model_file_layer, stride)] ^= 0x01;
+	replace_file(copy, size);
+	failed |= check_error("corrupt table", "Model file tables are corrupt.", &X, &expected);
+
+	memcpy(copy, bytes, size);
+	copy[offsetof(struct model_file_header, loss_type)] ^= 0x01;
+	replace_file(copy, size);
+	failed |= check_error("corrupt header", "Model file header is corrupt.", &X, &expected);
+
+	// Truncate the file inside the last tensor.
+	replace_file(bytes, last.offset + last.size / 2);
+	failed |= check_error("truncated", "Model file is truncated or corrupt.", &X, &expected);
+
+	// A newer version.
+	memcpy(copy, bytes, size);
+	((struct model_file_header*)copy)->version = MODEL_FILE_VERSION + 1;
+	replace_file(copy, size);
+	failed |= check_error("newer version", "Unsupported model file version.", &X, &expected);
+
+	free(copy);
+	free(bytes);
+	remove(PATH);
+	matrix_free(&X);
+	matrix_free(&expected);
+	return failed;
+}
@@ -0,0 +1,170 @@
+// planner_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "tom.h"
+
+#define SAMPLES 4
+#define STEPS 3
+
+// A model configuration.
+struct config {
+	const char* name;
+	enum memory_plan_mode plan;
+	int checkpoint_interval;
+	enum layout_2d layout;
+	bool fused;
+};
+
+// Build and finalize the test model, with deterministic parameters.
+static void build(struct model* m, const struct config* config) {
+	QUIT_ON_ERROR(model_init(m, SAMPLES));
+	model_set_memory_plan(m, config->plan);
+	model_set_checkpointing(m, config->checkpoint_interval);
+	model_set_layout_2d(m, config->layout);
+
+	// The padding layer is merged into the conv layer, and the elementwise
+	// layers run in place with a memory plan.
+	QUIT_ON_ERROR(model_add_padding2d_layer(m, 2, 10, 10, 1, 1) != NULL);
+	QUIT_ON_ERROR(model_add_conv2d_layer(m, 2, 12, 12, 4, 3, 1) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_RELU, 4 * 10 * 10, 4 * 10 * 10) != NULL);
+	QUIT_ON_ERROR(model_add_depthwise_conv2d_layer(m, 4, 10, 10, 2, 3, 1, 1, 1, PADDING_REFLECTION) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_LEAKY_RELU, 8 * 10 * 10, 8 * 10 * 10) != NULL);
+	QUIT_ON_ERROR(model_add_maxpool2d_layer(m, 8, 10, 10, 2, 2) != NULL);
+	QUIT_ON_ERROR(model_add_conv2d_grouped_layer(m, 8, 5, 5, 6, 3, 1, 2, 2, PADDING_ZERO, 2, 2) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_TANH, 6 * 5 * 5, 6 * 5 * 5) != NULL);
+	QUIT_ON_ERROR(model_add_globavgpool2d_layer(m, 6, 5, 5) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 6, 12) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_NORMALIZATION, 12, 12) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_SIGMOID, 12, 12) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_DENSE, 12, 3) != NULL);
+	QUIT_ON_ERROR(model_add_layer(m, LAYER_SOFTMAX, 3, 3) != NULL);
+	model_set_loss(m, LOSS_CROSSENTROPY);
+	QUIT_ON_ERROR(model_finalize(m));
+
+	int k = 0;
+	for (struct layer* current = m->first; current != NULL; current = current->next) {
+		struct matrix* params[LAYER_MAX_PARAMS];
+		struct matrix* grads[LAYER_MAX_PARAMS];
+		int n = layer_get_params(current, params, grads);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < params[i]->size; j++) {
+				params[i]->buffer[j] = sin(k++ * 0.61) * 0.5;
+			}
+		}
+	}
+
+	if (config->fused) {
+		QUIT_ON_ERROR(model_init_fused_optimizer(m, OPTIMIZER_ADAM, 0.01, 0.9, 0.999, 0.0, 1e-7));
+	} else {
+		QUIT_ON_ERROR(model_init_optimizers(m, OPTIMIZER_ADAM, 0.01, 0.9, 0.999, 0.0, 1e-7));
+	}
+}
+
+// Get the largest difference between the parameters, or the gradients, of
+// two models with the same parameter layers.
+static double compare(struct model* a, struct model* b, bool gradients) {
+	double error = 0.0;
+	struct layer* x = a->first;
+	struct layer* y = b->first;
+	while (x != NULL && y != NULL) {
+		struct matrix* params[2][LAYER_MAX_PARAMS];
+		struct matrix* grads[2][LAYER_MAX_PARAMS];
+		int n = layer_get_params(x, params[0], grads[0]);
+		int m = layer_get_params(y, params[1], grads[1]);
+		if (n == 0) {
+			x = x->next;
+			continue;
+		}
+		if (m == 0) {
+			y = y->next;
+			continue;
+		}
+		if (n != m || x->type != y->type) {
+			return INFINITY;
+		}
+		for (int i = 0; i < n; i++) {
+			struct matrix* p = gradients ? grads[0][i] : params[0][i];
+			struct matrix* q = gradients ? grads[1][i] : params[1][i];
+			for (int j = 0; j < p->size; j++) {
+				error = fmax(error, fabs(p->buffer[j] - q->buffer[j]));
+			}
+		}
+		x = x->next;
+		y = y->next;
+	}
+	return error;
+}
+
+// Train a planned model next to the unplanned reference model, and compare
+// the losses, the gradients and the updated parameters after each step.
+static double check(const struct config* config, struct matrix* X, struct matrix* Y) {
+	static const struct config reference = {"unplanned", MEMORY_PLAN_NONE, 0, LAYOUT_NCHW, false};
+	struct model a = {0}, b = {0};
+	build(&a, &reference);
+	build(&b, config);
+
+	double error = 0.0;
+	for (int step = 0; step < STEPS; step++) {
+		struct model* models[2] = {&a, &b};
+		for (int i = 0; i < 2; i++) {
+			for (int j = 0; j < SAMPLES * X->n_cols; j++) {
+				models[i]->input->buffer[j] = X->buffer[step * SAMPLES * X->n_cols + j];
+			}
+			for (int j = 0; j < SAMPLES * Y->n_cols; j++) {
+				models[i]->y->buffer[j] = Y->buffer[step * SAMPLES * Y->n_cols + j];
+			}
+			QUIT_ON_ERROR(model_forward(models[i], MODEL_FORWARD_TRAINING_LOSS));
+			QUIT_ON_ERROR(model_backward(models[i]));
+		}
+		error = fmax(error, fabs(a.loss.batch_loss - b.loss.batch_loss));
+		error = fmax(error, compare(&a, &b, true));
+		QUIT_ON_ERROR(model_update(&a));
+		QUIT_ON_ERROR(model_update(&b));
+		error = fmax(error, compare(&a, &b, false));
+	}
+
+	printf("%s: %d layers, %d of %d activations, error %g\n", config->name, b.n_layers, \
+			b.planned_activation_size, b.unplanned_activation_size, error);
+
+	model_free(&a);
+	model_free(&b);
+	return error;
+}
+
+// Check that the memory plans, the in-place elementwise layers, gradient
+// checkpointing, the NHWC layout and the fused optimizer give the same
+// losses, gradients and updates as an unplanned model.
+int main(void) {
+	struct config configs[] = {
+		{"training plan", MEMORY_PLAN_TRAINING, 0, LAYOUT_NCHW, false},
+		{"checkpoints", MEMORY_PLAN_TRAINING, MODEL_CHECKPOINT_AUTO, LAYOUT_NCHW, false},
+		{"checkpoints every 2 layers", MEMORY_PLAN_TRAINING, 2, LAYOUT_NCHW, false},
+		{"NHWC", MEMORY_PLAN_NONE, 0, LAYOUT_NHWC, false},
+		{"fused optimizer", MEMORY_PLAN_NONE, 0, LAYOUT_NCHW, true},
+		{"everything", MEMORY_PLAN_TRAINING, 3, LAYOUT_NHWC, true},
+	};
+
+	struct matrix X, Y;
+	QUIT_ON_ERROR(matrix_init(&X, SAMPLES * STEPS, 2 * 10 * 10));
+	QUIT_ON_ERROR(matrix_init(&Y, SAMPLES * STEPS, 3));
+	for (int i = 0; i < X.size; i++) {
+		X.buffer[i] = sin(i * 0.37);
+	}
+	for (int i = 0; i < Y.n_rows; i++) {
+		for (int j = 0; j < Y.n_cols; j++) {
+			Y.buffer[i * Y.n_cols + j] = i % Y.n_cols == j;
+		}
+	}
+
+	double error = 0.0;
+	for (int i = 0; i < (int)(sizeof(configs) / sizeof(configs[0])); i++) {
+		error = fmax(error, check(&configs[i], &X, &Y));
+	}
+
+	matrix_free(&X);
+	matrix_free(&Y);
+	return error > 1e-10;
+}
@@ -0,0 +1,171 @@
+// precision_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "tom.h"
+#include "dataset.h"
+
+#define PATH "precision_test.tom"
+#define SAMPLES 10
+#define EPOCHS 200
+
+// A model file precision, and the bound on its difference with the float64
+// predictions.
+struct precision {
+	const char* name;
+	enum model_file_type type;
+	double bound;
+};
+
+// Load the iris dataset, with one-hot labels.
+static int load_dataset(const char* path, struct matrix* X, struct matrix* Y) {
+	static const char* classes[3] = {"Iris-setosa", "Iris-versicolor", "Iris-virginica"};
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("Failed to open %s.\n", path);
+		return 0;
+	}
+	QUIT_ON_ERROR(matrix_init(X, 150, 4));
+	QUIT_ON_ERROR(matrix_init(Y, 150, 3));
+	for (int i = 0; i < Y->size; i++) {
+		Y->buffer[i] = 0.0;
+	}
+
+	char line[256];
+	int n = 0;
+	while (n < 150 && fgets(line, sizeof(line), fp) != NULL) {
+		char label[64];
+		double* x = &X->buffer[n * 4];
+		if (sscanf(line, "%lf,%lf,%lf,%lf,%63s", &x[0], &x[1], &x[2], &x[3], label) != 5) {
+			continue;
+		}
+		for (int i = 0; i < 3; i++) {
+			if (strcmp(label, classes[i]) == 0) {
+				Y->buffer[n * 3 + i] = 1.0;
+			}
+		}
+		n++;
+	}
+	fclose(fp);
+	if (n != 150) {
+		printf("Read %d samples from %s.\n", n, path);
+		return 0;
+	}
+	return 1;
+}
+
+// Get the fraction of samples whose largest prediction is the label.
+static double accuracy(struct matrix* P, struct matrix* Y) {
+	int correct = 0;
+	for (int i = 0; i < P->n_rows; i++) {
+		int best = 0;
+		for (int j = 1; j < P->n_cols; j++) {
+			if (P->buffer[i * P->n_cols + j] > P->buffer[i * P->n_cols + best]) {
+				best = j;
+			}
+		}
+		correct += Y->buffer[i * Y->n_cols + best] == 1.0;
+	}
+	return (double)correct / P->n_rows;
+}
+
+// Write the model file with a precision, read it back, and get the largest
+// difference between its predictions and the float64 ones.
+static double check(struct model* m, const struct precision* precision, struct matrix* X, struct matrix* Y, struct matrix* expected) {
+	FILE* fp = fopen(PATH, "wb");
+	if (fp == NULL) {
+		printf("Failed to open %s.\n", PATH);
+		exit(1);
+	}
+	QUIT_ON_ERROR(serialize_model_file(m, fp, precision->type));
+	fclose(fp);
+
+	struct model loaded = {0};
+	QUIT_ON_ERROR(model_init(&loaded, SAMPLES));
+	model_set_memory_plan(&loaded, MEMORY_PLAN_INFERENCE);
+	fp = fopen(PATH, "rb");
+	if (fp == NULL) {
+		printf("Failed to open %s.\n", PATH);
+		exit(1);
+	}
+	QUIT_ON_ERROR(deserialize_model_file(&loaded, fp));
+	fclose(fp);
+
+	struct matrix P;
+	QUIT_ON_ERROR(matrix_init(&P, expected->n_rows, expected->n_cols));
+	QUIT_ON_ERROR(model_predict(&loaded, X, &P));
+	double error = 0.0;
+	for (int i = 0; i < P.size; i++) {
+		error = fmax(error, fabs(P.buffer[i] - expected->buffer[i]));
+	}
+	printf("%s: error %g (bound %g), accuracy %g\n", precision->name, error, precision->bound, accuracy(&P, Y));
+
+	matrix_free(&P);
+	model_free(&loaded);
+	return error;
+}
+
+// Train a model on the iris dataset, write it in each model file precision,
+// and bound the difference between the predictions of the lower precisions
+// and the float64 ones.
+int main(void) {
+	static const struct precision precisions[] = {
+		{"float64", MODEL_FILE_FLOAT64, 0.0},
+		{"float32", MODEL_FILE_FLOAT32, 1e-5},
+		{"float16", MODEL_FILE_FLOAT16, 1e-2},
+		{"bfloat16", MODEL_FILE_BFLOAT16, 5e-2},
+		{"int8", MODEL_FILE_INT8, 5e-2},
+	};
+
+	struct matrix X, Y;
+	if (!load_dataset("iris.csv", &X, &Y)) {
+		return 1;
+	}
+	dataset_normalize(&X);
+
+	struct model m = {0};
+	QUIT_ON_ERROR(model_init(&m, SAMPLES));
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, 4, 16) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_RELU, 16, 16) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, 16, 16) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_TANH, 16, 16) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, 16, 3) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_SOFTMAX, 3, 3) != NULL);
+	model_set_loss(&m, LOSS_CROSSENTROPY);
+	QUIT_ON_ERROR(model_finalize(&m));
+
+	int k = 0;
+	for (struct layer* current = m.first; current != NULL; current = current->next) {
+		struct matrix* params[LAYER_MAX_PARAMS];
+		struct matrix* grads[LAYER_MAX_PARAMS];
+		int n = layer_get_params(current, params, grads);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < params[i]->size; j++) {
+				params[i]->buffer[j] = sin(k++ * 0.61) * 0.5;
+			}
+		}
+	}
+	QUIT_ON_ERROR(model_init_optimizers(&m, OPTIMIZER_ADAM, 0.01, 0.9, 0.999, 0.0, 1e-7));
+	QUIT_ON_ERROR(model_train(&m, &X, &Y, EPOCHS, false));
+
+	struct matrix expected;
+	QUIT_ON_ERROR(matrix_init(&expected, Y.n_rows, Y.n_cols));
+	QUIT_ON_ERROR(model_predict(&m, &X, &expected));
+	double trained = accuracy(&expected, &Y);
+	printf("trained: accuracy %g\n", trained);
+
+	int failed = trained < 0.9;
+	for (int i = 0; i < (int)(sizeof(precisions) / sizeof(precisions[0])); i++) {
+		failed |= check(&m, &precisions[i], &X, &Y, &expected) > precisions[i].bound;
+	}
+
+	remove(PATH);
+	matrix_free(&X);
+	matrix_free(&Y);
+	matrix_free(&expected);
+	model_free(&m);
+	return failed;
+}
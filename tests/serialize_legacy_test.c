@@ -0,0 +1,85 @@
+// serialize_legacy_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "tom.h"
+
+// Load a model, and get the largest difference between its predictions and
+// the expected outputs.
+static double check(FILE* fp, struct matrix* x, struct matrix* expected) {
+	struct model m = {0};
+	struct matrix y;
+	QUIT_ON_ERROR(model_init(&m, 4));
+	QUIT_ON_ERROR(deserialize_model(&m, fp));
+	QUIT_ON_ERROR(matrix_init(&y, expected->n_rows, expected->n_cols));
+	QUIT_ON_ERROR(model_predict(&m, x, &y));
+
+	double error = 0.0;
+	for (int i = 0; i < y.size; i++) {
+		error = fmax(error, fabs(y.buffer[i] - expected->buffer[i]));
+	}
+	for (struct layer* current = m.first; current != NULL; current = current->next) {
+		if (current->type == LAYER_CONV2D && (current->groups != 1 || current->dilation != 1)) {
+			printf("conv layer with %d groups and dilation %d\n", current->groups, current->dilation);
+			error += 1.0;
+		}
+	}
+
+	matrix_free(&y);
+	model_free(&m);
+	return error;
+}
+
+// Load a model stream written before conv layers stored their groups and
+// dilation, and check its predictions against the outputs recorded when it
+// was written. Then check that it survives a round trip through the current
+// format.
+int main(void) {
+	struct matrix x, expected;
+	QUIT_ON_ERROR(matrix_init(&x, 6, 2 * 8 * 8));
+	QUIT_ON_ERROR(matrix_init(&expected, 6, 5));
+	for (int i = 0; i < x.size; i++) {
+		x.buffer[i] = sin(i * 0.37);
+	}
+
+	FILE* fp = fopen("conv2d_legacy_output.dat", "rb");
+	if (fp == NULL) {
+		printf("Failed to open conv2d_legacy_output.dat.\n");
+		return 1;
+	}
+	QUIT_ON_ERROR(deserialize_matrix(&expected, fp));
+	fclose(fp);
+
+	fp = fopen("conv2d_legacy_model.dat", "rb");
+	if (fp == NULL) {
+		printf("Failed to open conv2d_legacy_model.dat.\n");
+		return 1;
+	}
+	double error = check(fp, &x, &expected);
+	printf("original format: error %g\n", error);
+
+	// Write the model in the current format, and load it again.
+	struct model m = {0};
+	QUIT_ON_ERROR(model_init(&m, 4));
+	rewind(fp);
+	QUIT_ON_ERROR(deserialize_model(&m, fp));
+	fclose(fp);
+
+	fp = tmpfile();
+	if (fp == NULL) {
+		printf("Failed to create a temporary file.\n");
+		return 1;
+	}
+	QUIT_ON_ERROR(serialize_model(&m, fp));
+	model_free(&m);
+	rewind(fp);
+	double round_trip = check(fp, &x, &expected);
+	fclose(fp);
+	printf("current format: error %g\n", round_trip);
+
+	matrix_free(&x);
+	matrix_free(&expected);
+	return fmax(error, round_trip) > 1e-12;
+}
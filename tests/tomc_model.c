@@ -0,0 +1,64 @@
+// tomc_model.c
+// Writes the model which tomc_test compiles with tomc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "tom.h"
+#include "batch_normalization.h"
+
+int main(int argc, char* argv[]) {
+	if (argc != 2) {
+		printf("usage: tomc_model model_file\n");
+		return 1;
+	}
+
+	struct model m = {0};
+	QUIT_ON_ERROR(model_init(&m, 1));
+	QUIT_ON_ERROR(model_add_padding2d_layer(&m, 3, 9, 10, 1, 1) != NULL);
+	QUIT_ON_ERROR(model_add_conv2d_layer(&m, 3, 11, 12, 6, 3, 1) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_RELU, 6 * 9 * 10, 6 * 9 * 10) != NULL);
+	QUIT_ON_ERROR(model_add_depthwise_conv2d_layer(&m, 6, 9, 10, 2, 3, 1, 1, 1, PADDING_REFLECTION) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_LEAKY_RELU, 12 * 9 * 10, 12 * 9 * 10) != NULL);
+	QUIT_ON_ERROR(model_add_maxpool2d_layer(&m, 12, 9, 10, 2, 2) != NULL);
+	QUIT_ON_ERROR(model_add_conv2d_grouped_layer(&m, 12, 4, 5, 8, 3, 1, 1, 1, PADDING_ZERO, 2, 1) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_TANH, 8 * 4 * 5, 8 * 4 * 5) != NULL);
+	QUIT_ON_ERROR(model_add_globavgpool2d_layer(&m, 8, 4, 5) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, 8, 16) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_NORMALIZATION, 16, 16) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_SIGMOID, 16, 16) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_DENSE, 16, 5) != NULL);
+	QUIT_ON_ERROR(model_add_layer(&m, LAYER_SOFTMAX, 5, 5) != NULL);
+	model_set_loss(&m, LOSS_CROSSENTROPY);
+	QUIT_ON_ERROR(model_finalize(&m));
+
+	int k = 0;
+	for (struct layer* current = m.first; current != NULL; current = current->next) {
+		struct matrix* params[LAYER_MAX_PARAMS];
+		struct matrix* grads[LAYER_MAX_PARAMS];
+		int n = layer_get_params(current, params, grads);
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < params[i]->size; j++) {
+				params[i]->buffer[j] = sin(k++ * 0.61) * 0.5;
+			}
+		}
+		if (current->type == LAYER_NORMALIZATION) {
+			struct layer_normalization* bn = current->obj;
+			for (int j = 0; j < bn->running_mean.size; j++) {
+				bn->running_mean.buffer[j] = sin(k++ * 0.61) * 0.1;
+				bn->running_variance.buffer[j] = 1.0 + sin(k++ * 0.61) * 0.5;
+			}
+		}
+	}
+
+	FILE* fp = fopen(argv[1], "wb");
+	if (fp == NULL) {
+		printf("Failed to open %s.\n", argv[1]);
+		return 1;
+	}
+	QUIT_ON_ERROR(serialize_model_file(&m, fp, MODEL_FILE_FLOAT64));
+	fclose(fp);
+	model_free(&m);
+	return 0;
+}
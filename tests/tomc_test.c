@@ -0,0 +1,54 @@
+// tomc_test.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "tom.h"
+
+#define N_SAMPLES 23
+
+// The inference function which tomc generated from the model file.
+void tomc_model_predict(const double* input, double* output, int n_samples);
+
+// Compare the predictions of the code which tomc generated from a model file
+// with model_predict on the same file.
+int main(int argc, char* argv[]) {
+	if (argc != 2) {
+		printf("usage: tomc_test model_file\n");
+		return 1;
+	}
+
+	struct model m = {0};
+	QUIT_ON_ERROR(model_init(&m, 8));
+	model_set_memory_plan(&m, MEMORY_PLAN_INFERENCE);
+	FILE* fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		printf("Failed to open %s.\n", argv[1]);
+		return 1;
+	}
+	QUIT_ON_ERROR(deserialize_model_file(&m, fp));
+	fclose(fp);
+
+	struct matrix X, expected, Y;
+	QUIT_ON_ERROR(matrix_init(&X, N_SAMPLES, m.first->input_size));
+	QUIT_ON_ERROR(matrix_init(&expected, N_SAMPLES, m.last->output_size));
+	QUIT_ON_ERROR(matrix_init(&Y, N_SAMPLES, m.last->output_size));
+	for (int i = 0; i < X.size; i++) {
+		X.buffer[i] = sin(i * 0.37);
+	}
+	QUIT_ON_ERROR(model_predict(&m, &X, &expected));
+	tomc_model_predict(X.buffer, Y.buffer, N_SAMPLES);
+
+	double error = 0.0;
+	for (int i = 0; i < Y.size; i++) {
+		error = fmax(error, fabs(Y.buffer[i] - expected.buffer[i]));
+	}
+	printf("%d layers, %d samples: error %g\n", m.n_layers, N_SAMPLES, error);
+
+	matrix_free(&X);
+	matrix_free(&expected);
+	matrix_free(&Y);
+	model_free(&m);
+	return error > 1e-12;
+}
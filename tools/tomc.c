@@ -0,0 +1,690 @@
+// tomc.c
+// Ahead of time model compiler. Reads a serialized model and writes a
+// standalone C file with a single inference function for it. The layer
+// dimensions are constants in the generated loops, the small kernels are
+// unrolled, and the weights are embedded as static aligned arrays, so the
+// generated file has no dependency on tom.
+//
+// usage: tomc [-n name] model_file output.c
+// The model file is read with deserialize_model, or with
+// deserialize_model_file if it starts with MODEL_FILE_MAGIC. The generated
+// function is
+//
+//     void name(const double *input, double *output, int n_samples);
+//
+// with the samples stored by rows, as in model_predict.
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tom.h"
+#include "batch_normalization.h"
+
+// The largest kernel, in values, whose taps are unrolled.
+#define TOMC_MAX_UNROLLED_KERNEL 49
+
+// The number of dense layer inputs applied in each pass over the outputs.
+#define TOMC_DENSE_UNROLL 4
+
+// The buffers holding activations in the generated code.
+enum tomc_buffer {
+    // The current sample's input, which is read only.
+    TOMC_INPUT,
+
+    // The two activation buffers.
+    TOMC_A,
+    TOMC_B,
+
+    // The current sample's output.
+    TOMC_OUTPUT
+};
+
+static const char *BUFFER_NAMES[] = {"x", "a", "b", "y"};
+
+// The compiler state.
+struct tomc {
+    // The generated file, and the name of the inference function.
+    FILE *out;
+    const char *name;
+
+    // The sizes of the activation buffers and of the padding buffer, in
+    // doubles.
+    int buffer_size[4], pad_size;
+};
+
+// Write a formatted line of code, indented by a number of levels.
+static void emit(struct tomc *obj, int level, const char *format, ...) {
+    va_list ap;
+    fprintf(obj->out, "%*s", level * 4, "");
+    va_start(ap, format);
+    vfprintf(obj->out, format, ap);
+    va_end(ap);
+    fputc('\n', obj->out);
+}
+
+// Format a double as a C literal which reads back as the same value.
+static void format_double(char *buffer, size_t size, double value) {
+    if (isnan(value)) {
+        snprintf(buffer, size, "NAN");
+    } else if (isinf(value)) {
+        snprintf(buffer, size, value < 0 ? "-HUGE_VAL" : "HUGE_VAL");
+    } else {
+        snprintf(buffer, size, "%.17g", value);
+        if (strpbrk(buffer, ".e") == NULL) {
+            strncat(buffer, ".0", size - strlen(buffer) - 1);
+        }
+    }
+}
+
+// Write a static aligned array of doubles.
+static void emit_doubles(struct tomc *obj, int index, const char *field, const double *values, int n) {
+    char literal[64];
+    fprintf(obj->out, "static const TOMC_ALIGN double l%d_%s[%d] = {", index, field, n);
+    for (int i = 0; i < n; i++) {
+        format_double(literal, sizeof(literal), values[i]);
+        fprintf(obj->out, "%s%s%s", i % 4 == 0 ? "\n    " : " ", literal, i + 1 < n ? "," : "");
+    }
+    fprintf(obj->out, "\n};\n\n");
+}
+
+// Write a static array of ints.
+static void emit_ints(struct tomc *obj, int index, const char *field, const int *values, int n) {
+    fprintf(obj->out, "static const int l%d_%s[%d] = {", index, field, n);
+    for (int i = 0; i < n; i++) {
+        fprintf(obj->out, "%s%d%s", i % 16 == 0 ? "\n    " : " ", values[i], i + 1 < n ? "," : "");
+    }
+    fprintf(obj->out, "\n};\n\n");
+}
+
+// Map a padded index to an input index, or -1 for zero padding. The same
+// mapping as the conv and padding layers.
+static int padded_index(int index, int dim, enum padding_type padding_type) {
+    if (index >= 0 && index < dim) {
+        return index;
+    }
+
+    switch (padding_type) {
+    case PADDING_SYMMETRIC:
+        return index < 0 ? -index - 1 : dim * 2 - 1 - index;
+    case PADDING_REFLECTION:
+        return index < 0 ? -index : (dim - 1) * 2 - index;
+    default:
+        return -1;
+    }
+}
+
+// Returns true if the layer's output is its input, at inference. Dropout is
+// disabled, and the 2D layers are compiled in the NCHW layout, so layout
+// conversions have no effect.
+static bool is_identity_layer(enum layer_type type) {
+    return type == LAYER_DROPOUT || type == LAYER_LAYOUT2D;
+}
+
+// Returns true if the layer can write its output over its input.
+static bool is_elementwise_layer(enum layer_type type) {
+    return type == LAYER_RELU || type == LAYER_LEAKY_RELU || type == LAYER_SIGMOID ||
+           type == LAYER_TANH || type == LAYER_NORMALIZATION || type == LAYER_SOFTMAX;
+}
+
+// Get the padding of a layer which pads its input, or return false.
+static bool layer_padding(struct layer *layer, int *padding_x, int *padding_y, enum padding_type *padding_type) {
+    *padding_x = 0;
+    *padding_y = 0;
+    *padding_type = PADDING_ZERO;
+    if (layer->type == LAYER_PADDING2D) {
+        struct layer_padding2d *padding = layer->obj;
+        *padding_x = padding->padding_x;
+        *padding_y = padding->padding_y;
+        *padding_type = padding->type;
+        return true;
+    }
+    if (layer->type == LAYER_CONV2D || layer->type == LAYER_DEPTHWISE_CONV2D) {
+        struct layer_conv2d *conv = layer->obj;
+        *padding_x = conv->padding_x;
+        *padding_y = conv->padding_y;
+        *padding_type = conv->padding_type;
+        return conv->padding_x > 0 || conv->padding_y > 0;
+    }
+    return false;
+}
+
+// Write the static data of a layer.
+static void compile_layer_data(struct tomc *obj, struct layer *layer, int index) {
+    switch (layer->type) {
+    case LAYER_DENSE:
+    {
+        struct layer_dense *dense = layer->obj;
+        emit_doubles(obj, index, "weights", dense->weights.buffer, dense->weights.size);
+        emit_doubles(obj, index, "biases", dense->biases.buffer, dense->biases.size);
+        break;
+    }
+    case LAYER_CONV2D:
+    case LAYER_DEPTHWISE_CONV2D:
+    {
+        struct layer_conv2d *conv = layer->obj;
+        emit_doubles(obj, index, "weights", conv->weights.buffer, conv->weights.size);
+        emit_doubles(obj, index, "biases", conv->biases.buffer, conv->biases.size);
+        break;
+    }
+    case LAYER_NORMALIZATION:
+    {
+        // The square root is correctly rounded, so the standard deviation is
+        // the value the layer calculates.
+        struct layer_normalization *normalization = layer->obj;
+        double *deviation = malloc(normalization->input_size * sizeof(double));
+        for (int i = 0; i < normalization->input_size; i++) {
+            deviation[i] = sqrt(normalization->running_variance.buffer[i] + normalization->epsilon);
+        }
+        emit_doubles(obj, index, "gamma", normalization->gamma.buffer, normalization->input_size);
+        emit_doubles(obj, index, "beta", normalization->beta.buffer, normalization->input_size);
+        emit_doubles(obj, index, "mean", normalization->running_mean.buffer, normalization->input_size);
+        emit_doubles(obj, index, "deviation", deviation, normalization->input_size);
+        free(deviation);
+        break;
+    }
+    default:
+        break;
+    }
+
+    // The index of each padded value in its input plane, for symmetric and
+    // reflection padding.
+    int padding_x, padding_y;
+    enum padding_type padding_type;
+    if (layer_padding(layer, &padding_x, &padding_y, &padding_type) && padding_type != PADDING_ZERO) {
+        const int height = layer->input_height + padding_y * 2, width = layer->input_width + padding_x * 2;
+        int *indices = malloc(height * width * sizeof(int));
+        for (int i = 0; i < height; i++) {
+            for (int j = 0; j < width; j++) {
+                const int row = padded_index(i - padding_y, layer->input_height, padding_type);
+                const int col = padded_index(j - padding_x, layer->input_width, padding_type);
+                indices[i * width + j] = row < 0 || col < 0 ? -1 : row * layer->input_width + col;
+            }
+        }
+        emit_ints(obj, index, "padding", indices, height * width);
+        free(indices);
+    }
+}
+
+// Write the padding of a layer's input planes from src into dst.
+static void compile_padding(struct tomc *obj, struct layer *layer, int index, const char *src, const char *dst) {
+    int padding_x, padding_y;
+    enum padding_type padding_type;
+    layer_padding(layer, &padding_x, &padding_y, &padding_type);
+    const int height = layer->input_height, width = layer->input_width;
+    const int padded_width = width + padding_x * 2;
+    const int padded_size = (height + padding_y * 2) * padded_width;
+
+    emit(obj, 2, "for (int c = 0; c < %d; c++) {", layer->input_channels);
+    emit(obj, 3, "const double *in = &%s[c * %d];", src, height * width);
+    emit(obj, 3, "double *out = &%s[c * %d];", dst, padded_size);
+    if (padding_type == PADDING_ZERO) {
+        emit(obj, 3, "for (int i = 0; i < %d; i++) {", padded_size);
+        emit(obj, 4, "out[i] = 0.0;");
+        emit(obj, 3, "}");
+        emit(obj, 3, "for (int i = 0; i < %d; i++) {", height);
+        emit(obj, 4, "for (int j = 0; j < %d; j++) {", width);
+        emit(obj, 5, "out[i * %d + j + %d] = in[i * %d + j];", padded_width, padding_y * padded_width + padding_x, width);
+        emit(obj, 4, "}");
+        emit(obj, 3, "}");
+    } else {
+        emit(obj, 3, "for (int i = 0; i < %d; i++) {", padded_size);
+        emit(obj, 4, "out[i] = in[l%d_padding[i]];", index);
+        emit(obj, 3, "}");
+    }
+    emit(obj, 2, "}");
+}
+
+// Write a dense layer. The inputs are applied in groups, each in a single
+// pass over the outputs, and the sums are in the same order as the layer's.
+static void compile_dense(struct tomc *obj, struct layer *layer, int index, const char *src, const char *dst) {
+    const int input_size = layer->input_size, output_size = layer->output_size;
+    const int n_unrolled = input_size / TOMC_DENSE_UNROLL * TOMC_DENSE_UNROLL;
+    char line[512];
+
+    emit(obj, 2, "for (int j = 0; j < %d; j++) {", output_size);
+    emit(obj, 3, "%s[j] = 0.0;", dst);
+    emit(obj, 2, "}");
+    if (n_unrolled > 0) {
+        emit(obj, 2, "for (int k = 0; k < %d; k += %d) {", n_unrolled, TOMC_DENSE_UNROLL);
+        emit(obj, 3, "const double *w = &l%d_weights[k * %d];", index, output_size);
+        emit(obj, 3, "for (int j = 0; j < %d; j++) {", output_size);
+        int length = snprintf(line, sizeof(line), "%s[j] = %s[j]", dst, dst);
+        for (int k = 0; k < TOMC_DENSE_UNROLL; k++) {
+            length += snprintf(line + length, sizeof(line) - length, " + %s[k + %d] * w[%d + j]", src, k, k * output_size);
+        }
+        emit(obj, 4, "%s;", line);
+        emit(obj, 3, "}");
+        emit(obj, 2, "}");
+    }
+    for (int k = n_unrolled; k < input_size; k++) {
+        emit(obj, 2, "for (int j = 0; j < %d; j++) {", output_size);
+        emit(obj, 3, "%s[j] += %s[%d] * l%d_weights[%d + j];", dst, src, k, index, k * output_size);
+        emit(obj, 2, "}");
+    }
+    emit(obj, 2, "for (int j = 0; j < %d; j++) {", output_size);
+    emit(obj, 3, "%s[j] += l%d_biases[j];", dst, index);
+    emit(obj, 2, "}");
+}
+
+// Write a conv layer, reading an input which is already padded. Each output
+// value adds the taps of each channel of its filter's group in order, as
+// the layer does. Kernels up to TOMC_MAX_UNROLLED_KERNEL values have their
+// taps unrolled, with the weights held in locals.
+static void compile_conv2d(struct tomc *obj, struct layer *layer, int index, const char *src, const char *dst) {
+    struct layer_conv2d *conv = layer->obj;
+    const int width = conv->input_width + conv->padding_x * 2;
+    const int input_plane = (conv->input_height + conv->padding_y * 2) * width;
+    const int output_plane = conv->output_height * conv->output_width;
+    const int kernel_size = conv->filter_size * conv->filter_size;
+    const int stride = conv->stride, dilation = conv->dilation;
+    char line[4096], column[32];
+
+    emit(obj, 2, "for (int f = 0; f < %d; f++) {", conv->n_filters);
+    emit(obj, 3, "double *out = &%s[f * %d];", dst, output_plane);
+    emit(obj, 3, "for (int i = 0; i < %d; i++) {", output_plane);
+    emit(obj, 4, "out[i] = l%d_biases[f];", index);
+    emit(obj, 3, "}");
+
+    // The loop over the channels of the filter's group, if it has more than
+    // one.
+    int level = 3;
+    if (conv->group_channels > 1) {
+        emit(obj, level++, "for (int c = 0; c < %d; c++) {", conv->group_channels);
+    }
+    if (conv->groups == 1 && conv->group_channels == 1) {
+        emit(obj, level, "const double *in = %s;", src);
+    } else if (conv->groups == 1) {
+        emit(obj, level, "const double *in = &%s[c * %d];", src, input_plane);
+    } else if (conv->group_channels == 1) {
+        emit(obj, level, "const double *in = &%s[f / %d * %d];", src, conv->group_filters, input_plane);
+    } else {
+        emit(obj, level, "const double *in = &%s[(f / %d * %d + c) * %d];", src, conv->group_filters, conv->group_channels, input_plane);
+    }
+    if (conv->group_channels == 1) {
+        emit(obj, level, "const double *w = &l%d_weights[f * %d];", index, kernel_size);
+    } else {
+        emit(obj, level, "const double *w = &l%d_weights[(f * %d + c) * %d];", index, conv->group_channels, kernel_size);
+    }
+
+    // The input column of each output column.
+    if (stride == 1) {
+        snprintf(column, sizeof(column), "j");
+    } else {
+        snprintf(column, sizeof(column), "j * %d", stride);
+    }
+
+    if (kernel_size <= TOMC_MAX_UNROLLED_KERNEL) {
+        int length = snprintf(line, sizeof(line), "const double");
+        for (int k = 0; k < kernel_size; k++) {
+            length += snprintf(line + length, sizeof(line) - length, "%s w%d = w[%d]", k ? "," : "", k, k);
+        }
+        emit(obj, level, "%s;", line);
+        emit(obj, level, "for (int i = 0; i < %d; i++) {", conv->output_height);
+        emit(obj, level + 1, "const double *r = &in[i * %d];", stride * width);
+        emit(obj, level + 1, "double *o = &out[i * %d];", conv->output_width);
+        emit(obj, level + 1, "for (int j = 0; j < %d; j++) {", conv->output_width);
+        length = snprintf(line, sizeof(line), "o[j] = o[j]");
+        for (int ky = 0; ky < conv->filter_size; ky++) {
+            for (int kx = 0; kx < conv->filter_size; kx++) {
+                const int offset = ky * dilation * width + kx * dilation;
+                if (offset) {
+                    length += snprintf(line + length, sizeof(line) - length, " + w%d * r[%s + %d]", ky * conv->filter_size + kx, column, offset);
+                } else {
+                    length += snprintf(line + length, sizeof(line) - length, " + w%d * r[%s]", ky * conv->filter_size + kx, column);
+                }
+            }
+        }
+        emit(obj, level + 2, "%s;", line);
+        emit(obj, level + 1, "}");
+        emit(obj, level, "}");
+    } else {
+        emit(obj, level, "for (int i = 0; i < %d; i++) {", conv->output_height);
+        emit(obj, level + 1, "double *o = &out[i * %d];", conv->output_width);
+        emit(obj, level + 1, "for (int ky = 0; ky < %d; ky++) {", conv->filter_size);
+        emit(obj, level + 2, "for (int kx = 0; kx < %d; kx++) {", conv->filter_size);
+        emit(obj, level + 3, "const double weight = w[ky * %d + kx];", conv->filter_size);
+        emit(obj, level + 3, "const double *r = &in[i * %d + ky * %d + kx * %d];", stride * width, dilation * width, dilation);
+        emit(obj, level + 3, "for (int j = 0; j < %d; j++) {", conv->output_width);
+        emit(obj, level + 4, "o[j] += weight * r[%s];", column);
+        emit(obj, level + 3, "}");
+        emit(obj, level + 2, "}");
+        emit(obj, level + 1, "}");
+        emit(obj, level, "}");
+    }
+    if (conv->group_channels > 1) {
+        emit(obj, --level, "}");
+    }
+    emit(obj, 2, "}");
+}
+
+// Write a max pooling layer, with the pool unrolled.
+static void compile_maxpool2d(struct tomc *obj, struct layer *layer, const char *src, const char *dst) {
+    struct layer_maxpool2d *pool = layer->obj;
+    const int input_plane = pool->input_height * pool->input_width;
+    const int output_plane = pool->output_height * pool->output_width;
+    char column[32];
+    if (pool->stride == 1) {
+        snprintf(column, sizeof(column), "j");
+    } else {
+        snprintf(column, sizeof(column), "j * %d", pool->stride);
+    }
+
+    emit(obj, 2, "for (int c = 0; c < %d; c++) {", pool->n_channels);
+    emit(obj, 3, "const double *in = &%s[c * %d];", src, input_plane);
+    emit(obj, 3, "double *out = &%s[c * %d];", dst, output_plane);
+    emit(obj, 3, "for (int i = 0; i < %d; i++) {", pool->output_height);
+    emit(obj, 4, "const double *r = &in[i * %d];", pool->stride * pool->input_width);
+    emit(obj, 4, "for (int j = 0; j < %d; j++) {", pool->output_width);
+    emit(obj, 5, "double m = r[%s], v;", column);
+    for (int x = 0; x < pool->pool_size; x++) {
+        for (int y = 0; y < pool->pool_size; y++) {
+            if (x || y) {
+                emit(obj, 5, "v = r[%s + %d];", column, x * pool->input_width + y);
+                emit(obj, 5, "m = v > m ? v : m;");
+            }
+        }
+    }
+    emit(obj, 5, "out[i * %d + j] = m;", pool->output_width);
+    emit(obj, 4, "}");
+    emit(obj, 3, "}");
+    emit(obj, 2, "}");
+}
+
+// Write a global average pooling layer.
+static void compile_globavgpool2d(struct tomc *obj, struct layer *layer, const char *src, const char *dst) {
+    const int plane_size = layer->input_height * layer->input_width;
+    char scale[64];
+    format_double(scale, sizeof(scale), 1.0 / (double)plane_size);
+
+    emit(obj, 2, "for (int c = 0; c < %d; c++) {", layer->input_channels);
+    emit(obj, 3, "const double *plane = &%s[c * %d];", src, plane_size);
+    emit(obj, 3, "double sum = 0.0;");
+    emit(obj, 3, "for (int i = 0; i < %d; i++) {", plane_size);
+    emit(obj, 4, "sum += plane[i];");
+    emit(obj, 3, "}");
+    emit(obj, 3, "%s[c] = sum * %s;", dst, scale);
+    emit(obj, 2, "}");
+}
+
+// Write an elementwise layer, which may run in place.
+static void compile_elementwise(struct tomc *obj, struct layer *layer, int index, const char *src, const char *dst) {
+    const int size = layer->input_size;
+    char rate[64];
+
+    if (layer->type == LAYER_SOFTMAX) {
+        emit(obj, 2, "{");
+        emit(obj, 3, "double max = -HUGE_VAL, sum = 0.0;");
+        emit(obj, 3, "for (int i = 0; i < %d; i++) {", size);
+        emit(obj, 4, "max = %s[i] > max ? %s[i] : max;", src, src);
+        emit(obj, 3, "}");
+        emit(obj, 3, "for (int i = 0; i < %d; i++) {", size);
+        emit(obj, 4, "%s[i] = exp(%s[i] - max);", dst, src);
+        emit(obj, 4, "sum += %s[i];", dst);
+        emit(obj, 3, "}");
+        emit(obj, 3, "for (int i = 0; i < %d; i++) {", size);
+        emit(obj, 4, "%s[i] /= sum;", dst);
+        emit(obj, 3, "}");
+        emit(obj, 2, "}");
+        return;
+    }
+
+    emit(obj, 2, "for (int i = 0; i < %d; i++) {", size);
+    switch (layer->type) {
+    case LAYER_RELU:
+        emit(obj, 3, "%s[i] = %s[i] < 0.0 ? 0.0 : %s[i];", dst, src, src);
+        break;
+    case LAYER_LEAKY_RELU:
+        format_double(rate, sizeof(rate), ((struct activation_leaky_relu*)layer->obj)->rate);
+        emit(obj, 3, "%s[i] = %s[i] < 0.0 ? %s * %s[i] : %s[i];", dst, src, rate, src, src);
+        break;
+    case LAYER_SIGMOID:
+        emit(obj, 3, "%s[i] = 1.0 / (1.0 + exp(-%s[i]));", dst, src);
+        break;
+    case LAYER_TANH:
+        emit(obj, 3, "const double e = exp(%s[i]), f = exp(-%s[i]);", src, src);
+        emit(obj, 3, "%s[i] = (e - f) / (e + f);", dst);
+        break;
+    case LAYER_NORMALIZATION:
+        emit(obj, 3, "%s[i] = l%d_gamma[i] * (%s[i] - l%d_mean[i]) / l%d_deviation[i] + l%d_beta[i];", dst, index, src, index, index, index);
+        break;
+    default:
+        break;
+    }
+    emit(obj, 2, "}");
+}
+
+// Plan the buffer each layer writes. Elementwise layers run in place, the
+// other layers alternate between the two activation buffers, and the last
+// layer writes the output. Identity layers write nothing, and are given
+// their input buffer. Returns the buffer holding the model's output before
+// the final copy, if any.
+static enum tomc_buffer tomc_plan(struct tomc *obj, struct model *model, enum tomc_buffer *buffers) {
+    struct layer *last = NULL;
+    for (struct layer *current = model->first; current != NULL; current = current->next) {
+        if (!is_identity_layer(current->type)) {
+            last = current;
+        }
+    }
+
+    enum tomc_buffer buffer = TOMC_INPUT;
+    int i = 0;
+    for (struct layer *current = model->first; current != NULL; current = current->next, i++) {
+        if (is_identity_layer(current->type)) {
+            buffers[i] = buffer;
+            continue;
+        }
+        if (current == last) {
+            buffer = TOMC_OUTPUT;
+        } else if (!is_elementwise_layer(current->type) || buffer == TOMC_INPUT) {
+            buffer = buffer == TOMC_A ? TOMC_B : TOMC_A;
+        }
+        buffers[i] = buffer;
+        if (current->output_size > obj->buffer_size[buffer]) {
+            obj->buffer_size[buffer] = current->output_size;
+        }
+
+        int padding_x, padding_y;
+        enum padding_type padding_type;
+        if (current->type != LAYER_PADDING2D && layer_padding(current, &padding_x, &padding_y, &padding_type)) {
+            const int size = current->input_channels * (current->input_height + padding_y * 2) * (current->input_width + padding_x * 2);
+            if (size > obj->pad_size) {
+                obj->pad_size = size;
+            }
+        }
+    }
+    return buffer;
+}
+
+// Compile a finalized model.
+static int tomc_compile(struct tomc *obj, struct model *model, const char *source) {
+    enum tomc_buffer *buffers = calloc(model->n_layers, sizeof(enum tomc_buffer));
+    if (buffers == NULL) {
+        LAST_ERROR = "Failed to allocate memory.";
+        return 0;
+    }
+    enum tomc_buffer result = tomc_plan(obj, model, buffers);
+    const int input_size = model->first->input_size, output_size = model->last->output_size;
+
+    fprintf(obj->out,
+        "// Generated by tomc from %s. Do not edit.\n"
+        "//\n"
+        "// void %s(const double *input, double *output, int n_samples);\n"
+        "// Run the model on n_samples samples of %d values, and write the %d output\n"
+        "// values of each sample. The activations of a sample are kept on the stack.\n"
+        "\n"
+        "#include <math.h>\n"
+        "\n"
+        "#if defined(_MSC_VER)\n"
+        "#define TOMC_ALIGN __declspec(align(64))\n"
+        "#else\n"
+        "#define TOMC_ALIGN __attribute__((aligned(64)))\n"
+        "#endif\n"
+        "\n", source, obj->name, input_size, output_size);
+
+    int i = 0;
+    for (struct layer *current = model->first; current != NULL; current = current->next, i++) {
+        compile_layer_data(obj, current, i);
+    }
+
+    fprintf(obj->out, "void %s(const double *input, double *output, int n_samples) {\n", obj->name);
+    for (int buffer = TOMC_A; buffer <= TOMC_B; buffer++) {
+        if (obj->buffer_size[buffer] > 0) {
+            emit(obj, 1, "TOMC_ALIGN double %s[%d];", BUFFER_NAMES[buffer], obj->buffer_size[buffer]);
+        }
+    }
+    if (obj->pad_size > 0) {
+        emit(obj, 1, "TOMC_ALIGN double p[%d];", obj->pad_size);
+    }
+    emit(obj, 1, "for (int sample = 0; sample < n_samples; sample++) {");
+    emit(obj, 2, "const double *x = &input[sample * %d];", input_size);
+    emit(obj, 2, "double *y = &output[sample * %d];", output_size);
+
+    enum tomc_buffer buffer = TOMC_INPUT;
+    i = 0;
+    for (struct layer *current = model->first; current != NULL; current = current->next, i++) {
+        if (is_identity_layer(current->type)) {
+            continue;
+        }
+        const char *src = BUFFER_NAMES[buffer], *dst = BUFFER_NAMES[buffers[i]];
+        buffer = buffers[i];
+
+        fprintf(obj->out, "\n");
+        switch (current->type) {
+        case LAYER_DENSE:
+            emit(obj, 2, "// Layer %d: dense, %d -> %d.", i, current->input_size, current->output_size);
+            compile_dense(obj, current, i, src, dst);
+            break;
+        case LAYER_CONV2D:
+        case LAYER_DEPTHWISE_CONV2D:
+        {
+            struct layer_conv2d *conv = current->obj;
+            emit(obj, 2, "// Layer %d: conv 2D, %dx%dx%d -> %dx%dx%d, %dx%d filters, stride %d, dilation %d, groups %d.", i,
+                conv->n_channels, conv->input_height, conv->input_width, conv->n_filters, conv->output_height, conv->output_width,
+                conv->filter_size, conv->filter_size, conv->stride, conv->dilation, conv->groups);
+            if (conv->padding_x > 0 || conv->padding_y > 0) {
+                compile_padding(obj, current, i, src, "p");
+                src = "p";
+            }
+            compile_conv2d(obj, current, i, src, dst);
+            break;
+        }
+        case LAYER_PADDING2D:
+            emit(obj, 2, "// Layer %d: padding 2D, %dx%dx%d -> %dx%dx%d.", i, current->input_channels, current->input_height,
+                current->input_width, current->output_channels, current->output_height, current->output_width);
+            compile_padding(obj, current, i, src, dst);
+            break;
+        case LAYER_MAXPOOL2D:
+            emit(obj, 2, "// Layer %d: max pooling 2D, %dx%dx%d -> %dx%dx%d.", i, current->input_channels, current->input_height,
+                current->input_width, current->output_channels, current->output_height, current->output_width);
+            compile_maxpool2d(obj, current, src, dst);
+            break;
+        case LAYER_GLOBAVGPOOL2D:
+            emit(obj, 2, "// Layer %d: global average pooling 2D, %dx%dx%d -> %d.", i, current->input_channels,
+                current->input_height, current->input_width, current->output_size);
+            compile_globavgpool2d(obj, current, src, dst);
+            break;
+        case LAYER_RELU:
+        case LAYER_LEAKY_RELU:
+        case LAYER_SIGMOID:
+        case LAYER_TANH:
+        case LAYER_SOFTMAX:
+        case LAYER_NORMALIZATION:
+            emit(obj, 2, "// Layer %d: %s, %d values.", i,
+                current->type == LAYER_RELU ? "relu" : current->type == LAYER_LEAKY_RELU ? "leaky relu" :
+                current->type == LAYER_SIGMOID ? "sigmoid" : current->type == LAYER_TANH ? "tanh" :
+                current->type == LAYER_SOFTMAX ? "softmax" : "batch normalization", current->input_size);
+            compile_elementwise(obj, current, i, src, dst);
+            break;
+        default:
+            free(buffers);
+            LAST_ERROR = "Invalid layer type.";
+            return 0;
+        }
+    }
+
+    // A model of identity layers copies its input.
+    if (result != TOMC_OUTPUT) {
+        fprintf(obj->out, "\n");
+        emit(obj, 2, "for (int i = 0; i < %d; i++) {", output_size);
+        emit(obj, 3, "y[i] = x[i];");
+        emit(obj, 2, "}");
+    }
+    emit(obj, 1, "}");
+    fprintf(obj->out, "}\n");
+
+    free(buffers);
+    if (ferror(obj->out)) {
+        LAST_ERROR = "Failed to write file.";
+        return 0;
+    }
+    return 1;
+}
+
+// Load a model from a file in either format, for inference.
+static int tomc_load(struct model *model, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        LAST_ERROR = "Failed to open file.";
+        return 0;
+    }
+
+    char magic[sizeof(((struct model_file_header*)0)->magic)];
+    bool is_model_file = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, MODEL_FILE_MAGIC, sizeof(magic)) == 0;
+    rewind(fp);
+
+    model_set_memory_plan(model, MEMORY_PLAN_INFERENCE);
+    int result = is_model_file ? deserialize_model_file(model, fp) : deserialize_model(model, fp);
+    fclose(fp);
+    return result;
+}
+
+// Returns true if the name is a C identifier.
+static bool is_identifier(const char *name) {
+    if (!isalpha((unsigned char)name[0]) && name[0] != '_') {
+        return false;
+    }
+    for (const char *c = name; *c; c++) {
+        if (!isalnum((unsigned char)*c) && *c != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    struct tomc obj = {0};
+    obj.name = "tom_model";
+
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        obj.name = argv[2];
+        arg = 3;
+    }
+    if (argc - arg != 2 || !is_identifier(obj.name)) {
+        fprintf(stderr, "usage: tomc [-n name] model_file output.c\n");
+        return 1;
+    }
+
+    struct model model = {0};
+    QUIT_ON_ERROR(model_init(&model, 1));
+    QUIT_ON_ERROR(tomc_load(&model, argv[arg]));
+
+    obj.out = fopen(argv[arg + 1], "w");
+    if (obj.out == NULL) {
+        fprintf(stderr, "Failed to open %s.\n", argv[arg + 1]);
+        model_free(&model);
+        return 1;
+    }
+    int result = tomc_compile(&obj, &model, argv[arg]);
+    if (fclose(obj.out) != 0 && result) {
+        LAST_ERROR = "Failed to write file.";
+        result = 0;
+    }
+    model_free(&model);
+    QUIT_ON_ERROR(result);
+    return 0;
+}